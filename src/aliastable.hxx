@@ -0,0 +1,145 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Alias table
+//
+// Samples an index proportionally to a set of non-negative weights in O(1).
+// Built with Vose's method: each bin holds the probability of keeping its
+// own index and the index to return otherwise.
+
+class AliasTable
+{
+public:
+
+    AliasTable()
+    {}
+
+    void Build(const std::vector<float> &aWeights)
+    {
+        const int count = (int)aWeights.size();
+
+        mProb.resize(count);
+        mAlias.resize(count);
+        mPdf.resize(count);
+
+        if(count == 0)
+            return;
+
+        double sum = 0;
+        for(int i=0; i<count; i++)
+            sum += std::max(0.f, aWeights[i]);
+
+        // Degenerate weights fall back to uniform selection
+        for(int i=0; i<count; i++)
+            mPdf[i] = sum > 0 ? float(std::max(0.f, aWeights[i]) / sum) : 1.f / count;
+
+        std::vector<float> scaled(count);
+        std::vector<int>   small, large;
+
+        for(int i=0; i<count; i++)
+        {
+            scaled[i] = mPdf[i] * count;
+
+            if(scaled[i] < 1.f)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+
+        while(!small.empty() && !large.empty())
+        {
+            const int s = small.back(); small.pop_back();
+            const int l = large.back(); large.pop_back();
+
+            mProb[s]  = scaled[s];
+            mAlias[s] = l;
+
+            scaled[l] = (scaled[l] + scaled[s]) - 1.f;
+
+            if(scaled[l] < 1.f)
+                small.push_back(l);
+            else
+                large.push_back(l);
+        }
+
+        // Leftovers are 1 up to rounding errors
+        for(size_t i=0; i<large.size(); i++)
+        {
+            mProb[large[i]]  = 1.f;
+            mAlias[large[i]] = large[i];
+        }
+
+        for(size_t i=0; i<small.size(); i++)
+        {
+            mProb[small[i]]  = 1.f;
+            mAlias[small[i]] = small[i];
+        }
+    }
+
+    // Returns the sampled index and its probability, aRnd is in [0, 1)
+    int Sample(
+        float aRnd,
+        float &oPdf) const
+    {
+        const int   count = (int)mProb.size();
+        const float scaled = aRnd * count;
+        const int   bin = std::min(int(scaled), count - 1);
+        const float remainder = scaled - bin;
+
+        const int index = (remainder < mProb[bin]) ? bin : mAlias[bin];
+        oPdf = mPdf[index];
+        return index;
+    }
+
+    // Same as above, oRnd receives the part of aRnd left after picking
+    // the index, rescaled to [0, 1), so it can drive another choice
+    int Sample(
+        float aRnd,
+        float &oPdf,
+        float &oRnd) const
+    {
+        const int   count = (int)mProb.size();
+        const float scaled = aRnd * count;
+        const int   bin = std::min(int(scaled), count - 1);
+        const float remainder = scaled - bin;
+
+        // Largest float below one, rounding must not push oRnd to one
+        const float kOneMinusEps = 0.99999994f;
+
+        int index;
+        if(remainder < mProb[bin])
+        {
+            index = bin;
+            oRnd  = remainder / mProb[bin];
+        }
+        else
+        {
+            index = mAlias[bin];
+            oRnd  = mProb[bin] < 1.f ? (remainder - mProb[bin]) / (1.f - mProb[bin]) : 0.f;
+        }
+
+        oRnd = std::min(std::max(oRnd, 0.f), kOneMinusEps);
+        oPdf = mPdf[index];
+        return index;
+    }
+
+    float Pdf(int aIndex) const
+    {
+        return mPdf[aIndex];
+    }
+
+    int Size() const
+    {
+        return (int)mPdf.size();
+    }
+
+private:
+
+    std::vector<float> mProb;
+    std::vector<int>   mAlias;
+    std::vector<float> mPdf;
+};
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include "math.hxx"
+#include "utils.hxx"
+#include "framebuffer.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Arbitrary output variables, the layers written next to the radiance
+//
+// The renderers fill the enabled layers while rendering, a layer takes no
+// memory until it is enabled. The layers of the first camera ray hits and
+// the radiance split are averaged over the samples of a pixel like the
+// radiance, the sample count is summed up and the material ID is the one
+// of the first sample that reached the pixel.
+
+class AovBuffer
+{
+public:
+
+    enum Layer
+    {
+        kAovAlbedo,      //!< reflectance of the first hit
+        kAovNormal,      //!< normal of the first hit, facing the camera
+        kAovDepth,       //!< distance to the first hit
+        kAovMaterialID,  //!< material of the first hit plus one, 0 for the background
+        kAovSampleCount, //!< camera samples taken in the pixel
+        kAovVariance,    //!< variance of the luminance of the camera samples
+        kAovDirect,      //!< radiance reaching the camera after at most one bounce
+        kAovIndirect,    //!< radiance reaching the camera after two or more bounces
+        kAovCount
+    };
+
+    static const char* GetLayerName(Layer aLayer)
+    {
+        static const char* layerNames[kAovCount] =
+        {
+            "albedo", "normal", "depth", "materialID",
+            "sampleCount", "variance", "direct", "indirect"
+        };
+
+        if(aLayer < 0 || aLayer >= kAovCount)
+            return "unknown";
+        return layerNames[aLayer];
+    }
+
+    AovBuffer() :
+        mResX(0), mResY(0), mEnabledMask(0)
+    {}
+
+    void Setup(const Vec2f& aResolution)
+    {
+        mResX = int(aResolution.x);
+        mResY = int(aResolution.y);
+
+        for(int i=0; i<kAovCount; i++)
+        {
+            if(IsEnabled(Layer(i)))
+                mLayers[i].assign(mResX * mResY * GetChannels(Layer(i)), 0.f);
+        }
+    }
+
+    // Enables the layers of the bit mask, (1 << layer) for each
+    void Enable(uint aMask)
+    {
+        mEnabledMask |= aMask;
+        Setup(Vec2f(float(mResX), float(mResY)));
+    }
+
+    bool IsEnabled(Layer aLayer) const { return (mEnabledMask & (1u << aLayer)) != 0; }
+    bool IsEmpty() const { return mEnabledMask == 0; }
+    uint GetEnabledMask() const { return mEnabledMask; }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Accumulation
+
+    // Records the first hit of the camera ray through aSample, rays
+    // leaving the scene have a zero normal and depth and material -1
+    void AddHit(
+        const Vec2f &aSample,
+        const Vec3f &aAlbedo,
+        const Vec3f &aNormal,
+        float       aDepth,
+        int         aMaterialID)
+    {
+        const int pixel = GetPixel(aSample);
+        if(pixel < 0)
+            return;
+
+        Add(kAovAlbedo, pixel, aAlbedo);
+        Add(kAovNormal, pixel, aNormal);
+        Add(kAovDepth, pixel, Vec3f(aDepth));
+        Add(kAovSampleCount, pixel, Vec3f(1));
+
+        if(IsEnabled(kAovMaterialID) && mLayers[kAovMaterialID][pixel] == 0)
+            mLayers[kAovMaterialID][pixel] = float(aMaterialID + 1);
+    }
+
+    // Records the radiance of the camera sample aSample, aDirect is the
+    // part of it that reached the camera after at most one bounce
+    void AddSample(
+        const Vec2f &aSample,
+        const Vec3f &aRadiance,
+        const Vec3f &aDirect)
+    {
+        const int pixel = GetPixel(aSample);
+        if(pixel < 0)
+            return;
+
+        const float luminance = Luminance(aRadiance);
+        Add(kAovVariance, pixel, Vec3f(luminance, Sqr(luminance), 0));
+        Add(kAovDirect, pixel, aDirect);
+        Add(kAovIndirect, pixel, aRadiance - aDirect);
+    }
+
+    // Records radiance splatted at aSample from outside of a camera sample,
+    // like the light subpaths connected to the camera
+    void AddSplat(
+        const Vec2f &aSample,
+        const Vec3f &aRadiance,
+        bool        aDirect)
+    {
+        const int pixel = GetPixel(aSample);
+        if(pixel < 0)
+            return;
+
+        Add(aDirect ? kAovDirect : kAovIndirect, pixel, aRadiance);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Combining the buffers of the renderers
+
+    void Add(const AovBuffer& aOther)
+    {
+        for(int i=0; i<kAovCount; i++)
+        {
+            std::vector<float> &layer = mLayers[i];
+            const std::vector<float> &other = aOther.mLayers[i];
+
+            if(!IsEnabled(Layer(i)) || other.size() != layer.size())
+                continue;
+
+            for(size_t j=0; j<layer.size(); j++)
+            {
+                if(i != kAovMaterialID)
+                    layer[j] += other[j];
+                else if(layer[j] == 0)
+                    layer[j] = other[j];
+            }
+        }
+    }
+
+    // Scales the averaged layers
+    void Scale(float aScale)
+    {
+        for(int i=0; i<kAovCount; i++)
+        {
+            if(i == kAovMaterialID || i == kAovSampleCount)
+                continue;
+
+            for(size_t j=0; j<mLayers[i].size(); j++)
+                mLayers[i][j] *= aScale;
+        }
+    }
+
+    // Turns the averaged luminance moments into the variance,
+    // to be called once the buffers of all renderers are combined
+    void Finalize()
+    {
+        if(!IsEnabled(kAovVariance))
+            return;
+
+        std::vector<float> &moments = mLayers[kAovVariance];
+        for(int i=0; i<mResX * mResY; i++)
+        {
+            moments[2*i] = std::max(0.f, moments[2*i + 1] - Sqr(moments[2*i]));
+            moments[2*i + 1] = 0;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Access
+
+    // Value of a layer at a pixel, single channel layers in x
+    Vec3f Get(Layer aLayer, int aX, int aY) const
+    {
+        const int channels = GetChannels(aLayer);
+        const float *value = &mLayers[aLayer][(aX + aY * mResX) * channels];
+
+        return channels == 3 ? Vec3f(value[0], value[1], value[2]) : Vec3f(value[0], 0, 0);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Saving
+
+    // Writes the radiance and the enabled layers to an uncompressed
+    // multi-channel OpenEXR file, with 32 bit float channels named
+    // R, G, B for the radiance and <layer>.R/G/B or <layer> for the rest
+    bool SaveEXR(
+        const char        *aFilename,
+        const Framebuffer &aRadiance) const
+    {
+        // the channels, sorted by name as OpenEXR requires
+        std::vector<Channel> channels;
+        for(int c=0; c<3; c++)
+            channels.push_back(Channel(std::string(1, "RGB"[c]), -1, c));
+
+        for(int i=0; i<kAovCount; i++)
+        {
+            if(!IsEnabled(Layer(i)))
+                continue;
+
+            const std::string name = GetLayerName(Layer(i));
+            if(GetChannels(Layer(i)) == 3)
+            {
+                for(int c=0; c<3; c++)
+                    channels.push_back(Channel(name + "." + "RGB"[c], i, c));
+            }
+            else
+                channels.push_back(Channel(name, i, 0));
+        }
+
+        std::sort(channels.begin(), channels.end());
+
+        std::ofstream exr(aFilename, std::ios::binary);
+        if(!exr)
+            return false;
+
+        // magic number and version 2, single part scan lines
+        const unsigned char magic[8] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+        exr.write((const char*)magic, 8);
+
+        std::string channelList;
+        for(size_t i=0; i<channels.size(); i++)
+        {
+            channelList += channels[i].mName;
+            channelList += '\0';
+            AppendInt(channelList, 2); // FLOAT
+            AppendInt(channelList, 0); // pLinear and reserved
+            AppendInt(channelList, 1); // x sampling
+            AppendInt(channelList, 1); // y sampling
+        }
+        channelList += '\0';
+
+        std::string window;
+        AppendInt(window, 0);
+        AppendInt(window, 0);
+        AppendInt(window, mResX - 1);
+        AppendInt(window, mResY - 1);
+
+        std::string one, center;
+        AppendFloat(one, 1.f);
+        AppendFloat(center, 0.f);
+        AppendFloat(center, 0.f);
+
+        WriteAttribute(exr, "channels", "chlist", channelList);
+        WriteAttribute(exr, "compression", "compression", std::string(1, '\0'));
+        WriteAttribute(exr, "dataWindow", "box2i", window);
+        WriteAttribute(exr, "displayWindow", "box2i", window);
+        WriteAttribute(exr, "lineOrder", "lineOrder", std::string(1, '\0'));
+        WriteAttribute(exr, "pixelAspectRatio", "float", one);
+        WriteAttribute(exr, "screenWindowCenter", "v2f", center);
+        WriteAttribute(exr, "screenWindowWidth", "float", one);
+        exr.put('\0');
+
+        // offsets of the scan lines, one line per chunk
+        const int lineSize = int(channels.size()) * mResX * 4;
+        const unsigned long long tableEnd = (unsigned long long)exr.tellp() + 8ull * mResY;
+
+        for(int y=0; y<mResY; y++)
+        {
+            const unsigned long long offset = tableEnd + (unsigned long long)y * (8 + lineSize);
+            exr.write((const char*)&offset, 8);
+        }
+
+        std::vector<float> line(channels.size() * mResX);
+        for(int y=0; y<mResY; y++)
+        {
+            for(size_t c=0; c<channels.size(); c++)
+            {
+                const Channel &channel = channels[c];
+
+                for(int x=0; x<mResX; x++)
+                {
+                    const Vec3f value = channel.mLayer < 0 ? aRadiance.GetColor(x, y) :
+                        Get(Layer(channel.mLayer), x, y);
+                    line[c * mResX + x] = value.Get(channel.mComponent);
+                }
+            }
+
+            exr.write((const char*)&y, 4);
+            exr.write((const char*)&lineSize, 4);
+            exr.write((const char*)&line[0], lineSize);
+        }
+
+        return bool(exr);
+    }
+
+private:
+
+    struct Channel
+    {
+        Channel(const std::string &aName, int aLayer, int aComponent) :
+            mName(aName), mLayer(aLayer), mComponent(aComponent)
+        {}
+
+        bool operator<(const Channel &aOther) const { return mName < aOther.mName; }
+
+        std::string mName;
+        int         mLayer;     //!< -1 for the radiance
+        int         mComponent;
+    };
+
+    static void AppendInt(std::string &aoData, int aValue)
+    {
+        aoData.append((const char*)&aValue, 4);
+    }
+
+    static void AppendFloat(std::string &aoData, float aValue)
+    {
+        aoData.append((const char*)&aValue, 4);
+    }
+
+    static void WriteAttribute(
+        std::ofstream     &aoFile,
+        const char        *aName,
+        const char        *aType,
+        const std::string &aValue)
+    {
+        const int size = int(aValue.size());
+
+        aoFile.write(aName, strlen(aName) + 1);
+        aoFile.write(aType, strlen(aType) + 1);
+        aoFile.write((const char*)&size, 4);
+        aoFile.write(aValue.data(), size);
+    }
+
+    // Floats stored per pixel, the variance keeps the luminance
+    // and its square until it is finalized
+    static int GetChannels(Layer aLayer)
+    {
+        static const int layerChannels[kAovCount] = { 3, 3, 1, 1, 1, 2, 3, 3 };
+        return layerChannels[aLayer];
+    }
+
+    int GetPixel(const Vec2f &aSample) const
+    {
+        if(aSample.x < 0 || aSample.x >= mResX || aSample.y < 0 || aSample.y >= mResY)
+            return -1;
+
+        return int(aSample.x) + int(aSample.y) * mResX;
+    }
+
+    void Add(Layer aLayer, int aPixel, const Vec3f &aValue)
+    {
+        if(!IsEnabled(aLayer))
+            return;
+
+        const int channels = GetChannels(aLayer);
+        float *value = &mLayers[aLayer][aPixel * channels];
+
+        for(int c=0; c<channels; c++)
+            value[c] += aValue.Get(c);
+    }
+
+private:
+
+    int                mResX;
+    int                mResY;
+    uint               mEnabledMask;
+    std::vector<float> mLayers[kAovCount]; //!< Interleaved channels, empty when disabled
+};
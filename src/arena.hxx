@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+//////////////////////////////////////////////////////////////////////////
+// Scene arena
+//
+// Owns the objects a scene is made of. Each pool hands out memory from
+// blocks of kBlockSize bytes by bumping an offset, so the primitives of a
+// scene lie next to each other in the order they are created instead of
+// all over the heap. Release frees the blocks in one go, after running the
+// destructors of the objects that free something, last created first.
+// Objects cannot be freed one at a time. Not thread safe, scenes are built
+// by one thread.
+
+// Whether the arena runs the destructor of a T. Types whose destructor is
+// only there for being virtual, like the primitives, specialize it to
+// false, their objects go with the blocks without any work per object.
+template<typename T>
+struct ArenaDestroys
+{
+    static const bool value = !std::is_trivially_destructible<T>::value;
+};
+
+class SceneArena
+{
+public:
+
+    enum Pool
+    {
+        kPoolPrimitives,   //!< Triangles, spheres and mesh instances
+        kPoolMeshes,       //!< Meshes and the hierarchies over the primitives
+        kPoolLights,
+        kPoolCount
+    };
+
+    static const size_t kBlockSize      = 64 << 10;
+    static const size_t kBlockAlignment = 64;      //!< Cache line, the blocks start at one
+
+    SceneArena()
+    {
+        for(int i=0; i<kPoolCount; i++)
+        {
+            mUsedBytes[i]   = 0;
+            mObjectCount[i] = 0;
+        }
+    }
+
+    ~SceneArena()
+    {
+        Release();
+    }
+
+    // Constructs a T in aPool from aArgs
+    template<typename T, typename... tArgs>
+    T* Create(
+        Pool     aPool,
+        tArgs&&  ...aArgs)
+    {
+        T *object = new(Allocate(aPool, sizeof(T), alignof(T))) T(std::forward<tArgs>(aArgs)...);
+
+        if(ArenaDestroys<T>::value)
+        {
+            Destructor destructor = { object, &Destroy<T> };
+            mDestructors.push_back(destructor);
+        }
+
+        mObjectCount[aPool]++;
+        return object;
+    }
+
+    // Uninitialized memory in aPool, aAlignment is a power of two of at
+    // most kBlockAlignment
+    void* Allocate(
+        Pool   aPool,
+        size_t aSize,
+        size_t aAlignment)
+    {
+        std::vector<Block> &blocks = mBlocks[aPool];
+
+        size_t offset = 0;
+        if(!blocks.empty())
+            offset = (blocks.back().mUsed + aAlignment - 1) & ~(aAlignment - 1);
+
+        // objects larger than a block get one of their own
+        if(blocks.empty() || offset + aSize > blocks.back().mSize)
+        {
+            Block block;
+            block.mSize = std::max(aSize, size_t(kBlockSize));
+            block.mData = (char*)malloc(block.mSize + kBlockAlignment);
+            if(!block.mData)
+                throw std::bad_alloc();
+
+            block.mUsed = 0;
+            blocks.push_back(block);
+            offset = 0;
+        }
+
+        Block &block = blocks.back();
+        block.mUsed = offset + aSize;
+        mUsedBytes[aPool] += aSize;
+
+        return GetBlockStart(block) + offset;
+    }
+
+    // Destroys all objects and frees all blocks
+    void Release()
+    {
+        for(size_t i=mDestructors.size(); i>0; i--)
+            mDestructors[i - 1].mDestroy(mDestructors[i - 1].mObject);
+        std::vector<Destructor>().swap(mDestructors);
+
+        for(int i=0; i<kPoolCount; i++)
+        {
+            for(size_t j=0; j<mBlocks[i].size(); j++)
+                free(mBlocks[i][j].mData);
+            std::vector<Block>().swap(mBlocks[i]);
+
+            mUsedBytes[i]   = 0;
+            mObjectCount[i] = 0;
+        }
+    }
+
+    // Bytes of the objects in the pool, without the padding between them
+    size_t GetUsedBytes(Pool aPool) const
+    {
+        return mUsedBytes[aPool];
+    }
+
+    // Bytes of the pool's blocks
+    size_t GetReservedBytes(Pool aPool) const
+    {
+        size_t bytes = 0;
+        for(size_t i=0; i<mBlocks[aPool].size(); i++)
+            bytes += mBlocks[aPool][i].mSize;
+        return bytes;
+    }
+
+    int GetObjectCount(Pool aPool) const
+    {
+        return mObjectCount[aPool];
+    }
+
+    static const char* GetPoolName(Pool aPool)
+    {
+        switch(aPool)
+        {
+        case kPoolPrimitives: return "primitives";
+        case kPoolMeshes:     return "meshes";
+        case kPoolLights:     return "lights";
+        default:              return "unknown";
+        }
+    }
+
+private:
+
+    struct Block
+    {
+        char   *mData;  //!< As returned by malloc, see GetBlockStart
+        size_t mSize;
+        size_t mUsed;
+    };
+
+    struct Destructor
+    {
+        void *mObject;
+        void (*mDestroy)(void*);
+    };
+
+    template<typename T>
+    static void Destroy(void *aObject)
+    {
+        static_cast<T*>(aObject)->~T();
+    }
+
+    static char* GetBlockStart(const Block &aBlock)
+    {
+        const uintptr_t address = (uintptr_t(aBlock.mData) + kBlockAlignment - 1) & ~uintptr_t(kBlockAlignment - 1);
+        return (char*)address;
+    }
+
+    // The arena cannot be copied, the objects point at each other
+    SceneArena(const SceneArena&);
+    SceneArena& operator=(const SceneArena&);
+
+private:
+
+    std::vector<Block>      mBlocks[kPoolCount];
+    std::vector<Destructor> mDestructors;  //!< In the order of creation
+    size_t                  mUsedBytes[kPoolCount];
+    int                     mObjectCount[kPoolCount];
+};
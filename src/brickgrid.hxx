@@ -0,0 +1,279 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Sparse density grid made of 8x8x8 voxel bricks
+//
+// Only the bricks with a non-zero voxel are stored, so the memory grows
+// with the occupied part of the volume. A dense coarse grid holds for every
+// brick the index of its voxels (-1 when it is empty) and the maximum
+// density of the brick, which serves as the majorant of the volume
+// tracking. The voxels of a brick are quantized to 8 bits relative to the
+// brick maximum, so the majorant bounds them exactly.
+//
+// The densities are piecewise constant over the voxels and the grid is
+// addressed in voxel units, [0, resolution] along each axis.
+
+class BrickGrid
+{
+public:
+
+    static const int kBrickLog2   = 3;
+    static const int kBrickSize   = 1 << kBrickLog2;
+    static const int kBrickVoxels = kBrickSize * kBrickSize * kBrickSize;
+
+    BrickGrid() :
+        mResolution(0), mBrickRes(0)
+    {}
+
+    // Loads a raw grid file: the magic "PG3V", the resolution as three
+    // int32 values and the float32 densities with x running fastest.
+    // The file is read one slab of bricks at a time.
+    bool LoadRaw(const char *aFilename)
+    {
+        std::ifstream file(aFilename, std::ios::binary);
+        if(!file)
+            return false;
+
+        char magic[4];
+        int res[3];
+        if(!file.read(magic, 4) || std::memcmp(magic, "PG3V", 4) != 0 ||
+            !file.read((char*)res, sizeof(res)) ||
+            res[0] <= 0 || res[1] <= 0 || res[2] <= 0)
+            return false;
+
+        Setup(Vec3i(res[0], res[1], res[2]));
+
+        const int sliceSize = res[0] * res[1];
+        std::vector<float> slab(sliceSize * kBrickSize);
+
+        for(int bz=0; bz<mBrickRes.z; bz++)
+        {
+            const int slices = std::min(int(kBrickSize), res[2] - bz * kBrickSize);
+
+            std::fill(slab.begin(), slab.end(), 0.f);
+            if(!file.read((char*)&slab[0], sizeof(float) * sliceSize * slices))
+                return false;
+
+            AddSlab(bz, slab);
+        }
+
+        return true;
+    }
+
+    // Builds the grid from a functor returning the density
+    // at a point of the unit cube
+    template<typename tDensity>
+    void Build(
+        const Vec3i    &aResolution,
+        const tDensity &aDensity)
+    {
+        Setup(aResolution);
+
+        const int sliceSize = aResolution.x * aResolution.y;
+        std::vector<float> slab(sliceSize * kBrickSize);
+
+        for(int bz=0; bz<mBrickRes.z; bz++)
+        {
+            std::fill(slab.begin(), slab.end(), 0.f);
+
+            const int slices = std::min(int(kBrickSize), aResolution.z - bz * kBrickSize);
+            for(int z=0; z<slices; z++)
+            for(int y=0; y<aResolution.y; y++)
+            for(int x=0; x<aResolution.x; x++)
+            {
+                const Vec3f pos(
+                    (x + 0.5f) / aResolution.x,
+                    (y + 0.5f) / aResolution.y,
+                    (bz * kBrickSize + z + 0.5f) / aResolution.z);
+
+                slab[x + y * aResolution.x + z * sliceSize] = std::max(0.f, aDensity(pos));
+            }
+
+            AddSlab(bz, slab);
+        }
+    }
+
+    // Density of the voxel containing aPos
+    float Density(const Vec3f &aPos) const
+    {
+        const int x = std::max(0, std::min(int(aPos.x), mResolution.x - 1));
+        const int y = std::max(0, std::min(int(aPos.y), mResolution.y - 1));
+        const int z = std::max(0, std::min(int(aPos.z), mResolution.z - 1));
+
+        const int brick = BrickIndex(Vec3i(x >> kBrickLog2, y >> kBrickLog2, z >> kBrickLog2));
+        const int offset = mBrickOffsets[brick];
+        if(offset < 0)
+            return 0.f;
+
+        const int mask = kBrickSize - 1;
+        const int voxel = (x & mask) + ((y & mask) << kBrickLog2) + ((z & mask) << (2 * kBrickLog2));
+
+        return mMajorants[brick] * (1.f / 255.f) * mVoxels[offset + voxel];
+    }
+
+    // Maximum density of the brick at the given brick coordinates
+    float Majorant(const Vec3i &aBrick) const
+    {
+        return mMajorants[BrickIndex(aBrick)];
+    }
+
+    const Vec3i& GetResolution() const { return mResolution; }
+    const Vec3i& GetBrickResolution() const { return mBrickRes; }
+
+    int GetOccupiedBrickCount() const { return int(mVoxels.size()) / kBrickVoxels; }
+
+    // Bytes used by the grid
+    size_t GetMemorySize() const
+    {
+        return mVoxels.size() + mBrickOffsets.size() * sizeof(int) +
+            mMajorants.size() * sizeof(float);
+    }
+
+private:
+
+    void Setup(const Vec3i &aResolution)
+    {
+        mResolution = aResolution;
+        mBrickRes   = Vec3i(
+            (aResolution.x + kBrickSize - 1) >> kBrickLog2,
+            (aResolution.y + kBrickSize - 1) >> kBrickLog2,
+            (aResolution.z + kBrickSize - 1) >> kBrickLog2);
+
+        const int brickCount = mBrickRes.x * mBrickRes.y * mBrickRes.z;
+        mBrickOffsets.assign(brickCount, -1);
+        mMajorants.assign(brickCount, 0.f);
+        mVoxels.clear();
+    }
+
+    int BrickIndex(const Vec3i &aBrick) const
+    {
+        return aBrick.x + mBrickRes.x * (aBrick.y + mBrickRes.y * aBrick.z);
+    }
+
+    // Stores the non-empty bricks of a slab of kBrickSize slices,
+    // the voxels outside of the grid resolution are zero
+    void AddSlab(
+        int                      aBrickZ,
+        const std::vector<float> &aSlab)
+    {
+        const int sliceSize = mResolution.x * mResolution.y;
+
+        for(int by=0; by<mBrickRes.y; by++)
+        for(int bx=0; bx<mBrickRes.x; bx++)
+        {
+            float voxels[kBrickVoxels];
+            float maxDensity = 0.f;
+
+            for(int z=0; z<kBrickSize; z++)
+            for(int y=0; y<kBrickSize; y++)
+            for(int x=0; x<kBrickSize; x++)
+            {
+                const int gx = bx * kBrickSize + x;
+                const int gy = by * kBrickSize + y;
+
+                float density = 0.f;
+                if(gx < mResolution.x && gy < mResolution.y)
+                    density = aSlab[gx + gy * mResolution.x + z * sliceSize];
+
+                voxels[x + (y << kBrickLog2) + (z << (2 * kBrickLog2))] = density;
+                maxDensity = std::max(maxDensity, density);
+            }
+
+            if(maxDensity <= 0.f)
+                continue;
+
+            const int brick = BrickIndex(Vec3i(bx, by, aBrickZ));
+            mBrickOffsets[brick] = int(mVoxels.size());
+            mMajorants[brick]    = maxDensity;
+
+            const float scale = 255.f / maxDensity;
+            for(int i=0; i<kBrickVoxels; i++)
+                mVoxels.push_back((unsigned char)std::min(255.f, voxels[i] * scale + 0.5f));
+        }
+    }
+
+private:
+
+    Vec3i mResolution;                  //!< Voxels along each axis
+    Vec3i mBrickRes;                    //!< Bricks along each axis
+    std::vector<int> mBrickOffsets;     //!< Start of each brick in mVoxels, -1 when empty
+    std::vector<float> mMajorants;      //!< Maximum density of each brick
+    std::vector<unsigned char> mVoxels; //!< Quantized voxels of the occupied bricks
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Procedural cloud in the unit cube, fills the grid when no file is given:
+// a few overlapping blobs eroded by value noise
+
+struct ProceduralCloud
+{
+    float operator()(const Vec3f &aPos) const
+    {
+        static const float blobs[3][4] =
+        {
+            // center, radius
+            { 0.50f, 0.45f, 0.50f, 0.28f },
+            { 0.32f, 0.55f, 0.45f, 0.18f },
+            { 0.68f, 0.52f, 0.56f, 0.20f }
+        };
+
+        float shape = 0.f;
+        for(int i=0; i<3; i++)
+        {
+            const Vec3f toCenter = aPos - Vec3f(blobs[i][0], blobs[i][1], blobs[i][2]);
+            shape = std::max(shape, 1.f - toCenter.Length() / blobs[i][3]);
+        }
+
+        if(shape <= 0.f)
+            return 0.f;
+
+        // fractal noise erodes the blob surface
+        float noise = 0.f, amplitude = 0.5f, frequency = 8.f;
+        for(int octave=0; octave<4; octave++)
+        {
+            noise += amplitude * ValueNoise(aPos * frequency);
+            amplitude *= 0.5f;
+            frequency *= 2.f;
+        }
+
+        return std::max(0.f, std::min(1.f, 3.f * (shape - 0.5f * noise) + 0.1f));
+    }
+
+private:
+
+    static float Lattice(int aX, int aY, int aZ)
+    {
+        uint h = uint(aX) * 73856093u ^ uint(aY) * 19349663u ^ uint(aZ) * 83492791u;
+        h ^= h >> 13;
+        h *= 0x5bd1e995u;
+        h ^= h >> 15;
+        return float(h & 0xffffu) / 65535.f;
+    }
+
+    // Trilinearly interpolated lattice values
+    static float ValueNoise(const Vec3f &aPos)
+    {
+        const int x = int(std::floor(aPos.x));
+        const int y = int(std::floor(aPos.y));
+        const int z = int(std::floor(aPos.z));
+        const float fx = aPos.x - x, fy = aPos.y - y, fz = aPos.z - z;
+
+        float res = 0.f;
+        for(int i=0; i<8; i++)
+        {
+            const int dx = i & 1, dy = (i >> 1) & 1, dz = (i >> 2) & 1;
+            res += Lattice(x + dx, y + dy, z + dz) *
+                (dx ? fx : 1.f - fx) * (dy ? fy : 1.f - fy) * (dz ? fz : 1.f - fz);
+        }
+
+        return res;
+    }
+};
@@ -22,7 +22,9 @@ public:
 
         mPosition   = aPosition;
         mForward    = forward;
+        mUp         = aUp;
         mResolution = aResolution;
+        mHorizontalFOV = aHorizontalFOV;
 
         const Vec3f pos(
             Dot(up, aPosition),
@@ -48,6 +50,7 @@ public:
 
         const float tanHalfAngle = std::tan(aHorizontalFOV * PI_F / 360.f);
         mPixelArea = 4.f * Sqr(tanHalfAngle) / Sqr(aResolution.x);
+        mImagePlaneDist = aResolution.x / (2.f * tanHalfAngle);
     }
 
     int RasterToIndex(const Vec2f &aPixelCoords) const
@@ -91,12 +94,39 @@ public:
         return res;
     }
 
+    // The ray with its differentials towards the next pixels. The image
+    // plane points are the projective mRasterToWorld of the raster ones,
+    // their derivatives are its raster columns minus the change of w.
+    Ray GenerateRay(
+        const Vec2f     &aRasterXY,
+        RayDifferential &oDifferential) const
+    {
+        const Mat4f &m = mRasterToWorld;
+        const float w = m.Get(3, 0) * aRasterXY.x + m.Get(3, 1) * aRasterXY.y + m.Get(3, 3);
+        const Vec3f point = RasterToWorld(aRasterXY);
+
+        const Vec3f dPdx = (Vec3f(m.Get(0, 0), m.Get(1, 0), m.Get(2, 0)) - point * m.Get(3, 0)) / Vec3f(w);
+        const Vec3f dPdy = (Vec3f(m.Get(0, 1), m.Get(1, 1), m.Get(2, 1)) - point * m.Get(3, 1)) / Vec3f(w);
+
+        // derivatives of the normalized direction
+        const Ray res = GenerateRay(aRasterXY);
+        const float invDist = 1.f / (point - mPosition).Length();
+
+        oDifferential = RayDifferential();
+        oDifferential.dDdx = (dPdx - res.dir * Dot(res.dir, dPdx)) * invDist;
+        oDifferential.dDdy = (dPdy - res.dir * Dot(res.dir, dPdy)) * invDist;
+        return res;
+    }
+
 public:
 
     Vec3f mPosition;
     Vec3f mForward;
+    Vec3f mUp;             //!< As given to Setup, not orthogonalized
     Vec2f mResolution;
+    float mHorizontalFOV;  //!< In degrees
     Mat4f mRasterToWorld;
     Mat4f mWorldToRaster;
     float mPixelArea;
+    float mImagePlaneDist; //!< Distance of the image plane measured in pixels
 };
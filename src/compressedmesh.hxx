@@ -0,0 +1,495 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <climits>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+#include "mesh.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Quantized triangle mesh
+//
+// A compact copy of a built TriangleMesh, decoded while it is traced. The
+// BVH is cut into clusters of at most kClusterTriangles triangles, each
+// with its own vertices, so a triangle gives its corners by three 8 bit
+// indices into them. The vertices are 16 bit lattice offsets from the
+// lattice point at the low corner of their cluster, the cluster's step is
+// the finest power of two times the mesh's base step the cluster spans in
+// 16 bits. A vertex shared by clusters of different steps is snapped to
+// the coarsest of them, the coarser lattices are subsets of the finer
+// ones, so each cluster decodes it to the same position and the mesh stays
+// watertight. The nodes of the clusters keep their boxes as 16 bit
+// offsets on the same lattice, the nodes above the clusters are stored as
+// in TriangleMesh.
+//
+// The vertices move by half a step at most. The triangles keep 16 bit
+// materials, the few clusters with emissive triangles also their
+// primitive IDs. Texture coordinates are not kept, the hits have none.
+
+class CompressedMesh : public AbstractGeometry
+{
+public:
+
+    static const int kClusterTriangles = 64;      //!< Their corners fit 8 bit indices
+    static const int kLatticeBits      = 23;      //!< Of the mesh's base steps over its extent
+    static const int kMaxOffset        = 65535;
+
+    struct QuantizedNode
+    {
+        unsigned short mBBoxMin[3];
+        unsigned short mBBoxMax[3];
+        unsigned short mOffset;     //!< First triangle of a leaf, left child of an inner node (right follows it)
+        unsigned short mCount;      //!< Triangles of a leaf, 0 for inner nodes
+    };
+
+    struct Cluster
+    {
+        Vec3i mBase;          //!< Lattice point of the zero offsets, in steps of the cluster
+        float mStep;
+        int   mFirstVertex;
+        int   mFirstTriangle;
+        int   mFirstNode;
+        int   mFirstPrimID;   //!< Into mPrimIDs, -1 when no triangle of the cluster emits
+    };
+
+    // A built mesh with fewer than 65536 materials can be compressed
+    static bool CanCompress(const TriangleMesh &aMesh)
+    {
+        const TriangleMesh::Arrays &arrays = aMesh.GetArrays();
+        if(arrays.mNodeCount == 0)
+            return false;
+
+        for(int i=0; i<arrays.mTriangleCount; i++)
+        {
+            if(arrays.mMatIDs[i] < 0 || arrays.mMatIDs[i] > 65535)
+                return false;
+        }
+        return true;
+    }
+
+    explicit CompressedMesh(const TriangleMesh &aMesh)
+    {
+        const TriangleMesh::Arrays &arrays = aMesh.GetArrays();
+
+        std::vector<int> clusterRoots;
+        std::vector<std::pair<int, int> > clusterTriangles;
+        TriangleMesh::BuildClusters(arrays, kClusterTriangles, mTopNodes, clusterRoots, clusterTriangles);
+
+        // the mesh vertices of each cluster, the clusters are extracted
+        // again one at a time when they are quantized
+        const int clusterCount = (int)clusterRoots.size();
+        TriangleMesh::Cluster source;
+        std::vector<int> vertexMap(arrays.mVertexCount, -1), clusterVertices, vertexStarts(1, 0);
+        for(int i=0; i<clusterCount; i++)
+        {
+            TriangleMesh::ExtractCluster(arrays, clusterRoots[i], clusterTriangles[i], vertexMap, source);
+            clusterVertices.insert(clusterVertices.end(), source.mMeshVertices.begin(), source.mMeshVertices.end());
+            vertexStarts.push_back((int)clusterVertices.size());
+        }
+
+        // the base lattice spans the mesh's box in kLatticeBits
+        const TriangleMesh::Node &root = arrays.mNodes[0];
+        const Vec3f extent = root.mBBoxMax - root.mBBoxMin;
+        const float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+
+        mOrigin   = root.mBBoxMin;
+        mBaseStep = maxExtent > 0.f ? maxExtent / float(1 << kLatticeBits) : 1.f;
+
+        // the finest levels that fit, coarsened until the vertices snapped
+        // to the coarsest level of their clusters fit as well
+        std::vector<int> levels(clusterCount, 0), vertexLevels(arrays.mVertexCount);
+        for(bool changed = true; changed; )
+        {
+            std::fill(vertexLevels.begin(), vertexLevels.end(), 0);
+            for(int i=0; i<clusterCount; i++)
+            {
+                for(int j=vertexStarts[i]; j<vertexStarts[i + 1]; j++)
+                {
+                    int &level = vertexLevels[clusterVertices[j]];
+                    level = std::max(level, levels[i]);
+                }
+            }
+
+            changed = false;
+            for(int i=0; i<clusterCount; i++)
+            {
+                Vec3i base, span;
+                GetClusterRange(arrays, &clusterVertices[vertexStarts[i]], vertexStarts[i + 1] - vertexStarts[i],
+                    levels[i], vertexLevels, base, span);
+                if(std::max(span.x, std::max(span.y, span.z)) > kMaxOffset)
+                {
+                    levels[i]++;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<int>().swap(clusterVertices);
+
+        mClusters.resize(clusterCount);
+        mVertices.reserve(3 * size_t(vertexStarts.back()));
+        mIndices.reserve(3 * size_t(arrays.mTriangleCount));
+        mMatIDs.reserve(arrays.mTriangleCount);
+
+        for(int i=0; i<clusterCount; i++)
+        {
+            TriangleMesh::ExtractCluster(arrays, clusterRoots[i], clusterTriangles[i], vertexMap, source);
+            Cluster &cluster = mClusters[i];
+
+            Vec3i span;
+            GetClusterRange(arrays, &source.mMeshVertices[0], (int)source.mMeshVertices.size(),
+                levels[i], vertexLevels, cluster.mBase, span);
+            cluster.mStep          = std::ldexp(mBaseStep, levels[i]);
+            cluster.mFirstVertex   = (int)mVertices.size() / 3;
+            cluster.mFirstTriangle = (int)mIndices.size() / 3;
+            cluster.mFirstNode     = (int)mNodes.size();
+            cluster.mFirstPrimID   = -1;
+
+            for(size_t j=0; j<source.mVertices.size(); j++)
+            {
+                const Vec3i point = GetLatticePoint(source.mVertices[j],
+                    vertexLevels[source.mMeshVertices[j]], levels[i]);
+                for(int axis=0; axis<3; axis++)
+                    mVertices.push_back((unsigned short)(point.Get(axis) - cluster.mBase.Get(axis)));
+            }
+
+            for(size_t j=0; j<source.mIndices.size(); j++)
+            {
+                for(int corner=0; corner<3; corner++)
+                    mIndices.push_back((unsigned char)source.mIndices[j].Get(corner));
+
+                mMatIDs.push_back((unsigned short)source.mMatIDs[j]);
+                if(source.mPrimIDs[j] >= 0 && cluster.mFirstPrimID < 0)
+                {
+                    cluster.mFirstPrimID = (int)mPrimIDs.size();
+                    mPrimIDs.insert(mPrimIDs.end(), source.mPrimIDs.begin(), source.mPrimIDs.end());
+                }
+            }
+
+            // the boxes of the quantized vertices, the children come after
+            // their parent
+            const int firstNode = (int)mNodes.size();
+            mNodes.resize(firstNode + source.mNodes.size());
+            for(int j=(int)source.mNodes.size()-1; j>=0; j--)
+            {
+                QuantizedNode &node = mNodes[firstNode + j];
+                node.mOffset = (unsigned short)source.mNodes[j].mOffset;
+                node.mCount  = (unsigned short)source.mNodes[j].mCount;
+
+                for(int axis=0; axis<3; axis++)
+                {
+                    node.mBBoxMin[axis] = kMaxOffset;
+                    node.mBBoxMax[axis] = 0;
+                }
+
+                for(int k=0; k<(node.mCount > 0 ? node.mCount : 2); k++)
+                {
+                    unsigned short childMin[3] = { 0 }, childMax[3] = { 0 };
+                    if(node.mCount > 0)
+                    {
+                        for(int axis=0; axis<3; axis++)
+                        {
+                            childMin[axis] = kMaxOffset;
+                            childMax[axis] = 0;
+                        }
+
+                        const int triangle = cluster.mFirstTriangle + node.mOffset + k;
+                        for(int corner=0; corner<3; corner++)
+                        {
+                            const unsigned short *vertex =
+                                &mVertices[3 * (cluster.mFirstVertex + mIndices[3 * triangle + corner])];
+                            for(int axis=0; axis<3; axis++)
+                            {
+                                childMin[axis] = std::min(childMin[axis], vertex[axis]);
+                                childMax[axis] = std::max(childMax[axis], vertex[axis]);
+                            }
+                        }
+                    }
+                    else
+                    {
+                        const QuantizedNode &child = mNodes[firstNode + node.mOffset + k];
+                        std::copy(child.mBBoxMin, child.mBBoxMin + 3, childMin);
+                        std::copy(child.mBBoxMax, child.mBBoxMax + 3, childMax);
+                    }
+
+                    for(int axis=0; axis<3; axis++)
+                    {
+                        node.mBBoxMin[axis] = std::min(node.mBBoxMin[axis], childMin[axis]);
+                        node.mBBoxMax[axis] = std::max(node.mBBoxMax[axis], childMax[axis]);
+                    }
+                }
+            }
+        }
+
+        // the top boxes hold the decoded clusters
+        for(int i=(int)mTopNodes.size()-1; i>=0; i--)
+        {
+            TriangleMesh::Node &node = mTopNodes[i];
+            if(node.mCount > 0)
+            {
+                const TriangleMesh::Node box = DecodeBox(mClusters[node.mOffset],
+                    mNodes[mClusters[node.mOffset].mFirstNode]);
+                node.mBBoxMin = box.mBBoxMin;
+                node.mBBoxMax = box.mBBoxMax;
+            }
+            else
+            {
+                node.mBBoxMin = Min(mTopNodes[node.mOffset].mBBoxMin, mTopNodes[node.mOffset + 1].mBBoxMin);
+                node.mBBoxMax = Max(mTopNodes[node.mOffset].mBBoxMax, mTopNodes[node.mOffset + 1].mBBoxMax);
+            }
+        }
+
+        mTriangleCount = arrays.mTriangleCount;
+    }
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        return Traverse<false>(aRay, oResult);
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        return Traverse<true>(aRay, oResult);
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        if(mTopNodes.empty())
+            return;
+
+        aoBBoxMin = Min(aoBBoxMin, mTopNodes[0].mBBoxMin);
+        aoBBoxMax = Max(aoBBoxMax, mTopNodes[0].mBBoxMax);
+    }
+
+    int GetTriangleCount() const
+    {
+        return mTriangleCount;
+    }
+
+    int GetClusterCount() const
+    {
+        return (int)mClusters.size();
+    }
+
+    // Bytes used by the clusters, their vertices, triangles and nodes and
+    // the hierarchy above them
+    size_t GetMemorySize() const
+    {
+        return mTopNodes.size() * sizeof(TriangleMesh::Node) + mClusters.size() * sizeof(Cluster) +
+            mVertices.size() * sizeof(unsigned short) + mIndices.size() + mMatIDs.size() *
+            sizeof(unsigned short) + mPrimIDs.size() * sizeof(int) + mNodes.size() * sizeof(QuantizedNode);
+    }
+
+private:
+
+    // The lattice point nearest to aPoint at aLevel, in steps of aClusterLevel
+    Vec3i GetLatticePoint(
+        const Vec3f &aPoint,
+        int         aLevel,
+        int         aClusterLevel) const
+    {
+        const double step = std::ldexp(double(mBaseStep), aLevel);
+
+        Vec3i point;
+        for(int axis=0; axis<3; axis++)
+        {
+            const double steps = std::floor((aPoint.Get(axis) - mOrigin.Get(axis)) / step + 0.5);
+            point.Get(axis) = int(steps) << (aLevel - aClusterLevel);
+        }
+        return point;
+    }
+
+    // The lowest lattice point at aLevel of the aMeshVertices of a cluster
+    // and the steps they span from it
+    void GetClusterRange(
+        const TriangleMesh::Arrays &aArrays,
+        const int                  *aMeshVertices,
+        int                        aVertexCount,
+        int                        aLevel,
+        const std::vector<int>     &aVertexLevels,
+        Vec3i                      &oBase,
+        Vec3i                      &oSpan) const
+    {
+        Vec3i low(INT_MAX), high(INT_MIN);
+        for(int i=0; i<aVertexCount; i++)
+        {
+            const Vec3i point = GetLatticePoint(aArrays.mVertices[aMeshVertices[i]],
+                std::max(aLevel, aVertexLevels[aMeshVertices[i]]), aLevel);
+            for(int axis=0; axis<3; axis++)
+            {
+                low.Get(axis)  = std::min(low.Get(axis),  point.Get(axis));
+                high.Get(axis) = std::max(high.Get(axis), point.Get(axis));
+            }
+        }
+
+        oBase = low;
+        oSpan = high - low;
+    }
+
+    Vec3f DecodeVertex(
+        const Cluster &aCluster,
+        int           aVertex) const
+    {
+        const unsigned short *offsets = &mVertices[3 * (aCluster.mFirstVertex + aVertex)];
+        return mOrigin + Vec3f(
+            float(aCluster.mBase.x + offsets[0]),
+            float(aCluster.mBase.y + offsets[1]),
+            float(aCluster.mBase.z + offsets[2])) * aCluster.mStep;
+    }
+
+    TriangleMesh::Node DecodeBox(
+        const Cluster       &aCluster,
+        const QuantizedNode &aNode) const
+    {
+        TriangleMesh::Node box;
+        for(int axis=0; axis<3; axis++)
+        {
+            box.mBBoxMin.Get(axis) = mOrigin.Get(axis) +
+                float(aCluster.mBase.Get(axis) + aNode.mBBoxMin[axis]) * aCluster.mStep;
+            box.mBBoxMax.Get(axis) = mOrigin.Get(axis) +
+                float(aCluster.mBase.Get(axis) + aNode.mBBoxMax[axis]) * aCluster.mStep;
+        }
+        box.mOffset = aNode.mOffset;
+        box.mCount  = aNode.mCount;
+        return box;
+    }
+
+    template<bool tAnyHit>
+    bool Traverse(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mTopNodes.empty())
+            return false;
+
+        const Vec3f invDir(1.f / aRay.dir.x, 1.f / aRay.dir.y, 1.f / aRay.dir.z);
+
+        return TriangleMesh::TraverseNodes<tAnyHit>(&mTopNodes[0], (int)mTopNodes.size(), aRay, oResult,
+            [&](int aCluster, const Ray &aLeafRay, Isect &aoLeafResult)
+            {
+                return TraverseCluster<tAnyHit>(mClusters[aCluster], aLeafRay, invDir, aoLeafResult);
+            });
+    }
+
+    // TriangleMesh::TraverseNodes over the quantized nodes of a cluster
+    template<bool tAnyHit>
+    bool TraverseCluster(
+        const Cluster &aCluster,
+        const Ray     &aRay,
+        const Vec3f   &aInvDir,
+        Isect         &oResult) const
+    {
+        const QuantizedNode *nodes = &mNodes[aCluster.mFirstNode];
+
+        // a subtree of at most kClusterTriangles leaves is no deeper
+        int stack[kClusterTriangles];
+        int stackSize = 0;
+        int node = 0;
+        bool hit = false;
+        unsigned long long steps = 0;
+
+        for(;;)
+        {
+            const QuantizedNode &current = nodes[node];
+            steps++;
+
+            if(current.mCount > 0)
+            {
+                steps += current.mCount;
+                for(int i=0; i<current.mCount; i++)
+                {
+                    if(IntersectTriangle(aCluster, current.mOffset + i, aRay, oResult))
+                    {
+                        hit = true;
+                        if(tAnyHit)
+                        {
+                            g_TraversalSteps += steps;
+                            return true;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                int near = current.mOffset, far = current.mOffset + 1;
+                float distNear = TriangleMesh::IntersectBox(DecodeBox(aCluster, nodes[near]),
+                    aRay, aInvDir, oResult.dist);
+                float distFar  = TriangleMesh::IntersectBox(DecodeBox(aCluster, nodes[far]),
+                    aRay, aInvDir, oResult.dist);
+
+                if(distFar < distNear)
+                {
+                    std::swap(near, far);
+                    std::swap(distNear, distFar);
+                }
+
+                if(distNear != 1e36f)
+                {
+                    if(distFar != 1e36f)
+                        stack[stackSize++] = far;
+                    node = near;
+                    continue;
+                }
+            }
+
+            // pops the boxes the closest hit has not moved past
+            node = -1;
+            while(stackSize > 0)
+            {
+                const int candidate = stack[--stackSize];
+                if(TriangleMesh::IntersectBox(DecodeBox(aCluster, nodes[candidate]),
+                    aRay, aInvDir, oResult.dist) != 1e36f)
+                {
+                    node = candidate;
+                    break;
+                }
+            }
+
+            if(node < 0)
+                break;
+        }
+
+        g_TraversalSteps += steps;
+        return hit;
+    }
+
+    bool IntersectTriangle(
+        const Cluster &aCluster,
+        int           aTriangle,
+        const Ray     &aRay,
+        Isect         &oResult) const
+    {
+        const int triangle = aCluster.mFirstTriangle + aTriangle;
+        const unsigned char *corners = &mIndices[3 * triangle];
+
+        const Vec3f p0 = DecodeVertex(aCluster, corners[0]);
+        const Vec3f e1 = DecodeVertex(aCluster, corners[1]) - p0;
+        const Vec3f e2 = DecodeVertex(aCluster, corners[2]) - p0;
+        const int primID = aCluster.mFirstPrimID >= 0 ? mPrimIDs[aCluster.mFirstPrimID + aTriangle] : -1;
+
+        float u, v;
+        return TriangleMesh::IntersectTriangle(p0, e1, e2, mMatIDs[triangle], primID, aRay, oResult, u, v);
+    }
+
+private:
+
+    Vec3f                           mOrigin;   //!< Of the lattice, the low corner of the mesh's box
+    float                           mBaseStep;
+    int                             mTriangleCount;
+    std::vector<TriangleMesh::Node> mTopNodes; //!< Over the clusters, one per leaf
+    std::vector<Cluster>            mClusters;
+    std::vector<unsigned short>     mVertices; //!< Three offsets per vertex
+    std::vector<unsigned char>      mIndices;  //!< Three per triangle, into the vertices of its cluster
+    std::vector<unsigned short>     mMatIDs;
+    std::vector<int>                mPrimIDs;  //!< Of the triangles of the clusters with emitters
+    std::vector<QuantizedNode>      mNodes;
+};
@@ -13,6 +13,8 @@
 #include "eyelight.hxx"
 #include "pathtracer.hxx"
 #include "directillum.hxx"
+#include "vertexcm.hxx"
+#include "photonmap.hxx"
 #include "embree_util.hxx"
 
 #include <omp.h>
@@ -29,6 +31,9 @@ struct Config
         kEyeLight,
 		kDirectIllum,
         kPathTracing,
+        kBidirPathTracing,
+        kProgressivePhotonMapping,
+        kVertexCM,
 		kAlgorithmMax
     };
 
@@ -36,6 +41,7 @@ struct Config
 	{
 		kGlobalHomogenious,
 		kIsotropic,
+		kHeterogeneous,
 		kPartMedMax
 	};
 
@@ -45,10 +51,13 @@ struct Config
         {
             "eye light",
 			"direct illumination",
-            "path tracing"
+            "path tracing",
+            "bidirectional path tracing",
+            "progressive photon mapping",
+            "vertex connection and merging"
         };
 
-        if(aAlgorithm < 0 || aAlgorithm > 2) // debug
+        if(aAlgorithm < 0 || aAlgorithm >= kAlgorithmMax) // debug
             return "unknown algorithm";
 
         return algorithmNames[aAlgorithm];
@@ -58,11 +67,12 @@ struct Config
 	{
 		static const char* partMedNames[7] =
 		{
-			"global homogenious",
-			"isotropic"
+			"global homogeneous, forward scattering",
+			"global homogeneous, isotropic",
+			"heterogeneous brick grid"
 		};
 
-		if (aPartMed > 1)
+		if (aPartMed < 0 || aPartMed >= kPartMedMax)
 			return "unknown volume type";
 
 		return partMedNames[aPartMed];
@@ -70,50 +80,78 @@ struct Config
 
     static const char* GetAcronym(Algorithm aAlgorithm)
     {
-        static const char* algorithmNames[7] = { "el", "di", "pt" };
+        static const char* algorithmNames[7] = { "el", "di", "pt", "bpt", "ppm", "vcm" };
 
-        if(aAlgorithm < 0 || aAlgorithm > 2)
+        if(aAlgorithm < 0 || aAlgorithm >= kAlgorithmMax)
             return "unknown";
         return algorithmNames[aAlgorithm];
     }
 
 	static const char* GetAcronym(ParticipatingMediaType aPartMed)
 	{
-		static const char* partMedNames[7] = {  "gh", "iso" };
+		static const char* partMedNames[7] = {  "gh", "iso", "het" };
 
-		if (aPartMed < 0 || aPartMed > 1)
+		if (aPartMed < 0 || aPartMed >= kPartMedMax)
 			return "unknown";
 		return partMedNames[aPartMed];
 	}
 
     const Scene *mScene;
     Algorithm   mAlgorithm;
+    ParticipatingMediaType mPartMedType;
     int         mIterations;
     float       mMaxTime;
     Framebuffer *mFramebuffer;
+    AovBuffer   *mAovs;     //!< Layers filled while rendering, NULL when none
     int         mNumThreads;
     int         mBaseSeed;
     uint        mMaxPathLength;
     uint        mMinPathLength;
+    uint        mLightSamples;
     std::string mOutputName;
     Vec2i       mResolution;
+    bool        mRayReordering;
+    bool        mDenoise;
+    bool        mPathGuiding;
+    SDTree      *mGuiding;  //!< Learned by path tracing while rendering, NULL when off
+    uint        mAovMask;   //!< Layers written next to the image, (1 << layer) for each
+    Scene::LightSamplerType mLightSampler;
+    std::string mEnvMapFile;
+    std::string mVolumeFile;
+    std::string mSceneFile; //!< Loaded instead of the Cornell box when set
+    std::string mBakeFile;  //!< Scene cache written instead of rendering when set
+    int         mTextureCache; //!< Megabytes of texture tiles kept in memory
+    std::string mTextureDir;   //!< Directory of the tiled texture files
+    int         mGeometryMemory; //!< Megabytes of scene cache clusters kept in memory, 0 for all
+    AbstractSampler::SamplerType mSamplerType;
+    const AbstractSampler *mSampler;
+    bool        mSamplerBenchmark;
+    bool        mGuidingBenchmark;
+    bool        mCompressMeshes;
+    bool        mMeshBenchmark;
 };
 
 // Utility function, essentially a renderer factory
 AbstractRenderer* CreateRenderer(
-    const Config& aConfig,
-    const int     aSeed)
+    const Config& aConfig)
 {
     const Scene& scene = *aConfig.mScene;
+    const AbstractSampler& sampler = *aConfig.mSampler;
 
     switch(aConfig.mAlgorithm)
     {
     case Config::kEyeLight:
-        return new EyeLight(scene, aSeed);
+        return new EyeLight(scene, sampler);
 	case Config::kDirectIllum:
-		return new DirectIllum(scene, aSeed);
+		return new DirectIllum(scene, sampler);
     case Config::kPathTracing:
-        return new PathTracer(scene, aSeed);
+        return new PathTracer(scene, sampler, aConfig.mRayReordering, aConfig.mGuiding);
+    case Config::kBidirPathTracing:
+        return new VertexCM(scene, sampler, VertexCM::kBpt);
+    case Config::kProgressivePhotonMapping:
+        return new ProgressivePhotonMapping(scene, sampler);
+    case Config::kVertexCM:
+        return new VertexCM(scene, sampler, VertexCM::kVcm);
     default:
         printf("Unknown algorithm!!\n");
         exit(2);
@@ -208,13 +246,42 @@ void PrintHeading()
 void PrintHelp(const char *argv[])
 {
     printf("\n");
-    printf("Usage: %s [ -s <scene_id> >| -v <volume_type> | -a <algorithm> |\n", argv[0]);
-    printf("          | -t <time> | -i <iteration> | -o <output_name> | --report ]\n\n");
+    printf("Usage: %s [ -s <scene_id> | --input <scene_file> | -v <volume_type> | -a <algorithm> |\n", argv[0]);
+    printf("          | -t <time> | -i <iteration> | -o <output_name> | -l <light_samples> |\n");
+    printf("          | --light-sampler <power|bvh> | --env <env_map> | --volume <grid_file> |\n");
+    printf("          | --sampler <sampler> | --bake-scene <cache_file> | --texture-cache <MB> |\n");
+    printf("          | --texture-dir <dir> | --geometry-memory <MB> | --compress-meshes |\n");
+    printf("          | --mesh-benchmark | --sampler-benchmark | --reorder | --denoise |\n");
+    printf("          | --aov <layers> | --guiding | --guiding-benchmark | --report ]\n\n");
     printf("    -s  Selects the scene (default 0):\n");
 
     for(int i = 0; i < SizeOfArray(g_SceneConfigs); i++)
         printf("          %d    %s\n", i, Scene::GetSceneName(g_SceneConfigs[i]).c_str());
 
+    printf("    --input <scene_file>  Renders a scene file instead of a Cornell box scene:\n");
+    printf("               .obj  Wavefront OBJ with its MTL materials, lit by the triangles\n");
+    printf("                     with an emitted color (Ke) or else by the background\n");
+    printf("               .ply  binary little-endian PLY, gray and lit by the background\n");
+    printf("               .pg3s scene cache written by --bake-scene, traced in place or\n");
+    printf("                     paged in (--geometry-memory)\n");
+    printf("               .scene text scene description with the camera, materials,\n");
+    printf("                     shapes, meshes, lights, medium and render settings, the\n");
+    printf("                     settings are the defaults of the options given here\n");
+    printf("    --bake-scene <cache_file>  Writes the --input scene to a .pg3s cache,\n");
+    printf("               including its BVH cut into clusters, instead of rendering it\n");
+    printf("    --geometry-memory <MB>  Pages the clusters of a .pg3s cache in on demand,\n");
+    printf("               keeping at most this much of them in memory, the clusters\n");
+    printf("               rays trace included (default 0, the whole cache is traced\n");
+    printf("               in place). Raised to the largest cluster when below it\n");
+    printf("    --compress-meshes  Traces the .obj and .ply meshes of the --input scene\n");
+    printf("               quantized to 16 bit vertices in clusters, freeing the full ones\n");
+    printf("    --mesh-benchmark  Traces camera and bounce rays against the --input mesh\n");
+    printf("               and its compressed copy, prints their memory, speed and error\n");
+    printf("    --texture-cache <MB>  Memory kept for texture tiles, the tiles of the\n");
+    printf("               --input scene's .bmp and .hdr maps are read on demand (default 1024)\n");
+    printf("    --texture-dir <dir>  Directory the maps are converted to tiled files in,\n");
+    printf("               a map whose file cannot be written is kept in memory\n");
+    printf("               (default pg3t_cache)\n");
     printf("    -a  Selects the rendering algorithm (default pt):\n");
 
     for(int i = 0; i < (int)Config::kAlgorithmMax; i++)
@@ -222,7 +289,8 @@ void PrintHelp(const char *argv[])
             Config::GetAcronym(Config::Algorithm(i)),
             Config::GetName(Config::Algorithm(i)));
 
-	printf("    -v  Optinally selects participating media type (default none)\n");
+	printf("    -v  Optionally fills the scene with a participating medium, rendered by\n");
+	printf("        pt only (default none):\n");
 
 	for (int i = 0; i < (int)Config::kPartMedMax; i++)
 		printf("          %-3s  %s\n",
@@ -232,16 +300,108 @@ void PrintHelp(const char *argv[])
     printf("    -e  Flag for enabling embree support (can be omitted if embree support is not desired)\n");
     printf("    -t  Number of seconds to run the algorithm\n");
     printf("    -i  Number of iterations to run the algorithm (default 1)\n");
+    printf("    -l  Number of lights sampled per shading point (default 1)\n");
+    printf("    --light-sampler <power|bvh>  How the sampled lights are picked: by power\n");
+    printf("               only, or by their importance for the shading point (default bvh)\n");
+    printf("    --env <env_map>  Lat-long Radiance .hdr image used as the background of\n");
+    printf("               the env. light and unlit --input scenes, importance sampled by luminance\n");
+    printf("    --volume <grid_file>  Raw density grid of the het medium (magic PG3V,\n");
+    printf("               int32 x y z resolution, float32 densities with x fastest),\n");
+    printf("               stretched over the scene's bounding box (default procedural cloud)\n");
     printf("    -o  User specified output name, with extension .bmp or .hdr (default .bmp)\n");
+    printf("    --sampler <random|sobol|halton|bluenoise>  Generator of the sample\n");
+    printf("               dimensions used by all algorithms (default random)\n");
+    printf("    --sampler-benchmark  Renders -i iterations with every sampler and prints\n");
+    printf("               their error against a high sample count reference, then\n");
+    printf("               their error in the time the random sampler took\n");
+    printf("    --reorder  Path tracing traces the paths as a stream, binning bounce rays\n");
+    printf("               by direction and origin before each bounce\n");
+    printf("    --guiding  Path tracing learns the incident light in an SD-tree over\n");
+    printf("               passes of doubling length and samples bounces from it\n");
+    printf("    --guiding-benchmark  Renders -i iterations of pt with and without path\n");
+    printf("               guiding and prints their time to reach the same error\n");
+    printf("    --denoise  Filters the image before saving, guided by the albedo, normal\n");
+    printf("               and depth of the first camera ray hits\n");
+    printf("    --aov <layers>  Comma separated AOV layers, or all, saved with the radiance\n");
+    printf("               to an OpenEXR file next to the output image:\n");
+    printf("              ");
+    for(int i = 0; i < (int)AovBuffer::kAovCount; i++)
+        printf(" %s", AovBuffer::GetLayerName(AovBuffer::Layer(i)));
+    printf("\n");
     printf("\n    Note: Time (-t) takes precedence over iterations (-i) if both are defined\n");
 }
 
+// Takes the render settings of a scene description as the config defaults
+bool ApplySceneSettings(
+    const SceneDescription &aDescription,
+    Config                 &oConfig)
+{
+    const SceneDescription::RenderSettings &settings = aDescription.mSettings;
+    const char *filename = aDescription.mFilename.c_str();
+
+    if(settings.mResolution.x > 0)
+        oConfig.mResolution = settings.mResolution;
+    if(settings.mIterations > 0)
+        oConfig.mIterations = settings.mIterations;
+    if(settings.mMaxTime > 0.f)
+    {
+        oConfig.mMaxTime    = settings.mMaxTime;
+        oConfig.mIterations = -1; // time has precedence
+    }
+    if(settings.mLightSamples > 0)
+        oConfig.mLightSamples = uint(settings.mLightSamples);
+    if(settings.mMaxPathLength > 0)
+        oConfig.mMaxPathLength = uint(settings.mMaxPathLength);
+    if(!settings.mOutputName.empty())
+        oConfig.mOutputName = settings.mOutputName;
+
+    if(!settings.mAlgorithm.empty())
+    {
+        for(int i=0; i<Config::kAlgorithmMax; i++)
+            if(settings.mAlgorithm == Config::GetAcronym(Config::Algorithm(i)))
+                oConfig.mAlgorithm = Config::Algorithm(i);
+
+        if(oConfig.mAlgorithm == Config::kAlgorithmMax)
+        {
+            printf("%s: Invalid algorithm %s\n", filename, settings.mAlgorithm.c_str());
+            return false;
+        }
+    }
+
+    if(!settings.mSampler.empty())
+    {
+        oConfig.mSamplerType = AbstractSampler::kSamplerTypeMax;
+        for(int i=0; i<AbstractSampler::kSamplerTypeMax; i++)
+            if(settings.mSampler == AbstractSampler::GetName(AbstractSampler::SamplerType(i)))
+                oConfig.mSamplerType = AbstractSampler::SamplerType(i);
+
+        if(oConfig.mSamplerType == AbstractSampler::kSamplerTypeMax)
+        {
+            printf("%s: Invalid sampler %s\n", filename, settings.mSampler.c_str());
+            return false;
+        }
+    }
+
+    if(settings.mLightSampler == "power")
+        oConfig.mLightSampler = Scene::kLightSamplerPower;
+    else if(settings.mLightSampler == "bvh")
+        oConfig.mLightSampler = Scene::kLightSamplerBVH;
+    else if(!settings.mLightSampler.empty())
+    {
+        printf("%s: Invalid light sampler %s\n", filename, settings.mLightSampler.c_str());
+        return false;
+    }
+
+    return true;
+}
+
 // Parses command line, setting up config
 void ParseCommandline(int argc, const char *argv[], Config &oConfig)
 {
     // Parameters marked with [cmd] can be change from command line
     oConfig.mScene         = NULL;                  // [cmd] When NULL, renderer will not run
     oConfig.mAlgorithm     = Config::kAlgorithmMax; // [cmd]
+    oConfig.mPartMedType   = Config::kPartMedMax;   // [cmd] none
     oConfig.mIterations    = 1;                     // [cmd]
     oConfig.mMaxTime       = -1.f;                  // [cmd]
     oConfig.mOutputName    = "";                    // [cmd]
@@ -249,11 +409,44 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
     oConfig.mBaseSeed      = 1234;
     oConfig.mMaxPathLength = 10;
     oConfig.mMinPathLength = 0;
+    oConfig.mLightSamples  = 1;                     // [cmd]
+    oConfig.mLightSampler  = Scene::kLightSamplerBVH; // [cmd]
+    oConfig.mRayReordering = false;                 // [cmd]
+    oConfig.mDenoise       = false;                 // [cmd]
+    oConfig.mPathGuiding   = false;                 // [cmd]
+    oConfig.mGuiding       = NULL;
+    oConfig.mAovMask       = 0;                     // [cmd]
+    oConfig.mAovs          = NULL;
+    oConfig.mEnvMapFile    = "";                    // [cmd]
+    oConfig.mVolumeFile    = "";                    // [cmd]
+    oConfig.mSceneFile     = "";                    // [cmd]
+    oConfig.mBakeFile      = "";                    // [cmd]
+    oConfig.mTextureCache  = 1024;                  // [cmd]
+    oConfig.mTextureDir    = "pg3t_cache";          // [cmd]
+    oConfig.mGeometryMemory = 0;                    // [cmd]
+    oConfig.mSamplerType   = AbstractSampler::kRandom; // [cmd]
+    oConfig.mSampler       = NULL;
+    oConfig.mSamplerBenchmark = false;              // [cmd]
+    oConfig.mGuidingBenchmark = false;              // [cmd]
+    oConfig.mCompressMeshes = false;                // [cmd]
+    oConfig.mMeshBenchmark = false;                 // [cmd]
 	oConfig.mResolution = /* Vec2i(300, 300); // */ Vec2i(512, 512);
     //oConfig.mFramebuffer   = NULL; // this is never set by any parameter
 
     int sceneID    = 0; // default 0
 
+    // A scene description is parsed first, its render settings are
+    // overridden by the arguments
+    SceneDescription description;
+    for(int i=1; i+1<argc; i++)
+    {
+        if(std::string(argv[i]) == "--input" && SceneDescription::IsDescriptionFile(argv[i+1]))
+        {
+            if(!description.Load(argv[i+1]) || !ApplySceneSettings(description, oConfig))
+                return;
+        }
+    }
+
     // Load arguments
     for(int i=1; i<argc; i++)
     {
@@ -287,6 +480,75 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
                 return;
             }
         }
+        else if(arg == "--reorder") // bin bounce rays before tracing
+        {
+            oConfig.mRayReordering = true;
+        }
+        else if(arg == "--guiding") // learn where the light comes from
+        {
+            oConfig.mPathGuiding = true;
+        }
+        else if(arg == "--guiding-benchmark") // compare pt with and without guiding
+        {
+            oConfig.mGuidingBenchmark = true;
+        }
+        else if(arg == "--denoise") // filter the image before saving
+        {
+            oConfig.mDenoise = true;
+        }
+        else if(arg == "--aov") // output variables written next to the image
+        {
+            if(++i == argc)
+            {
+                printf("Missing <layers> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream layers(argv[i]);
+            std::string layer;
+            while(std::getline(layers, layer, ','))
+            {
+                bool found = false;
+                for(int i=0; i<AovBuffer::kAovCount; i++)
+                {
+                    if(layer == "all" || layer == AovBuffer::GetLayerName(AovBuffer::Layer(i)))
+                    {
+                        oConfig.mAovMask |= 1u << i;
+                        found = true;
+                    }
+                }
+
+                if(!found)
+                {
+                    printf("Invalid <layers> argument, please see help (-h)\n");
+                    return;
+                }
+            }
+        }
+        else if(arg == "--sampler") // sample generator
+        {
+            if(++i == argc)
+            {
+                printf("Missing <sampler> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::string sampler(argv[i]);
+            oConfig.mSamplerType = AbstractSampler::kSamplerTypeMax;
+            for(int i=0; i<AbstractSampler::kSamplerTypeMax; i++)
+                if(sampler == AbstractSampler::GetName(AbstractSampler::SamplerType(i)))
+                    oConfig.mSamplerType = AbstractSampler::SamplerType(i);
+
+            if(oConfig.mSamplerType == AbstractSampler::kSamplerTypeMax)
+            {
+                printf("Invalid <sampler> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--sampler-benchmark") // compare the samplers
+        {
+            oConfig.mSamplerBenchmark = true;
+        }
         else if(arg == "-a") // algorithm to use
         {
             if(++i == argc)
@@ -306,6 +568,25 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
                 return;
             }
         }
+        else if(arg == "-v") // participating medium
+        {
+            if(++i == argc)
+            {
+                printf("Missing <volume_type> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::string med(argv[i]);
+            for(int i=0; i<Config::kPartMedMax; i++)
+                if(med == Config::GetAcronym(Config::ParticipatingMediaType(i)))
+                    oConfig.mPartMedType = Config::ParticipatingMediaType(i);
+
+            if(oConfig.mPartMedType == Config::kPartMedMax)
+            {
+                printf("Invalid <volume_type> argument, please see help (-h)\n");
+                return;
+            }
+        }
         else if(arg == "-i") // number of iterations to run
         {
             if(++i == argc)
@@ -323,6 +604,137 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
                 return;
             }
         }
+        else if(arg == "-l") // number of light samples per shading point
+        {
+            if(++i == argc)
+            {
+                printf("Missing <light_samples> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            int lightSamples;
+            iss >> lightSamples;
+
+            if(iss.fail() || lightSamples < 1)
+            {
+                printf("Invalid <light_samples> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mLightSamples = uint(lightSamples);
+        }
+        else if(arg == "--light-sampler") // how the sampled lights are picked
+        {
+            if(++i == argc)
+            {
+                printf("Missing <light_sampler> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::string sampler(argv[i]);
+            if(sampler == "power")
+                oConfig.mLightSampler = Scene::kLightSamplerPower;
+            else if(sampler == "bvh")
+                oConfig.mLightSampler = Scene::kLightSamplerBVH;
+            else
+            {
+                printf("Invalid <light_sampler> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--volume") // density grid of the heterogeneous medium
+        {
+            if(++i == argc)
+            {
+                printf("Missing <grid_file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mVolumeFile = argv[i];
+        }
+        else if(arg == "--input") // scene file rendered instead of the Cornell box
+        {
+            if(++i == argc)
+            {
+                printf("Missing <scene_file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mSceneFile = argv[i];
+        }
+        else if(arg == "--bake-scene") // scene cache to write
+        {
+            if(++i == argc)
+            {
+                printf("Missing <cache_file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mBakeFile = argv[i];
+        }
+        else if(arg == "--texture-cache") // memory of the texture tiles
+        {
+            if(++i == argc)
+            {
+                printf("Missing <MB> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mTextureCache;
+
+            if(iss.fail() || oConfig.mTextureCache < 1)
+            {
+                printf("Invalid <MB> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--texture-dir") // directory of the tiled textures
+        {
+            if(++i == argc)
+            {
+                printf("Missing <dir> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mTextureDir = argv[i];
+        }
+        else if(arg == "--geometry-memory") // memory of the scene cache clusters
+        {
+            if(++i == argc)
+            {
+                printf("Missing <MB> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mGeometryMemory;
+
+            if(iss.fail() || oConfig.mGeometryMemory < 0)
+            {
+                printf("Invalid <MB> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--compress-meshes") // quantize the loaded meshes
+        {
+            oConfig.mCompressMeshes = true;
+        }
+        else if(arg == "--mesh-benchmark") // compare full and compressed meshes
+        {
+            oConfig.mMeshBenchmark = true;
+        }
+        else if(arg == "--env") // environment map of the env. light scenes
+        {
+            if(++i == argc)
+            {
+                printf("Missing <env_map> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mEnvMapFile = argv[i];
+        }
         else if(arg == "-t") // number of seconds to run
         {
             if(++i == argc)
@@ -368,9 +780,67 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
 
     // Load scene
     Scene *scene = new Scene;
-    scene->LoadCornellBox(oConfig.mResolution, g_SceneConfigs[sceneID]);
+    scene->mLightSamplerType = oConfig.mLightSampler;
+    scene->mEnvMapFile = oConfig.mEnvMapFile;
+    scene->mTextures.SetMemoryLimit(size_t(oConfig.mTextureCache) << 20);
+    scene->mTextures.SetCacheDirectory(oConfig.mTextureDir);
+    scene->mGeometryMemory = size_t(oConfig.mGeometryMemory) << 20;
+    scene->mCompressMeshes = oConfig.mCompressMeshes && !oConfig.mMeshBenchmark;
+
+    bool loaded = true;
+    if(oConfig.mSceneFile.empty())
+        scene->LoadCornellBox(oConfig.mResolution, g_SceneConfigs[sceneID]);
+    else if(SceneDescription::IsDescriptionFile(oConfig.mSceneFile))
+        loaded = scene->LoadDescription(description, oConfig.mResolution);
+    else
+        loaded = scene->LoadFile(oConfig.mSceneFile.c_str(), oConfig.mResolution);
+
+    if(!loaded)
+    {
+        printf("Could not load %s\n", oConfig.mSceneFile.c_str());
+        delete scene;
+        return;
+    }
+
+    // Fills the scene's bounding sphere with a thin gray fog,
+    // or its bounding box with smoke given by a density grid
+    if(oConfig.mPartMedType == Config::kHeterogeneous)
+    {
+        scene->SetMedium(scene->CreateGridMedium(PhaseFunction(0.3f), Vec3f(0.9f), 10.f,
+            oConfig.mVolumeFile));
+    }
+    else if(oConfig.mPartMedType != Config::kPartMedMax)
+    {
+        const PhaseFunction phase(
+            oConfig.mPartMedType == Config::kGlobalHomogenious ? 0.5f : 0.f);
+
+        scene->SetMedium(new HomogeneousMedium(Vec3f(0.05f), Vec3f(0.5f), phase,
+            scene->mSceneSphere.mSceneCenter, scene->mSceneSphere.mSceneRadius));
+    }
+    else if(scene->GetMedium())
+    {
+        // the medium of a scene description
+        const SceneDescription::MediumDesc &medium = description.mMedium;
+
+        if(medium.mType == SceneDescription::MediumDesc::kHeterogeneous)
+            oConfig.mPartMedType = Config::kHeterogeneous;
+        else
+            oConfig.mPartMedType = medium.mAnisotropy == 0.f ? Config::kIsotropic : Config::kGlobalHomogenious;
+    }
+
+    if(oConfig.mPartMedType != Config::kPartMedMax &&
+        oConfig.mAlgorithm != Config::kPathTracing)
+    {
+        printf("Warning: only pt renders the participating medium\n");
+    }
+
+    if(oConfig.mPathGuiding && oConfig.mAlgorithm != Config::kPathTracing)
+    {
+        printf("Warning: only pt uses path guiding\n");
+    }
 
     oConfig.mScene = scene;
+    oConfig.mSampler = AbstractSampler::Create(oConfig.mSamplerType, uint(oConfig.mBaseSeed));
 
     // If no output name is chosen, create a default one
     if(oConfig.mOutputName.length() == 0)
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+#include "math.hxx"
+#include "framebuffer.hxx"
+#include "aov.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010)
+//
+// The radiance is divided by the albedo first, so the filter smooths the
+// lighting but keeps the texture and material edges, and it is multiplied
+// back at the end. Each pass applies a 5x5 B3 spline kernel with holes of
+// 2^pass pixels, the taps weighted by how similar their color, normal,
+// albedo and depth are to the filtered pixel. The color tolerance halves
+// with every pass, as the noise gets filtered out. The rows of a pass are
+// filtered in parallel.
+
+class Denoiser
+{
+public:
+
+    // AOV layers the filter is guided by
+    static const uint kRequiredAovs = (1u << AovBuffer::kAovAlbedo) |
+        (1u << AovBuffer::kAovNormal) | (1u << AovBuffer::kAovDepth);
+
+    Denoiser(
+        int   aPasses      = 5,
+        float aSigmaColor  = 1.f,
+        float aSigmaNormal = 0.3f,
+        float aSigmaAlbedo = 0.1f,
+        float aSigmaDepth  = 0.05f) :
+        mPasses(aPasses),
+        mSigmaColor(aSigmaColor),
+        mSigmaNormal(aSigmaNormal),
+        mSigmaAlbedo(aSigmaAlbedo),
+        mSigmaDepth(aSigmaDepth)
+    {}
+
+    void Apply(
+        const AovBuffer &aAovs,
+        Framebuffer     &aoImage) const
+    {
+        const int resX = aoImage.GetResX();
+        const int resY = aoImage.GetResY();
+        const int pixelCount = resX * resY;
+
+        std::vector<Vec3f> albedo(pixelCount), normal(pixelCount), color(pixelCount);
+        std::vector<Vec3f> modulation(pixelCount), filtered(pixelCount);
+        std::vector<float> depth(pixelCount);
+
+        for(int y=0; y<resY; y++)
+        {
+            for(int x=0; x<resX; x++)
+            {
+                const int idx = x + y * resX;
+
+                albedo[idx] = aAovs.Get(AovBuffer::kAovAlbedo, x, y);
+                normal[idx] = aAovs.Get(AovBuffer::kAovNormal, x, y);
+                depth[idx]  = aAovs.Get(AovBuffer::kAovDepth, x, y).x;
+
+                // black channels keep their radiance
+                for(int c=0; c<3; c++)
+                    modulation[idx].Get(c) = albedo[idx].Get(c) > 1e-3f ? albedo[idx].Get(c) : 1.f;
+
+                color[idx] = aoImage.GetColor(x, y) / modulation[idx];
+            }
+        }
+
+        static const float kernel[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+        float sigmaColor = mSigmaColor;
+        for(int pass=0; pass<mPasses; pass++)
+        {
+            const int step = 1 << pass;
+
+#pragma omp parallel for
+            for(int y=0; y<resY; y++)
+            {
+                for(int x=0; x<resX; x++)
+                {
+                    const int idx = x + y * resX;
+                    const Vec3f &colorP  = color[idx];
+                    const Vec3f &normalP = normal[idx];
+                    const Vec3f &albedoP = albedo[idx];
+                    const float depthP   = depth[idx];
+
+                    // noise is relative to the brightness in HDR images
+                    const float invColor  = 1.f / Sqr(sigmaColor * (Luminance(colorP) + 0.05f));
+                    const float invNormal = 1.f / Sqr(mSigmaNormal);
+                    const float invAlbedo = 1.f / Sqr(mSigmaAlbedo);
+                    const float invDepth  = 1.f / (mSigmaDepth * step * std::max(depthP, 1e-3f));
+
+                    Vec3f sum(0);
+                    float weightSum = 0;
+
+                    for(int dy=-2; dy<=2; dy++)
+                    {
+                        const int qy = y + dy * step;
+                        if(qy < 0 || qy >= resY)
+                            continue;
+
+                        for(int dx=-2; dx<=2; dx++)
+                        {
+                            const int qx = x + dx * step;
+                            if(qx < 0 || qx >= resX)
+                                continue;
+
+                            const int q = qx + qy * resX;
+
+                            const float distance =
+                                (color[q] - colorP).LenSqr() * invColor +
+                                (normal[q] - normalP).LenSqr() * invNormal +
+                                (albedo[q] - albedoP).LenSqr() * invAlbedo +
+                                std::abs(depth[q] - depthP) * invDepth;
+
+                            const float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] *
+                                std::exp(-distance);
+
+                            sum += color[q] * weight;
+                            weightSum += weight;
+                        }
+                    }
+
+                    filtered[idx] = sum / weightSum;
+                }
+            }
+
+            color.swap(filtered);
+            sigmaColor *= 0.5f;
+        }
+
+        for(int y=0; y<resY; y++)
+        {
+            for(int x=0; x<resX; x++)
+            {
+                const int idx = x + y * resX;
+                aoImage.SetColor(x, y, color[idx] * modulation[idx]);
+            }
+        }
+    }
+
+private:
+
+    int   mPasses;
+    float mSigmaColor;  //!< Color tolerance of the first pass, relative to the luminance
+    float mSigmaNormal;
+    float mSigmaAlbedo;
+    float mSigmaDepth;  //!< Depth tolerance per pixel of the kernel step, relative to the depth
+};
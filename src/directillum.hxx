@@ -2,8 +2,7 @@
 #include <cmath>
 #include <omp.h>
 #include <cassert>
-#include "renderer.hxx"
-#include "rng.hxx"
+#include "renderer.hxx"
 
 // Algorithm for computing direct illumination via multiple-importance-sampling
 // (Basically ASSIGNMENT 3)
@@ -12,10 +11,10 @@ class DirectIllum : public AbstractRenderer
 public:
 
 	DirectIllum(
-		const Scene& aScene,
-		int aSeed = 1234
-	) :
-		AbstractRenderer(aScene), mRng(aSeed)
+		const Scene& aScene,
+		const AbstractSampler& aSampler
+	) :
+		AbstractRenderer(aScene, aSampler)
 	{
 	}
 
@@ -31,13 +30,19 @@ public:
 			const int x = pixID % resX;
 			const int y = pixID / resX;
 
-			const Vec2f sample = Vec2f(float(x), float(y)) + mRng.GetVec2f();
+			SamplerState sampler;
+			mSampler.StartPixelSample(x, y, uint(aIteration), sampler);
+
+			const Vec2f sample = Vec2f(float(x), float(y)) + mSampler.Get2D(sampler);
 
 			Ray   ray = mScene.mCamera.GenerateRay(sample);
 			Isect isect;
 			isect.dist = 1e36f;
 
-			if (mScene.Intersect(ray, isect))
+			const bool hit = mScene.Intersect(ray, isect);
+			AddFirstHit(sample, ray, isect, hit);
+
+			if (hit)
 			{
 				const Vec3f surfPt = ray.org + ray.dir * isect.dist;
 				Frame frame;
@@ -46,19 +51,18 @@ public:
 				const Vec3f wol = frame.ToLocal(-ray.dir);
 
 				Vec3f LoDirect = Vec3f(0);
-				const Material& mat = mScene.GetMaterial(isect.matID);
-
-				// if light source is intersected, add the light to the final image
-				if (isect.lightID >= 0)
-				{
-					const AbstractLight *abstLight = mScene.GetLightPtr(isect.lightID);
-					const AreaLight *areaLight = dynamic_cast<const AreaLight*>(abstLight);
-
-					if (areaLight != 0)
-					{
-						mFramebuffer.AddColor(sample, areaLight->mRadiance);
-						continue;
-					}
+				const Material mat = mScene.GetMaterial(isect.matID, isect.uv);
+				const LightStorage& lights = mScene.GetLightStorage();
+
+				// if light source is intersected, add the light to the final image
+				if (isect.lightID >= 0)
+				{
+					if (lights.IsArea(isect.lightID))
+					{
+						const Vec3f radiance = lights.GetEmittedRadiance(isect.lightID, isect.primID, ray.dir);
+						AddSample(sample, radiance, radiance);
+						continue;
+					}
 				}
 
 				// initialize variables for the prob of light sampling or brdf sampling
@@ -71,30 +75,33 @@ public:
 				//			Area Light Sampling				//
 				//////////////////////////////////////////////
 
-				// ASSIGNMENT 1
-				for (int i = 0; i < mScene.GetLightCount(); i++)
-				{
-					const AbstractLight* light = mScene.GetLightPtr(i);
-					assert(light != 0);
-
-					Vec3f wig;
-					float lightDist;
-					Vec3f illum = light->sampleIllumination(mRng.GetVec3f(), surfPt, frame, wig, lightDist); // debug
-
-					// if the scene is a "point light scene", always do
-					// light sampling
-					// set the probabilities accordingly
-					const PointLight* ptLight = dynamic_cast<const PointLight*>(light);
-					if (ptLight != nullptr)
-					{
-						lightSamplingPdfLight = 1;
-						lightSamplingPdfBrdf = 0;
-					}
-					else
-					{
-						lightSamplingPdfLight = light->getPDF(lightDist, wig);
-						lightSamplingPdfBrdf = mat.evalBrdfPdf(wog, wig, frame.Normal());
-					}
+				// ASSIGNMENT 1
+				// take mLightSamples lights picked by the scene's light sampler
+				// instead of sampling every light in the scene
+				PickLights(surfPt, frame.Normal(), sampler);
+				lights.SampleIllumination(surfPt, frame, mLightBatch);
+
+				for (int s = 0; s < mLightBatch.mCount; s++)
+				{
+					const int lightID = mLightBatch.mLightIdx[s];
+					const float lightPickPdf = mLightBatch.mPickPdf[s];
+					const Vec3f& illum = mLightBatch.mIllum[s];
+					const Vec3f& wig = mLightBatch.mWig[s];
+					const float lightDist = mLightBatch.mLightDist[s];
+
+					// if the scene is a "point light scene", always do
+					// light sampling
+					// set the probabilities accordingly
+					if (lights.IsDelta(lightID))
+					{
+						lightSamplingPdfLight = 1;
+						lightSamplingPdfBrdf = 0;
+					}
+					else
+					{
+						lightSamplingPdfLight = lightPickPdf * mLightBatch.mPdf[s];
+						lightSamplingPdfBrdf = mat.evalBrdfPdf(wog, wig, frame.Normal());
+					}
 
 					// get the weights
 					float weightLightSampling = getBalanceHeuristic(lightSamplingPdfLight, lightSamplingPdfBrdf);
@@ -102,7 +109,7 @@ public:
 					if (illum.Max() > 0)
 					{
 						if (!mScene.Occluded(surfPt, wig, lightDist))
-							LoDirect += (illum * mat.evalBrdf(frame.ToLocal(wig), wol) * weightLightSampling); // multiply expression by weight 
+							LoDirect += (illum * mat.evalBrdf(frame.ToLocal(wig), wol) * weightLightSampling) / lightPickPdf; // multiply expression by weight 
 					}
 				}
 
@@ -125,7 +132,7 @@ public:
 				float pd;
 
 				// generate new direction
-				createSecondRay(mat, genDir, secondRay, secondRayIsect, frame, wog, surfPt, normal, pd, ps);
+				createSecondRay(mat, genDir, secondRay, secondRayIsect, frame, wog, surfPt, normal, pd, ps, sampler);
 
 				// evaluate Pdf
 				float pdf = pd * mat.getPDFDiffuseValue(genDir, normal)
@@ -138,11 +145,13 @@ public:
 					// impossible to hit a point that is infinitely small
 					if (secondRayIsect.lightID >= 0)
 					{
-						// set up light source
-						const AbstractLight *abstLight = mScene.GetLightPtr(secondRayIsect.lightID);
-
-						// set probabilities
-						brdfSamplingPdfLight = abstLight->getPDF(secondRayIsect.dist, genDir);
+						// set up light source
+						const int lightID = secondRayIsect.lightID;
+
+						// set probabilities
+						brdfSamplingPdfLight = mLightSamples
+							* mScene.LightSelectionPdf(surfPt, frame.Normal(), lightID, secondRayIsect.primID)
+							* lights.GetPDF(lightID, secondRayIsect.primID, secondRayIsect.dist, genDir);
 						brdfSamplingPdfBrdf = mat.evalBrdfPdf(wog, genDir, normal);
 
 						// calculate weight
@@ -151,7 +160,7 @@ public:
 						float cosTheta = Dot(normal, genDir);
 						if (cosTheta >= 0)
 						{
-							LoDirect += (abstLight->getRadiance() * mat.evalBrdf(frame.ToLocal(genDir), wol) * cosTheta * weightBRDFSampling) / pdf;
+							LoDirect += (lights.GetEmittedRadiance(lightID, secondRayIsect.primID, genDir) * mat.evalBrdf(frame.ToLocal(genDir), wol) * cosTheta * weightBRDFSampling) / pdf;
 						}
 					}
 				}
@@ -159,21 +168,31 @@ public:
 				// ask the background light to give the radiance
 				else if (mScene.GetBackground())
 				{
-					Vec3f radiance = mScene.GetBackground()->mBackgroundColor;
-					float cosTheta = Dot(normal, genDir);
-					LoDirect += (radiance * mat.evalBrdf(frame.ToLocal(genDir), wol) * cosTheta) / pdf;
+					Vec3f radiance = mScene.GetBackground()->GetRadiance(genDir);
+
+					// set probabilities
+					brdfSamplingPdfLight = mLightSamples
+						* mScene.LightSelectionPdf(surfPt, frame.Normal(), mScene.GetBackgroundID(), 0)
+						* mScene.GetBackground()->GetPDF(genDir);
+					brdfSamplingPdfBrdf = mat.evalBrdfPdf(wog, genDir, normal);
+
+					// calculate weight
+					float weightBRDFSampling = getBalanceHeuristic(brdfSamplingPdfBrdf, brdfSamplingPdfLight);
+
+					float cosTheta = Dot(normal, genDir);
+					LoDirect += (radiance * mat.evalBrdf(frame.ToLocal(genDir), wol) * cosTheta * weightBRDFSampling) / pdf;
 				}
 
 				//////////////////////////////////////////////
 				//				BRDF Sampling end			//
 				//////////////////////////////////////////////
 
-				mFramebuffer.AddColor(sample, LoDirect); // finally add the information to the image
+				AddSample(sample, LoDirect, LoDirect); // finally add the information to the image
 
 				/*
 				float dotLN = Dot(isect.normal, -ray.dir);
 				// this illustrates how to pick-up the material properties of the intersected surface
-				const Material& mat = mScene.GetMaterial( isect.matID );
+				const Material mat = mScene.GetMaterial(isect.matID, isect.uv);
 				const Vec3f& rhoD = mat.mDiffuseReflectance;
 				// this illustrates how to pick-up the area source associated with the intersected surface
 				const AbstractLight *light = isect.lightID < 0 ?  0 : mScene.GetLightPtr( isect.lightID );
@@ -197,8 +216,9 @@ public:
 		Vec3f wog,
 		Vec3f surfPt,
 		Vec3f &normal,
-		float &pd,
-		float &ps)
+		float &pd,
+		float &ps,
+		SamplerState &aoSampler)
 	{
 		// generate new direction
 		pd = mat.getMaxElementInVector(mat.mDiffuseReflectance);
@@ -207,10 +227,11 @@ public:
 		pd /= sumPdPs;	 // prob of choosing the diffuse component
 		ps /= sumPdPs;	 // prob of choosing the specular comp.
 
-		float r1 = mRng.GetFloat();
-		float r2 = mRng.GetFloat();
-
-		if (mRng.GetFloat() <= pd)
+		const Vec2f rnd = mSampler.Get2D(aoSampler);
+		float r1 = rnd.x;
+		float r2 = rnd.y;
+
+		if (mSampler.Get1D(aoSampler) <= pd)
 		{
 			genDir = frame.ToWorld(mat.sampleDiffuse(r1, r2));
 		}
@@ -227,11 +248,9 @@ public:
 		secondRayIsect.dist = 1e36f; // distance from starting point to intersection 
 	}
 
-	// get balance heuristic
-	float getBalanceHeuristic(float fPdf, float gPdf)
-	{
-		return (fPdf) / (fPdf + gPdf);
-	}
-
-	Rng              mRng;
+	// get balance heuristic
+	float getBalanceHeuristic(float fPdf, float gPdf)
+	{
+		return (fPdf) / (fPdf + gPdf);
+	}
 };
\ No newline at end of file
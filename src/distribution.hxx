@@ -0,0 +1,149 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Piecewise-constant 1D distribution
+//
+// Samples a continuous value in [0, 1) proportionally to a step function
+// with mFunc.size() equally sized steps, by inverting its CDF.
+
+class Distribution1D
+{
+public:
+
+    Distribution1D() :
+        mFuncInt(0)
+    {}
+
+    void Build(
+        const float *aFunc,
+        int         aCount)
+    {
+        mFunc.assign(aFunc, aFunc + aCount);
+        mCdf.resize(aCount + 1);
+
+        mCdf[0] = 0;
+        for(int i=0; i<aCount; i++)
+            mCdf[i+1] = mCdf[i] + std::max(0.f, mFunc[i]) / aCount;
+
+        mFuncInt = mCdf[aCount];
+
+        // Degenerate functions fall back to the uniform distribution
+        for(int i=1; i<=aCount; i++)
+            mCdf[i] = mFuncInt > 0 ? mCdf[i] / mFuncInt : float(i) / aCount;
+    }
+
+    // Returns the sampled value in [0, 1), its pdf and the index of its step
+    float SampleContinuous(
+        float aRnd,
+        float &oPdf,
+        int   &oOffset) const
+    {
+        const int count = Count();
+
+        // last CDF entry that is <= aRnd
+        oOffset = int(std::upper_bound(mCdf.begin(), mCdf.end(), aRnd) - mCdf.begin()) - 1;
+        oOffset = std::max(0, std::min(count - 1, oOffset));
+
+        float du = aRnd - mCdf[oOffset];
+        const float stepCdf = mCdf[oOffset + 1] - mCdf[oOffset];
+        if(stepCdf > 0)
+            du /= stepCdf;
+
+        oPdf = Pdf(oOffset);
+        return std::min((oOffset + du) / count, 1.f - 1e-7f);
+    }
+
+    // Pdf of the values in the given step
+    float Pdf(int aOffset) const
+    {
+        return mFuncInt > 0 ? std::max(0.f, mFunc[aOffset]) / mFuncInt : 1.f;
+    }
+
+    int Count() const
+    {
+        return (int)mFunc.size();
+    }
+
+    // Integral of the function over [0, 1]
+    float Integral() const
+    {
+        return mFuncInt;
+    }
+
+private:
+
+    std::vector<float> mFunc;
+    std::vector<float> mCdf;
+    float              mFuncInt;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Piecewise-constant 2D distribution
+//
+// Samples (u, v) in [0, 1)^2 proportionally to a function given on a
+// regular grid: v is picked from the marginal distribution of the rows,
+// u from the conditional distribution of the picked row.
+
+class Distribution2D
+{
+public:
+
+    // aFunc holds aCountV rows of aCountU values
+    void Build(
+        const std::vector<float> &aFunc,
+        int                      aCountU,
+        int                      aCountV)
+    {
+        mConditional.resize(aCountV);
+
+        std::vector<float> marginal(aCountV);
+        for(int v=0; v<aCountV; v++)
+        {
+            mConditional[v].Build(&aFunc[v * aCountU], aCountU);
+            marginal[v] = mConditional[v].Integral();
+        }
+
+        mMarginal.Build(&marginal[0], aCountV);
+    }
+
+    Vec2f SampleContinuous(
+        const Vec2f &aRnd,
+        float       &oPdf) const
+    {
+        float pdfU, pdfV;
+        int   offsetU, offsetV;
+
+        const float v = mMarginal.SampleContinuous(aRnd.y, pdfV, offsetV);
+        const float u = mConditional[offsetV].SampleContinuous(aRnd.x, pdfU, offsetU);
+
+        oPdf = pdfU * pdfV;
+        return Vec2f(u, v);
+    }
+
+    float Pdf(const Vec2f &aUV) const
+    {
+        const int countV = mMarginal.Count();
+        const int countU = mConditional[0].Count();
+
+        const int v = std::max(0, std::min(countV - 1, int(aUV.y * countV)));
+        const int u = std::max(0, std::min(countU - 1, int(aUV.x * countU)));
+
+        return mMarginal.Pdf(v) * mConditional[v].Pdf(u);
+    }
+
+    // Integral of the function over [0, 1]^2
+    float Integral() const
+    {
+        return mMarginal.Integral();
+    }
+
+private:
+
+    std::vector<Distribution1D> mConditional;
+    Distribution1D              mMarginal;
+};
@@ -4,7 +4,6 @@
 #include <cmath>
 #include <omp.h>
 #include "renderer.hxx"
-#include "rng.hxx"
 
 class EyeLight : public AbstractRenderer
 {
@@ -12,9 +11,9 @@ public:
 
     EyeLight(
         const Scene& aScene,
-        int aSeed = 1234
+        const AbstractSampler& aSampler
     ) :
-        AbstractRenderer(aScene), mRng(aSeed)
+        AbstractRenderer(aScene, aSampler)
     {}
 
     virtual void RunIteration(int aIteration)
@@ -29,26 +28,29 @@ public:
             const int x = pixID % resX;
             const int y = pixID / resX;
 
+            SamplerState sampler;
+            mSampler.StartPixelSample(x, y, uint(aIteration), sampler);
+
             const Vec2f sample = Vec2f(float(x), float(y)) +
-                (aIteration == 1 ? Vec2f(0.5f) : mRng.GetVec2f());
+                (aIteration == 1 ? Vec2f(0.5f) : mSampler.Get2D(sampler));
 
             Ray   ray = mScene.mCamera.GenerateRay(sample);
             Isect isect;
             isect.dist = 1e36f;
 
-            if(mScene.Intersect(ray, isect))
+            const bool hit = mScene.Intersect(ray, isect);
+            AddFirstHit(sample, ray, isect, hit);
+
+            if(hit)
             {
                 float dotLN = Dot(isect.normal, -ray.dir);
 
-                if(dotLN > 0)
-                    mFramebuffer.AddColor(sample, Vec3f(dotLN));
-                else
-                    mFramebuffer.AddColor(sample, Vec3f(-dotLN, 0, 0));
+                // back faces are shown in red
+                const Vec3f color = dotLN > 0 ? Vec3f(dotLN) : Vec3f(-dotLN, 0, 0);
+                AddSample(sample, color, color);
             }
         }
 
         mIterations++;
     }
-
-    Rng              mRng;
 };
@@ -3,6 +3,8 @@
 #include <vector>
 #include <cmath>
 #include <fstream>
+#include <string>
+#include <stdio.h>
 #include <string.h>
 #include "utils.hxx"
 
@@ -225,6 +227,181 @@ public:
         }
     }
 
+    //////////////////////////////////////////////////////////////////////////
+    // Loading HDR, reads flat and run-length encoded scanlines
+    bool LoadHDR(const char* aFilename)
+    {
+        std::ifstream hdr(aFilename, std::ios::binary);
+        if(!hdr)
+            return false;
+
+        std::string line;
+        std::getline(hdr, line);
+        if(line.compare(0, 2, "#?") != 0)
+            return false;
+
+        // header ends with an empty line
+        while(std::getline(hdr, line) && !line.empty())
+        {
+            if(line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+                return false;
+        }
+
+        int resX, resY;
+        std::getline(hdr, line);
+        if(sscanf(line.c_str(), "-Y %d +X %d", &resY, &resX) != 2 || resX <= 0 || resY <= 0)
+            return false;
+
+        Setup(Vec2f(float(resX), float(resY)));
+
+        typedef unsigned char byte;
+        std::vector<byte> scanline(resX * 4);
+
+        for(int y=0; y<resY; y++)
+        {
+            byte start[4];
+            if(!hdr.read((char*)start, 4))
+                return false;
+
+            const bool rle = resX >= 8 && resX < 32768 &&
+                start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == resX;
+
+            if(rle)
+            {
+                // each of the four channels is encoded separately
+                for(int c=0; c<4; c++)
+                {
+                    for(int x=0; x<resX; )
+                    {
+                        byte count;
+                        if(!hdr.read((char*)&count, 1))
+                            return false;
+
+                        if(count > 128)
+                        {
+                            count -= 128;
+                            byte value;
+                            if(!hdr.read((char*)&value, 1) || x + count > resX)
+                                return false;
+
+                            for(int i=0; i<count; i++)
+                                scanline[(x++) * 4 + c] = value;
+                        }
+                        else
+                        {
+                            if(count == 0 || x + count > resX)
+                                return false;
+
+                            for(int i=0; i<count; i++)
+                            {
+                                if(!hdr.read((char*)&scanline[(x++) * 4 + c], 1))
+                                    return false;
+                            }
+                        }
+                    }
+                }
+            }
+            else
+            {
+                memcpy(&scanline[0], start, 4);
+                if(resX > 1 && !hdr.read((char*)&scanline[4], (resX - 1) * 4))
+                    return false;
+            }
+
+            for(int x=0; x<resX; x++)
+            {
+                const byte *rgbe = &scanline[x * 4];
+                Vec3f &rgbF = mColor[x + y*mResX];
+
+                if(rgbe[3] == 0)
+                    rgbF = Vec3f(0);
+                else
+                {
+                    const float f = float(ldexp(1.0, int(rgbe[3]) - (128 + 8)));
+                    rgbF = Vec3f((rgbe[0] + 0.5f) * f, (rgbe[1] + 0.5f) * f, (rgbe[2] + 0.5f) * f);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Loading BMP, reads uncompressed 24 and 32 bit images. The colors stay
+    // gamma encoded, the bytes are only scaled to [0, 1].
+    bool LoadBMP(const char* aFilename)
+    {
+        std::ifstream bmp(aFilename, std::ios::binary);
+        if(!bmp)
+            return false;
+
+        typedef unsigned char byte;
+        byte header[54];
+        if(!bmp.read((char*)header, sizeof(header)) || header[0] != 'B' || header[1] != 'M')
+            return false;
+
+        int dataOffset, width, height, compression;
+        short bitsPerPixel;
+        memcpy(&dataOffset,   header + 10, 4);
+        memcpy(&width,        header + 18, 4);
+        memcpy(&height,       header + 22, 4);
+        memcpy(&bitsPerPixel, header + 28, 2);
+        memcpy(&compression,  header + 30, 4);
+
+        // 32 bit images may give the channel masks, BGRA is assumed
+        const bool topDown = height < 0;
+        height = std::abs(height);
+
+        if(width <= 0 || height <= 0 || (bitsPerPixel != 24 && bitsPerPixel != 32) ||
+            !(compression == 0 || (compression == 3 && bitsPerPixel == 32)))
+            return false;
+
+        Setup(Vec2f(float(width), float(height)));
+
+        const int bytesPerPixel = bitsPerPixel / 8;
+        const int rowSize = (width * bytesPerPixel + 3) & ~3;
+        std::vector<byte> row(rowSize);
+
+        bmp.seekg(dataOffset);
+        for(int i=0; i<height; i++)
+        {
+            if(!bmp.read((char*)&row[0], rowSize))
+                return false;
+
+            // bmp is stored from bottom up unless the height is negative
+            const int y = topDown ? i : height - 1 - i;
+            for(int x=0; x<width; x++)
+            {
+                const byte *bgr = &row[x * bytesPerPixel];
+                mColor[x + y*mResX] = Vec3f(bgr[2], bgr[1], bgr[0]) / Vec3f(255.f);
+            }
+        }
+
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Access
+    int GetResX() const
+    {
+        return mResX;
+    }
+
+    int GetResY() const
+    {
+        return mResY;
+    }
+
+    const Vec3f& GetColor(int aX, int aY) const
+    {
+        return mColor[aX + aY*mResX];
+    }
+
+    void SetColor(int aX, int aY, const Vec3f& aColor)
+    {
+        mColor[aX + aY*mResX] = aColor;
+    }
+
 private:
 
     std::vector<Vec3f> mColor;
@@ -9,6 +9,10 @@
 //////////////////////////////////////////////////////////////////////////
 // Geometry
 
+// Number of geometry tests done by the calling thread, renderers read it
+// before and after tracing a ray to gather traversal statistics
+static thread_local unsigned long long g_TraversalSteps = 0;
+
 class AbstractGeometry
 {
 public:
@@ -32,16 +36,12 @@ class GeometryList : public AbstractGeometry
 {
 public:
 
-    virtual ~GeometryList()
-    {
-        for(int i=0; i<(int)mGeometry.size(); i++)
-            delete mGeometry[i];
-    };
-
     virtual bool Intersect(const Ray& aRay, Isect& oResult) const
     {
         bool anyIntersection = false;
 
+        g_TraversalSteps += mGeometry.size();
+
         for(int i=0; i<(int)mGeometry.size(); i++)
         {
             bool hit = mGeometry[i]->Intersect(aRay, oResult);
@@ -59,6 +59,8 @@ public:
     {
         for(int i=0; i<(int)mGeometry.size(); i++)
         {
+            g_TraversalSteps++;
+
             if(mGeometry[i]->IntersectP(aRay, oResult))
                 return true;
         }
@@ -76,7 +78,7 @@ public:
 
 public:
 
-    std::vector<AbstractGeometry*> mGeometry;
+    std::vector<AbstractGeometry*> mGeometry; //!< Owned by the arena of the scene
 };
 
 class Triangle : public AbstractGeometry
@@ -89,13 +91,32 @@ public:
         const Vec3f &p0,
         const Vec3f &p1,
         const Vec3f &p2,
-        int         aMatID)
+        int         aMatID,
+        int         aPrimID = -1)
     {
         p[0] = p0;
         p[1] = p1;
         p[2] = p2;
         matID = aMatID;
+        primID = aPrimID;
         mNormal = Normalize(Cross(p[1] - p[0], p[2] - p[0]));
+        SetTexCoords(Vec2f(0), Vec2f(0), Vec2f(0));
+    }
+
+    // The texture is stretched evenly, its scale is the square root of the
+    // ratio of the areas in texture and world space
+    void SetTexCoords(
+        const Vec2f &uv0,
+        const Vec2f &uv1,
+        const Vec2f &uv2)
+    {
+        uv[0] = uv0;
+        uv[1] = uv1;
+        uv[2] = uv2;
+
+        const Vec2f e1 = uv1 - uv0, e2 = uv2 - uv0;
+        const float area = Cross(p[1] - p[0], p[2] - p[0]).Length();
+        mUVScale = area > 0.f ? std::sqrt(std::abs(e1.x * e2.y - e1.y * e2.x) / area) : 0.f;
     }
 
     virtual bool Intersect(
@@ -121,9 +142,16 @@ public:
 
             if((distance > aRay.tmin) & (distance < oResult.dist))
             {
+                // the volumes over the edges are the barycentric
+                // coordinates of the opposite corners, times their sum
+                const float invSum = 1.f / (v0d + v1d + v2d);
+
                 oResult.normal = mNormal;
                 oResult.matID  = matID;
+                oResult.primID = primID;
                 oResult.dist   = distance;
+                oResult.uv     = (uv[0] * v0d + uv[1] * v2d + uv[2] * v1d) * invSum;
+                oResult.uvScale = mUVScale;
                 return true;
             }
         }
@@ -148,8 +176,11 @@ public:
 public:
 
     Vec3f p[3];
+    Vec2f uv[3];  //!< Texture coordinates of the corners, set by SetTexCoords
     int   matID;
+    int   primID; //!< Index of the triangle in its mesh light, -1 if none
     Vec3f mNormal;
+    float mUVScale;
 };
 
 class Sphere : public AbstractGeometry
@@ -208,7 +239,15 @@ public:
 
         oResult.dist   = resT;
         oResult.matID  = matID;
+        oResult.primID = -1;
         oResult.normal = Normalize(transformedOrigin + Vec3f(resT) * aRay.dir);
+
+        // longitude and latitude, v runs from the +z pole
+        const Vec3f &n = oResult.normal;
+        oResult.uv = Vec2f(
+            0.5f + std::atan2(n.y, n.x) * (0.5f * INV_PI_F),
+            std::acos(std::min(1.f, std::max(-1.f, n.z))) * INV_PI_F);
+        oResult.uvScale = 0.5f / (radius * std::sqrt(PI_F)); // the unit square over the area
         return true;
     }
 
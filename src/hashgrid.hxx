@@ -0,0 +1,183 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Hashed uniform grid for fixed radius range queries over particles
+//
+// The cells are 2 * radius wide and hashed into a fixed number of buckets,
+// so a query only visits the 2x2x2 cells closest to the query point. The
+// particle indices are stored sorted by bucket in one array, each bucket
+// is a contiguous range of it (counting sort), which keeps the queries
+// cache friendly.
+//
+// The particle type needs a `const Vec3f& GetPosition() const` method.
+
+class HashGrid
+{
+public:
+
+    HashGrid() :
+        mRadius(0), mRadiusSqr(0), mCellSize(0), mInvCellSize(0)
+    {}
+
+    // Sets the number of hash buckets
+    void Reserve(int aNumCells)
+    {
+        mCellEnds.resize(std::max(aNumCells, 1));
+    }
+
+    // Builds the grid over all particles. The passes over the particles
+    // run in parallel when called outside of a parallel region.
+    template<typename tParticle>
+    void Build(
+        const std::vector<tParticle> &aParticles,
+        float                        aRadius)
+    {
+        const int numParticles = (int)aParticles.size();
+        const int numCells     = (int)mCellEnds.size();
+
+        mRadius      = aRadius;
+        mRadiusSqr   = Sqr(aRadius);
+        mCellSize    = aRadius * 2.f;
+        mInvCellSize = 1.f / mCellSize;
+
+        mBBoxMin = Vec3f( 1e36f);
+        mBBoxMax = Vec3f(-1e36f);
+
+        for(int i=0; i<numParticles; i++)
+        {
+            mBBoxMin = Min(mBBoxMin, aParticles[i].GetPosition());
+            mBBoxMax = Max(mBBoxMax, aParticles[i].GetPosition());
+        }
+
+        mIndices.resize(numParticles);
+        mParticleCells.resize(numParticles);
+        std::fill(mCellEnds.begin(), mCellEnds.end(), 0);
+
+        // bucket of each particle and the bucket sizes
+#pragma omp parallel for
+        for(int i=0; i<numParticles; i++)
+        {
+            const int cellIdx = GetCellIndex(aParticles[i].GetPosition());
+            mParticleCells[i] = cellIdx;
+
+#pragma omp atomic
+            mCellEnds[cellIdx]++;
+        }
+
+        // bucket starts
+        int sum = 0;
+        for(int i=0; i<numCells; i++)
+        {
+            const int count = mCellEnds[i];
+            mCellEnds[i] = sum;
+            sum += count;
+        }
+
+        // scatter the indices, moves the bucket starts to their ends
+#pragma omp parallel for
+        for(int i=0; i<numParticles; i++)
+        {
+            int slot;
+#pragma omp atomic capture
+            slot = mCellEnds[mParticleCells[i]]++;
+
+            mIndices[slot] = i;
+        }
+    }
+
+    // Calls aoQuery.Process(particle) for every particle within the radius
+    // of aQueryPos
+    template<typename tParticle, typename tQuery>
+    void Process(
+        const std::vector<tParticle> &aParticles,
+        const Vec3f                  &aQueryPos,
+        tQuery                       &aoQuery) const
+    {
+        if(mIndices.empty())
+            return;
+
+        // outside of the particle bounds extended by the radius
+        const Vec3f distMin = aQueryPos - mBBoxMin;
+        const Vec3f distMax = mBBoxMax - aQueryPos;
+        for(int i=0; i<3; i++)
+        {
+            if(distMin.Get(i) < -mRadius || distMax.Get(i) < -mRadius)
+                return;
+        }
+
+        // the 2 closest cells along each axis
+        const Vec3f cellPt = mInvCellSize * distMin;
+        const Vec3f coordF(std::floor(cellPt.x), std::floor(cellPt.y), std::floor(cellPt.z));
+        const Vec3i coord(int(coordF.x), int(coordF.y), int(coordF.z));
+
+        const int px = cellPt.x - coordF.x < 0.5f ? -1 : 1;
+        const int py = cellPt.y - coordF.y < 0.5f ? -1 : 1;
+        const int pz = cellPt.z - coordF.z < 0.5f ? -1 : 1;
+
+        int visited[8];
+        for(int j=0; j<8; j++)
+        {
+            const Vec3i cell(
+                coord.x + ((j & 1) ? px : 0),
+                coord.y + ((j & 2) ? py : 0),
+                coord.z + ((j & 4) ? pz : 0));
+
+            // neighbouring cells may share a bucket
+            const int cellIdx = GetCellIndex(cell);
+            visited[j] = cellIdx;
+            if(std::find(visited, visited + j, cellIdx) != visited + j)
+                continue;
+
+            const int begin = cellIdx > 0 ? mCellEnds[cellIdx - 1] : 0;
+            const int end   = mCellEnds[cellIdx];
+
+            for(int k=begin; k<end; k++)
+            {
+                const tParticle &particle = aParticles[mIndices[k]];
+                const float distSqr = (aQueryPos - particle.GetPosition()).LenSqr();
+
+                if(distSqr <= mRadiusSqr)
+                    aoQuery.Process(particle);
+            }
+        }
+    }
+
+private:
+
+    int GetCellIndex(const Vec3i &aCoord) const
+    {
+        uint x = uint(aCoord.x);
+        uint y = uint(aCoord.y);
+        uint z = uint(aCoord.z);
+
+        return int(((x * 73856093) ^ (y * 19349663) ^ (z * 83492791)) % uint(mCellEnds.size()));
+    }
+
+    int GetCellIndex(const Vec3f &aPoint) const
+    {
+        const Vec3f distMin = aPoint - mBBoxMin;
+
+        return GetCellIndex(Vec3i(
+            int(std::floor(mInvCellSize * distMin.x)),
+            int(std::floor(mInvCellSize * distMin.y)),
+            int(std::floor(mInvCellSize * distMin.z))));
+    }
+
+private:
+
+    Vec3f mBBoxMin;
+    Vec3f mBBoxMax;
+    std::vector<int> mIndices;       //!< Particle indices sorted by bucket
+    std::vector<int> mCellEnds;      //!< End of each bucket in mIndices
+    std::vector<int> mParticleCells; //!< Bucket of each particle, used by Build
+    float mRadius;
+    float mRadiusSqr;
+    float mCellSize;
+    float mInvCellSize;
+};
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+#include "mesh.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Instanced geometry
+//
+// A MeshInstance places a prototype TriangleMesh with an affine transform
+// and optionally one material for all of its triangles. The ray is moved
+// into the space of the prototype instead of the triangles into the world,
+// so an instance costs its transforms and box while the triangles and the
+// BVH of the prototype exist once however often it is placed. The ray
+// direction is not normalized after the transform, which keeps the hit
+// distance the same in both spaces.
+//
+// GeometryBVH is the top level of the two-level hierarchy. It builds the
+// TriangleMesh hierarchy over the boxes of whole geometries, the instances,
+// meshes and single primitives of a scene, and passes the ray on to the
+// geometries in the leaves it reaches.
+
+class MeshInstance : public AbstractGeometry
+{
+public:
+
+    // aObjectToWorld has to be affine and invertible, aMatID -1 keeps the
+    // materials of the prototype
+    MeshInstance(
+        const TriangleMesh *aPrototype,
+        const Mat4f        &aObjectToWorld,
+        int                aMatID) :
+        mPrototype(aPrototype),
+        mObjectToWorld(aObjectToWorld),
+        mWorldToObject(Invert(aObjectToWorld)),
+        mMatID(aMatID)
+    {
+        // normals go with the inverse transpose
+        mNormalToWorld = Mat4f::Indetity();
+        for(int r=0; r<3; r++)
+            for(int c=0; c<3; c++)
+                mNormalToWorld.Get(r, c) = mWorldToObject.Get(c, r);
+
+        // areas grow by the determinant times the length of the
+        // transformed unit normal
+        const Vec3f x(aObjectToWorld.Get(0, 0), aObjectToWorld.Get(1, 0), aObjectToWorld.Get(2, 0));
+        const Vec3f y(aObjectToWorld.Get(0, 1), aObjectToWorld.Get(1, 1), aObjectToWorld.Get(2, 1));
+        const Vec3f z(aObjectToWorld.Get(0, 2), aObjectToWorld.Get(1, 2), aObjectToWorld.Get(2, 2));
+        mDeterminant = std::abs(Dot(x, Cross(y, z)));
+
+        // world box of the corners of the prototype's box
+        mBBoxMin = Vec3f( 1e36f);
+        mBBoxMax = Vec3f(-1e36f);
+
+        const TriangleMesh::Arrays &arrays = mPrototype->GetArrays();
+        if(arrays.mNodeCount == 0)
+            return;
+
+        const TriangleMesh::Node &root = arrays.mNodes[0];
+        for(int i=0; i<8; i++)
+        {
+            const Vec3f corner(
+                (i & 1) ? root.mBBoxMax.x : root.mBBoxMin.x,
+                (i & 2) ? root.mBBoxMax.y : root.mBBoxMin.y,
+                (i & 4) ? root.mBBoxMax.z : root.mBBoxMin.z);
+
+            const Vec3f p = TransformPoint(mObjectToWorld, corner);
+            mBBoxMin = Min(mBBoxMin, p);
+            mBBoxMax = Max(mBBoxMax, p);
+        }
+    }
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        const Ray ray(TransformPoint(mWorldToObject, aRay.org),
+            mWorldToObject.TransformVector(aRay.dir), aRay.tmin);
+
+        if(!mPrototype->Intersect(ray, oResult))
+            return false;
+
+        const Vec3f normal = mNormalToWorld.TransformVector(oResult.normal);
+        oResult.normal   = Normalize(normal);
+        oResult.uvScale /= std::sqrt(mDeterminant * normal.Length());
+        if(mMatID >= 0)
+            oResult.matID = mMatID;
+        return true;
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        const Ray ray(TransformPoint(mWorldToObject, aRay.org),
+            mWorldToObject.TransformVector(aRay.dir), aRay.tmin);
+
+        return mPrototype->IntersectP(ray, oResult);
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        aoBBoxMin = Min(aoBBoxMin, mBBoxMin);
+        aoBBoxMax = Max(aoBBoxMax, mBBoxMax);
+    }
+
+    const TriangleMesh* GetPrototype() const
+    {
+        return mPrototype;
+    }
+
+    const Mat4f& GetTransform() const
+    {
+        return mObjectToWorld;
+    }
+
+private:
+
+    // Affine, skips the homogeneous division of Mat4f::TransformPoint
+    static Vec3f TransformPoint(
+        const Mat4f &aMatrix,
+        const Vec3f &aPoint)
+    {
+        return aMatrix.TransformVector(aPoint) +
+            Vec3f(aMatrix.Get(0, 3), aMatrix.Get(1, 3), aMatrix.Get(2, 3));
+    }
+
+private:
+
+    const TriangleMesh *mPrototype;     //!< Owned by the scene, shared by its instances
+    Mat4f              mObjectToWorld;
+    Mat4f              mWorldToObject;
+    Mat4f              mNormalToWorld;
+    float              mDeterminant;   //!< Of mObjectToWorld, absolute
+    Vec3f              mBBoxMin;
+    Vec3f              mBBoxMax;
+    int                mMatID;
+};
+
+class GeometryBVH : public AbstractGeometry
+{
+public:
+
+    static const int kMaxLeafSize = 2;
+
+    // Builds the hierarchy over the boxes of mGeometry, reorders it to the
+    // leaves. Has to be called after the last geometry is added.
+    void Build()
+    {
+        const int count = (int)mGeometry.size();
+
+        std::vector<Vec3f> boxMin(count, Vec3f(1e36f)), boxMax(count, Vec3f(-1e36f));
+        for(int i=0; i<count; i++)
+            mGeometry[i]->GrowBBox(boxMin[i], boxMax[i]);
+
+        std::vector<int> order;
+        TriangleMesh::BuildNodes(boxMin, boxMax, kMaxLeafSize, order, mNodes);
+
+        std::vector<AbstractGeometry*> geometry(count);
+        for(int i=0; i<count; i++)
+            geometry[i] = mGeometry[order[i]];
+        mGeometry.swap(geometry);
+    }
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mNodes.empty())
+            return false;
+
+        return TriangleMesh::TraverseNodes<false>(&mNodes[0], (int)mNodes.size(), aRay, oResult,
+            [this](int aIndex, const Ray &aLeafRay, Isect &aoLeafResult)
+            {
+                return mGeometry[aIndex]->Intersect(aLeafRay, aoLeafResult);
+            });
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mNodes.empty())
+            return false;
+
+        return TriangleMesh::TraverseNodes<true>(&mNodes[0], (int)mNodes.size(), aRay, oResult,
+            [this](int aIndex, const Ray &aLeafRay, Isect &aoLeafResult)
+            {
+                return mGeometry[aIndex]->IntersectP(aLeafRay, aoLeafResult);
+            });
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        if(mNodes.empty())
+            return;
+
+        aoBBoxMin = Min(aoBBoxMin, mNodes[0].mBBoxMin);
+        aoBBoxMax = Max(aoBBoxMax, mNodes[0].mBBoxMax);
+    }
+
+public:
+
+    std::vector<AbstractGeometry*> mGeometry; //!< Owned by the arena of the scene, in the order of the leaves once built
+
+private:
+
+    std::vector<TriangleMesh::Node> mNodes;
+};
@@ -0,0 +1,633 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "math.hxx"
+#include "lights.hxx"
+#include "lightsampler.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Light BVH
+//
+// Binary tree over the bounded lights. Each node keeps a bounding box,
+// a cone bounding the emitter normals and the total power below it.
+// Sampling descends from the root and at each node picks a child with
+// probability proportional to its importance for the shading point,
+// so the pdf of a light is the product of the choices along its path.
+// The leaves are single primitives, each triangle of a mesh light gets
+// its own. Lights without bounds (background) are picked uniformly on
+// the side.
+// The construction and importance follow Conty Estevez and Kulla,
+// "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018.
+
+class LightBVH : public AbstractLightSampler
+{
+public:
+
+    LightBVH(
+        const std::vector<AbstractLight*> &aLights,
+        const SceneSphere                 &aSceneSphere)
+    {
+        mFirstPrimitive.resize(aLights.size(), -1);
+
+        std::vector<BuildItem> items;
+        int primitiveCount = 0;
+
+        for(int i=0; i<(int)aLights.size(); i++)
+        {
+            LightBounds bounds;
+            if(!aLights[i]->getLightBounds(aSceneSphere, 0, bounds))
+            {
+                mInfiniteLights.push_back(i);
+                continue;
+            }
+
+            mFirstPrimitive[i] = primitiveCount;
+            primitiveCount += aLights[i]->getPrimitiveCount();
+
+            for(int p=0; p<aLights[i]->getPrimitiveCount(); p++)
+            {
+                BuildItem item;
+                item.mLightIdx = i;
+                item.mPrimID   = p;
+
+                if(p == 0)
+                    item.mBounds = bounds;
+                else
+                    aLights[i]->getLightBounds(aSceneSphere, p, item.mBounds);
+
+                if(item.mBounds.mPower > 0)
+                    items.push_back(item);
+            }
+        }
+
+        mPrimitiveBitTrail.resize(primitiveCount, 0);
+        mPrimitiveLeaf.resize(primitiveCount, -1);
+
+        if(!items.empty())
+        {
+            mNodes.reserve(2 * items.size() - 1);
+            BuildRecursive(items, 0, (int)items.size(),
+                GetBounds(items, 0, (int)items.size()), 0, 0);
+        }
+    }
+
+    virtual int Sample(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        float       aRnd,
+        int         &oPrimID,
+        float       &oPdf) const
+    {
+        // Largest float below one, keeps the rescaled random numbers in [0, 1)
+        const float kOneMinusEps = 0.99999994f;
+
+        // Pick between the infinite lights and the tree
+        const float pInfinite = GetInfiniteProbability();
+
+        if(aRnd < pInfinite)
+        {
+            aRnd = std::min(aRnd / pInfinite, kOneMinusEps);
+            const int idx = std::min(int(aRnd * mInfiniteLights.size()),
+                (int)mInfiniteLights.size() - 1);
+            oPdf = pInfinite / mInfiniteLights.size();
+            oPrimID = 0;
+            return mInfiniteLights[idx];
+        }
+
+        if(mNodes.empty())
+            return -1;
+
+        aRnd = std::min((aRnd - pInfinite) / (1.f - pInfinite), kOneMinusEps);
+        float pdf = 1.f - pInfinite;
+        int nodeIdx = 0;
+
+        while(true)
+        {
+            const Node &node = mNodes[nodeIdx];
+
+            if(node.mIsLeaf)
+            {
+                if(Importance(node, aSurfPt, aNormal) <= 0)
+                    return -1;
+
+                oPdf = pdf;
+                oPrimID = node.mPrimID;
+                return node.mChildOrLight;
+            }
+
+            const float importance0 = Importance(mNodes[nodeIdx + 1], aSurfPt, aNormal);
+            const float importance1 = Importance(mNodes[node.mChildOrLight], aSurfPt, aNormal);
+
+            if(importance0 <= 0 && importance1 <= 0)
+                return -1;
+
+            // Reuse the random number for the next level
+            const float p0 = importance0 / (importance0 + importance1);
+
+            if(aRnd < p0)
+            {
+                aRnd = std::min(aRnd / p0, kOneMinusEps);
+                pdf *= p0;
+                nodeIdx = nodeIdx + 1;
+            }
+            else
+            {
+                aRnd = std::min((aRnd - p0) / (1.f - p0), kOneMinusEps);
+                pdf *= 1.f - p0;
+                nodeIdx = node.mChildOrLight;
+            }
+        }
+    }
+
+    virtual float Pdf(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        int         aLightIdx,
+        int         aPrimID) const
+    {
+        const float pInfinite = GetInfiniteProbability();
+
+        if(mFirstPrimitive[aLightIdx] < 0)
+        {
+            for(size_t i=0; i<mInfiniteLights.size(); i++)
+                if(mInfiniteLights[i] == aLightIdx)
+                    return pInfinite / mInfiniteLights.size();
+
+            return 0;
+        }
+
+        // Primitive has no power, it is never picked
+        const int primitive = mFirstPrimitive[aLightIdx] + aPrimID;
+        if(mPrimitiveLeaf[primitive] < 0)
+            return 0;
+
+        // Follow the path to the primitive, the bit trail tells which
+        // child to take at each level
+        unsigned long long bitTrail = mPrimitiveBitTrail[primitive];
+        float pdf = 1.f - pInfinite;
+        int nodeIdx = 0;
+
+        while(!mNodes[nodeIdx].mIsLeaf)
+        {
+            const Node &node = mNodes[nodeIdx];
+            const float importance0 = Importance(mNodes[nodeIdx + 1], aSurfPt, aNormal);
+            const float importance1 = Importance(mNodes[node.mChildOrLight], aSurfPt, aNormal);
+
+            if(importance0 <= 0 && importance1 <= 0)
+                return 0;
+
+            const float p0 = importance0 / (importance0 + importance1);
+
+            if(bitTrail & 1)
+            {
+                pdf *= 1.f - p0;
+                nodeIdx = node.mChildOrLight;
+            }
+            else
+            {
+                pdf *= p0;
+                nodeIdx = nodeIdx + 1;
+            }
+
+            bitTrail >>= 1;
+        }
+
+        if(Importance(mNodes[nodeIdx], aSurfPt, aNormal) <= 0)
+            return 0;
+
+        return pdf;
+    }
+
+private:
+
+    // Nodes are stored depth-first, the first child directly follows its
+    // parent. For inner nodes mChildOrLight is the index of the second child,
+    // for leaves the index of the light and mPrimID its primitive. The terms
+    // of the importance that do not depend on the shading point are cached.
+    struct Node
+    {
+        LightBounds mBounds;
+        Vec3f       mCenter;
+        float       mRadiusSqr;     //!< Squared radius of the bounding sphere
+        float       mMinDistSqr;    //!< Clamp of the squared distance
+        float       mSinThetaO;
+        int         mChildOrLight;
+        int         mPrimID;
+        bool        mIsLeaf;
+    };
+
+    struct BuildItem
+    {
+        LightBounds mBounds;
+        int         mLightIdx;
+        int         mPrimID;
+    };
+
+    float GetInfiniteProbability() const
+    {
+        if(mInfiniteLights.empty())
+            return 0.f;
+
+        const float count = float(mInfiniteLights.size());
+        return count / (count + (mNodes.empty() ? 0.f : 1.f));
+    }
+
+    // Union of the bounds of the items in [aBegin, aEnd)
+    static LightBounds GetBounds(
+        const std::vector<BuildItem> &aItems,
+        int                          aBegin,
+        int                          aEnd)
+    {
+        LightBounds bounds = aItems[aBegin].mBounds;
+        for(int i=aBegin+1; i<aEnd; i++)
+            bounds = Union(bounds, aItems[i].mBounds);
+
+        return bounds;
+    }
+
+    static void SetBounds(
+        Node              &aoNode,
+        const LightBounds &aBounds)
+    {
+        const Vec3f diagonal = aBounds.mBBoxMax - aBounds.mBBoxMin;
+
+        aoNode.mBounds     = aBounds;
+        aoNode.mCenter     = Centroid(aBounds);
+        aoNode.mRadiusSqr  = diagonal.LenSqr() * 0.25f;
+        aoNode.mMinDistSqr = diagonal.Length() * 0.5f;
+        aoNode.mSinThetaO  = SafeSqrt(1.f - Sqr(aBounds.mCosThetaO));
+    }
+
+    // aBounds are the bounds of the items in [aBegin, aEnd)
+    int BuildRecursive(
+        std::vector<BuildItem> &aoItems,
+        int                    aBegin,
+        int                    aEnd,
+        const LightBounds      &aBounds,
+        unsigned long long     aBitTrail,
+        int                    aDepth)
+    {
+        const int nodeIdx = (int)mNodes.size();
+        mNodes.push_back(Node());
+
+        if(aEnd - aBegin == 1)
+        {
+            const BuildItem &item = aoItems[aBegin];
+            const int primitive = mFirstPrimitive[item.mLightIdx] + item.mPrimID;
+            SetBounds(mNodes[nodeIdx], item.mBounds);
+            mNodes[nodeIdx].mChildOrLight = item.mLightIdx;
+            mNodes[nodeIdx].mPrimID       = item.mPrimID;
+            mNodes[nodeIdx].mIsLeaf       = true;
+            mPrimitiveBitTrail[primitive] = aBitTrail;
+            mPrimitiveLeaf[primitive]     = nodeIdx;
+            return nodeIdx;
+        }
+
+        Vec3f centroidMin = Centroid(aoItems[aBegin].mBounds);
+        Vec3f centroidMax = centroidMin;
+
+        for(int i=aBegin+1; i<aEnd; i++)
+        {
+            centroidMin = Min(centroidMin, Centroid(aoItems[i].mBounds));
+            centroidMax = Max(centroidMax, Centroid(aoItems[i].mBounds));
+        }
+
+        LightBounds boundsBelow, boundsAbove;
+        int mid = FindSplit(aoItems, aBegin, aEnd, aBounds, centroidMin, centroidMax,
+            boundsBelow, boundsAbove);
+
+        // The bit trail has room for 64 levels, deeper trees would need
+        // degenerate inputs, split in the middle to keep them balanced
+        if(mid <= aBegin || mid >= aEnd || aDepth >= 48)
+        {
+            mid = (aBegin + aEnd) / 2;
+            const int axis = LargestAxis(centroidMax - centroidMin);
+            std::nth_element(&aoItems[aBegin], &aoItems[mid], &aoItems[aEnd - 1] + 1,
+                [axis](const BuildItem &a, const BuildItem &b)
+                {
+                    return Centroid(a.mBounds).Get(axis) < Centroid(b.mBounds).Get(axis);
+                });
+
+            boundsBelow = GetBounds(aoItems, aBegin, mid);
+            boundsAbove = GetBounds(aoItems, mid, aEnd);
+        }
+
+        BuildRecursive(aoItems, aBegin, mid, boundsBelow, aBitTrail, aDepth + 1);
+        const int secondChild =
+            BuildRecursive(aoItems, mid, aEnd, boundsAbove, aBitTrail | (1ull << aDepth), aDepth + 1);
+
+        SetBounds(mNodes[nodeIdx], aBounds);
+        mNodes[nodeIdx].mChildOrLight = secondChild;
+        mNodes[nodeIdx].mPrimID       = 0;
+        mNodes[nodeIdx].mIsLeaf       = false;
+        return nodeIdx;
+    }
+
+    // Binned split minimizing power times orientation bound times surface area,
+    // partitions the items and returns the split position (aBegin when none)
+    // and the bounds of the items on both sides
+    int FindSplit(
+        std::vector<BuildItem> &aoItems,
+        int                    aBegin,
+        int                    aEnd,
+        const LightBounds      &aBounds,
+        const Vec3f            &aCentroidMin,
+        const Vec3f            &aCentroidMax,
+        LightBounds            &oBoundsBelow,
+        LightBounds            &oBoundsAbove)
+    {
+        const int kBuckets = 12;
+
+        float bestCost  = std::numeric_limits<float>::max();
+        int   bestAxis   = -1;
+        int   bestBucket = -1;
+
+        const Vec3f extent = aBounds.mBBoxMax - aBounds.mBBoxMin;
+        const float maxExtent = extent.Max();
+
+        for(int axis=0; axis<3; axis++)
+        {
+            const float axisMin = aCentroidMin.Get(axis);
+            const float axisLen = aCentroidMax.Get(axis) - axisMin;
+
+            if(axisLen <= 0)
+                continue;
+
+            LightBounds buckets[kBuckets];
+            bool        used[kBuckets] = {};
+
+            for(int i=aBegin; i<aEnd; i++)
+            {
+                const int b = BucketOf(aoItems[i].mBounds, axis, axisMin, axisLen, kBuckets);
+                buckets[b] = used[b] ? Union(buckets[b], aoItems[i].mBounds) : aoItems[i].mBounds;
+                used[b] = true;
+            }
+
+            // Penalize thin slabs along the split axis
+            const float regularization = extent.Get(axis) > 0 ? maxExtent / extent.Get(axis) : 1.f;
+
+            // Bounds and costs of the buckets from each one up, swept from the top
+            LightBounds above[kBuckets];
+            float       costAbove[kBuckets];
+            bool        anyAbove[kBuckets];
+
+            for(int b=kBuckets-1; b>0; b--)
+            {
+                const bool anyHigher = b < kBuckets-1 && anyAbove[b+1];
+                anyAbove[b] = used[b] || anyHigher;
+
+                if(used[b])
+                {
+                    above[b] = anyHigher ? Union(above[b+1], buckets[b]) : buckets[b];
+                    costAbove[b] = Cost(above[b]);
+                }
+                else if(anyHigher)
+                {
+                    above[b] = above[b+1];
+                    costAbove[b] = costAbove[b+1];
+                }
+            }
+
+            LightBounds below;
+            bool anyBelow = false;
+
+            for(int split=0; split<kBuckets-1; split++)
+            {
+                // Splits after an empty bucket repeat the previous one
+                if(!used[split])
+                    continue;
+
+                below = anyBelow ? Union(below, buckets[split]) : buckets[split];
+                anyBelow = true;
+
+                if(!anyAbove[split + 1])
+                    continue;
+
+                const float cost = regularization * (Cost(below) + costAbove[split + 1]);
+
+                if(cost < bestCost)
+                {
+                    bestCost     = cost;
+                    bestAxis     = axis;
+                    bestBucket   = split;
+                    oBoundsBelow = below;
+                    oBoundsAbove = above[split + 1];
+                }
+            }
+        }
+
+        if(bestAxis < 0)
+            return aBegin;
+
+        const float axisMin = aCentroidMin.Get(bestAxis);
+        const float axisLen = aCentroidMax.Get(bestAxis) - axisMin;
+
+        BuildItem *mid = std::partition(&aoItems[aBegin], &aoItems[aEnd - 1] + 1,
+            [=](const BuildItem &aItem)
+            {
+                return BucketOf(aItem.mBounds, bestAxis, axisMin, axisLen, kBuckets) <= bestBucket;
+            });
+
+        return int(mid - &aoItems[0]);
+    }
+
+    static int BucketOf(
+        const LightBounds &aBounds,
+        int               aAxis,
+        float             aAxisMin,
+        float             aAxisLen,
+        int               aBuckets)
+    {
+        const float t = (Centroid(aBounds).Get(aAxis) - aAxisMin) / aAxisLen;
+        return std::min(aBuckets - 1, std::max(0, int(t * aBuckets)));
+    }
+
+    static Vec3f Centroid(const LightBounds &aBounds)
+    {
+        return (aBounds.mBBoxMin + aBounds.mBBoxMax) * 0.5f;
+    }
+
+    static int LargestAxis(const Vec3f &aExtent)
+    {
+        if(aExtent.x >= aExtent.y && aExtent.x >= aExtent.z) return 0;
+        return aExtent.y >= aExtent.z ? 1 : 2;
+    }
+
+    // Solid angle measure of the orientation bounds times power and area
+    static float Cost(const LightBounds &aBounds)
+    {
+        const float thetaO = std::acos(Clamp(aBounds.mCosThetaO, -1.f, 1.f));
+        const float thetaE = std::acos(Clamp(aBounds.mCosThetaE, -1.f, 1.f));
+        const float thetaW = std::min(thetaO + thetaE, PI_F);
+        const float sinThetaO = SafeSqrt(1.f - Sqr(aBounds.mCosThetaO));
+
+        const float orientation = 2 * PI_F * (1.f - aBounds.mCosThetaO) +
+            PI_F / 2 * (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW) -
+                        2 * thetaO * sinThetaO + aBounds.mCosThetaO);
+
+        const Vec3f d = aBounds.mBBoxMax - aBounds.mBBoxMin;
+        const float area = 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+
+        return aBounds.mPower * orientation * std::max(area, 1e-6f);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Bounds operations
+
+    static LightBounds Union(
+        const LightBounds &a,
+        const LightBounds &b)
+    {
+        LightBounds res;
+        res.mBBoxMin = Min(a.mBBoxMin, b.mBBoxMin);
+        res.mBBoxMax = Max(a.mBBoxMax, b.mBBoxMax);
+        res.mCosThetaE = std::min(a.mCosThetaE, b.mCosThetaE);
+        res.mPower = a.mPower + b.mPower;
+        UnionCones(a.mAxis, a.mCosThetaO, b.mAxis, b.mCosThetaO,
+            res.mAxis, res.mCosThetaO);
+        return res;
+    }
+
+    // Smallest cone containing both given cones
+    static void UnionCones(
+        const Vec3f &aAxisA,
+        float       aCosA,
+        const Vec3f &aAxisB,
+        float       aCosB,
+        Vec3f       &oAxis,
+        float       &oCos)
+    {
+        // Most unions during the build add a cone that is already
+        // covered, test for that without the inverse cosines
+        const float cosD = Dot(aAxisA, aAxisB);
+        const float sinD = SafeSqrt(1.f - Sqr(cosD));
+        const float sinA = SafeSqrt(1.f - Sqr(aCosA));
+        const float sinB = SafeSqrt(1.f - Sqr(aCosB));
+
+        if(aCosA <= CosSumClamped(sinD, cosD, sinB, aCosB))
+        {
+            oAxis = aAxisA; oCos = aCosA;
+            return;
+        }
+
+        if(aCosB <= CosSumClamped(sinD, cosD, sinA, aCosA))
+        {
+            oAxis = aAxisB; oCos = aCosB;
+            return;
+        }
+
+        const float thetaA = std::acos(Clamp(aCosA, -1.f, 1.f));
+        const float thetaB = std::acos(Clamp(aCosB, -1.f, 1.f));
+        const float thetaD = std::acos(Clamp(cosD, -1.f, 1.f));
+
+        const float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+        const Vec3f rotAxis = Cross(aAxisA, aAxisB);
+
+        if(thetaO >= PI_F || rotAxis.LenSqr() == 0)
+        {
+            oAxis = aAxisA; oCos = -1.f;
+            return;
+        }
+
+        // Rotate axis A towards B by thetaO - thetaA (Rodrigues' formula)
+        const float thetaR = thetaO - thetaA;
+        const Vec3f k = Normalize(rotAxis);
+        const float cosR = std::cos(thetaR);
+        const float sinR = std::sin(thetaR);
+        oAxis = Normalize(aAxisA * cosR + Cross(k, aAxisA) * sinR + k * (Dot(k, aAxisA) * (1 - cosR)));
+        oCos  = std::cos(thetaO);
+    }
+
+    // Conservative estimate of the contribution of the lights below
+    // the bounds to the shading point
+    static float Importance(
+        const Node  &aNode,
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal)
+    {
+        const LightBounds &bounds = aNode.mBounds;
+        const Vec3f toPoint = aSurfPt - aNode.mCenter;
+        const float toPointSqr = toPoint.LenSqr();
+
+        // Clamp the distance to avoid the singularity inside the bounds
+        const float distSqr = std::max(toPointSqr, aNode.mMinDistSqr);
+        const float dist = std::sqrt(toPointSqr);
+        const Vec3f wo = dist > 0 ? toPoint / dist : bounds.mAxis;
+
+        // Angle between the axis and the direction to the point
+        const float cosThetaW = Dot(bounds.mAxis, wo);
+        const float sinThetaW = SafeSqrt(1.f - Sqr(cosThetaW));
+
+        // Angle subtended by the bounding sphere of the box
+        float cosThetaB = -1.f;
+        float sinThetaB = 0.f;
+        if(toPointSqr > aNode.mRadiusSqr)
+        {
+            sinThetaB = std::sqrt(aNode.mRadiusSqr / toPointSqr);
+            cosThetaB = SafeSqrt(1.f - Sqr(sinThetaB));
+        }
+
+        const float sinThetaO = aNode.mSinThetaO;
+
+        // Minimal angle between the emitter normals and the point
+        const float cosThetaX = CosSubClamped(sinThetaW, cosThetaW, sinThetaO, bounds.mCosThetaO);
+        const float sinThetaX = SinSubClamped(sinThetaW, cosThetaW, sinThetaO, bounds.mCosThetaO);
+        const float cosThetaP = CosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+
+        if(cosThetaP <= bounds.mCosThetaE)
+            return 0;
+
+        float importance = bounds.mPower * cosThetaP / distSqr;
+
+        // Minimal angle between the surface normal and the bounds,
+        // points in media (zero normal) receive light from all directions
+        if(!aNormal.IsZero())
+        {
+            const float cosThetaI = -Dot(wo, aNormal);
+            const float sinThetaI = SafeSqrt(1.f - Sqr(cosThetaI));
+            importance *= CosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+        }
+
+        return std::max(importance, 0.f);
+    }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from sines and cosines
+    static float CosSubClamped(float aSinA, float aCosA, float aSinB, float aCosB)
+    {
+        if(aCosA > aCosB) return 1.f;
+        return aCosA * aCosB + aSinA * aSinB;
+    }
+
+    static float SinSubClamped(float aSinA, float aCosA, float aSinB, float aCosB)
+    {
+        if(aCosA > aCosB) return 0.f;
+        return aSinA * aCosB - aCosA * aSinB;
+    }
+
+    // cos(min(a + b, pi)) from sines and cosines
+    static float CosSumClamped(float aSinA, float aCosA, float aSinB, float aCosB)
+    {
+        if(aSinA * aCosB + aCosA * aSinB < 0) return -1.f;
+        return aCosA * aCosB - aSinA * aSinB;
+    }
+
+    static float SafeSqrt(float a)
+    {
+        return std::sqrt(std::max(0.f, a));
+    }
+
+    static float Clamp(float a, float aMin, float aMax)
+    {
+        return std::min(aMax, std::max(aMin, a));
+    }
+
+private:
+
+    std::vector<Node>               mNodes;
+    std::vector<int>                mInfiniteLights;
+    std::vector<int>                mFirstPrimitive;     //!< Per light, -1 for infinite lights
+    std::vector<unsigned long long> mPrimitiveBitTrail;  //!< Indexed by mFirstPrimitive + primitive
+    std::vector<int>                mPrimitiveLeaf;      //!< Leaf node, -1 for primitives without power
+};
@@ -5,12 +5,69 @@
 #include "math.hxx"
 #include "rng.hxx"
 #include "utils.hxx"
+#include "aliastable.hxx"
+#include "distribution.hxx"
+#include "framebuffer.hxx"
+
+struct SceneSphere
+{
+    // Center of the scene's bounding sphere
+    Vec3f mSceneCenter;
+    // Radius of the scene's bounding sphere
+    float mSceneRadius;
+    // 1.f / (mSceneRadius^2)
+    float mInvSceneRadiusSqr;
+};
+
+// Spatial and directional bounds of the emission of a light
+struct LightBounds
+{
+    Vec3f mBBoxMin;
+    Vec3f mBBoxMax;
+    // Principal direction of the emitter normals
+    Vec3f mAxis;
+    // Cosine of the spread of the normals around mAxis
+    float mCosThetaO;
+    // Cosine of the angle of emission around each normal
+    float mCosThetaE;
+    float mPower;
+};
 
 class AbstractLight
 {
 public:
 
-	virtual Vec3f sampleIllumination(const Vec3f rndGen, const Vec3f& aSurfPt, const Frame& aFrame, Vec3f& oWig, float& oLightDist) const
+	// Compact type tag, lets the hot paths avoid RTTI
+	enum LightType
+	{
+		kArea,
+		kPoint,
+		kBackground,
+		kMesh
+	};
+
+	// Capability flags
+	enum LightFlags
+	{
+		kFlagDelta    = 1, // position or direction is a delta function, cannot be hit
+		kFlagArea     = 2, // emitting surface that can be hit by rays
+		kFlagInfinite = 4  // infinitely far away, hit by rays leaving the scene
+	};
+
+	AbstractLight(LightType aType, uint aFlags) :
+		mType((unsigned char)aType), mFlags((unsigned char)aFlags)
+	{}
+
+	virtual ~AbstractLight(){}
+
+	LightType GetType() const { return LightType(mType); }
+	bool IsDelta()    const { return (mFlags & kFlagDelta) != 0; }
+	bool IsArea()     const { return (mFlags & kFlagArea) != 0; }
+	bool IsInfinite() const { return (mFlags & kFlagInfinite) != 0; }
+
+	// oPrimID receives the sampled primitive of the light,
+	// only lights made of several primitives (mesh lights) set it
+	virtual Vec3f sampleIllumination(const Vec3f rndGen, const Vec3f& aSurfPt, const Frame& aFrame, Vec3f& oWig, float& oLightDist, int& oPrimID) const
 	{
 		return Vec3f(0);
 	}
@@ -20,10 +77,104 @@ public:
 		return Vec3f(0);
 	}
 
-	virtual float getPDF(float lightDist, Vec3f wig) const
-	{
-		return 0;
+	// aPrimID is the primitive of the light that was sampled or hit
+	virtual float getPDF(float lightDist, Vec3f wig, int aPrimID) const
+	{
+		return 0;
 	}
+
+	// Estimate of the emitted power, drives the light selection
+	virtual float getPower(const SceneSphere& aSceneSphere) const
+	{
+		return 0;
+	}
+
+	// Bounds of the emission of primitive aPrimID for the light BVH,
+	// returns false for lights that are infinitely far away
+	virtual bool getLightBounds(const SceneSphere& aSceneSphere, int aPrimID, LightBounds& oBounds) const
+	{
+		return false;
+	}
+
+	// Lights made of several primitives (mesh lights) are picked one
+	// primitive at a time by the light samplers, the others have only
+	// primitive 0
+	virtual int getPrimitiveCount() const
+	{
+		return 1;
+	}
+
+	// Picks a primitive proportionally to its power, for the light
+	// samplers that ignore the shading point
+	virtual int samplePrimitive(float aRnd, float& oPdf) const
+	{
+		oPdf = 1.f;
+		return 0;
+	}
+
+	// Probability of samplePrimitive picking aPrimID
+	virtual float getPrimitivePdf(int aPrimID) const
+	{
+		return 1.f;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+	// Emission interface of the bidirectional renderers. None of the pdfs
+	// include the probability of picking the light. Area pdfs of infinite
+	// lights are solid angle pdfs of the direction towards the light.
+
+	// Samples a light path origin and its direction. oEmissionPdfW is the pdf
+	// of the pair (area times solid angle), oDirectPdfA the area pdf of
+	// illuminate generating the same point, oCosThetaLight the cosine at the
+	// light. Returns the emitted radiance (intensity for point lights) times
+	// oCosThetaLight.
+	virtual Vec3f emit(
+		const SceneSphere& aSceneSphere,
+		const Vec2f& aDirRnd,
+		const Vec3f& aPosRnd,
+		Vec3f& oPosition,
+		Vec3f& oDirection,
+		float& oEmissionPdfW,
+		float& oDirectPdfA,
+		float& oCosThetaLight) const
+	{
+		return Vec3f(0);
+	}
+
+	// Samples a point on the light as seen from aReceivingPosition, returns
+	// the radiance arriving from it. oDirectPdfW is the solid angle pdf at
+	// the receiver, oEmissionPdfW the pdf of emit generating the sample.
+	virtual Vec3f illuminate(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aReceivingPosition,
+		const Vec3f& aRnd,
+		Vec3f& oDirectionToLight,
+		float& oDistance,
+		float& oDirectPdfW,
+		float& oEmissionPdfW,
+		float& oCosAtLight) const
+	{
+		return Vec3f(0);
+	}
+
+	// Radiance arriving along aRayDirection from the point aHitPoint of
+	// primitive aPrimID of the light, with the pdfs of illuminate and emit
+	// generating that point
+	virtual Vec3f getEmittedRadiance(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aRayDirection,
+		const Vec3f& aHitPoint,
+		int aPrimID,
+		float& oDirectPdfA,
+		float& oEmissionPdfW) const
+	{
+		return Vec3f(0);
+	}
+
+private:
+
+	unsigned char mType;
+	unsigned char mFlags;
 };
 
 
@@ -35,7 +186,8 @@ public:
     AreaLight(
         const Vec3f &aP0,
         const Vec3f &aP1,
-        const Vec3f &aP2)
+        const Vec3f &aP2) :
+        AbstractLight(kArea, kFlagArea)
     {
         p0 = aP0;
         e1 = aP1 - aP0;
@@ -52,12 +204,37 @@ public:
 		return mRadiance;
 	}
 
-	virtual Vec3f sampleIllumination(
-		const Vec3f rndGen, 
-		const Vec3f& aSurfPt,
-		const Frame& aFrame,
-		Vec3f& oWig,
-		float& oLightDist) const
+	virtual Vec3f sampleIllumination(
+		const Vec3f rndGen, 
+		const Vec3f& aSurfPt,
+		const Frame& aFrame,
+		Vec3f& oWig,
+		float& oLightDist,
+		int& oPrimID) const
+	{
+		oPrimID = 0;
+		return SampleIllumination(p0, e1, e2, mFrame.mZ, mInvArea, mRadiance,
+			rndGen, aSurfPt, aFrame, oWig, oLightDist);
+	}
+
+	virtual float getPDF(float lightDist, Vec3f wig, int aPrimID) const
+	{
+		return GetPDF(mFrame.mZ, mInvArea, lightDist, wig);
+	}
+
+	// Implementations on plain data, shared with the light storage
+	static Vec3f SampleIllumination(
+		const Vec3f& p0,
+		const Vec3f& e1,
+		const Vec3f& e2,
+		const Vec3f& aNormal,
+		float aInvArea,
+		const Vec3f& aRadiance,
+		const Vec3f& rndGen,
+		const Vec3f& aSurfPt,
+		const Frame& aFrame,
+		Vec3f& oWig,
+		float& oLightDist)
 	{
 		// get random x and y coordinate
 		float areaX = rndGen.x;
@@ -80,7 +257,7 @@ public:
 		oWig /= oLightDist;
 
 		float cosThetaX = Dot(aFrame.mZ, oWig); // at surface point
-		float cosThetaY = Dot(mFrame.mZ, -oWig); // at light source
+		float cosThetaY = Dot(aNormal, -oWig); // at light source
 
 		if (cosThetaX <= 0)
 			return Vec3f(0);
@@ -88,21 +265,178 @@ public:
 		if (cosThetaY <= 0)
 			return Vec3f(0);
 
-		return mRadiance * (cosThetaX * cosThetaY) / (distSqr * mInvArea);
+		return aRadiance * (cosThetaX * cosThetaY) / (distSqr * aInvArea);
 	}
 
-	virtual float getPDF(float lightDist, Vec3f wig) const
-	{
-		float cosine = Dot(mFrame.mZ, -wig);
+	static float GetPDF(
+		const Vec3f& aNormal,
+		float aInvArea,
+		float lightDist,
+		const Vec3f& wig)
+	{
+		float cosine = Dot(aNormal, -wig);
 		
 		// without this statement, light box would have unplausible 
-		// "light stipe" in the box
-		if (cosine < 0)
+		// "light stipe" in the box. The back is never sampled, the pdf
+		// is 0 there and not infinite, so MIS weights stay finite when the
+		// light sampler gives the light no chance either.
+		if (cosine <= 0)
 		{
-			cosine = 0;
+			return 0;
 		}
 		
-		return (lightDist * lightDist) * mInvArea / cosine;
+		return (lightDist * lightDist) * aInvArea / cosine;
+	}
+
+	virtual float getPower(const SceneSphere& aSceneSphere) const
+	{
+		return Luminance(mRadiance) * PI_F / mInvArea;
+	}
+
+	virtual Vec3f emit(
+		const SceneSphere& aSceneSphere,
+		const Vec2f& aDirRnd,
+		const Vec3f& aPosRnd,
+		Vec3f& oPosition,
+		Vec3f& oDirection,
+		float& oEmissionPdfW,
+		float& oDirectPdfA,
+		float& oCosThetaLight) const
+	{
+		return Emit(p0, e1, e2, mFrame, mInvArea, mRadiance, aDirRnd, aPosRnd,
+			oPosition, oDirection, oEmissionPdfW, oDirectPdfA, oCosThetaLight);
+	}
+
+	virtual Vec3f illuminate(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aReceivingPosition,
+		const Vec3f& aRnd,
+		Vec3f& oDirectionToLight,
+		float& oDistance,
+		float& oDirectPdfW,
+		float& oEmissionPdfW,
+		float& oCosAtLight) const
+	{
+		return Illuminate(p0, e1, e2, mFrame.mZ, mInvArea, mRadiance, aReceivingPosition, aRnd,
+			oDirectionToLight, oDistance, oDirectPdfW, oEmissionPdfW, oCosAtLight);
+	}
+
+	virtual Vec3f getEmittedRadiance(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aRayDirection,
+		const Vec3f& aHitPoint,
+		int aPrimID,
+		float& oDirectPdfA,
+		float& oEmissionPdfW) const
+	{
+		return GetEmittedRadiance(mFrame.mZ, mInvArea, mRadiance, aRayDirection,
+			oDirectPdfA, oEmissionPdfW);
+	}
+
+	// uniformly distributed point on the triangle
+	static Vec3f SamplePoint(
+		const Vec3f& p0,
+		const Vec3f& e1,
+		const Vec3f& e2,
+		const Vec3f& rndGen)
+	{
+		float areaX = rndGen.x;
+		float areaY = rndGen.y;
+
+		if (areaX + areaY >= 1)
+		{
+			areaX = 1 - areaX;
+			areaY = 1 - areaY;
+		}
+
+		return p0 + (areaX * e1) + (areaY * e2);
+	}
+
+	// cosine weighted emission from a uniformly sampled point
+	static Vec3f Emit(
+		const Vec3f& p0,
+		const Vec3f& e1,
+		const Vec3f& e2,
+		const Frame& aFrame,
+		float aInvArea,
+		const Vec3f& aRadiance,
+		const Vec2f& aDirRnd,
+		const Vec3f& aPosRnd,
+		Vec3f& oPosition,
+		Vec3f& oDirection,
+		float& oEmissionPdfW,
+		float& oDirectPdfA,
+		float& oCosThetaLight)
+	{
+		oPosition = SamplePoint(p0, e1, e2, aPosRnd);
+
+		const Vec3f localDir = SampleCosHemisphereW(aDirRnd, &oEmissionPdfW);
+		oDirection      = aFrame.ToWorld(localDir);
+		oEmissionPdfW  *= aInvArea;
+		oDirectPdfA     = aInvArea;
+		oCosThetaLight  = localDir.z;
+
+		return aRadiance * localDir.z;
+	}
+
+	static Vec3f Illuminate(
+		const Vec3f& p0,
+		const Vec3f& e1,
+		const Vec3f& e2,
+		const Vec3f& aNormal,
+		float aInvArea,
+		const Vec3f& aRadiance,
+		const Vec3f& aReceivingPosition,
+		const Vec3f& aRnd,
+		Vec3f& oDirectionToLight,
+		float& oDistance,
+		float& oDirectPdfW,
+		float& oEmissionPdfW,
+		float& oCosAtLight)
+	{
+		oDirectionToLight = SamplePoint(p0, e1, e2, aRnd) - aReceivingPosition;
+		const float distSqr = oDirectionToLight.LenSqr();
+		oDistance = std::sqrt(distSqr);
+		oDirectionToLight /= oDistance;
+
+		oCosAtLight = Dot(aNormal, -oDirectionToLight);
+		if (oCosAtLight <= EPS_COSINE)
+			return Vec3f(0);
+
+		oDirectPdfW   = aInvArea * distSqr / oCosAtLight;
+		oEmissionPdfW = aInvArea * oCosAtLight * INV_PI_F;
+
+		return aRadiance;
+	}
+
+	static Vec3f GetEmittedRadiance(
+		const Vec3f& aNormal,
+		float aInvArea,
+		const Vec3f& aRadiance,
+		const Vec3f& aRayDirection,
+		float& oDirectPdfA,
+		float& oEmissionPdfW)
+	{
+		const float cosOutL = Dot(aNormal, -aRayDirection);
+		if (cosOutL <= 0)
+			return Vec3f(0);
+
+		oDirectPdfA   = aInvArea;
+		oEmissionPdfW = aInvArea * cosOutL * INV_PI_F;
+
+		return aRadiance;
+	}
+
+	// one-sided emitter, emits into the hemisphere around its normal
+	virtual bool getLightBounds(const SceneSphere& aSceneSphere, int aPrimID, LightBounds& oBounds) const
+	{
+		oBounds.mBBoxMin   = Min(p0, Min(p0 + e1, p0 + e2));
+		oBounds.mBBoxMax   = Max(p0, Max(p0 + e1, p0 + e2));
+		oBounds.mAxis      = mFrame.mZ;
+		oBounds.mCosThetaO = 1.f;
+		oBounds.mCosThetaE = 0.f;
+		oBounds.mPower     = getPower(aSceneSphere);
+		return true;
 	}
 
 public:
@@ -117,7 +451,8 @@ class PointLight : public AbstractLight
 {
 public:
 
-    PointLight(const Vec3f& aPosition)
+    PointLight(const Vec3f& aPosition) :
+        AbstractLight(kPoint, kFlagDelta)
     {
         mPosition = aPosition;
     }
@@ -127,9 +462,23 @@ public:
 		const Vec3f& aSurfPt, 
 		const Frame& aFrame, 
 		Vec3f& oWig, 
-		float& oLightDist) const
+		float& oLightDist,
+		int& oPrimID) const
+	{
+		oPrimID = 0;
+		return SampleIllumination(mPosition, mIntensity, aSurfPt, aFrame, oWig, oLightDist);
+	}
+
+	// Implementation on plain data, shared with the light storage
+	static Vec3f SampleIllumination(
+		const Vec3f& aPosition,
+		const Vec3f& aIntensity,
+		const Vec3f& aSurfPt,
+		const Frame& aFrame,
+		Vec3f& oWig,
+		float& oLightDist)
 	{
-		oWig           = mPosition - aSurfPt;
+		oWig           = aPosition - aSurfPt;
 		float distSqr  = oWig.LenSqr();
 		oLightDist     = sqrt(distSqr);
 		
@@ -140,14 +489,72 @@ public:
 		if(cosTheta <= 0)
 			return Vec3f(0);
 
-		return mIntensity * cosTheta / distSqr;
+		return aIntensity * cosTheta / distSqr;
 	}
 
-	virtual float getPDF(float lightDist, Vec3f wig) const
-	{
+	virtual float getPDF(float lightDist, Vec3f wig, int aPrimID) const
+	{
 		return 1;
 	}
 
+	virtual float getPower(const SceneSphere& aSceneSphere) const
+	{
+		return Luminance(mIntensity) * 4 * PI_F;
+	}
+
+	// isotropic emission, the position is fixed
+	virtual Vec3f emit(
+		const SceneSphere& aSceneSphere,
+		const Vec2f& aDirRnd,
+		const Vec3f& aPosRnd,
+		Vec3f& oPosition,
+		Vec3f& oDirection,
+		float& oEmissionPdfW,
+		float& oDirectPdfA,
+		float& oCosThetaLight) const
+	{
+		oPosition      = mPosition;
+		oDirection     = SampleUniformSphereW(aDirRnd, &oEmissionPdfW);
+		oDirectPdfA    = 1.f;
+		oCosThetaLight = 1.f;
+
+		return mIntensity;
+	}
+
+	virtual Vec3f illuminate(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aReceivingPosition,
+		const Vec3f& aRnd,
+		Vec3f& oDirectionToLight,
+		float& oDistance,
+		float& oDirectPdfW,
+		float& oEmissionPdfW,
+		float& oCosAtLight) const
+	{
+		oDirectionToLight = mPosition - aReceivingPosition;
+		const float distSqr = oDirectionToLight.LenSqr();
+		oDistance = std::sqrt(distSqr);
+		oDirectionToLight /= oDistance;
+
+		oDirectPdfW   = distSqr;
+		oEmissionPdfW = UniformSpherePdfW();
+		oCosAtLight   = 1.f;
+
+		return mIntensity;
+	}
+
+	// emits into all directions
+	virtual bool getLightBounds(const SceneSphere& aSceneSphere, int aPrimID, LightBounds& oBounds) const
+	{
+		oBounds.mBBoxMin   = mPosition;
+		oBounds.mBBoxMax   = mPosition;
+		oBounds.mAxis      = Vec3f(0, 0, 1);
+		oBounds.mCosThetaO = -1.f;
+		oBounds.mCosThetaE = 0.f;
+		oBounds.mPower     = getPower(aSceneSphere);
+		return true;
+	}
+
 public:
 
     Vec3f mPosition;
@@ -159,34 +566,78 @@ public:
 class BackgroundLight : public AbstractLight
 {
 public:
-	BackgroundLight()
+	BackgroundLight() :
+		AbstractLight(kBackground, kFlagInfinite),
+		mHasEnvMap(false)
 	{
 		mBackgroundColor = Vec3f(135, 206, 250) / Vec3f(255.f);
 	}
 
-	virtual Vec3f getRadiance() const
-	{
-		return mBackgroundColor;
-	}
+	// Loads a lat-long environment map from a Radiance .hdr file.
+	// The top row is +z, the left column looks along +x.
+	bool LoadEnvMap(const char* aFilename)
+	{
+		if(!mEnvMap.LoadHDR(aFilename))
+			return false;
+
+		const int resX = mEnvMap.GetResX();
+		const int resY = mEnvMap.GetResY();
 
+		// sin(theta) accounts for the rows getting narrower towards the poles
+		std::vector<float> func(resX * resY);
+		for(int y=0; y<resY; y++)
+		{
+			const float sinTheta = std::sin(PI_F * (y + 0.5f) / resY);
+
+			for(int x=0; x<resX; x++)
+				func[x + y*resX] = Luminance(mEnvMap.GetColor(x, y)) * sinTheta;
+		}
+
+		mEnvDistribution.Build(func, resX, resY);
+		mHasEnvMap = true;
+		return true;
+	}
+
+	virtual Vec3f getRadiance() const
+	{
+		return mBackgroundColor;
+	}
+
+	// radiance seen by a ray leaving the scene in direction aDir
+	Vec3f GetRadiance(const Vec3f& aDir) const
+	{
+		if(!mHasEnvMap)
+			return mBackgroundColor;
+
+		const Vec2f uv = DirToUV(aDir);
+		const int x = std::min(int(uv.x * mEnvMap.GetResX()), mEnvMap.GetResX() - 1);
+		const int y = std::min(int(uv.y * mEnvMap.GetResY()), mEnvMap.GetResY() - 1);
+		return mEnvMap.GetColor(x, y);
+	}
 
 	virtual Vec3f sampleIllumination(
 		const Vec3f rndGen, 
 		const Vec3f& aSurfPt,
 		const Frame& aFrame,
 		Vec3f& oWig,
-		float& oLightDist) const
+		float& oLightDist,
+		int& oPrimID) const
 	{
-		// find random point on sphere
-		Vec3f randomPointOnSphere = Vec3f(rndGen.x, rndGen.y, rndGen.z);
-
-		// sample point on surface
-		// by using rational form of sphere
-		Vec3f sampledPoint = Vec3f(cos(2 * PI_F * randomPointOnSphere.y) * sqrt(1 - (randomPointOnSphere.x * randomPointOnSphere.x)),
-			sin(2 * PI_F*randomPointOnSphere.y)*sqrt(1 - (randomPointOnSphere.x * randomPointOnSphere.x)),
-			randomPointOnSphere.x);
+		oPrimID = 0;
+		return SampleIllumination(rndGen, aFrame, oWig, oLightDist);
+	}
 
-		oWig = Normalize(aFrame.ToWorld(sampledPoint));
+	// Non-virtual, used directly by the light storage
+	Vec3f SampleIllumination(
+		const Vec3f& rndGen,
+		const Frame& aFrame,
+		Vec3f& oWig,
+		float& oLightDist) const
+	{
+		float pdf;
+		oWig = SampleDirection(Vec2f(rndGen.x, rndGen.y), pdf);
+		if(pdf == 0)
+			return Vec3f(0);
 
 		// set distance incredibly high
 		oLightDist = std::numeric_limits<float>::max();
@@ -196,15 +647,370 @@ public:
 		if (cosTheta <= 0)
 			return Vec3f(0);
 
-		return mBackgroundColor * cosTheta * (2 * PI_F);
+		return GetRadiance(oWig) * cosTheta / pdf;
 	}
 
-	// virtual float getPDF(float lightDist, Vec3f wig) const
-	virtual float getPDF() const
-	{
-		return (1 / 4 * PI_F);
+	virtual float getPDF(float lightDist, Vec3f wig, int aPrimID) const
+	{
+		return GetPDF(wig);
+	}
+
+	// Solid angle pdf of SampleIllumination generating the direction aDir
+	float GetPDF(const Vec3f& aDir) const
+	{
+		if(!mHasEnvMap)
+			return INV_PI_F * 0.25f;
+
+		const Vec2f uv = DirToUV(aDir);
+		const float sinTheta = std::sin(PI_F * uv.y);
+		if(sinTheta == 0)
+			return 0;
+
+		return mEnvDistribution.Pdf(uv) / (2 * PI_F * PI_F * sinTheta);
+	}
+
+	// radiance arriving from all directions onto the scene's bounding disc
+	virtual float getPower(const SceneSphere& aSceneSphere) const
+	{
+		// integral of the luminance over the sphere of directions
+		const float lumIntegral = mHasEnvMap
+			? 2 * PI_F * PI_F * mEnvDistribution.Integral()
+			: Luminance(mBackgroundColor) * 4 * PI_F;
+
+		return lumIntegral * PI_F * Sqr(aSceneSphere.mSceneRadius);
+	}
+
+	// Rays enter the scene through the disc of the bounding sphere
+	// perpendicular to their direction
+	virtual Vec3f emit(
+		const SceneSphere& aSceneSphere,
+		const Vec2f& aDirRnd,
+		const Vec3f& aPosRnd,
+		Vec3f& oPosition,
+		Vec3f& oDirection,
+		float& oEmissionPdfW,
+		float& oDirectPdfA,
+		float& oCosThetaLight) const
+	{
+		float directPdf;
+		const Vec3f dirToLight = SampleDirection(aDirRnd, directPdf);
+		if(directPdf == 0)
+			return Vec3f(0);
+
+		Frame frame;
+		frame.SetFromZ(dirToLight);
+		const Vec2f xy = SampleConcentricDisc(Vec2f(aPosRnd.x, aPosRnd.y));
+
+		oPosition = aSceneSphere.mSceneCenter + aSceneSphere.mSceneRadius * (
+			dirToLight + frame.Binormal() * xy.x + frame.Tangent() * xy.y);
+		oDirection     = -dirToLight;
+		oEmissionPdfW  = directPdf * ConcentricDiscPdfA() * aSceneSphere.mInvSceneRadiusSqr;
+		oDirectPdfA    = directPdf;
+		oCosThetaLight = 1.f;
+
+		return GetRadiance(dirToLight);
+	}
+
+	virtual Vec3f illuminate(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aReceivingPosition,
+		const Vec3f& aRnd,
+		Vec3f& oDirectionToLight,
+		float& oDistance,
+		float& oDirectPdfW,
+		float& oEmissionPdfW,
+		float& oCosAtLight) const
+	{
+		oDirectionToLight = SampleDirection(Vec2f(aRnd.x, aRnd.y), oDirectPdfW);
+		if(oDirectPdfW == 0)
+			return Vec3f(0);
+
+		oDistance     = 1e36f;
+		oEmissionPdfW = oDirectPdfW * ConcentricDiscPdfA() * aSceneSphere.mInvSceneRadiusSqr;
+		oCosAtLight   = 1.f;
+
+		return GetRadiance(oDirectionToLight);
+	}
+
+	// aRayDirection is the direction of the ray leaving the scene
+	virtual Vec3f getEmittedRadiance(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aRayDirection,
+		const Vec3f& aHitPoint,
+		int aPrimID,
+		float& oDirectPdfA,
+		float& oEmissionPdfW) const
+	{
+		oDirectPdfA   = GetPDF(aRayDirection);
+		oEmissionPdfW = oDirectPdfA * ConcentricDiscPdfA() * aSceneSphere.mInvSceneRadiusSqr;
+
+		return GetRadiance(aRayDirection);
+	}
+
+private:
+
+	// Direction towards the background, importance sampled by the luminance
+	// of the environment map, uniform without one. oPdf is 0 for
+	// directions that cannot be used.
+	Vec3f SampleDirection(const Vec2f& aRnd, float& oPdf) const
+	{
+		if(!mHasEnvMap)
+			return SampleUniformSphereW(aRnd, &oPdf);
+
+		// importance sample the pixels by their luminance
+		float pdfUV;
+		const Vec2f uv = mEnvDistribution.SampleContinuous(aRnd, pdfUV);
+
+		const float sinTheta = std::sin(PI_F * uv.y);
+		oPdf = (pdfUV == 0 || sinTheta == 0) ? 0.f : pdfUV / (2 * PI_F * PI_F * sinTheta);
+
+		return UVToDir(uv);
+	}
+
+	// lat-long parameterization: u = phi / 2pi, v = theta / pi
+	static Vec2f DirToUV(const Vec3f& aDir)
+	{
+		const float theta = std::acos(std::max(-1.f, std::min(1.f, aDir.z)));
+		float phi = std::atan2(aDir.y, aDir.x);
+		if(phi < 0)
+			phi += 2 * PI_F;
+
+		return Vec2f(std::min(phi / (2 * PI_F), 1.f - 1e-7f), std::min(theta / PI_F, 1.f - 1e-7f));
+	}
+
+	static Vec3f UVToDir(const Vec2f& aUV)
+	{
+		const float phi   = aUV.x * 2 * PI_F;
+		const float theta = aUV.y * PI_F;
+		const float sinTheta = std::sin(theta);
+
+		return Vec3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), std::cos(theta));
 	}
 
 public:
 	Vec3f mBackgroundColor;
-};
\ No newline at end of file
+
+private:
+	bool           mHasEnvMap;
+	Framebuffer    mEnvMap;
+	Distribution2D mEnvDistribution;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// All emitting triangles of a mesh with a common radiance, stored as
+// structure of arrays. The light BVH sees each triangle as a light of its
+// own and picks them by their importance for the shading point. The
+// samplers that ignore the shading point, and emit and illuminate, pick
+// the triangles proportionally to their area with an alias table, so a
+// sample costs O(1) regardless of the mesh size.
+// The primitive ID of a triangle is its index in the arrays.
+class MeshLight : public AbstractLight
+{
+public:
+
+	MeshLight() :
+		AbstractLight(kMesh, kFlagArea),
+		mTotalArea(0),
+		mInvTotalArea(0)
+	{
+		mRadiance = Vec3f(0);
+	}
+
+	// Adds a triangle, returns its primitive ID
+	int AddTriangle(
+		const Vec3f& aP0,
+		const Vec3f& aP1,
+		const Vec3f& aP2)
+	{
+		const Vec3f e1 = aP1 - aP0;
+		const Vec3f e2 = aP2 - aP0;
+		const Vec3f normal = Cross(e1, e2);
+
+		mP0.push_back(aP0);
+		mE1.push_back(e1);
+		mE2.push_back(e2);
+		mNormal.push_back(Normalize(normal));
+		mArea.push_back(normal.Length() * 0.5f);
+
+		return (int)mP0.size() - 1;
+	}
+
+	// Builds the sampling table, has to be called after the last AddTriangle
+	void Finalize()
+	{
+		mTotalArea = 0;
+		for(size_t i=0; i<mArea.size(); i++)
+			mTotalArea += mArea[i];
+
+		mInvTotalArea = mTotalArea > 0 ? 1.f / mTotalArea : 0.f;
+		mTriangleTable.Build(mArea);
+	}
+
+	int GetTriangleCount() const
+	{
+		return (int)mP0.size();
+	}
+
+	virtual Vec3f getRadiance() const
+	{
+		return mRadiance;
+	}
+
+	// Picks a triangle with rndGen.z and a point on it with rndGen.x/y.
+	// Picking the triangle with probability area / total area and the
+	// point uniformly on it gives the area pdf 1 / total area.
+	virtual Vec3f sampleIllumination(
+		const Vec3f rndGen,
+		const Vec3f& aSurfPt,
+		const Frame& aFrame,
+		Vec3f& oWig,
+		float& oLightDist,
+		int& oPrimID) const
+	{
+		float triPdf;
+		oPrimID = mTriangleTable.Sample(rndGen.z, triPdf);
+
+		return AreaLight::SampleIllumination(
+			mP0[oPrimID], mE1[oPrimID], mE2[oPrimID], mNormal[oPrimID],
+			mInvTotalArea, mRadiance, rndGen, aSurfPt, aFrame, oWig, oLightDist);
+	}
+
+	virtual float getPDF(float lightDist, Vec3f wig, int aPrimID) const
+	{
+		return AreaLight::GetPDF(mNormal[aPrimID], mInvTotalArea, lightDist, wig);
+	}
+
+	// Samples a point on triangle aPrimID, which the light sampler picked.
+	// Non-virtual, used directly by the light storage.
+	Vec3f SampleIllumination(
+		int aPrimID,
+		const Vec3f& rndGen,
+		const Vec3f& aSurfPt,
+		const Frame& aFrame,
+		Vec3f& oWig,
+		float& oLightDist) const
+	{
+		return AreaLight::SampleIllumination(
+			mP0[aPrimID], mE1[aPrimID], mE2[aPrimID], mNormal[aPrimID],
+			1.f / mArea[aPrimID], mRadiance, rndGen, aSurfPt, aFrame, oWig, oLightDist);
+	}
+
+	// Solid angle pdf of SampleIllumination on triangle aPrimID
+	float GetPDF(
+		int aPrimID,
+		float lightDist,
+		const Vec3f& wig) const
+	{
+		return AreaLight::GetPDF(mNormal[aPrimID], 1.f / mArea[aPrimID], lightDist, wig);
+	}
+
+	// Same as illuminate on triangle aPrimID, which the light sampler picked
+	Vec3f Illuminate(
+		int aPrimID,
+		const Vec3f& aReceivingPosition,
+		const Vec3f& aRnd,
+		Vec3f& oDirectionToLight,
+		float& oDistance,
+		float& oDirectPdfW,
+		float& oEmissionPdfW,
+		float& oCosAtLight) const
+	{
+		return AreaLight::Illuminate(mP0[aPrimID], mE1[aPrimID], mE2[aPrimID], mNormal[aPrimID],
+			1.f / mArea[aPrimID], mRadiance, aReceivingPosition, aRnd,
+			oDirectionToLight, oDistance, oDirectPdfW, oEmissionPdfW, oCosAtLight);
+	}
+
+	virtual float getPower(const SceneSphere& aSceneSphere) const
+	{
+		return Luminance(mRadiance) * PI_F * mTotalArea;
+	}
+
+	// aPosRnd.z picks the triangle like in SampleIllumination
+	virtual Vec3f emit(
+		const SceneSphere& aSceneSphere,
+		const Vec2f& aDirRnd,
+		const Vec3f& aPosRnd,
+		Vec3f& oPosition,
+		Vec3f& oDirection,
+		float& oEmissionPdfW,
+		float& oDirectPdfA,
+		float& oCosThetaLight) const
+	{
+		float triPdf;
+		const int primID = mTriangleTable.Sample(aPosRnd.z, triPdf);
+
+		Frame frame;
+		frame.SetFromZ(mNormal[primID]);
+
+		return AreaLight::Emit(mP0[primID], mE1[primID], mE2[primID], frame,
+			mInvTotalArea, mRadiance, aDirRnd, aPosRnd,
+			oPosition, oDirection, oEmissionPdfW, oDirectPdfA, oCosThetaLight);
+	}
+
+	virtual Vec3f illuminate(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aReceivingPosition,
+		const Vec3f& aRnd,
+		Vec3f& oDirectionToLight,
+		float& oDistance,
+		float& oDirectPdfW,
+		float& oEmissionPdfW,
+		float& oCosAtLight) const
+	{
+		float triPdf;
+		const int primID = mTriangleTable.Sample(aRnd.z, triPdf);
+
+		return AreaLight::Illuminate(mP0[primID], mE1[primID], mE2[primID], mNormal[primID],
+			mInvTotalArea, mRadiance, aReceivingPosition, aRnd,
+			oDirectionToLight, oDistance, oDirectPdfW, oEmissionPdfW, oCosAtLight);
+	}
+
+	virtual Vec3f getEmittedRadiance(
+		const SceneSphere& aSceneSphere,
+		const Vec3f& aRayDirection,
+		const Vec3f& aHitPoint,
+		int aPrimID,
+		float& oDirectPdfA,
+		float& oEmissionPdfW) const
+	{
+		return AreaLight::GetEmittedRadiance(mNormal[aPrimID], mInvTotalArea, mRadiance,
+			aRayDirection, oDirectPdfA, oEmissionPdfW);
+	}
+
+	// each triangle is a one-sided emitter of its own
+	virtual bool getLightBounds(const SceneSphere& aSceneSphere, int aPrimID, LightBounds& oBounds) const
+	{
+		const Vec3f &p0 = mP0[aPrimID];
+		oBounds.mBBoxMin   = Min(p0, Min(p0 + mE1[aPrimID], p0 + mE2[aPrimID]));
+		oBounds.mBBoxMax   = Max(p0, Max(p0 + mE1[aPrimID], p0 + mE2[aPrimID]));
+		oBounds.mAxis      = mNormal[aPrimID];
+		oBounds.mCosThetaO = 1.f;
+		oBounds.mCosThetaE = 0.f;
+		oBounds.mPower     = Luminance(mRadiance) * PI_F * mArea[aPrimID];
+		return true;
+	}
+
+	virtual int getPrimitiveCount() const
+	{
+		return GetTriangleCount();
+	}
+
+	virtual int samplePrimitive(float aRnd, float& oPdf) const
+	{
+		return mTriangleTable.Sample(aRnd, oPdf);
+	}
+
+	virtual float getPrimitivePdf(int aPrimID) const
+	{
+		return mTriangleTable.Pdf(aPrimID);
+	}
+
+public:
+	std::vector<Vec3f> mP0, mE1, mE2;
+	std::vector<Vec3f> mNormal;
+	std::vector<float> mArea;
+	AliasTable         mTriangleTable;
+	float              mTotalArea;
+	float              mInvTotalArea;
+	Vec3f              mRadiance;
+};
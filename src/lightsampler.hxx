@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "math.hxx"
+#include "lights.hxx"
+#include "aliastable.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Light samplers pick one of the scene lights for next event estimation
+
+class AbstractLightSampler
+{
+public:
+
+    virtual ~AbstractLightSampler(){};
+
+    // Picks a light and one of its primitives (see
+    // AbstractLight::getPrimitiveCount) for the given shading point,
+    // returns the light index and the probability of picking the pair,
+    // or -1 when no light can contribute
+    virtual int Sample(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        float       aRnd,
+        int         &oPrimID,
+        float       &oPdf) const = 0;
+
+    // Probability of Sample picking primitive aPrimID of the given light
+    // at the shading point
+    virtual float Pdf(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        int         aLightIdx,
+        int         aPrimID) const = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Picks lights proportionally to their power, ignores the shading point.
+// The primitive is picked by the light, with what is left of the random
+// number.
+class PowerLightSampler : public AbstractLightSampler
+{
+public:
+
+    PowerLightSampler(
+        const std::vector<AbstractLight*> &aLights,
+        const SceneSphere                 &aSceneSphere) :
+        mLights(aLights.begin(), aLights.end())
+    {
+        std::vector<float> power(aLights.size());
+        for(size_t i=0; i<aLights.size(); i++)
+            power[i] = aLights[i]->getPower(aSceneSphere);
+
+        mTable.Build(power);
+    }
+
+    virtual int Sample(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        float       aRnd,
+        int         &oPrimID,
+        float       &oPdf) const
+    {
+        if(mTable.Size() == 0)
+            return -1;
+
+        float primRnd, primPdf;
+        const int lightIdx = mTable.Sample(aRnd, oPdf, primRnd);
+        oPrimID = mLights[lightIdx]->samplePrimitive(primRnd, primPdf);
+        oPdf   *= primPdf;
+        return lightIdx;
+    }
+
+    virtual float Pdf(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        int         aLightIdx,
+        int         aPrimID) const
+    {
+        return mTable.Pdf(aLightIdx) * mLights[aLightIdx]->getPrimitivePdf(aPrimID);
+    }
+
+    // Picks a whole light, for the renderers that leave the choice of the
+    // primitive to AbstractLight::emit and illuminate
+    int SampleLight(
+        float aRnd,
+        float &oPdf) const
+    {
+        if(mTable.Size() == 0)
+            return -1;
+
+        return mTable.Sample(aRnd, oPdf);
+    }
+
+    // Probability of SampleLight picking the given light
+    float LightPdf(int aLightIdx) const
+    {
+        return mTable.Pdf(aLightIdx);
+    }
+
+private:
+
+    std::vector<const AbstractLight*> mLights;
+    AliasTable                        mTable;
+};
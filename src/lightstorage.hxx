@@ -0,0 +1,259 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "math.hxx"
+#include "lights.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Light samples of one shading point, evaluated in a batch
+
+struct LightSampleBatch
+{
+    void Resize(int aCount)
+    {
+        mLightIdx.resize(aCount);
+        mPrimID.resize(aCount);
+        mPickPdf.resize(aCount);
+        mRnd.resize(aCount);
+        mIllum.resize(aCount);
+        mWig.resize(aCount);
+        mLightDist.resize(aCount);
+        mPdf.resize(aCount);
+    }
+
+    int                mCount;
+
+    // Inputs
+    std::vector<int>   mLightIdx;  //!< Index of the sampled light
+    std::vector<int>   mPrimID;    //!< Picked primitive of the light
+    std::vector<float> mPickPdf;   //!< Probability of picking the light and primitive
+    std::vector<Vec3f> mRnd;       //!< Random numbers for sampling the light
+
+    // Outputs
+    std::vector<Vec3f> mIllum;     //!< Illumination estimate, see sampleIllumination
+    std::vector<Vec3f> mWig;       //!< Direction towards the light
+    std::vector<float> mLightDist; //!< Distance to the light
+    std::vector<float> mPdf;       //!< Solid angle pdf of the light sample
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Light storage
+//
+// Copy of the scene lights in per-type arrays (structure of arrays),
+// indexed by the same light index as Scene::mLights. Lets the renderers
+// evaluate the lights with a switch on the type tag instead of virtual
+// calls and dynamic casts.
+
+class LightStorage
+{
+public:
+
+    void Build(const std::vector<AbstractLight*> &aLights)
+    {
+        *this = LightStorage();
+
+        mType.resize(aLights.size());
+        mFlags.resize(aLights.size());
+        mIndex.resize(aLights.size());
+
+        for(size_t i=0; i<aLights.size(); i++)
+        {
+            mType[i]  = (unsigned char)aLights[i]->GetType();
+            mFlags[i] = (unsigned char)(
+                (aLights[i]->IsDelta() ? AbstractLight::kFlagDelta : 0) |
+                (aLights[i]->IsArea()  ? AbstractLight::kFlagArea  : 0));
+
+            switch(aLights[i]->GetType())
+            {
+            case AbstractLight::kArea:
+            {
+                const AreaLight *light = static_cast<const AreaLight*>(aLights[i]);
+                mIndex[i] = (int)mAreaP0.size();
+                mAreaP0.push_back(light->p0);
+                mAreaE1.push_back(light->e1);
+                mAreaE2.push_back(light->e2);
+                mAreaNormal.push_back(light->mFrame.mZ);
+                mAreaInvArea.push_back(light->mInvArea);
+                mAreaRadiance.push_back(light->mRadiance);
+                break;
+            }
+            case AbstractLight::kPoint:
+            {
+                const PointLight *light = static_cast<const PointLight*>(aLights[i]);
+                mIndex[i] = (int)mPointPosition.size();
+                mPointPosition.push_back(light->mPosition);
+                mPointIntensity.push_back(light->mIntensity);
+                break;
+            }
+            case AbstractLight::kBackground:
+            {
+                // may hold a whole environment map, keep a pointer
+                mIndex[i] = (int)mBackgroundLights.size();
+                mBackgroundLights.push_back(static_cast<const BackgroundLight*>(aLights[i]));
+                break;
+            }
+            case AbstractLight::kMesh:
+            {
+                // mesh lights are stored as structure of arrays already,
+                // keep a pointer instead of copying the triangles
+                mIndex[i] = (int)mMeshLights.size();
+                mMeshLights.push_back(static_cast<const MeshLight*>(aLights[i]));
+                break;
+            }
+            }
+        }
+    }
+
+    AbstractLight::LightType GetType(int aLightIdx) const
+    {
+        return AbstractLight::LightType(mType[aLightIdx]);
+    }
+
+    bool IsDelta(int aLightIdx) const
+    {
+        return (mFlags[aLightIdx] & AbstractLight::kFlagDelta) != 0;
+    }
+
+    bool IsArea(int aLightIdx) const
+    {
+        return (mFlags[aLightIdx] & AbstractLight::kFlagArea) != 0;
+    }
+
+    // Radiance a ray along aRayDirection receives from primitive aPrimID
+    // of a light it hit, the emitted radiance of AbstractLight without the
+    // pdfs. Area and mesh lights are one-sided, their backs are black. The
+    // background radiance depends on the direction, see
+    // BackgroundLight::GetRadiance
+    Vec3f GetEmittedRadiance(
+        int          aLightIdx,
+        int          aPrimID,
+        const Vec3f  &aRayDirection) const
+    {
+        const int idx = mIndex[aLightIdx];
+        float directPdfA, emissionPdfW;
+
+        switch(mType[aLightIdx])
+        {
+        case AbstractLight::kArea:
+            return AreaLight::GetEmittedRadiance(mAreaNormal[idx], mAreaInvArea[idx], mAreaRadiance[idx],
+                aRayDirection, directPdfA, emissionPdfW);
+        case AbstractLight::kMesh:
+        {
+            const MeshLight *light = mMeshLights[idx];
+            return AreaLight::GetEmittedRadiance(light->mNormal[aPrimID], light->mInvTotalArea, light->mRadiance,
+                aRayDirection, directPdfA, emissionPdfW);
+        }
+        default:
+            return Vec3f(0);
+        }
+    }
+
+    // Samples the light on primitive aPrimID, picked by the light sampler
+    Vec3f SampleIllumination(
+        int          aLightIdx,
+        int          aPrimID,
+        const Vec3f  &aRnd,
+        const Vec3f  &aSurfPt,
+        const Frame  &aFrame,
+        Vec3f        &oWig,
+        float        &oLightDist) const
+    {
+        const int idx = mIndex[aLightIdx];
+
+        switch(mType[aLightIdx])
+        {
+        case AbstractLight::kArea:
+            return AreaLight::SampleIllumination(
+                mAreaP0[idx], mAreaE1[idx], mAreaE2[idx], mAreaNormal[idx],
+                mAreaInvArea[idx], mAreaRadiance[idx],
+                aRnd, aSurfPt, aFrame, oWig, oLightDist);
+        case AbstractLight::kPoint:
+            return PointLight::SampleIllumination(
+                mPointPosition[idx], mPointIntensity[idx],
+                aSurfPt, aFrame, oWig, oLightDist);
+        case AbstractLight::kBackground:
+            return mBackgroundLights[idx]->SampleIllumination(
+                aRnd, aFrame, oWig, oLightDist);
+        case AbstractLight::kMesh:
+            return mMeshLights[idx]->SampleIllumination(
+                aPrimID, aRnd, aSurfPt, aFrame, oWig, oLightDist);
+        default:
+            return Vec3f(0);
+        }
+    }
+
+    // Solid angle pdf of SampleIllumination on primitive aPrimID
+    float GetPDF(
+        int          aLightIdx,
+        int          aPrimID,
+        float        aLightDist,
+        const Vec3f  &aWig) const
+    {
+        const int idx = mIndex[aLightIdx];
+
+        switch(mType[aLightIdx])
+        {
+        case AbstractLight::kArea:
+            return AreaLight::GetPDF(mAreaNormal[idx], mAreaInvArea[idx], aLightDist, aWig);
+        case AbstractLight::kPoint:
+            return 1.f;
+        case AbstractLight::kBackground:
+            return mBackgroundLights[idx]->GetPDF(aWig);
+        case AbstractLight::kMesh:
+            return mMeshLights[idx]->GetPDF(aPrimID, aLightDist, aWig);
+        default:
+            return 0.f;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Batch versions, evaluate all samples of aoBatch
+
+    void SampleIllumination(
+        const Vec3f      &aSurfPt,
+        const Frame      &aFrame,
+        LightSampleBatch &aoBatch) const
+    {
+        for(int i=0; i<aoBatch.mCount; i++)
+        {
+            aoBatch.mIllum[i] = SampleIllumination(aoBatch.mLightIdx[i], aoBatch.mPrimID[i],
+                aoBatch.mRnd[i], aSurfPt, aFrame, aoBatch.mWig[i], aoBatch.mLightDist[i]);
+        }
+
+        GetPDF(aoBatch);
+    }
+
+    void GetPDF(LightSampleBatch &aoBatch) const
+    {
+        for(int i=0; i<aoBatch.mCount; i++)
+        {
+            aoBatch.mPdf[i] = GetPDF(aoBatch.mLightIdx[i], aoBatch.mPrimID[i],
+                aoBatch.mLightDist[i], aoBatch.mWig[i]);
+        }
+    }
+
+private:
+
+    std::vector<unsigned char> mType;  //!< AbstractLight::LightType of each light
+    std::vector<unsigned char> mFlags; //!< AbstractLight::LightFlags of each light
+    std::vector<int>           mIndex; //!< Index into the arrays of its type
+
+    // Area lights
+    std::vector<Vec3f> mAreaP0;
+    std::vector<Vec3f> mAreaE1;
+    std::vector<Vec3f> mAreaE2;
+    std::vector<Vec3f> mAreaNormal;
+    std::vector<float> mAreaInvArea;
+    std::vector<Vec3f> mAreaRadiance;
+
+    // Point lights
+    std::vector<Vec3f> mPointPosition;
+    std::vector<Vec3f> mPointIntensity;
+
+    // Background lights, owned by the scene
+    std::vector<const BackgroundLight*> mBackgroundLights;
+
+    // Mesh lights, owned by the scene
+    std::vector<const MeshLight*> mMeshLights;
+};
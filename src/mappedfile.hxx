@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Read-only memory mapped file
+//
+// The loaders parse the mapped bytes in place, the pages are read in by
+// the OS when first touched and can be shared by the parsing threads.
+// Files read piecemeal, like a streamed scene cache, are not read ahead
+// and hand the pages they are done with back with Release.
+
+class MappedFile
+{
+public:
+
+    static const size_t kFaultAround = 64 << 10; //!< Bytes Linux maps around a faulted page at most
+
+    MappedFile() :
+        mData(NULL), mSize(0)
+    {}
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    // aPrefetch asks the OS to start reading the whole file
+    bool Open(
+        const char *aFilename,
+        bool       aPrefetch = true)
+    {
+        Close();
+
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(aFilename, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, aPrefetch ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, NULL);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(file, &size))
+        {
+            CloseHandle(file);
+            return false;
+        }
+
+        mSize = size_t(size.QuadPart);
+        if(mSize > 0)
+        {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if(mapping)
+            {
+                mData = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        const int file = open(aFilename, O_RDONLY);
+        if(file < 0)
+            return false;
+
+        struct stat info;
+        if(fstat(file, &info) != 0)
+        {
+            close(file);
+            return false;
+        }
+
+        mSize = size_t(info.st_size);
+        if(mSize > 0)
+        {
+            void *data = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, file, 0);
+            if(data != MAP_FAILED)
+            {
+                mData = (const char*)data;
+                madvise(data, mSize, aPrefetch ? MADV_WILLNEED : MADV_RANDOM);
+            }
+        }
+        close(file);
+#endif
+
+        // empty files have no mapping but are valid
+        if(mSize > 0 && !mData)
+        {
+            mSize = 0;
+            return false;
+        }
+
+        return true;
+    }
+
+    void Close()
+    {
+        if(mData)
+        {
+#if defined(_WIN32)
+            UnmapViewOfFile(mData);
+#else
+            munmap((void*)mData, mSize);
+#endif
+        }
+
+        mData = NULL;
+        mSize = 0;
+    }
+
+    // Drops the pages of a range from the memory of the process, they are
+    // read again from the file when touched
+    void Release(
+        size_t aOffset,
+        size_t aSize) const
+    {
+        if(!mData || aSize == 0)
+            return;
+
+#if defined(_WIN32)
+        // unlocking pages that are not locked takes them out of the working set
+        VirtualUnlock((LPVOID)(mData + aOffset), std::min(aSize, mSize - aOffset));
+#else
+        // whole pages and the neighbors a fault may have mapped along with
+        // them, those still in use are read again when next touched
+        const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+        const size_t begin = (aOffset - std::min(aOffset, size_t(kFaultAround))) / pageSize * pageSize;
+        const size_t end   = std::min(mSize, aOffset + aSize + size_t(kFaultAround));
+
+        madvise((void*)(mData + begin), end - begin, MADV_DONTNEED);
+#endif
+    }
+
+    const char* GetData() const { return mData; }
+    size_t GetSize() const { return mSize; }
+
+private:
+
+    // not copyable, the mapping has a single owner
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+private:
+
+    const char *mData;
+    size_t     mSize;
+};
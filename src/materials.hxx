@@ -16,6 +16,9 @@ public:
         mDiffuseReflectance = Vec3f(0);
         mPhongReflectance   = Vec3f(0);
         mPhongExponent      = 1.f;
+        mDiffuseTexture     = -1;
+        mPhongTexture       = -1;
+        mExponentTexture    = -1;
     }
 
 	// function that returns the maximum component in a vector
@@ -130,5 +133,9 @@ public:
     Vec3f mDiffuseReflectance;
     Vec3f mPhongReflectance;
     float mPhongExponent;
-	Rng mRng;
+
+    // Textures of the scene scaling the values above, -1 for none
+    int   mDiffuseTexture;
+    int   mPhongTexture;
+    int   mExponentTexture;
 };
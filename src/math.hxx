@@ -71,6 +71,7 @@ public:
     T&       Get(int a)       { return reinterpret_cast<T*>(this)[a]; }
     Vec2x<T> GetXY() const    { return Vec2x<T>(x, y); }
     T        Max()   const    { T res = Get(0); for(int i=1; i<3; i++) res = std::max(res, Get(i)); return res;}
+    T        Min()   const    { T res = Get(0); for(int i=1; i<3; i++) res = std::min(res, Get(i)); return res;}
     
     bool     IsZero() const
     {
@@ -135,6 +136,17 @@ Vec3f Normalize(const Vec3f& a)
     return a / len;
 }
 
+// Component-wise minimum and maximum
+Vec3f Min(const Vec3f &a, const Vec3f &b)
+{
+    return Vec3f(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+Vec3f Max(const Vec3f &a, const Vec3f &b)
+{
+    return Vec3f(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
 class Mat4f
 {
 public:
@@ -222,6 +234,22 @@ public:
         return res;
     }
 
+    // Rotation by aDegrees around the normalized aAxis, counter-clockwise
+    // looking against the axis
+    static Mat4f Rotate(const Vec3f& aAxis, float aDegrees)
+    {
+        const float angle = aDegrees * PI_F / 180.f;
+        const float s = std::sin(angle);
+        const float c = std::cos(angle);
+        const Vec3f &a = aAxis;
+
+        Mat4f res = Mat4f::Indetity();
+        res.SetRow(0, a.x * a.x * (1 - c) + c,       a.x * a.y * (1 - c) - a.z * s, a.x * a.z * (1 - c) + a.y * s, 0);
+        res.SetRow(1, a.y * a.x * (1 - c) + a.z * s, a.y * a.y * (1 - c) + c,       a.y * a.z * (1 - c) - a.x * s, 0);
+        res.SetRow(2, a.z * a.x * (1 - c) - a.y * s, a.z * a.y * (1 - c) + a.x * s, a.z * a.z * (1 - c) + c,       0);
+        return res;
+    }
+
     static Mat4f Perspective(
         float aFov,
         float aNear,
@@ -0,0 +1,493 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "math.hxx"
+#include "ray.hxx"
+#include "utils.hxx"
+#include "sampler.hxx"
+#include "brickgrid.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Henyey-Greenstein phase function, isotropic for mG = 0
+
+class PhaseFunction
+{
+public:
+
+    PhaseFunction(float aG = 0.f) :
+        mG(aG)
+    {}
+
+    // Density of scattering from the propagation direction aDirIn
+    // into aDirOut, normalized over the sphere of aDirOut
+    float Eval(const Vec3f &aDirIn, const Vec3f &aDirOut) const
+    {
+        return HenyeyGreenstein(Dot(aDirIn, aDirOut));
+    }
+
+    // Samples aDirOut proportionally to Eval, oPdf equals Eval
+    Vec3f Sample(const Vec3f &aDirIn, const Vec2f &aRnd, float &oPdf) const
+    {
+        float cosTheta;
+        if(std::abs(mG) < 1e-3f)
+            cosTheta = 1.f - 2.f * aRnd.y;
+        else
+        {
+            const float term = (1.f - Sqr(mG)) / (1.f - mG + 2.f * mG * aRnd.y);
+            cosTheta = (1.f + Sqr(mG) - Sqr(term)) / (2.f * mG);
+        }
+
+        cosTheta = std::max(-1.f, std::min(1.f, cosTheta));
+        const float sinTheta = std::sqrt(std::max(0.f, 1.f - Sqr(cosTheta)));
+        const float phi = 2.f * PI_F * aRnd.x;
+
+        Frame frame;
+        frame.SetFromZ(aDirIn);
+        const Vec3f dirOut = frame.ToWorld(
+            Vec3f(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta));
+
+        oPdf = HenyeyGreenstein(cosTheta);
+        return dirOut;
+    }
+
+private:
+
+    float HenyeyGreenstein(float aCosTheta) const
+    {
+        const float denom = 1.f + Sqr(mG) - 2.f * mG * aCosTheta;
+        return INV_PI_F * 0.25f * (1.f - Sqr(mG)) / (denom * std::sqrt(denom));
+    }
+
+public:
+
+    float mG; //!< Mean cosine of the scattering angle
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Participating medium filling a part of the scene.
+// The surfaces in the medium do not bound it, rays travel through the
+// medium between any two surface hits.
+
+class AbstractMedium
+{
+public:
+
+    AbstractMedium(const PhaseFunction &aPhase) :
+        mPhase(aPhase)
+    {}
+
+    virtual ~AbstractMedium(){}
+
+    // Samples a free flight distance along aRay, up to aMaxDist. Returns true
+    // when the ray scatters in the medium at oDist, false when it reaches
+    // aMaxDist. oWeight is the throughput factor of the sampled event
+    // (scattering coefficient or transmittance divided by its probability).
+    virtual bool SampleDistance(
+        const Ray             &aRay,
+        float                 aMaxDist,
+        const AbstractSampler &aSampler,
+        SamplerState          &aoState,
+        float                 &oDist,
+        Vec3f                 &oWeight) const = 0;
+
+    // Transmittance (or an unbiased estimate of it) along aRay up to aMaxDist
+    virtual Vec3f Transmittance(
+        const Ray             &aRay,
+        float                 aMaxDist,
+        const AbstractSampler &aSampler,
+        SamplerState          &aoState) const = 0;
+
+    const PhaseFunction& GetPhase() const { return mPhase; }
+
+protected:
+
+    // Clips the ray segment [0, aMaxDist] to the sphere,
+    // returns false when they do not overlap
+    static bool ClipToSphere(
+        const Ray   &aRay,
+        float       aMaxDist,
+        const Vec3f &aCenter,
+        float       aRadius,
+        float       &oNear,
+        float       &oFar)
+    {
+        const Vec3f toOrigin = aRay.org - aCenter;
+        const float b = Dot(toOrigin, aRay.dir);
+        const float c = toOrigin.LenSqr() - Sqr(aRadius);
+        const float disc = Sqr(b) - c;
+
+        if(disc <= 0)
+            return false;
+
+        const float sqrtDisc = std::sqrt(disc);
+        oNear = std::max(0.f, -b - sqrtDisc);
+        oFar  = std::min(aMaxDist, -b + sqrtDisc);
+
+        return oNear < oFar;
+    }
+
+protected:
+
+    PhaseFunction mPhase;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Homogeneous medium inside a sphere, usually the scene's bounding sphere.
+// Free flight distances are sampled with the extinction of a randomly picked
+// color channel and weighted by the average pdf of all channels, so
+// chromatic media stay unbiased.
+
+class HomogeneousMedium : public AbstractMedium
+{
+public:
+
+    HomogeneousMedium(
+        const Vec3f         &aSigmaA,
+        const Vec3f         &aSigmaS,
+        const PhaseFunction &aPhase,
+        const Vec3f         &aCenter,
+        float               aRadius) :
+        AbstractMedium(aPhase),
+        mSigmaS(aSigmaS),
+        mSigmaT(aSigmaA + aSigmaS),
+        mCenter(aCenter),
+        mRadius(aRadius)
+    {}
+
+    virtual bool SampleDistance(
+        const Ray             &aRay,
+        float                 aMaxDist,
+        const AbstractSampler &aSampler,
+        SamplerState          &aoState,
+        float                 &oDist,
+        Vec3f                 &oWeight) const
+    {
+        const Vec2f rnd = aSampler.Get2D(aoState);
+
+        float tNear, tFar;
+        if(!ClipToSphere(aRay, aMaxDist, mCenter, mRadius, tNear, tFar))
+        {
+            oWeight = Vec3f(1);
+            return false;
+        }
+
+        const int channel = std::min(int(rnd.x * 3.f), 2);
+        const float sigmaT = mSigmaT.Get(channel);
+        const float segment = tFar - tNear;
+        const float dist = sigmaT > 0 ? -std::log(1.f - rnd.y) / sigmaT : 1e36f;
+
+        if(dist < segment)
+        {
+            const Vec3f tr = Exp(-mSigmaT * dist);
+            const float pdf = Average(mSigmaT * tr);
+
+            oDist   = tNear + dist;
+            oWeight = pdf > 0 ? mSigmaS * tr / pdf : Vec3f(0);
+            return true;
+        }
+
+        const Vec3f tr = Exp(-mSigmaT * segment);
+        const float prob = Average(tr);
+
+        oWeight = prob > 0 ? tr / prob : Vec3f(0);
+        return false;
+    }
+
+    virtual Vec3f Transmittance(
+        const Ray             &aRay,
+        float                 aMaxDist,
+        const AbstractSampler &aSampler,
+        SamplerState          &aoState) const
+    {
+        float tNear, tFar;
+        if(!ClipToSphere(aRay, aMaxDist, mCenter, mRadius, tNear, tFar))
+            return Vec3f(1);
+
+        return Exp(-mSigmaT * (tFar - tNear));
+    }
+
+private:
+
+    static Vec3f Exp(const Vec3f &aVec)
+    {
+        return Vec3f(std::exp(aVec.x), std::exp(aVec.y), std::exp(aVec.z));
+    }
+
+    static float Average(const Vec3f &aVec)
+    {
+        return (aVec.x + aVec.y + aVec.z) / 3.f;
+    }
+
+    Vec3f mSigmaS;
+    Vec3f mSigmaT;
+    Vec3f mCenter;
+    float mRadius;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Heterogeneous medium given by a brick grid stretched over a box.
+// The extinction is the grid density times mDensityScale and the albedo is
+// constant, so the extinction stays gray. Free flight distances are sampled
+// by delta tracking, the transmittance is estimated by ratio tracking. Both
+// walk the ray through the bricks of the grid and step with the majorant
+// of the current brick, empty bricks are skipped without any sampling.
+
+class HeterogeneousMedium : public AbstractMedium
+{
+public:
+
+    HeterogeneousMedium(
+        const PhaseFunction &aPhase,
+        const Vec3f         &aAlbedo,
+        float               aDensityScale,
+        const Vec3f         &aBoxMin,
+        const Vec3f         &aBoxMax) :
+        AbstractMedium(aPhase),
+        mAlbedo(aAlbedo),
+        mDensityScale(aDensityScale),
+        mBoxMin(aBoxMin),
+        mBoxMax(aBoxMax)
+    {}
+
+    // The density grid, to be filled before rendering
+    BrickGrid& GetGrid() { return mGrid; }
+    const BrickGrid& GetGrid() const { return mGrid; }
+
+    virtual bool SampleDistance(
+        const Ray             &aRay,
+        float                 aMaxDist,
+        const AbstractSampler &aSampler,
+        SamplerState          &aoState,
+        float                 &oDist,
+        Vec3f                 &oWeight) const
+    {
+        DeltaTracker tracker(*this, aRay, aSampler, aoState);
+        Walk(aRay, aMaxDist, tracker);
+
+        if(!tracker.mCollided)
+        {
+            oWeight = Vec3f(1);
+            return false;
+        }
+
+        // real collisions scatter with the albedo, absorption is
+        // accounted for in the weight
+        oDist   = tracker.mDist;
+        oWeight = mAlbedo;
+        return true;
+    }
+
+    virtual Vec3f Transmittance(
+        const Ray             &aRay,
+        float                 aMaxDist,
+        const AbstractSampler &aSampler,
+        SamplerState          &aoState) const
+    {
+        RatioTracker tracker(*this, aRay, aSampler, aoState);
+        Walk(aRay, aMaxDist, tracker);
+
+        return Vec3f(tracker.mTransmittance);
+    }
+
+private:
+
+    // Samples tentative collisions with the brick majorant, a collision is
+    // real with the probability of the density relative to the majorant
+    struct DeltaTracker
+    {
+        DeltaTracker(
+            const HeterogeneousMedium &aMedium,
+            const Ray                 &aRay,
+            const AbstractSampler     &aSampler,
+            SamplerState              &aoState) :
+            mMedium(aMedium), mRay(aRay), mSampler(aSampler), mState(aoState),
+            mCollided(false), mDist(0)
+        {}
+
+        // Tracks through [aT0, aT1] with the majorant, false ends the walk
+        bool Step(float aT0, float aT1, float aMajorant)
+        {
+            const float sigmaMaj = aMajorant * mMedium.mDensityScale;
+
+            for(float t = aT0; ; )
+            {
+                t -= std::log(1.f - mSampler.Get1D(mState)) / sigmaMaj;
+                if(t >= aT1)
+                    return true;
+
+                const float density = mMedium.Density(mRay.org + mRay.dir * t);
+                if(mSampler.Get1D(mState) * aMajorant < density)
+                {
+                    mCollided = true;
+                    mDist     = t;
+                    return false;
+                }
+            }
+        }
+
+        const HeterogeneousMedium &mMedium;
+        const Ray                 &mRay;
+        const AbstractSampler     &mSampler;
+        SamplerState              &mState;
+        bool                      mCollided;
+        float                     mDist;
+    };
+
+    // Multiplies the fractions of null collisions at the tentative
+    // collisions, russian roulette ends the walk at low transmittance
+    struct RatioTracker
+    {
+        RatioTracker(
+            const HeterogeneousMedium &aMedium,
+            const Ray                 &aRay,
+            const AbstractSampler     &aSampler,
+            SamplerState              &aoState) :
+            mMedium(aMedium), mRay(aRay), mSampler(aSampler), mState(aoState),
+            mTransmittance(1)
+        {}
+
+        bool Step(float aT0, float aT1, float aMajorant)
+        {
+            const float sigmaMaj = aMajorant * mMedium.mDensityScale;
+
+            for(float t = aT0; ; )
+            {
+                t -= std::log(1.f - mSampler.Get1D(mState)) / sigmaMaj;
+                if(t >= aT1)
+                    return true;
+
+                const float density = mMedium.Density(mRay.org + mRay.dir * t);
+                mTransmittance *= std::max(0.f, 1.f - density / aMajorant);
+
+                if(mTransmittance < 0.1f)
+                {
+                    if(mSampler.Get1D(mState) >= 0.5f)
+                    {
+                        mTransmittance = 0;
+                        return false;
+                    }
+                    mTransmittance *= 2.f;
+                }
+            }
+        }
+
+        const HeterogeneousMedium &mMedium;
+        const Ray                 &mRay;
+        const AbstractSampler     &mSampler;
+        SamplerState              &mState;
+        float                     mTransmittance;
+    };
+
+    // Grid density at a world position
+    float Density(const Vec3f &aPos) const
+    {
+        const Vec3i &res = mGrid.GetResolution();
+
+        return mGrid.Density((aPos - mBoxMin) *
+            Vec3f(float(res.x), float(res.y), float(res.z)) / (mBoxMax - mBoxMin));
+    }
+
+    // Visits the non-empty bricks along the ray segment [0, aMaxDist] in
+    // order (3D DDA) and calls aoTracker.Step(t0, t1, majorant) for each
+    // until it returns false
+    template<typename tTracker>
+    void Walk(
+        const Ray &aRay,
+        float     aMaxDist,
+        tTracker  &aoTracker) const
+    {
+        float tNear, tFar;
+        if(!ClipToBox(aRay, aMaxDist, tNear, tFar))
+            return;
+
+        const Vec3i &res      = mGrid.GetResolution();
+        const Vec3i &brickRes = mGrid.GetBrickResolution();
+
+        // the ray in brick units, parameterized by the world distance
+        const Vec3f scale = Vec3f(float(res.x), float(res.y), float(res.z)) /
+            ((mBoxMax - mBoxMin) * float(BrickGrid::kBrickSize));
+        const Vec3f org = (aRay.org - mBoxMin) * scale;
+        const Vec3f dir = aRay.dir * scale;
+        const Vec3f start = org + dir * tNear;
+
+        Vec3i cell, step;
+        Vec3f tNext, tDelta;
+        for(int i=0; i<3; i++)
+        {
+            cell.Get(i) = std::max(0, std::min(int(start.Get(i)), brickRes.Get(i) - 1));
+
+            if(dir.Get(i) > 0)
+            {
+                step.Get(i)   = 1;
+                tNext.Get(i)  = (cell.Get(i) + 1 - org.Get(i)) / dir.Get(i);
+                tDelta.Get(i) = 1.f / dir.Get(i);
+            }
+            else if(dir.Get(i) < 0)
+            {
+                step.Get(i)   = -1;
+                tNext.Get(i)  = (cell.Get(i) - org.Get(i)) / dir.Get(i);
+                tDelta.Get(i) = -1.f / dir.Get(i);
+            }
+            else
+            {
+                step.Get(i)   = 0;
+                tNext.Get(i)  = 1e36f;
+                tDelta.Get(i) = 0;
+            }
+        }
+
+        for(float t = tNear; t < tFar; )
+        {
+            int axis = tNext.x < tNext.y ? 0 : 1;
+            if(tNext.z < tNext.Get(axis))
+                axis = 2;
+
+            const float tExit = std::min(tNext.Get(axis), tFar);
+            const float majorant = mGrid.Majorant(cell);
+
+            if(majorant > 0 && tExit > t && !aoTracker.Step(t, tExit, majorant))
+                return;
+
+            t = tExit;
+            cell.Get(axis)  += step.Get(axis);
+            tNext.Get(axis) += tDelta.Get(axis);
+
+            if(cell.Get(axis) < 0 || cell.Get(axis) >= brickRes.Get(axis))
+                return;
+        }
+    }
+
+    // Clips the ray segment [0, aMaxDist] to the box of the grid
+    bool ClipToBox(
+        const Ray &aRay,
+        float     aMaxDist,
+        float     &oNear,
+        float     &oFar) const
+    {
+        oNear = 0;
+        oFar  = aMaxDist;
+
+        for(int i=0; i<3; i++)
+        {
+            const float invDir = 1.f / aRay.dir.Get(i);
+            float t0 = (mBoxMin.Get(i) - aRay.org.Get(i)) * invDir;
+            float t1 = (mBoxMax.Get(i) - aRay.org.Get(i)) * invDir;
+            if(t0 > t1)
+                std::swap(t0, t1);
+
+            oNear = std::max(oNear, t0);
+            oFar  = std::min(oFar, t1);
+        }
+
+        return oNear < oFar;
+    }
+
+private:
+
+    BrickGrid mGrid;
+    Vec3f     mAlbedo;
+    float     mDensityScale; //!< Extinction of the unit density
+    Vec3f     mBoxMin;
+    Vec3f     mBoxMax;
+};
@@ -0,0 +1,765 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Indexed triangle mesh with its own bounding volume hierarchy
+//
+// The triangles share the vertex positions and keep a material per
+// triangle, the emissive ones also their primitive ID within the mesh light
+// of their material. Build() sorts the triangles into a BVH split by the
+// surface area heuristic over 16 bins per axis, the leaves hold at most
+// kMaxLeafSize triangles stored next to each other, so the mesh is traced
+// in logarithmic time instead of testing every triangle like GeometryList.
+// The triangles that do not emit are two-sided, their normal faces the ray.
+// Texture coordinates are optional and indexed per triangle separately
+// from the positions, as the corners of an OBJ face are, so the vertices
+// are not split at the seams of the texture.
+//
+// The built mesh is traced from the Arrays views. They point into the
+// vectors the mesh was built from, or into memory shared with it, like a
+// mapped scene cache, which then has to outlive the mesh.
+
+class TriangleMesh : public AbstractGeometry
+{
+public:
+
+    static const int kMaxLeafSize = 4;
+    static const int kBinCount    = 16;
+    static const int kMaxSahDepth = 64; //!< Deeper nodes are split in half, bounds the traversal stack
+
+    struct Node
+    {
+        Vec3f mBBoxMin;
+        int   mOffset; //!< First triangle of a leaf, left child of an inner node (right follows it)
+        Vec3f mBBoxMax;
+        int   mCount;  //!< Triangles of a leaf, 0 for inner nodes
+    };
+
+    // Built mesh data the mesh is traced from
+    struct Arrays
+    {
+        const Vec3f *mVertices;
+        const Vec3i *mIndices;
+        const int   *mMatIDs;
+        const int   *mPrimIDs;
+        const Node  *mNodes;
+        const Vec2f *mTexCoords;  //!< NULL when the mesh has none
+        const Vec3i *mTexIndices; //!< Texture coordinates of each triangle, -1 for none
+        int         mVertexCount;
+        int         mTriangleCount;
+        int         mNodeCount;
+        int         mTexCoordCount;
+    };
+
+    TriangleMesh()
+    {
+        memset(&mArrays, 0, sizeof(mArrays));
+    }
+
+    // Appends a triangle of the vertices given by their index in mVertices
+    void AddTriangle(
+        const Vec3i &aIndices,
+        int         aMatID,
+        int         aPrimID = -1)
+    {
+        mIndices.push_back(aIndices);
+        mMatIDs.push_back(aMatID);
+        mPrimIDs.push_back(aPrimID);
+
+        if(!mTexIndices.empty())
+            mTexIndices.push_back(Vec3i(-1));
+    }
+
+    int GetTriangleCount() const
+    {
+        return mArrays.mTriangleCount;
+    }
+
+    int GetNodeCount() const
+    {
+        return mArrays.mNodeCount;
+    }
+
+    const Arrays& GetArrays() const
+    {
+        return mArrays;
+    }
+
+    // Bytes used by the vertices, triangles, texture coordinates and the hierarchy
+    size_t GetMemorySize() const
+    {
+        size_t size = mArrays.mVertexCount * sizeof(Vec3f) + mArrays.mTriangleCount *
+            (sizeof(Vec3i) + 2 * sizeof(int)) + mArrays.mNodeCount * sizeof(Node);
+
+        if(mArrays.mTexIndices)
+            size += mArrays.mTexCoordCount * sizeof(Vec2f) + mArrays.mTriangleCount * sizeof(Vec3i);
+        return size;
+    }
+
+    // Traces built arrays in place instead of the mesh's own
+    void Share(const Arrays &aArrays)
+    {
+        std::vector<Vec3f>().swap(mVertices);
+        std::vector<Vec3i>().swap(mIndices);
+        std::vector<int>().swap(mMatIDs);
+        std::vector<int>().swap(mPrimIDs);
+        std::vector<Node>().swap(mNodes);
+        std::vector<Vec2f>().swap(mTexCoords);
+        std::vector<Vec3i>().swap(mTexIndices);
+
+        mArrays = aArrays;
+    }
+
+    // Frees the arrays, the mesh has no triangles after
+    void Clear()
+    {
+        Arrays empty;
+        memset(&empty, 0, sizeof(empty));
+        Share(empty);
+    }
+
+    // Builds the hierarchy over the triangles, reorders them to the leaves.
+    // Has to be called after the last AddTriangle and before tracing.
+    void Build()
+    {
+        mNodes.clear();
+
+        const int triangleCount = (int)mIndices.size();
+        if(triangleCount == 0)
+        {
+            UpdateArrays();
+            return;
+        }
+
+        std::vector<Vec3f> boxMin(triangleCount), boxMax(triangleCount);
+
+#pragma omp parallel for
+        for(int i=0; i<triangleCount; i++)
+        {
+            const Vec3f &p0 = mVertices[mIndices[i].x];
+            const Vec3f &p1 = mVertices[mIndices[i].y];
+            const Vec3f &p2 = mVertices[mIndices[i].z];
+
+            boxMin[i] = Min(p0, Min(p1, p2));
+            boxMax[i] = Max(p0, Max(p1, p2));
+        }
+
+        std::vector<int> order;
+        BuildNodes(boxMin, boxMax, kMaxLeafSize, order, mNodes);
+
+        // the triangles of each leaf end up next to each other
+        std::vector<Vec3i> indices(triangleCount);
+        std::vector<int>   matIDs(triangleCount), primIDs(triangleCount);
+        for(int i=0; i<triangleCount; i++)
+        {
+            indices[i] = mIndices[order[i]];
+            matIDs[i]  = mMatIDs[order[i]];
+            primIDs[i] = mPrimIDs[order[i]];
+        }
+
+        mIndices.swap(indices);
+        mMatIDs.swap(matIDs);
+        mPrimIDs.swap(primIDs);
+
+        if(!mTexIndices.empty())
+        {
+            for(int i=0; i<triangleCount; i++)
+                indices[i] = mTexIndices[order[i]];
+            mTexIndices.swap(indices);
+        }
+
+        UpdateArrays();
+    }
+
+    // Builds a hierarchy over boxes, oOrder gives the box of each leaf
+    // entry, the entries of a leaf are next to each other. Used for the
+    // triangles and for the instances of a scene.
+    static void BuildNodes(
+        const std::vector<Vec3f> &aBoxMin,
+        const std::vector<Vec3f> &aBoxMax,
+        int                      aMaxLeafSize,
+        std::vector<int>         &oOrder,
+        std::vector<Node>        &oNodes)
+    {
+        const int count = (int)aBoxMin.size();
+
+        oNodes.clear();
+        oOrder.resize(count);
+        if(count == 0)
+            return;
+
+        std::vector<Vec3f> centroids(count);
+        for(int i=0; i<count; i++)
+        {
+            centroids[i] = (aBoxMin[i] + aBoxMax[i]) * 0.5f;
+            oOrder[i]    = i;
+        }
+
+        // the hierarchy has at most 2n-1 nodes
+        oNodes.reserve(2 * count);
+        oNodes.push_back(Node());
+
+        struct BuildTask { int mNode, mBegin, mEnd, mDepth; };
+        std::vector<BuildTask> stack;
+        BuildTask root = { 0, 0, count, 0 };
+        stack.push_back(root);
+
+        while(!stack.empty())
+        {
+            const BuildTask task = stack.back();
+            stack.pop_back();
+
+            Vec3f nodeMin(1e36f), nodeMax(-1e36f), centroidMin(1e36f), centroidMax(-1e36f);
+            for(int i=task.mBegin; i<task.mEnd; i++)
+            {
+                nodeMin     = Min(nodeMin, aBoxMin[oOrder[i]]);
+                nodeMax     = Max(nodeMax, aBoxMax[oOrder[i]]);
+                centroidMin = Min(centroidMin, centroids[oOrder[i]]);
+                centroidMax = Max(centroidMax, centroids[oOrder[i]]);
+            }
+
+            oNodes[task.mNode].mBBoxMin = nodeMin;
+            oNodes[task.mNode].mBBoxMax = nodeMax;
+            oNodes[task.mNode].mOffset  = task.mBegin;
+            oNodes[task.mNode].mCount   = task.mEnd - task.mBegin;
+
+            const int primitives = task.mEnd - task.mBegin;
+            if(primitives <= aMaxLeafSize)
+                continue;
+
+            int   bestAxis = -1, bestSplit = 0;
+            float bestCost = primitives * SurfaceArea(nodeMin, nodeMax);
+
+            for(int axis=0; axis<3 && task.mDepth < kMaxSahDepth; axis++)
+            {
+                const float extent = centroidMax.Get(axis) - centroidMin.Get(axis);
+                if(extent <= 0.f)
+                    continue;
+
+                const float scale = kBinCount / extent;
+
+                int   binCount[kBinCount] = {};
+                Vec3f binMin[kBinCount], binMax[kBinCount];
+                for(int b=0; b<kBinCount; b++)
+                {
+                    binMin[b] = Vec3f( 1e36f);
+                    binMax[b] = Vec3f(-1e36f);
+                }
+
+                for(int i=task.mBegin; i<task.mEnd; i++)
+                {
+                    const int prim = oOrder[i];
+                    const int b = std::min(kBinCount - 1,
+                        int((centroids[prim].Get(axis) - centroidMin.Get(axis)) * scale));
+
+                    binCount[b]++;
+                    binMin[b] = Min(binMin[b], aBoxMin[prim]);
+                    binMax[b] = Max(binMax[b], aBoxMax[prim]);
+                }
+
+                // areas of the boxes right of each split plane
+                float rightArea[kBinCount];
+                int   rightCount[kBinCount];
+                Vec3f accMin(1e36f), accMax(-1e36f);
+                int   accCount = 0;
+                for(int b=kBinCount-1; b>0; b--)
+                {
+                    accMin    = Min(accMin, binMin[b]);
+                    accMax    = Max(accMax, binMax[b]);
+                    accCount += binCount[b];
+
+                    rightArea[b]  = accCount > 0 ? SurfaceArea(accMin, accMax) : 0.f;
+                    rightCount[b] = accCount;
+                }
+
+                accMin   = Vec3f( 1e36f);
+                accMax   = Vec3f(-1e36f);
+                accCount = 0;
+                for(int b=0; b<kBinCount-1; b++)
+                {
+                    accMin    = Min(accMin, binMin[b]);
+                    accMax    = Max(accMax, binMax[b]);
+                    accCount += binCount[b];
+
+                    if(accCount == 0 || rightCount[b + 1] == 0)
+                        continue;
+
+                    const float cost = accCount * SurfaceArea(accMin, accMax) +
+                        rightCount[b + 1] * rightArea[b + 1];
+
+                    if(cost < bestCost)
+                    {
+                        bestCost  = cost;
+                        bestAxis  = axis;
+                        bestSplit = b + 1;
+                    }
+                }
+            }
+
+            int middle;
+            if(bestAxis >= 0)
+            {
+                const float scale = kBinCount /
+                    (centroidMax.Get(bestAxis) - centroidMin.Get(bestAxis));
+                const float minCentroid = centroidMin.Get(bestAxis);
+
+                middle = int(std::partition(oOrder.begin() + task.mBegin, oOrder.begin() + task.mEnd,
+                    [&](int aPrim)
+                    {
+                        return std::min(kBinCount - 1,
+                            int((centroids[aPrim].Get(bestAxis) - minCentroid) * scale)) < bestSplit;
+                    }) - oOrder.begin());
+            }
+            else if(primitives > 4 * aMaxLeafSize || task.mDepth >= kMaxSahDepth)
+            {
+                // splitting does not pay off, the centroids coincide or the
+                // node is too deep, large leaves are still split in half
+                // at the median centroid along the widest axis
+                const Vec3f extent = centroidMax - centroidMin;
+                const int axis = extent.x > extent.y ?
+                    (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+                middle = (task.mBegin + task.mEnd) / 2;
+                std::nth_element(oOrder.begin() + task.mBegin, oOrder.begin() + middle,
+                    oOrder.begin() + task.mEnd, [&](int aPrimA, int aPrimB)
+                    {
+                        return centroids[aPrimA].Get(axis) < centroids[aPrimB].Get(axis);
+                    });
+            }
+            else
+                continue;
+
+            const int left = (int)oNodes.size();
+            oNodes.push_back(Node());
+            oNodes.push_back(Node());
+
+            oNodes[task.mNode].mOffset = left;
+            oNodes[task.mNode].mCount  = 0;
+
+            BuildTask leftTask  = { left,     task.mBegin, middle,    task.mDepth + 1 };
+            BuildTask rightTask = { left + 1, middle,      task.mEnd, task.mDepth + 1 };
+            stack.push_back(leftTask);
+            stack.push_back(rightTask);
+        }
+    }
+
+    // Visits the nodes front to back, the nearer child first, and calls
+    // aLeaf(entry, ray, result) for the entries of the leaves it reaches.
+    // Shadow rays stop at the first hit.
+    template<bool tAnyHit, typename tLeaf>
+    static bool TraverseNodes(
+        const Node  *aNodes,
+        int         aNodeCount,
+        const Ray   &aRay,
+        Isect       &oResult,
+        const tLeaf &aLeaf)
+    {
+        if(aNodeCount == 0)
+            return false;
+
+        const Vec3f invDir(1.f / aRay.dir.x, 1.f / aRay.dir.y, 1.f / aRay.dir.z);
+
+        if(IntersectBox(aNodes[0], aRay, invDir, oResult.dist) == 1e36f)
+            return false;
+
+        int stack[kMaxSahDepth + 64];
+        int stackSize = 0;
+        int node = 0;
+        bool hit = false;
+        unsigned long long steps = 0;
+
+        for(;;)
+        {
+            const Node &current = aNodes[node];
+            steps++;
+
+            if(current.mCount > 0)
+            {
+                steps += current.mCount;
+                for(int i=0; i<current.mCount; i++)
+                {
+                    if(aLeaf(current.mOffset + i, aRay, oResult))
+                    {
+                        hit = true;
+                        if(tAnyHit)
+                        {
+                            g_TraversalSteps += steps;
+                            return true;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                int near = current.mOffset, far = current.mOffset + 1;
+                float distNear = IntersectBox(aNodes[near], aRay, invDir, oResult.dist);
+                float distFar  = IntersectBox(aNodes[far],  aRay, invDir, oResult.dist);
+
+                if(distFar < distNear)
+                {
+                    std::swap(near, far);
+                    std::swap(distNear, distFar);
+                }
+
+                if(distNear != 1e36f)
+                {
+                    if(distFar != 1e36f)
+                        stack[stackSize++] = far;
+                    node = near;
+                    continue;
+                }
+            }
+
+            // pops the boxes the closest hit has not moved past
+            node = -1;
+            while(stackSize > 0)
+            {
+                const int candidate = stack[--stackSize];
+                if(IntersectBox(aNodes[candidate], aRay, invDir, oResult.dist) != 1e36f)
+                {
+                    node = candidate;
+                    break;
+                }
+            }
+
+            if(node < 0)
+                break;
+        }
+
+        g_TraversalSteps += steps;
+        return hit;
+    }
+
+    // A subtree of the hierarchy as a mesh of its own, see ExtractCluster
+    struct Cluster
+    {
+        std::vector<Vec3f> mVertices;
+        std::vector<int>   mMeshVertices; //!< Of each vertex in the whole mesh
+        std::vector<Vec3i> mIndices;
+        std::vector<int>   mMatIDs;
+        std::vector<int>   mPrimIDs;
+        std::vector<Node>  mNodes;
+    };
+
+    // Cuts the BVH of a built mesh into the subtrees of at most
+    // aMaxTriangles triangles, they become the clusters of a scene cache
+    // or of a CompressedMesh. oTopNodes are the nodes above them, a leaf
+    // holds the index of its cluster in oClusterRoots, the root node of
+    // the cluster's subtree. The triangles of a subtree are next to each other, from the
+    // first to the end one in oClusterTriangles.
+    static void BuildClusters(
+        const Arrays                       &aArrays,
+        int                                aMaxTriangles,
+        std::vector<Node>                  &oTopNodes,
+        std::vector<int>                   &oClusterRoots,
+        std::vector<std::pair<int, int> >  &oClusterTriangles)
+    {
+        oTopNodes.clear();
+        oClusterRoots.clear();
+        oClusterTriangles.clear();
+        if(aArrays.mNodeCount == 0)
+            return;
+
+        // the children come after their parent
+        const Node *nodes = aArrays.mNodes;
+        std::vector<std::pair<int, int> > triangles(aArrays.mNodeCount);
+        for(int i=aArrays.mNodeCount-1; i>=0; i--)
+        {
+            if(nodes[i].mCount > 0)
+                triangles[i] = std::make_pair(nodes[i].mOffset, nodes[i].mOffset + nodes[i].mCount);
+            else
+                triangles[i] = std::make_pair(triangles[nodes[i].mOffset].first,
+                    triangles[nodes[i].mOffset + 1].second);
+        }
+
+        // top node and the mesh node it copies
+        std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 0));
+        oTopNodes.push_back(nodes[0]);
+
+        while(!stack.empty())
+        {
+            const int top  = stack.back().first;
+            const int node = stack.back().second;
+            stack.pop_back();
+
+            if(nodes[node].mCount > 0 || triangles[node].second - triangles[node].first <= aMaxTriangles)
+            {
+                oTopNodes[top].mOffset = (int)oClusterRoots.size();
+                oTopNodes[top].mCount  = 1;
+                oClusterRoots.push_back(node);
+                oClusterTriangles.push_back(triangles[node]);
+                continue;
+            }
+
+            const int left = (int)oTopNodes.size();
+            oTopNodes.push_back(nodes[nodes[node].mOffset]);
+            oTopNodes.push_back(nodes[nodes[node].mOffset + 1]);
+            oTopNodes[top].mOffset = left;
+
+            stack.push_back(std::make_pair(left,     nodes[node].mOffset));
+            stack.push_back(std::make_pair(left + 1, nodes[node].mOffset + 1));
+        }
+    }
+
+    // Copies the subtree below aRoot and its aTriangles into a mesh of its
+    // own. aoVertexMap maps the mesh vertices to the cluster ones, it is
+    // all -1 before and after.
+    static void ExtractCluster(
+        const Arrays               &aArrays,
+        int                        aRoot,
+        const std::pair<int, int>  &aTriangles,
+        std::vector<int>           &aoVertexMap,
+        Cluster                    &oCluster)
+    {
+        const int firstTriangle = aTriangles.first;
+
+        oCluster.mNodes.assign(1, aArrays.mNodes[aRoot]);
+        std::vector<int> meshNodes(1, aRoot);
+
+        for(size_t i=0; i<oCluster.mNodes.size(); i++)
+        {
+            const Node &node = aArrays.mNodes[meshNodes[i]];
+            if(node.mCount > 0)
+            {
+                oCluster.mNodes[i].mOffset = node.mOffset - firstTriangle;
+                continue;
+            }
+
+            oCluster.mNodes[i].mOffset = (int)oCluster.mNodes.size();
+            for(int child=0; child<2; child++)
+            {
+                oCluster.mNodes.push_back(aArrays.mNodes[node.mOffset + child]);
+                meshNodes.push_back(node.mOffset + child);
+            }
+        }
+
+        oCluster.mVertices.clear();
+        oCluster.mMeshVertices.clear();
+        oCluster.mIndices.clear();
+        oCluster.mMatIDs.clear();
+        oCluster.mPrimIDs.clear();
+
+        for(int i=firstTriangle; i<aTriangles.second; i++)
+        {
+            Vec3i tri = aArrays.mIndices[i];
+            for(int corner=0; corner<3; corner++)
+            {
+                int &index = aoVertexMap[tri.Get(corner)];
+                if(index < 0)
+                {
+                    index = (int)oCluster.mVertices.size();
+                    oCluster.mVertices.push_back(aArrays.mVertices[tri.Get(corner)]);
+                    oCluster.mMeshVertices.push_back(tri.Get(corner));
+                }
+                tri.Get(corner) = index;
+            }
+
+            oCluster.mIndices.push_back(tri);
+            oCluster.mMatIDs.push_back(aArrays.mMatIDs[i]);
+            oCluster.mPrimIDs.push_back(aArrays.mPrimIDs[i]);
+        }
+
+        for(size_t i=0; i<oCluster.mMeshVertices.size(); i++)
+            aoVertexMap[oCluster.mMeshVertices[i]] = -1;
+    }
+
+    // Distance to the node's box along the ray, 1e36f when it is missed
+    static float IntersectBox(
+        const Node  &aNode,
+        const Ray   &aRay,
+        const Vec3f &aInvDir,
+        float       aMaxDist)
+    {
+        float tNear = aRay.tmin, tFar = aMaxDist;
+        for(int axis=0; axis<3; axis++)
+        {
+            float t0 = (aNode.mBBoxMin.Get(axis) - aRay.org.Get(axis)) * aInvDir.Get(axis);
+            float t1 = (aNode.mBBoxMax.Get(axis) - aRay.org.Get(axis)) * aInvDir.Get(axis);
+            if(t0 > t1)
+                std::swap(t0, t1);
+
+            tNear = std::max(tNear, t0);
+            tFar  = std::min(tFar, t1);
+        }
+
+        return tNear <= tFar ? tNear : 1e36f;
+    }
+
+    // Moeller-Trumbore test of the triangle at aP0 spanned by the edges aE1
+    // and aE2, oU and oV are the barycentric coordinates of the hit along
+    // them. Updates oResult with the triangle's material and primitive ID
+    // when the triangle is closer, without texture coordinates.
+    static bool IntersectTriangle(
+        const Vec3f &aP0,
+        const Vec3f &aE1,
+        const Vec3f &aE2,
+        int         aMatID,
+        int         aPrimID,
+        const Ray   &aRay,
+        Isect       &oResult,
+        float       &oU,
+        float       &oV)
+    {
+        const Vec3f pvec = Cross(aRay.dir, aE2);
+        const float det  = Dot(aE1, pvec);
+        if(det == 0.f)
+            return false;
+
+        const float invDet = 1.f / det;
+        const Vec3f tvec   = aRay.org - aP0;
+        const float u      = Dot(tvec, pvec) * invDet;
+        if(u < 0.f || u > 1.f)
+            return false;
+
+        const Vec3f qvec = Cross(tvec, aE1);
+        const float v    = Dot(aRay.dir, qvec) * invDet;
+        if(v < 0.f || u + v > 1.f)
+            return false;
+
+        const float distance = Dot(aE2, qvec) * invDet;
+        if(!(distance > aRay.tmin && distance < oResult.dist))
+            return false;
+
+        // the surfaces of imported meshes are seldom wound consistently,
+        // only the emitters keep the side their mesh light is sampled on
+        Vec3f normal = Normalize(Cross(aE1, aE2));
+        if(aPrimID < 0 && Dot(normal, aRay.dir) > 0.f)
+            normal = -normal;
+
+        oResult.dist    = distance;
+        oResult.normal  = normal;
+        oResult.matID   = aMatID;
+        oResult.primID  = aPrimID;
+        oResult.uv      = Vec2f(0);
+        oResult.uvScale = 0.f;
+
+        oU = u;
+        oV = v;
+        return true;
+    }
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        return Traverse<false>(aRay, oResult);
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        return Traverse<true>(aRay, oResult);
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        // the root box saves reading every vertex of a shared mesh
+        if(mArrays.mNodeCount > 0)
+        {
+            aoBBoxMin = Min(aoBBoxMin, mArrays.mNodes[0].mBBoxMin);
+            aoBBoxMax = Max(aoBBoxMax, mArrays.mNodes[0].mBBoxMax);
+            return;
+        }
+
+        for(int i=0; i<mArrays.mVertexCount; i++)
+        {
+            aoBBoxMin = Min(aoBBoxMin, mArrays.mVertices[i]);
+            aoBBoxMax = Max(aoBBoxMax, mArrays.mVertices[i]);
+        }
+    }
+
+private:
+
+    void UpdateArrays()
+    {
+        // Embree reads the vertices 16 bytes at a time, the last one included
+        mVertices.reserve(mVertices.size() + 1);
+
+        mArrays.mVertices      = mVertices.empty() ? NULL : &mVertices[0];
+        mArrays.mIndices       = mIndices.empty()  ? NULL : &mIndices[0];
+        mArrays.mMatIDs        = mMatIDs.empty()   ? NULL : &mMatIDs[0];
+        mArrays.mPrimIDs       = mPrimIDs.empty()  ? NULL : &mPrimIDs[0];
+        mArrays.mNodes         = mNodes.empty()    ? NULL : &mNodes[0];
+        mArrays.mTexCoords     = mTexCoords.empty()  ? NULL : &mTexCoords[0];
+        mArrays.mTexIndices    = mTexIndices.empty() ? NULL : &mTexIndices[0];
+        mArrays.mVertexCount   = (int)mVertices.size();
+        mArrays.mTriangleCount = (int)mIndices.size();
+        mArrays.mNodeCount     = (int)mNodes.size();
+        mArrays.mTexCoordCount = (int)mTexCoords.size();
+    }
+
+    static float SurfaceArea(
+        const Vec3f &aBBoxMin,
+        const Vec3f &aBBoxMax)
+    {
+        const Vec3f extent = aBBoxMax - aBBoxMin;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    // Tests a triangle of the mesh, updates oResult when it is closer
+    bool IntersectTriangle(
+        int       aTriangle,
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        const Vec3i &tri = mArrays.mIndices[aTriangle];
+        const Vec3f &p0  = mArrays.mVertices[tri.x];
+        const Vec3f e1   = mArrays.mVertices[tri.y] - p0;
+        const Vec3f e2   = mArrays.mVertices[tri.z] - p0;
+
+        float u, v;
+        if(!IntersectTriangle(p0, e1, e2, mArrays.mMatIDs[aTriangle], mArrays.mPrimIDs[aTriangle],
+            aRay, oResult, u, v))
+            return false;
+
+        if(mArrays.mTexIndices && mArrays.mTexIndices[aTriangle].x >= 0)
+        {
+            const Vec3i &tex = mArrays.mTexIndices[aTriangle];
+            const Vec2f &t0 = mArrays.mTexCoords[tex.x];
+            const Vec2f t1 = mArrays.mTexCoords[tex.y] - t0, t2 = mArrays.mTexCoords[tex.z] - t0;
+
+            // the square root of the ratio of the areas in texture and world space
+            oResult.uv      = t0 + t1 * u + t2 * v;
+            oResult.uvScale = std::sqrt(std::abs(t1.x * t2.y - t1.y * t2.x) / Cross(e1, e2).Length());
+        }
+        return true;
+    }
+
+    template<bool tAnyHit>
+    bool Traverse(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        return TraverseNodes<tAnyHit>(mArrays.mNodes, mArrays.mNodeCount, aRay, oResult,
+            [this](int aTriangle, const Ray &aLeafRay, Isect &aoLeafResult)
+            {
+                return IntersectTriangle(aTriangle, aLeafRay, aoLeafResult);
+            });
+    }
+
+public:
+
+    // Filled by the loaders, the mesh is built from them
+    std::vector<Vec3f> mVertices;
+    std::vector<Vec3i> mIndices;  //!< Vertices of each triangle
+    std::vector<int>   mMatIDs;   //!< Material of each triangle
+    std::vector<int>   mPrimIDs;  //!< Primitive ID in the mesh light of an emissive triangle, -1 otherwise
+    std::vector<Vec2f> mTexCoords;
+    std::vector<Vec3i> mTexIndices; //!< Into mTexCoords for each triangle, -1 for none, empty without texture coordinates
+
+private:
+
+    std::vector<Node>  mNodes;    //!< Root first, the children of an inner node next to each other
+    Arrays             mArrays;
+};
@@ -0,0 +1,614 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
+#include "math.hxx"
+#include "mappedfile.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Wavefront OBJ/MTL loader
+//
+// The OBJ file is memory mapped and split into chunks at line boundaries,
+// which are parsed in parallel in two passes. The first pass only counts
+// the vertices and triangles of each chunk and collects the material names,
+// the prefix sums of the counts then give every chunk the place of its
+// output in the shared arrays and the first vertex it sees, so the second
+// pass resolves the relative (negative) indices and writes the vertices
+// and triangles without any locking. Polygons are split into triangle fans.
+//
+// The positions and texture coordinates are read, the normals of the faces
+// are skipped. The texture coordinates keep their own indices, a triangle
+// with a corner without one has none. From the MTL libraries the loader
+// takes the diffuse (Kd), specular (Ks) and emitted (Ke) color, the
+// specular exponent (Ns) and the images of map_Kd, map_Ks and map_Ns.
+
+struct ObjMaterial
+{
+    ObjMaterial(const std::string &aName = "") :
+        mName(aName),
+        mDiffuse(0.8f),
+        mSpecular(0.f),
+        mEmission(0.f),
+        mShininess(1.f)
+    {}
+
+    std::string mName;
+    Vec3f       mDiffuse;   //!< Kd
+    Vec3f       mSpecular;  //!< Ks
+    Vec3f       mEmission;  //!< Ke
+    float       mShininess; //!< Ns
+
+    // Images scaling the values above, with the directory of the library
+    // prepended, empty when none
+    std::string mDiffuseMap;   //!< map_Kd
+    std::string mSpecularMap;  //!< map_Ks
+    std::string mShininessMap; //!< map_Ns
+};
+
+class ObjLoader
+{
+public:
+
+    // Files smaller than this are parsed by one thread
+    static const size_t kMinChunkSize = 1 << 20;
+
+    bool Load(const char *aFilename)
+    {
+        mVertices.clear();
+        mTriangles.clear();
+        mTriangleMaterials.clear();
+        mTexCoords.clear();
+        mTriangleTexCoords.clear();
+        mMaterials.clear();
+        mMaterialIndices.clear();
+        mInvalidFaces = 0;
+
+        MappedFile file;
+        if(!file.Open(aFilename))
+            return false;
+
+        const char *data = file.GetData();
+        const size_t size = file.GetSize();
+
+        // chunks end after a line break
+        const int threads = omp_get_max_threads();
+        const int chunkCount = int(std::max<size_t>(1,
+            std::min<size_t>(threads * 4, size / kMinChunkSize)));
+
+        std::vector<Chunk> chunks(chunkCount);
+        const char *chunkBegin = data;
+        for(int i=0; i<chunkCount; i++)
+        {
+            const char *chunkEnd = data + (i + 1 == chunkCount ? size : size / chunkCount * (i + 1));
+            chunkEnd = std::max(chunkEnd, chunkBegin);
+            while(chunkEnd < data + size && chunkEnd[-1] != '\n')
+                chunkEnd++;
+
+            chunks[i].mBegin = chunkBegin;
+            chunks[i].mEnd   = chunkEnd;
+            chunkBegin = chunkEnd;
+        }
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for(int i=0; i<chunkCount; i++)
+            CountChunk(chunks[i]);
+
+        // places the chunks in the output and loads the material libraries
+        // in the order they appear, the libraries are looked up next to the file
+        std::string directory(aFilename);
+        const size_t slash = directory.find_last_of("/\\");
+        directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+
+        size_t vertexCount = 0, triangleCount = 0, texCoordCount = 0;
+        for(int i=0; i<chunkCount; i++)
+        {
+            chunks[i].mVertexOffset   = vertexCount;
+            chunks[i].mTriangleOffset = triangleCount;
+            chunks[i].mTexCoordOffset = texCoordCount;
+            vertexCount   += chunks[i].mVertexCount;
+            triangleCount += chunks[i].mTriangleCount;
+            texCoordCount += chunks[i].mTexCoordCount;
+
+            for(size_t j=0; j<chunks[i].mLibraries.size(); j++)
+            {
+                const std::string library = directory + chunks[i].mLibraries[j];
+                if(!LoadMtl(library.c_str()))
+                    printf("Could not load material library %s\n", library.c_str());
+            }
+        }
+
+        // materials missing in the libraries get the default one
+        for(int i=0; i<chunkCount; i++)
+        {
+            for(std::set<std::string>::const_iterator it = chunks[i].mMaterialNames.begin();
+                it != chunks[i].mMaterialNames.end(); ++it)
+            {
+                if(mMaterialIndices.find(*it) == mMaterialIndices.end())
+                {
+                    printf("Material %s not found, using the default one\n", it->c_str());
+                    AddMaterial(ObjMaterial(*it));
+                }
+            }
+        }
+
+        // material set at the start of each chunk
+        int material = -1;
+        for(int i=0; i<chunkCount; i++)
+        {
+            chunks[i].mStartMaterial = material;
+            if(!chunks[i].mLastMaterial.empty())
+                material = mMaterialIndices[chunks[i].mLastMaterial];
+        }
+
+        mVertices.resize(vertexCount);
+        mTriangles.resize(triangleCount);
+        mTriangleMaterials.resize(triangleCount);
+        mTexCoords.resize(texCoordCount);
+        mTriangleTexCoords.resize(texCoordCount > 0 ? triangleCount : 0);
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for(int i=0; i<chunkCount; i++)
+            ParseChunk(chunks[i]);
+
+        // faces with indices out of range were written as degenerate triangles
+        if(mInvalidFaces > 0)
+        {
+            size_t kept = 0;
+            for(size_t i=0; i<mTriangles.size(); i++)
+            {
+                if(mTriangles[i].x < 0)
+                    continue;
+
+                mTriangles[kept]         = mTriangles[i];
+                mTriangleMaterials[kept] = mTriangleMaterials[i];
+                if(!mTriangleTexCoords.empty())
+                    mTriangleTexCoords[kept] = mTriangleTexCoords[i];
+                kept++;
+            }
+
+            mTriangles.resize(kept);
+            mTriangleMaterials.resize(kept);
+            if(!mTriangleTexCoords.empty())
+                mTriangleTexCoords.resize(kept);
+            printf("Skipped %d faces with invalid vertex indices\n", mInvalidFaces);
+        }
+
+        return true;
+    }
+
+public:
+
+    std::vector<Vec3f>       mVertices;
+    std::vector<Vec3i>       mTriangles;         //!< Indices into mVertices
+    std::vector<int>         mTriangleMaterials; //!< Index into mMaterials, -1 when no material was set
+    std::vector<Vec2f>       mTexCoords;
+    std::vector<Vec3i>       mTriangleTexCoords; //!< Indices into mTexCoords, -1 for none, empty when the file has none
+    std::vector<ObjMaterial> mMaterials;
+
+private:
+
+    struct Chunk
+    {
+        const char *mBegin;
+        const char *mEnd;
+
+        // counting pass
+        size_t                mVertexCount;
+        size_t                mTriangleCount;
+        size_t                mTexCoordCount;
+        std::string           mLastMaterial;  //!< Material set at the end of the chunk, empty when none
+        std::set<std::string> mMaterialNames;
+        std::vector<std::string> mLibraries;
+
+        // parsing pass
+        size_t mVertexOffset;
+        size_t mTriangleOffset;
+        size_t mTexCoordOffset;
+        int    mStartMaterial;
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // Tokenizer
+
+    static bool IsSpace(char aChar)
+    {
+        return aChar == ' ' || aChar == '\t' || aChar == '\r';
+    }
+
+    static bool IsDigit(char aChar)
+    {
+        return aChar >= '0' && aChar <= '9';
+    }
+
+    static const char* SkipSpaces(const char *aPtr, const char *aEnd)
+    {
+        while(aPtr < aEnd && IsSpace(*aPtr))
+            aPtr++;
+        return aPtr;
+    }
+
+    // Start of the next line
+    static const char* SkipLine(const char *aPtr, const char *aEnd)
+    {
+        const char *lineEnd = (const char*)memchr(aPtr, '\n', aEnd - aPtr);
+        return lineEnd ? lineEnd + 1 : aEnd;
+    }
+
+    static const char* SkipToken(const char *aPtr, const char *aEnd)
+    {
+        while(aPtr < aEnd && !IsSpace(*aPtr) && *aPtr != '\n')
+            aPtr++;
+        return aPtr;
+    }
+
+    // Compares the keyword at aPtr, it has to be followed by a space
+    static bool IsKeyword(const char *aPtr, const char *aEnd, const char *aKeyword)
+    {
+        const size_t length = strlen(aKeyword);
+        return size_t(aEnd - aPtr) > length && memcmp(aPtr, aKeyword, length) == 0 &&
+            IsSpace(aPtr[length]);
+    }
+
+    // Rest of the line without the surrounding spaces
+    static std::string ReadName(const char *aPtr, const char *aEnd)
+    {
+        aPtr = SkipSpaces(aPtr, aEnd);
+        const char *nameEnd = aPtr;
+        while(nameEnd < aEnd && *nameEnd != '\n')
+            nameEnd++;
+        while(nameEnd > aPtr && IsSpace(nameEnd[-1]))
+            nameEnd--;
+        return std::string(aPtr, nameEnd);
+    }
+
+    // Decimal number with an optional fraction and exponent, returns the
+    // position after it or NULL when there is no number
+    static const char* ParseFloat(const char *aPtr, const char *aEnd, float &oValue)
+    {
+        aPtr = SkipSpaces(aPtr, aEnd);
+
+        bool negative = false;
+        if(aPtr < aEnd && (*aPtr == '-' || *aPtr == '+'))
+            negative = *aPtr++ == '-';
+
+        // up to 18 significant digits fit the mantissa, the rest only scale it
+        unsigned long long mantissa = 0;
+        int  exponent = 0, digits = 0;
+        bool anyDigit = false;
+
+        for(; aPtr < aEnd && IsDigit(*aPtr); aPtr++, anyDigit = true)
+        {
+            if(digits < 18)
+            {
+                mantissa = mantissa * 10 + (*aPtr - '0');
+                digits += mantissa > 0;
+            }
+            else
+                exponent++;
+        }
+
+        if(aPtr < aEnd && *aPtr == '.')
+        {
+            for(aPtr++; aPtr < aEnd && IsDigit(*aPtr); aPtr++, anyDigit = true)
+            {
+                if(digits < 18)
+                {
+                    mantissa = mantissa * 10 + (*aPtr - '0');
+                    digits += mantissa > 0;
+                    exponent--;
+                }
+            }
+        }
+
+        if(!anyDigit)
+            return NULL;
+
+        if(aPtr < aEnd && (*aPtr == 'e' || *aPtr == 'E'))
+        {
+            int value;
+            const char *expEnd = ParseInt(aPtr + 1, aEnd, value);
+            if(expEnd)
+            {
+                exponent += value;
+                aPtr = expEnd;
+            }
+        }
+
+        static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+            1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+        double value = double(mantissa);
+        if(exponent >= 0 && exponent <= 22)
+            value *= powers[exponent];
+        else if(exponent < 0 && exponent >= -22)
+            value /= powers[-exponent];
+        else
+            value *= std::pow(10.0, exponent);
+
+        oValue = float(negative ? -value : value);
+        return aPtr;
+    }
+
+    static const char* ParseInt(const char *aPtr, const char *aEnd, int &oValue)
+    {
+        bool negative = false;
+        if(aPtr < aEnd && (*aPtr == '-' || *aPtr == '+'))
+            negative = *aPtr++ == '-';
+
+        if(aPtr >= aEnd || !IsDigit(*aPtr))
+            return NULL;
+
+        int value = 0;
+        for(; aPtr < aEnd && IsDigit(*aPtr); aPtr++)
+            value = value * 10 + (*aPtr - '0');
+
+        oValue = negative ? -value : value;
+        return aPtr;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // OBJ passes
+
+    void CountChunk(Chunk &aoChunk) const
+    {
+        aoChunk.mVertexCount   = 0;
+        aoChunk.mTriangleCount = 0;
+        aoChunk.mTexCoordCount = 0;
+
+        const char *end = aoChunk.mEnd;
+        for(const char *ptr = aoChunk.mBegin; ptr < end; ptr = SkipLine(ptr, end))
+        {
+            ptr = SkipSpaces(ptr, end);
+            if(ptr == end)
+                break;
+
+            if(ptr[0] == 'v' && ptr + 1 < end && IsSpace(ptr[1]))
+                aoChunk.mVertexCount++;
+            else if(IsKeyword(ptr, end, "vt"))
+                aoChunk.mTexCoordCount++;
+            else if(ptr[0] == 'f' && ptr + 1 < end && IsSpace(ptr[1]))
+            {
+                int corners = 0;
+                ptr = SkipSpaces(ptr + 1, end);
+                while(ptr < end && *ptr != '\n')
+                {
+                    corners++;
+                    ptr = SkipSpaces(SkipToken(ptr, end), end);
+                }
+
+                if(corners >= 3)
+                    aoChunk.mTriangleCount += corners - 2;
+            }
+            else if(IsKeyword(ptr, end, "usemtl"))
+            {
+                aoChunk.mLastMaterial = ReadName(ptr + 6, end);
+                aoChunk.mMaterialNames.insert(aoChunk.mLastMaterial);
+            }
+            else if(IsKeyword(ptr, end, "mtllib"))
+                aoChunk.mLibraries.push_back(ReadName(ptr + 6, end));
+        }
+    }
+
+    void ParseChunk(const Chunk &aChunk)
+    {
+        size_t vertex   = aChunk.mVertexOffset;
+        size_t triangle = aChunk.mTriangleOffset;
+        size_t texCoord = aChunk.mTexCoordOffset;
+        int material    = aChunk.mStartMaterial;
+        int invalid     = 0;
+
+        const int vertexCount   = (int)mVertices.size();
+        const int texCoordCount = (int)mTexCoords.size();
+        const char *end = aChunk.mEnd;
+
+        for(const char *ptr = aChunk.mBegin; ptr < end; ptr = SkipLine(ptr, end))
+        {
+            ptr = SkipSpaces(ptr, end);
+            if(ptr == end)
+                break;
+
+            if(ptr[0] == 'v' && ptr + 1 < end && IsSpace(ptr[1]))
+            {
+                Vec3f position(0.f);
+                const char *coord = ptr + 1;
+                for(int i=0; i<3 && coord; i++)
+                    coord = ParseFloat(coord, end, position.Get(i));
+
+                mVertices[vertex++] = position;
+            }
+            else if(IsKeyword(ptr, end, "vt"))
+            {
+                Vec2f uv(0.f);
+                const char *coord = ParseFloat(ptr + 2, end, uv.x);
+                if(coord)
+                    ParseFloat(coord, end, uv.y);
+
+                mTexCoords[texCoord++] = uv;
+            }
+            else if(ptr[0] == 'f' && ptr + 1 < end && IsSpace(ptr[1]))
+            {
+                // the vertices defined before the face, for the relative indices
+                const int defined = int(vertex), definedTexCoords = int(texCoord);
+                const size_t firstTriangle = triangle;
+
+                int  first = -1, previous = -1, corners = 0;
+                int  firstTex = -1, previousTex = -1;
+                bool valid = true;
+
+                ptr = SkipSpaces(ptr + 1, end);
+                while(ptr < end && *ptr != '\n')
+                {
+                    int index = 0;
+                    const char *next = ParseInt(ptr, end, index);
+                    if(!next || index == 0)
+                        valid = false;
+
+                    index = index < 0 ? defined + index : index - 1;
+                    if(index < 0 || index >= vertexCount)
+                        valid = false;
+
+                    // v/vt or v/vt/vn, a missing or invalid vt gives no coordinates
+                    int texIndex = -1;
+                    if(next && next + 1 < end && *next == '/' && texCoordCount > 0 &&
+                        ParseInt(next + 1, end, texIndex) && texIndex != 0)
+                    {
+                        texIndex = texIndex < 0 ? definedTexCoords + texIndex : texIndex - 1;
+                        if(texIndex >= texCoordCount)
+                            texIndex = -1;
+                    }
+                    else
+                        texIndex = -1;
+
+                    if(corners == 0)
+                    {
+                        first    = index;
+                        firstTex = texIndex;
+                    }
+                    else if(corners >= 2)
+                    {
+                        mTriangles[triangle]         = Vec3i(first, previous, index);
+                        mTriangleMaterials[triangle] = material;
+
+                        if(texCoordCount > 0)
+                        {
+                            const bool textured = firstTex >= 0 && previousTex >= 0 && texIndex >= 0;
+                            mTriangleTexCoords[triangle] = textured ?
+                                Vec3i(firstTex, previousTex, texIndex) : Vec3i(-1);
+                        }
+                        triangle++;
+                    }
+
+                    previous    = index;
+                    previousTex = texIndex;
+                    corners++;
+
+                    // skips the normal index
+                    ptr = SkipSpaces(SkipToken(ptr, end), end);
+                }
+
+                if(!valid)
+                {
+                    for(size_t i=firstTriangle; i<triangle; i++)
+                        mTriangles[i] = Vec3i(-1);
+                    invalid++;
+                }
+            }
+            else if(IsKeyword(ptr, end, "usemtl"))
+                material = mMaterialIndices.find(ReadName(ptr + 6, end))->second;
+        }
+
+        if(invalid > 0)
+        {
+#pragma omp atomic
+            mInvalidFaces += invalid;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // MTL library
+
+    void AddMaterial(const ObjMaterial &aMaterial)
+    {
+        mMaterialIndices[aMaterial.mName] = (int)mMaterials.size();
+        mMaterials.push_back(aMaterial);
+    }
+
+    // Color given by one or three numbers
+    static void ParseColor(const char *aPtr, const char *aEnd, Vec3f &oColor)
+    {
+        Vec3f color;
+        const char *ptr = ParseFloat(aPtr, aEnd, color.x);
+        if(!ptr)
+            return;
+
+        const char *ptrY = ParseFloat(ptr, aEnd, color.y);
+        if(ptrY && ParseFloat(ptrY, aEnd, color.z))
+            oColor = color;
+        else
+            oColor = Vec3f(color.x);
+    }
+
+    // Image of a map_ statement, options before it are skipped
+    static std::string ReadMap(
+        const char        *aPtr,
+        const char        *aEnd,
+        const std::string &aDirectory)
+    {
+        std::string name = ReadName(aPtr, aEnd);
+        if(!name.empty() && name[0] == '-')
+            name = name.substr(name.find_last_of(" \t") + 1);
+
+        if(name.empty() || name[0] == '/' || name[0] == '\\' || (name.size() > 1 && name[1] == ':'))
+            return name;
+        return aDirectory + name;
+    }
+
+    bool LoadMtl(const char *aFilename)
+    {
+        MappedFile file;
+        if(!file.Open(aFilename))
+            return false;
+
+        // the images are looked up next to the library
+        std::string directory(aFilename);
+        const size_t slash = directory.find_last_of("/\\");
+        directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+
+        const char *end = file.GetData() + file.GetSize();
+        ObjMaterial *material = NULL;
+
+        for(const char *ptr = file.GetData(); ptr < end; ptr = SkipLine(ptr, end))
+        {
+            ptr = SkipSpaces(ptr, end);
+            if(ptr == end)
+                break;
+
+            if(IsKeyword(ptr, end, "newmtl"))
+            {
+                const std::string name = ReadName(ptr + 6, end);
+
+                // a material defined twice keeps the last definition
+                std::map<std::string, int>::const_iterator it = mMaterialIndices.find(name);
+                if(it == mMaterialIndices.end())
+                {
+                    AddMaterial(ObjMaterial(name));
+                    material = &mMaterials.back();
+                }
+                else
+                {
+                    material = &mMaterials[it->second];
+                    *material = ObjMaterial(name);
+                }
+            }
+            else if(!material)
+                continue;
+            else if(IsKeyword(ptr, end, "Kd"))
+                ParseColor(ptr + 2, end, material->mDiffuse);
+            else if(IsKeyword(ptr, end, "Ks"))
+                ParseColor(ptr + 2, end, material->mSpecular);
+            else if(IsKeyword(ptr, end, "Ke"))
+                ParseColor(ptr + 2, end, material->mEmission);
+            else if(IsKeyword(ptr, end, "Ns"))
+                ParseFloat(ptr + 2, end, material->mShininess);
+            else if(IsKeyword(ptr, end, "map_Kd"))
+                material->mDiffuseMap = ReadMap(ptr + 6, end, directory);
+            else if(IsKeyword(ptr, end, "map_Ks"))
+                material->mSpecularMap = ReadMap(ptr + 6, end, directory);
+            else if(IsKeyword(ptr, end, "map_Ns"))
+                material->mShininessMap = ReadMap(ptr + 6, end, directory);
+        }
+
+        return true;
+    }
+
+private:
+
+    std::map<std::string, int> mMaterialIndices;
+    int                        mInvalidFaces;
+};
@@ -0,0 +1,455 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Practical path guiding (Mueller et al. 2017)
+//
+// The incident radiance is learned while rendering in an SD-tree: an
+// octree over the scene whose leaves hold a quadtree over the directions.
+// Rendering runs in passes of doubling length, each pass samples from the
+// distributions learned by the previous one and records its own paths into
+// a second set of quadtrees. Between the passes the recorded quadtrees
+// become the sampling ones, the octree leaves that got many samples are
+// split and the quadtrees are refined where they hold much energy.
+
+//////////////////////////////////////////////////////////////////////////
+// Quadtree over the unit square, which maps to the sphere of directions
+// by the equal-area cylindrical mapping. Only the leaf quadrants are
+// recorded into, Build sums them up into the inner nodes.
+
+class DirectionalTree
+{
+public:
+
+    DirectionalTree()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        mNodes.assign(1, Node());
+        mTotal = 0;
+    }
+
+    // Position of a direction in the unit square
+    static Vec2f DirToSquare(const Vec3f &aDir)
+    {
+        const float cosTheta = std::max(-1.f, std::min(1.f, aDir.z));
+
+        float phi = std::atan2(aDir.y, aDir.x);
+        if(phi < 0)
+            phi += 2.f * PI_F;
+
+        return Vec2f((cosTheta + 1.f) * 0.5f, std::min(phi / (2.f * PI_F), 1.f - 1e-7f));
+    }
+
+    static Vec3f SquareToDir(const Vec2f &aPos)
+    {
+        const float cosTheta = 2.f * aPos.x - 1.f;
+        const float sinTheta = std::sqrt(std::max(0.f, 1.f - Sqr(cosTheta)));
+        const float phi      = 2.f * PI_F * aPos.y;
+
+        return Vec3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+    }
+
+    // Adds aValue to the leaf quadrant containing aPos,
+    // can be called from several threads at once
+    void Record(
+        const Vec2f &aPos,
+        float       aValue)
+    {
+        Vec2f pos = aPos;
+        int node = 0;
+
+        for(;;)
+        {
+            const int quadrant = ChildQuadrant(pos);
+            const int child = mNodes[node].mChild[quadrant];
+
+            if(child == 0)
+            {
+                float &sum = mNodes[node].mSum[quadrant];
+#pragma omp atomic
+                sum += aValue;
+                return;
+            }
+
+            node = child;
+        }
+    }
+
+    // Sums the recorded leaves up into the inner nodes
+    void Build()
+    {
+        // children are always stored after their parent
+        for(int i=int(mNodes.size())-1; i>=0; i--)
+        {
+            Node &node = mNodes[i];
+            for(int q=0; q<4; q++)
+            {
+                if(node.mChild[q])
+                    node.mSum[q] = mNodes[node.mChild[q]].Total();
+            }
+        }
+
+        mTotal = mNodes[0].Total();
+    }
+
+    // Replaces the tree by an empty one with the structure adapted to the
+    // energy of aSource: quadrants holding more than aThreshold of its total
+    // are subdivided, those with less are merged
+    void Refine(
+        const DirectionalTree &aSource,
+        float                 aThreshold,
+        int                   aMaxDepth)
+    {
+        Reset();
+
+        struct Entry
+        {
+            int   mNode;
+            int   mSource;   //!< Node of aSource covering the same square, -1 if none
+            float mFraction; //!< Energy of the node relative to the total
+            int   mDepth;
+        };
+
+        std::vector<Entry> stack;
+        const Entry root = { 0, 0, 1.f, 1 };
+        stack.push_back(root);
+
+        while(!stack.empty())
+        {
+            const Entry entry = stack.back();
+            stack.pop_back();
+
+            for(int q=0; q<4; q++)
+            {
+                // without information the energy is spread evenly
+                float fraction = entry.mFraction * 0.25f;
+                int source = -1;
+
+                if(entry.mSource >= 0 && aSource.mTotal > 0)
+                {
+                    const Node &sourceNode = aSource.mNodes[entry.mSource];
+                    fraction = sourceNode.mSum[q] / aSource.mTotal;
+                    source = sourceNode.mChild[q] ? sourceNode.mChild[q] : -1;
+                }
+
+                if(fraction <= aThreshold || entry.mDepth >= aMaxDepth)
+                    continue;
+
+                const int child = int(mNodes.size());
+                mNodes.push_back(Node());
+                mNodes[entry.mNode].mChild[q] = child;
+
+                const Entry next = { child, source, fraction, entry.mDepth + 1 };
+                stack.push_back(next);
+            }
+        }
+    }
+
+    // Samples a position in the unit square proportionally to the energy
+    Vec2f Sample(const Vec2f &aRnd) const
+    {
+        Vec2f rnd(std::min(aRnd.x, 1.f - 1e-7f), std::min(aRnd.y, 1.f - 1e-7f));
+        Vec2f origin(0.f);
+        float size = 1.f;
+        int node = 0;
+
+        for(;;)
+        {
+            const float *sum = mNodes[node].mSum;
+
+            // the column first, then the quadrant within it
+            const int qx = PickHalf(sum[0] + sum[2], sum[1] + sum[3], rnd.x);
+            const int qy = PickHalf(sum[qx], sum[qx + 2], rnd.y);
+            const int quadrant = qx + 2 * qy;
+
+            size *= 0.5f;
+            origin = origin + Vec2f(float(qx), float(qy)) * size;
+
+            if(mNodes[node].mChild[quadrant] == 0)
+                return origin + rnd * size;
+
+            node = mNodes[node].mChild[quadrant];
+        }
+    }
+
+    // Pdf of sampling aPos, with respect to the area of the unit square
+    float Pdf(const Vec2f &aPos) const
+    {
+        if(mTotal <= 0)
+            return 0.f;
+
+        Vec2f pos = aPos;
+        float pdf = 1.f;
+        int node = 0;
+
+        for(;;)
+        {
+            const Node &current = mNodes[node];
+            const float total = current.Total();
+            if(total <= 0)
+                return 0.f;
+
+            const int quadrant = ChildQuadrant(pos);
+            pdf *= 4.f * current.mSum[quadrant] / total;
+
+            if(current.mChild[quadrant] == 0)
+                return pdf;
+
+            node = current.mChild[quadrant];
+        }
+    }
+
+    float GetTotal() const { return mTotal; }
+    int GetNodeCount() const { return int(mNodes.size()); }
+
+private:
+
+    struct Node
+    {
+        Node()
+        {
+            for(int q=0; q<4; q++)
+            {
+                mSum[q]   = 0;
+                mChild[q] = 0;
+            }
+        }
+
+        float Total() const { return mSum[0] + mSum[1] + mSum[2] + mSum[3]; }
+
+        float mSum[4];   //!< Energy of the quadrants, x fastest
+        int   mChild[4]; //!< Node subdividing each quadrant, 0 for leaves
+    };
+
+    // Quadrant of aoPos, which is then mapped into the quadrant's square
+    static int ChildQuadrant(Vec2f &aoPos)
+    {
+        const int qx = aoPos.x >= 0.5f ? 1 : 0;
+        const int qy = aoPos.y >= 0.5f ? 1 : 0;
+
+        aoPos.x = std::min(2.f * aoPos.x - qx, 1.f - 1e-7f);
+        aoPos.y = std::min(2.f * aoPos.y - qy, 1.f - 1e-7f);
+
+        return qx + 2 * qy;
+    }
+
+    // Picks one of two halves by their energy and rescales aoRnd into it
+    static int PickHalf(float aLow, float aHigh, float &aoRnd)
+    {
+        const float total = aLow + aHigh;
+        const float lowProb = total > 0 ? aLow / total : 0.5f;
+
+        if(aoRnd < lowProb)
+        {
+            aoRnd = std::min(aoRnd / lowProb, 1.f - 1e-7f);
+            return 0;
+        }
+
+        aoRnd = std::min((aoRnd - lowProb) / (1.f - lowProb), 1.f - 1e-7f);
+        return 1;
+    }
+
+private:
+
+    std::vector<Node> mNodes;
+    float             mTotal; //!< Energy of the whole tree, set by Build
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Spatial octree of directional quadtrees
+
+class SDTree
+{
+public:
+
+    SDTree(
+        int   aSpatialThreshold     = 12000,
+        float aDirectionalThreshold = 0.01f,
+        int   aMaxDirectionalDepth  = 20) :
+        mSpatialThreshold(aSpatialThreshold),
+        mDirectionalThreshold(aDirectionalThreshold),
+        mMaxDirectionalDepth(aMaxDirectionalDepth),
+        mPasses(0),
+        mRecording(false)
+    {}
+
+    // Starts learning from scratch, the octree covers the cube around the box
+    void Setup(const Vec3f &aBBoxMin, const Vec3f &aBBoxMax)
+    {
+        const Vec3f extent = aBBoxMax - aBBoxMin;
+        const float size = std::max(extent.x, std::max(extent.y, extent.z)) * 1.01f;
+
+        mMin  = (aBBoxMin + aBBoxMax) * 0.5f - Vec3f(size * 0.5f);
+        mSize = size;
+
+        mNodes.assign(1, SpatialNode());
+        mLeaves.assign(1, Leaf());
+        mPasses    = 0;
+        mRecording = true;
+    }
+
+    // Index of the leaf containing aPoint
+    int GetLeaf(const Vec3f &aPoint) const
+    {
+        Vec3f pos = (aPoint - mMin) / mSize;
+        int node = 0;
+
+        while(mNodes[node].mChildren)
+        {
+            int octant = 0;
+            for(int a=0; a<3; a++)
+            {
+                if(pos.Get(a) >= 0.5f)
+                {
+                    octant |= 1 << a;
+                    pos.Get(a) -= 0.5f;
+                }
+                pos.Get(a) *= 2.f;
+            }
+
+            node = mNodes[node].mChildren + octant;
+        }
+
+        return mNodes[node].mLeaf;
+    }
+
+    // Whether the leaf learned anything to sample from
+    bool CanSample(int aLeaf) const
+    {
+        return mLeaves[aLeaf].mSampling.GetTotal() > 0;
+    }
+
+    // Samples a direction proportionally to the learned incident radiance
+    Vec3f Sample(int aLeaf, const Vec2f &aRnd) const
+    {
+        return DirectionalTree::SquareToDir(mLeaves[aLeaf].mSampling.Sample(aRnd));
+    }
+
+    // Solid angle pdf of sampling aDir
+    float Pdf(int aLeaf, const Vec3f &aDir) const
+    {
+        return mLeaves[aLeaf].mSampling.Pdf(DirectionalTree::DirToSquare(aDir)) / (4.f * PI_F);
+    }
+
+    // Records the radiance incident from aDir divided by the pdf of
+    // sampling it, can be called from several threads at once
+    void Record(int aLeaf, const Vec3f &aDir, float aValue)
+    {
+        Leaf &leaf = mLeaves[aLeaf];
+        leaf.mBuilding.Record(DirectionalTree::DirToSquare(aDir), aValue);
+
+#pragma omp atomic
+        leaf.mSampleCount++;
+    }
+
+    // Turns the recorded distributions into the sampling ones and
+    // refines the tree for the next pass, which is twice as long
+    void EndPass()
+    {
+        const float threshold = mSpatialThreshold * std::sqrt(float(1 << std::min(mPasses, 30)));
+
+        for(size_t i=0; i<mLeaves.size(); i++)
+        {
+            mLeaves[i].mBuilding.Build();
+            mLeaves[i].mSampling = mLeaves[i].mBuilding;
+        }
+
+        // the split children are visited too, until they are small enough
+        for(size_t i=0; i<mNodes.size(); i++)
+        {
+            if(mNodes[i].mChildren == 0 && mLeaves[mNodes[i].mLeaf].mSampleCount > threshold)
+                Split(int(i));
+        }
+
+        for(size_t i=0; i<mLeaves.size(); i++)
+        {
+            Leaf &leaf = mLeaves[i];
+            leaf.mBuilding.Refine(leaf.mSampling, mDirectionalThreshold, mMaxDirectionalDepth);
+            leaf.mSampleCount = 0;
+        }
+
+        mPasses++;
+    }
+
+    // Paths of the last pass need not be recorded
+    void SetRecording(bool aRecording) { mRecording = aRecording; }
+    bool IsRecording() const { return mRecording; }
+
+    int GetPassCount() const { return mPasses; }
+    int GetLeafCount() const { return int(mLeaves.size()); }
+
+    int GetDirectionalNodeCount() const
+    {
+        int count = 0;
+        for(size_t i=0; i<mLeaves.size(); i++)
+            count += mLeaves[i].mSampling.GetNodeCount();
+        return count;
+    }
+
+private:
+
+    struct SpatialNode
+    {
+        SpatialNode() :
+            mChildren(0), mLeaf(0)
+        {}
+
+        int mChildren; //!< First of the 8 children, 0 for leaves
+        int mLeaf;     //!< Index to mLeaves of leaves
+    };
+
+    struct Leaf
+    {
+        Leaf() :
+            mSampleCount(0)
+        {}
+
+        DirectionalTree mSampling; //!< Learned by the previous pass
+        DirectionalTree mBuilding; //!< Recorded by the current pass
+        int             mSampleCount;
+    };
+
+    // Splits a leaf into 8 copies of it sharing its samples
+    void Split(int aNode)
+    {
+        const int leaf = mNodes[aNode].mLeaf;
+        mLeaves[leaf].mSampleCount /= 8;
+        const Leaf copy = mLeaves[leaf];
+
+        const int children = int(mNodes.size());
+        mNodes[aNode].mChildren = children;
+        mNodes.resize(children + 8);
+
+        for(int c=0; c<8; c++)
+        {
+            if(c == 0)
+                mNodes[children].mLeaf = leaf;
+            else
+            {
+                mNodes[children + c].mLeaf = int(mLeaves.size());
+                mLeaves.push_back(copy);
+            }
+        }
+    }
+
+private:
+
+    int   mSpatialThreshold;     //!< Samples of a leaf in the first pass that split it
+    float mDirectionalThreshold; //!< Part of the energy that subdivides a quadrant
+    int   mMaxDirectionalDepth;
+
+    Vec3f                    mMin;  //!< Corner of the cube covered by the octree
+    float                    mSize; //!< Edge length of the cube
+    std::vector<SpatialNode> mNodes;
+    std::vector<Leaf>        mLeaves;
+    int                      mPasses;
+    bool                     mRecording;
+};
@@ -5,221 +5,580 @@
 #include <omp.h>
 #include <cassert>
 #include "renderer.hxx"
-#include "rng.hxx"
+#include "raystream.hxx"
+#include "pathguiding.hxx"
 
 class PathTracer : public AbstractRenderer
 {
 public:
 
+	// State of a single path that is kept between bounces
+	struct PathState
+	{
+		Vec2f sample;    // raster position of the path
+		Vec3f thrput;    // path throughput
+		Vec3f LoDirect;  // radiance gathered so far
+		Vec3f LoOneBounce; // part of LoDirect reaching the camera after at most one bounce
+		bool  oneBounceSet; // whether the path got past its one bounce light
+		uint  segments;  // path segments traced so far
+		float pdfBrdf;   // pdf of the last sampled direction
+		Vec3f prevPt;    // origin of the last BRDF sampled direction
+		Vec3f prevNormal;
+		bool  firstIsec; // whether the next intersection is the first one
+		SamplerState sampler; // next sample dimensions of the path
+		RayDifferential differential; // footprint of the ray, picks the texture levels
+		int   guidingSlot;  // first of the path's vertices in mGuidingVertices
+		uint  guidingCount; // vertices recorded for path guiding so far
+	};
+
+	// Surface vertex of a path whose incident radiance is recorded into the
+	// guiding tree once the path is finished
+	struct GuidingVertex
+	{
+		int   leaf;     // leaf of the guiding tree containing the vertex
+		Vec3f dir;      // sampled direction
+		float pdf;      // pdf of sampling it
+		Vec3f thrput;   // path throughput after the bounce
+		Vec3f LoDirect; // radiance gathered before the bounce
+	};
+
+	// BRDF sampling probability at vertices with a learned distribution
+	static float getBrdfSamplingFraction() { return 0.5f; }
+
+	// Angular width of the lobe the next direction is sampled from, the
+	// cos^n lobe is about sqrt(2 / (n + 2)) wide. The diffuse and Phong
+	// widths are weighted by how often each is sampled, the phase function
+	// is taken to be as wide as the diffuse lobe.
+	static float getDiffuseSpread() { return 0.8165f; }
+
+	static float getLobeSpread(const Material &mat)
+	{
+		const float diffuse = mat.getMaxElementInVector(mat.mDiffuseReflectance);
+		const float phong = mat.getMaxElementInVector(mat.mPhongReflectance);
+		if (diffuse + phong <= 0)
+			return 0;
+
+		return (diffuse * getDiffuseSpread() + phong * std::sqrt(2.f / (mat.mPhongExponent + 2.f))) /
+			(diffuse + phong);
+	}
+
+	// Deeper vertices are not recorded
+	static const uint kMaxGuidingVertices = 8;
+
 	PathTracer(
-		const Scene& aScene,
-		int aSeed = 1234
-	) :
-		AbstractRenderer(aScene), mRng(aSeed)
-	{}
+		const Scene& aScene,
+		const AbstractSampler& aSampler,
+		bool aRayReordering = false,
+		SDTree* aGuiding = NULL
+	) :
+		AbstractRenderer(aScene, aSampler), mRayReordering(aRayReordering), mGuiding(aGuiding)
+	{
+		mBinning.Setup(aScene.mBBoxMin, aScene.mBBoxMax);
+	}
 
 	virtual void RunIteration(int aIteration)
+	{
+		// stream tracing keeps the vertices of all paths
+		if (mGuiding)
+		{
+			const size_t numPaths = mRayReordering ?
+				size_t(mScene.mCamera.mResolution.x * mScene.mCamera.mResolution.y) : 1;
+			mGuidingVertices.resize(numPaths * kMaxGuidingVertices);
+		}
+
+		if (mRayReordering)
+			RunIterationStream(aIteration);
+		else
+			RunIterationDepthFirst(aIteration);
+
+		mIterations++;
+	}
+
+	// Traces each path to its end before starting the next pixel
+	void RunIterationDepthFirst(int aIteration)
 	{
 		const int resX = int(mScene.mCamera.mResolution.x);
 		const int resY = int(mScene.mCamera.mResolution.y);
 
-		// create embree intersection context
-		RTCIntersectContext _context;
-		rtcInitIntersectContext(&_context);
-
 		for (int pixID = 0; pixID < resX * resY; pixID++)
 		{
-			//////////////////////////////////////////////////////////////////////////
-			// Generate ray
-			const int x = pixID % resX;
-			const int y = pixID / resX;
+			PathState state;
+			Ray ray;
+			InitPath(pixID, aIteration, state, ray);
+
+			while (ExtendPath(state, ray))
+				;
+
+			recordGuiding(state);
+			AddSample(state.sample, state.LoDirect, getOneBounce(state)); // finally add the information to the image
+
+			/*
+			float dotLN = Dot(isect.normal, -ray.dir);
+			// this illustrates how to pick-up the material properties of the intersected surface
+			const Material mat = mScene.GetMaterial(isect.matID, isect.uv);
+			const Vec3f& rhoD = mat.mDiffuseReflectance;
+			// this illustrates how to pick-up the area source associated with the intersected surface
+			const AbstractLight *light = isect.lightID < 0 ?  0 : mScene.GetLightPtr( isect.lightID );
+			// we cannot do anything with the light because it has no interface right now
+			if(dotLN > 0)
+				mFramebuffer.AddColor(sample, (rhoD/PI_F) * Vec3f(dotLN));
+			*/
+		}
+	}
+
+	// Traces the paths of all pixels one bounce at a time. Before each bounce
+	// the rays of the surviving paths are binned by direction octant and
+	// origin, so that similar rays are traced one after another.
+	void RunIterationStream(int aIteration)
+	{
+		const int resX = int(mScene.mCamera.mResolution.x);
+		const int resY = int(mScene.mCamera.mResolution.y);
+		const int numPaths = resX * resY;
+
+		mPaths.resize(numPaths);
+		mRays.resize(numPaths);
+		mIsects.resize(numPaths);
+		mHits.resize(numPaths);
+		mActive.resize(numPaths);
+
+		for (int pixID = 0; pixID < numPaths; pixID++)
+		{
+			InitPath(pixID, aIteration, mPaths[pixID], mRays[pixID]);
+			mActive[pixID] = pixID;
+		}
 
-			const Vec2f sample = Vec2f(float(x), float(y)) + mRng.GetVec2f();
-			Ray   ray = mScene.mCamera.GenerateRay(sample);
+		bool cameraRays = true;
 
-			// set up variables for recursion
-			Vec3f LoDirect = Vec3f(0);
-			Vec3f thrput = (1.f, 1.f, 1.f);
-			float pdfBrdf = 1;
+		while (!mActive.empty())
+		{
+			// camera rays are coherent in pixel order already
+			if (!cameraRays)
+				mBinning.Sort(mRays, mActive);
 
-			bool firstIsec = true;
+			cameraRays = false;
 
-			Isect prevIsect;
-			Ray prevRay = ray;
+			// the binned rays are traced as one batch before any of them is
+			// shaded, the batch is timed as a whole
+			const double traceStart = omp_get_wtime();
+			for (size_t i = 0; i < mActive.size(); i++)
+			{
+				const int pathID = mActive[i];
+				mHits[pathID] = TraceRay(mPaths[pathID], mRays[pathID], mIsects[pathID]);
+			}
+			mTraversalTime += omp_get_wtime() - traceStart;
 
-			while (true)
+			size_t numActive = 0;
+			for (size_t i = 0; i < mActive.size(); i++)
 			{
-				Isect isect;
-				isect.dist = 1e36f;
+				const int pathID = mActive[i];
 
-				// if nothing was hit by the ray, get background light information
-				if (!mScene.Intersect(ray, isect))
-				{
-					if (mScene.GetBackground())
-					{
-						// float pdfLightSampling = mScene.GetBackground()->getPDF(0, ray.dir);
-						float pdfLightSampling = mScene.GetBackground()->getPDF();
-						float weightBRDFSampling = getBalanceHeuristic(pdfBrdf, pdfLightSampling);
-						Vec3f radiance = mScene.GetBackground()->mBackgroundColor;
-						LoDirect += radiance *  weightBRDFSampling *  thrput;
-					}
-					break;
-				}
+				if (ShadeHit(mPaths[pathID], mRays[pathID], mIsects[pathID], mHits[pathID] != 0))
+					mActive[numActive++] = pathID;
+			}
 
-				// if something is hit, get the mat info from intersection point
-				Vec3f normal = Normalize(isect.normal); 
-				const Vec3f surfPt = ray.org + ray.dir * isect.dist;
-				Frame frame;
-				frame.SetFromZ(isect.normal);
-				const Vec3f wog = -ray.dir;
-				const Vec3f wol = frame.ToLocal(-ray.dir);
-				const Material& mat = mScene.GetMaterial(isect.matID);
-
-				// if light source is intersected, add the light to the final image
-				if (isect.lightID >= 0)
-				{
-					// if the first ray hits the light source 
-					// calculate LoDirect and return
-					if (firstIsec)
-					{
-						const auto* firstIsectLight = mScene.GetLightPtr(isect.lightID);
-						assert(firstIsectLight != 0);
-						LoDirect += thrput * firstIsectLight->getRadiance();
-						break;
-					}
-					
-					const AbstractLight *abstLight = mScene.GetLightPtr(isect.lightID);
-					float pdfLightSampling = abstLight->getPDF(isect.dist, ray.dir);
-					float weightBRDFSampling;
-					weightBRDFSampling = getBalanceHeuristic(pdfBrdf, pdfLightSampling);
-
-					// float cosTheta = Dot(normal, ray.dir);
-					LoDirect += abstLight->getRadiance() * weightBRDFSampling *  thrput;
-					break;
-				}
+			mActive.resize(numActive);
+		}
 
-				if (firstIsec)
-				{
-					firstIsec = false;
-				}
+		for (int pathID = 0; pathID < numPaths; pathID++)
+		{
+			recordGuiding(mPaths[pathID]);
+			AddSample(mPaths[pathID].sample, mPaths[pathID].LoDirect, getOneBounce(mPaths[pathID]));
+		}
+	}
 
-				//////////////////////////////////////////////
-				//			Area Light Sampling				//
-				//////////////////////////////////////////////
-				
-				// initialize variables for the prob of light sampling or brdf sampling
-				float lightSamplingPdfLight;
-				float lightSamplingPdfBrdf;
+	// Generates the camera ray of the given pixel, aIteration is the sample index
+	void InitPath(int aPixID, int aIteration, PathState &oState, Ray &oRay)
+	{
+		const int resX = int(mScene.mCamera.mResolution.x);
 
-				// ASSIGNMENT 1
-				for (int i = 0; i < mScene.GetLightCount(); i++)
-				{
-					const AbstractLight* light = mScene.GetLightPtr(i);
-					assert(light != 0);
-
-					Vec3f wig;
-					float lightDist;
-					Vec3f illum = light->sampleIllumination(mRng.GetVec3f(), surfPt, frame, wig, lightDist); 
-
-					// if the scene is a "point light scene", always do
-					// light sampling
-					// set the probabilities accordingly
-					const PointLight* ptLight = dynamic_cast<const PointLight*>(light);
-					if (ptLight != nullptr)
-					{
-						lightSamplingPdfLight = 1;
-						lightSamplingPdfBrdf = 0;
-					}
-					else
-					{
-						lightSamplingPdfLight = light->getPDF(lightDist, wig);
-						lightSamplingPdfBrdf = mat.evalBrdfPdf(wog, wig, frame.Normal());
-					}
-
-					// get the weights
-					float weightLightSampling = getBalanceHeuristic(lightSamplingPdfLight, lightSamplingPdfBrdf);
-
-					if (illum.Max() > 0)
-					{
-						if (!mScene.Occluded(surfPt, wig, lightDist))
-						{
-							LoDirect += (illum * mat.evalBrdf(frame.ToLocal(wig), wol) * weightLightSampling) * thrput;
-						}
-					}
-				}
-				
-				//////////////////////////////////////////////
-				//			Area Light Sampling	 end		//
-				//////////////////////////////////////////////
+		//////////////////////////////////////////////////////////////////////////
+		// Generate ray
+		const int x = aPixID % resX;
+		const int y = aPixID / resX;
+
+		mSampler.StartPixelSample(x, y, uint(aIteration), oState.sampler);
+		oState.sample = Vec2f(float(x), float(y)) + mSampler.Get2D(oState.sampler);
+		oRay = mScene.mCamera.GenerateRay(oState.sample, oState.differential);
+
+		// set up variables for recursion
+		oState.LoDirect = Vec3f(0);
+		oState.LoOneBounce = Vec3f(0);
+		oState.oneBounceSet = false;
+		oState.segments = 0;
+		oState.thrput = Vec3f(1.f);
+		oState.pdfBrdf = 1;
+		oState.firstIsec = true;
+		oState.guidingSlot = mRayReordering ? aPixID * int(kMaxGuidingVertices) : 0;
+		oState.guidingCount = 0;
+	}
 
-				//////////////////////////////////////////////
-				//				BRDF Sampling				//
-				//////////////////////////////////////////////
+	// Traces one segment of the path, gathers the light at its end and
+	// generates the next ray. Returns false when the path is terminated.
+	bool ExtendPath(PathState &aoState, Ray &aoRay)
+	{
+		Isect isect;
+		const bool hit = TraceRay(aoState, aoRay, isect);
+		return ShadeHit(aoState, aoRay, isect, hit);
+	}
 
-				// initialize variables for the probability of light sampling or brdf sampling
+	// Finds the end of the next path segment
+	bool TraceRay(PathState &aoState, const Ray &aRay, Isect &oIsect)
+	{
+		oIsect.dist = 1e36f;
+
+		const unsigned long long stepsBefore = g_TraversalSteps;
+		const bool hit = mScene.Intersect(aRay, oIsect);
+		mTraversalSteps += g_TraversalSteps - stepsBefore;
+		mRayCount++;
+		aoState.segments++;
+		return hit;
+	}
 
-				// set up for second ray
-				Vec3f genDir; // generated direction
-				Ray secondRay; // second Ray
-				Isect secondRayIsect; // second intersection
-				float ps; // prob of choosing the diffuse component
-				float pd; // prob of choosing the specular comp.
+	// Gathers the light at the end of the traced segment and generates the
+	// next ray. Returns false when the path is terminated.
+	bool ShadeHit(PathState &aoState, Ray &aoRay, const Isect &aIsect, bool aHit)
+	{
+		Ray &ray = aoRay;
+		Vec3f &LoDirect = aoState.LoDirect;
+		Vec3f &thrput = aoState.thrput;
+		float &pdfBrdf = aoState.pdfBrdf;
+		const Isect &isect = aIsect;
+		const bool hit = aHit;
+
+		if (aoState.firstIsec)
+			AddFirstHit(aoState.sample, ray, isect, hit);
+
+		// free flight through the medium, scenes without one skip it
+		const AbstractMedium* medium = mScene.GetMedium();
+		if (medium)
+		{
+			float mediumDist;
+			Vec3f mediumWeight;
+			const bool scattered = medium->SampleDistance(ray, hit ? isect.dist : 1e36f,
+				mSampler, aoState.sampler, mediumDist, mediumWeight);
 
-				// generate new direction
-				createSecondRay(mat, genDir, secondRay, secondRayIsect, frame, wog, surfPt, normal, pd, ps);
+			thrput *= mediumWeight;
 
-				// calculate pdf
-				pdfBrdf = mat.evalBrdfPdf(wog, genDir, normal);
+			if (scattered)
+				return scatterInMedium(aoState, ray, ray.org + ray.dir * mediumDist, mediumWeight);
+		}
 
-				//////////////////////////////////////////////
-				//				BRDF Sampling end			//
-				//////////////////////////////////////////////
+		// if nothing was hit by the ray, get background light information
+		if (!hit)
+		{
+			if (mScene.GetBackground())
+			{
+				Vec3f radiance = mScene.GetBackground()->GetRadiance(ray.dir);
+
+				// camera rays cannot be generated by light sampling
+				float weightBRDFSampling = 1;
+				if (!aoState.firstIsec)
+				{
+					float pdfLightSampling = mLightSamples
+						* mScene.LightSelectionPdf(aoState.prevPt, aoState.prevNormal, mScene.GetBackgroundID(), 0)
+						* mScene.GetBackground()->GetPDF(ray.dir);
+					weightBRDFSampling = getBalanceHeuristic(pdfBrdf, pdfLightSampling);
+				}
+
+				LoDirect += radiance *  weightBRDFSampling *  thrput;
+			}
+			return false;
+		}
 
-				//////////////////////////////////////////////
-				//				RR and Continuing			//
-				//////////////////////////////////////////////
+		// if something is hit, get the mat info from intersection point
+		Vec3f normal = Normalize(isect.normal); 
+		const Vec3f surfPt = ray.org + ray.dir * isect.dist;
+		Frame frame;
+		frame.SetFromZ(isect.normal);
+		const Vec3f wog = -ray.dir;
+		const Vec3f wol = frame.ToLocal(-ray.dir);
+
+		// the footprint of the ray on the surface picks the texture levels
+		Vec3f dPdx, dPdy;
+		aoState.differential.Transfer(ray, isect.dist, isect.normal, dPdx, dPdy);
+		const Material mat = mScene.GetMaterial(isect.matID, isect.uv,
+			RayDifferential::GetTextureWidth(dPdx, dPdy, isect.uvScale));
+		const LightStorage& lights = mScene.GetLightStorage();
+
+		// if light source is intersected, add the light to the final image
+		if (isect.lightID >= 0)
+		{
+			// if the first ray hits the light source 
+			// calculate LoDirect and return
+			if (aoState.firstIsec)
+			{
+				LoDirect += thrput * lights.GetEmittedRadiance(isect.lightID, isect.primID, ray.dir);
+				return false;
+			}
+			
+			float pdfLightSampling = mLightSamples
+				* mScene.LightSelectionPdf(aoState.prevPt, aoState.prevNormal, isect.lightID, isect.primID)
+				* lights.GetPDF(isect.lightID, isect.primID, isect.dist, ray.dir);
+			float weightBRDFSampling;
+			weightBRDFSampling = getBalanceHeuristic(pdfBrdf, pdfLightSampling);
+
+			// float cosTheta = Dot(normal, ray.dir);
+			LoDirect += lights.GetEmittedRadiance(isect.lightID, isect.primID, ray.dir) * weightBRDFSampling *  thrput;
+			return false;
+		}
 
-				Vec3f thrputUpdate = 1 / pdfBrdf * mat.evalBrdf(frame.ToLocal(genDir), wol) * Dot(isect.normal, genDir);
-				float survivalProb = fmin(1.f, thrputUpdate.Max());
+		if (aoState.firstIsec)
+		{
+			aoState.firstIsec = false;
+		}
 
-				// russian roulette
-				if (mRng.GetFloat() < survivalProb)
+		// the light gathered from here on took two or more bounces
+		if (aoState.segments == 2)
+		{
+			aoState.LoOneBounce = LoDirect;
+			aoState.oneBounceSet = true;
+		}
+
+		// the learned incident light at the point, when there is any,
+		// is sampled along with the BRDF
+		const int guidingLeaf = mGuiding ? mGuiding->GetLeaf(surfPt) : -1;
+		const int samplingLeaf = guidingLeaf >= 0 && mGuiding->CanSample(guidingLeaf) ? guidingLeaf : -1;
+
+		//////////////////////////////////////////////
+		//			Area Light Sampling				//
+		//////////////////////////////////////////////
+		
+		// initialize variables for the prob of light sampling or brdf sampling
+		float lightSamplingPdfLight;
+		float lightSamplingPdfBrdf;
+
+		// ASSIGNMENT 1
+		// take mLightSamples lights picked by the scene's light sampler
+		// instead of sampling every light in the scene
+		PickLights(surfPt, frame.Normal(), aoState.sampler);
+		lights.SampleIllumination(surfPt, frame, mLightBatch);
+
+		for (int s = 0; s < mLightBatch.mCount; s++)
+		{
+			const int lightID = mLightBatch.mLightIdx[s];
+			const float lightPickPdf = mLightBatch.mPickPdf[s];
+			const Vec3f& illum = mLightBatch.mIllum[s];
+			const Vec3f& wig = mLightBatch.mWig[s];
+			const float lightDist = mLightBatch.mLightDist[s];
+
+			// if the scene is a "point light scene", always do
+			// light sampling
+			// set the probabilities accordingly
+			if (lights.IsDelta(lightID))
+			{
+				lightSamplingPdfLight = 1;
+				lightSamplingPdfBrdf = 0;
+			}
+			else
+			{
+				lightSamplingPdfLight = lightPickPdf * mLightBatch.mPdf[s];
+				lightSamplingPdfBrdf = getDirectionPdf(mat, wog, wig, frame.Normal(), samplingLeaf);
+			}
+
+			// get the weights
+			float weightLightSampling = getBalanceHeuristic(lightSamplingPdfLight, lightSamplingPdfBrdf);
+
+			if (illum.Max() > 0)
+			{
+				if (!mScene.Occluded(surfPt, wig, lightDist))
 				{
-					thrput *= (thrputUpdate / survivalProb);
+					Vec3f contrib = (illum * mat.evalBrdf(frame.ToLocal(wig), wol) * weightLightSampling) * thrput / lightPickPdf;
 
-					prevRay = ray;
-					ray.org = surfPt + genDir * EPS_RAY; // a little offset
-					ray.dir = genDir;
-				}
-				else
-				{ 
-					// terminate path
-					break;
+					if (medium)
+						contrib *= shadowTransmittance(surfPt, wig, lightDist, aoState.sampler);
+
+					LoDirect += contrib;
 				}
+			}
+		}
+		
+		//////////////////////////////////////////////
+		//			Area Light Sampling	 end		//
+		//////////////////////////////////////////////
+
+		//////////////////////////////////////////////
+		//				BRDF Sampling				//
+		//////////////////////////////////////////////
+
+		// initialize variables for the probability of light sampling or brdf sampling
+
+		// set up for second ray
+		Vec3f genDir; // generated direction
+		Ray secondRay; // second Ray
+		Isect secondRayIsect; // second intersection
+		float ps; // prob of choosing the diffuse component
+		float pd; // prob of choosing the specular comp.
+
+		// generate new direction, the guided strategy is picked by the first
+		// dimension of the direction sample, so that the samples of both
+		// strategies stay stratified over the pixel samples
+		Vec2f rnd = mSampler.Get2D(aoState.sampler);
+		const float brdfFraction = getBrdfSamplingFraction();
+
+		if (samplingLeaf >= 0 && rnd.x >= brdfFraction)
+		{
+			rnd.x = (rnd.x - brdfFraction) / (1.f - brdfFraction);
+			genDir = mGuiding->Sample(samplingLeaf, rnd);
+			mSampler.Get1D(aoState.sampler); // unused BRDF component selection
+		}
+		else
+		{
+			if (samplingLeaf >= 0)
+				rnd.x /= brdfFraction;
+			createSecondRay(mat, genDir, secondRay, secondRayIsect, frame, wog, surfPt, normal, pd, ps, rnd, aoState.sampler);
+		}
 
-				//////////////////////////////////////////////
-				//		RR and Continuing end				//
-				//////////////////////////////////////////////
+		// calculate pdf
+		pdfBrdf = getDirectionPdf(mat, wog, genDir, normal, samplingLeaf);
 
-			} // end while loop
+		//////////////////////////////////////////////
+		//				BRDF Sampling end			//
+		//////////////////////////////////////////////
 
-		
-			mFramebuffer.AddColor(sample, LoDirect); // finally add the information to the image
+		//////////////////////////////////////////////
+		//				RR and Continuing			//
+		//////////////////////////////////////////////
 
-			/*
-			float dotLN = Dot(isect.normal, -ray.dir);
-			// this illustrates how to pick-up the material properties of the intersected surface
-			const Material& mat = mScene.GetMaterial( isect.matID );
-			const Vec3f& rhoD = mat.mDiffuseReflectance;
-			// this illustrates how to pick-up the area source associated with the intersected surface
-			const AbstractLight *light = isect.lightID < 0 ?  0 : mScene.GetLightPtr( isect.lightID );
-			// we cannot do anything with the light because it has no interface right now
-			if(dotLN > 0)
-				mFramebuffer.AddColor(sample, (rhoD/PI_F) * Vec3f(dotLN));
-			*/
+		Vec3f thrputUpdate = 1 / pdfBrdf * mat.evalBrdf(frame.ToLocal(genDir), wol) * Dot(isect.normal, genDir);
+		float survivalProb = fmin(1.f, thrputUpdate.Max());
+
+		// guided directions toward bright light have a high pdf, the roulette
+		// must not kill them for it, so they survive at least by the
+		// reflectance. The guided directions below the surface carry nothing.
+		if (samplingLeaf >= 0)
+		{
+			if (thrputUpdate.Max() <= 0)
+				return false;
+
+			survivalProb = fmin(1.f, fmax(thrputUpdate.Max(),
+				(mat.mDiffuseReflectance + mat.mPhongReflectance).Max()));
 		}
 
-		mIterations++;
+		// russian roulette
+		if (mSampler.Get1D(aoState.sampler) < survivalProb)
+		{
+			thrput *= (thrputUpdate / survivalProb);
+
+			ray.org = surfPt + genDir * EPS_RAY; // a little offset
+			ray.dir = genDir;
+			aoState.differential.Scatter(dPdx, dPdy, genDir, getLobeSpread(mat));
+
+			aoState.prevPt = surfPt;
+			aoState.prevNormal = frame.Normal();
+
+			if (guidingLeaf >= 0 && mGuiding->IsRecording() && aoState.guidingCount < kMaxGuidingVertices)
+			{
+				GuidingVertex &vertex = mGuidingVertices[aoState.guidingSlot + aoState.guidingCount++];
+				vertex.leaf = guidingLeaf;
+				vertex.dir = genDir;
+				vertex.pdf = pdfBrdf;
+				vertex.thrput = thrput;
+				vertex.LoDirect = LoDirect;
+			}
+		}
+		else
+		{ 
+			// terminate path
+			return false;
+		}
+
+		//////////////////////////////////////////////
+		//		RR and Continuing end				//
+		//////////////////////////////////////////////
+
+		return true;
+	}
+
+	// Scattering event in the medium at aPoint, aWeight is the throughput
+	// factor of the sampled distance. Gathers the light with the phase
+	// function and continues the path in a direction sampled from it.
+	bool scatterInMedium(PathState &aoState, Ray &aoRay, const Vec3f &aPoint, const Vec3f &aWeight)
+	{
+		const AbstractMedium& medium = *mScene.GetMedium();
+		const PhaseFunction& phase = medium.GetPhase();
+
+		aoState.firstIsec = false;
+
+		if (aoState.segments == 2)
+		{
+			aoState.LoOneBounce = aoState.LoDirect;
+			aoState.oneBounceSet = true;
+		}
+
+		// next event estimation, lights are picked like for surfaces
+		// but without a normal
+		const int lightSamples = mScene.GetLightCount() > 0 ? int(mLightSamples) : 0;
+
+		for (int s = 0; s < lightSamples; s++)
+		{
+			int primID;
+			float lightPickPdf;
+			const int lightID = mScene.SampleLight(aPoint, Vec3f(0), mSampler.Get1D(aoState.sampler), primID, lightPickPdf);
+			const Vec3f rnd = mSampler.Get3D(aoState.sampler);
+
+			if (lightID < 0)
+				continue;
+
+			lightPickPdf *= lightSamples;
+
+			const AbstractLight* light = mScene.GetLightPtr(lightID);
+
+			// mesh lights are sampled on the triangle picked with them
+			Vec3f wig;
+			float lightDist, directPdfW, emissionPdfW, cosAtLight;
+			const Vec3f radiance = light->GetType() == AbstractLight::kMesh ?
+				static_cast<const MeshLight*>(light)->Illuminate(primID, aPoint, rnd,
+					wig, lightDist, directPdfW, emissionPdfW, cosAtLight) :
+				light->illuminate(mScene.mSceneSphere, aPoint, rnd,
+					wig, lightDist, directPdfW, emissionPdfW, cosAtLight);
+
+			if (radiance.Max() <= 0 || directPdfW <= 0)
+				continue;
+
+			const float phaseValue = phase.Eval(aoRay.dir, wig);
+
+			// phase function sampling cannot hit delta lights
+			const float weightLightSampling = light->IsDelta() ? 1.f
+				: getBalanceHeuristic(lightPickPdf * directPdfW, phaseValue);
+
+			if (mScene.Occluded(aPoint, wig, lightDist))
+				continue;
+
+			aoState.LoDirect += aoState.thrput * radiance *
+				shadowTransmittance(aPoint, wig, lightDist, aoState.sampler) *
+				(phaseValue * weightLightSampling / (lightPickPdf * directPdfW));
+		}
+
+		// the phase function is sampled exactly, its value cancels out
+		float phasePdf;
+		const Vec3f genDir = phase.Sample(aoRay.dir, mSampler.Get2D(aoState.sampler), phasePdf);
+
+		// russian roulette on the albedo of the medium
+		const float survivalProb = fmin(1.f, aWeight.Max());
+		if (mSampler.Get1D(aoState.sampler) >= survivalProb)
+			return false;
+
+		// the footprint across the ray at the scattering point
+		Vec3f dPdx, dPdy;
+		aoState.differential.Transfer(aoRay, Dot(aPoint - aoRay.org, aoRay.dir), -aoRay.dir, dPdx, dPdy);
+		aoState.differential.Scatter(dPdx, dPdy, genDir, getDiffuseSpread());
+
+		aoState.thrput /= survivalProb;
+		aoState.pdfBrdf = phasePdf;
+		aoState.prevPt = aPoint;
+		aoState.prevNormal = Vec3f(0);
+
+		aoRay.org = aPoint;
+		aoRay.dir = genDir;
+		aoRay.tmin = 0;
+
+		return true;
+	}
+
+	// transmittance of the medium along a shadow ray
+	Vec3f shadowTransmittance(const Vec3f &aPoint, const Vec3f &aDir, float aDist, SamplerState &aoSampler)
+	{
+		return mScene.GetMedium()->Transmittance(Ray(aPoint, aDir, 0), aDist, mSampler, aoSampler);
 	}
 
 	// ASSIGNMENT 2
@@ -232,8 +591,10 @@ public:
 									Vec3f wog, 
 									Vec3f surfPt,
 									Vec3f &normal,
-									float &pd,
-									float &ps)
+									float &pd,
+									float &ps,
+									const Vec2f &rnd,
+									SamplerState &aoSampler)
 	{
 		// generate new direction
 		pd = mat.getMaxElementInVector(mat.mDiffuseReflectance); // Exception thrown: read access violation
@@ -242,10 +603,10 @@ public:
 		pd /= sumPdPs;	 // prob of choosing the diffuse component
 		// ps /= sumPdPs;	 // prob of choosing the specular comp.
 
-		float r1 = mRng.GetFloat();
-		float r2 = mRng.GetFloat();
-
-		if (mRng.GetFloat() <= pd) 
+		float r1 = rnd.x;
+		float r2 = rnd.y;
+
+		if (mSampler.Get1D(aoSampler) <= pd) 
 		{
 			genDir = frame.ToWorld(mat.sampleDiffuse(r1, r2));
 		}
@@ -255,11 +616,68 @@ public:
 		}
 	}
 	
-	// get balance heuristic
-	float getBalanceHeuristic(float fPdf, float gPdf)
+	// pdf of sampling aDir at a surface point, a mixture of the BRDF and the
+	// distribution learned by the guiding tree at aSamplingLeaf, if not -1
+	float getDirectionPdf(const Material &mat, const Vec3f &wog, const Vec3f &aDir, const Vec3f &normal, int aSamplingLeaf)
+	{
+		const float pdf = mat.evalBrdfPdf(wog, aDir, normal);
+
+		if (aSamplingLeaf < 0)
+			return pdf;
+
+		return getBrdfSamplingFraction() * pdf +
+			(1.f - getBrdfSamplingFraction()) * mGuiding->Pdf(aSamplingLeaf, aDir);
+	}
+
+	// records the radiance incident at the surface vertices of a finished
+	// path into the guiding tree, it is what the path gathered after the
+	// vertex divided by the throughput up to it
+	void recordGuiding(const PathState &aState)
+	{
+		if (!mGuiding || !mGuiding->IsRecording())
+			return;
+
+		for (uint i = 0; i < aState.guidingCount; i++)
+		{
+			const GuidingVertex &vertex = mGuidingVertices[aState.guidingSlot + i];
+			const Vec3f gathered = aState.LoDirect - vertex.LoDirect;
+
+			Vec3f incident(0);
+			for (int c = 0; c < 3; c++)
+			{
+				if (vertex.thrput.Get(c) > 0)
+					incident.Get(c) = gathered.Get(c) / vertex.thrput.Get(c);
+			}
+
+			const float value = Luminance(incident) / vertex.pdf;
+			if (std::isfinite(value))
+				mGuiding->Record(vertex.leaf, vertex.dir, std::max(0.f, value));
+		}
+	}
+
+	// radiance of a finished path that reached the camera after at most one
+	// bounce, paths ending before their second vertex gathered nothing else
+	Vec3f getOneBounce(const PathState &aState)
 	{
-		return (fPdf) / (fPdf + gPdf);
+		return aState.oneBounceSet ? aState.LoOneBounce : aState.LoDirect;
 	}
 
-	Rng mRng;
+	// get balance heuristic
+	float getBalanceHeuristic(float fPdf, float gPdf)
+	{
+		return (fPdf) / (fPdf + gPdf);
+	}
+
+	// Stream tracing with ray binning
+	bool                   mRayReordering;
+	RayBinning             mBinning;
+	std::vector<PathState> mPaths;
+	std::vector<Ray>       mRays;
+	std::vector<Isect>     mIsects;
+	std::vector<char>      mHits;   // whether mRays hit anything
+	std::vector<int>       mActive;
+
+	// Path guiding, shared by the renderers of all threads
+	SDTree*                    mGuiding;
+	std::vector<GuidingVertex> mGuidingVertices;
 };
@@ -2,6 +2,7 @@
 #include <cmath>
 #include <time.h>
 #include <cstdlib>
+#include <climits>
 #include <algorithm>
 #include "math.hxx"
 #include "ray.hxx"
@@ -11,6 +12,7 @@
 #include "scene.hxx"
 #include "eyelight.hxx"
 #include "pathtracer.hxx"
+#include "denoiser.hxx"
 #include "config.hxx"
 
 #include <omp.h>
@@ -18,12 +20,24 @@
 #include <set>
 #include <sstream>
 
+//////////////////////////////////////////////////////////////////////////
+// Statistics gathered from all renderers during rendering
+
+struct RenderStats
+{
+    unsigned long long mRayCount;
+    unsigned long long mTraversalSteps;
+    double             mTraversalTime;
+    double             mTechniqueContrib[AbstractRenderer::kTechniqueCount];
+};
+
 //////////////////////////////////////////////////////////////////////////
 // The main rendering function, renders what is in aConfig
 
 float render(
     const Config &aConfig,
-    int *oUsedIterations = NULL)
+    int *oUsedIterations = NULL,
+    RenderStats *oStats = NULL)
 {
     // Set number of used threads
     omp_set_num_threads(aConfig.mNumThreads);
@@ -35,68 +49,112 @@ float render(
 
     for (int i=0; i<aConfig.mNumThreads; i++)
     {
-        renderers[i] = CreateRenderer(aConfig, aConfig.mBaseSeed + i);
+        renderers[i] = CreateRenderer(aConfig);
 
         renderers[i]->mMaxPathLength = aConfig.mMaxPathLength;
         renderers[i]->mMinPathLength = aConfig.mMinPathLength;
+        renderers[i]->mLightSamples  = aConfig.mLightSamples;
+
+        if (aConfig.mAovs)
+            renderers[i]->EnableAovs(aConfig.mAovs->GetEnabledMask());
     }
 
+    // Path guiding learns from scratch
+    if (aConfig.mGuiding)
+        aConfig.mGuiding->Setup(aConfig.mScene->mBBoxMin, aConfig.mScene->mBBoxMax);
+
     clock_t startT = clock();
     int iter = 0;
 
     // Rendering loop, when we have any time limit, use time-based loop,
-    // otherwise go with required iterations
+    // otherwise go with required iterations. With path guiding the
+    // iterations run in passes of doubling length, between which the
+    // guiding tree is refined, all of them are accumulated in the image.
     if (aConfig.mMaxTime > 0)
     {
         // Time based loop
-#pragma omp parallel
-        while (clock() < startT + aConfig.mMaxTime*CLOCKS_PER_SEC)
+        for (int passLength = 1; clock() < startT + aConfig.mMaxTime*CLOCKS_PER_SEC; passLength *= 2)
         {
-            int threadId = omp_get_thread_num();
-            renderers[threadId]->RunIteration(iter);
+            const int passEnd = aConfig.mGuiding ? iter + passLength : INT_MAX;
+
+#pragma omp parallel
+            while (clock() < startT + aConfig.mMaxTime*CLOCKS_PER_SEC)
+            {
+                int threadId = omp_get_thread_num();
+
+                // the iteration is the sample index, no two threads may share it
+                int sampleIndex;
+#pragma omp atomic capture
+                sampleIndex = iter++; // counts number of iterations
+
+                if (sampleIndex >= passEnd)
+                    break;
 
-#pragma omp atomic
-            iter++; // counts number of iterations
+                renderers[threadId]->RunIteration(sampleIndex);
+            }
+
+            iter = std::min(iter, passEnd);
+
+            if (aConfig.mGuiding)
+                aConfig.mGuiding->EndPass();
         }
     }
     else
     {
         // Iterations based loop
         int globalCounter = 0;
-#pragma omp parallel for
-        for (iter=0; iter < aConfig.mIterations; iter++)
+        for (int passStart = 0, passLength = 1; passStart < aConfig.mIterations; passLength *= 2)
         {
-            int threadId = omp_get_thread_num();
-            renderers[threadId]->RunIteration(iter);
+            // the last pass takes what would not fill the next one
+            int passEnd = aConfig.mIterations;
+            if (aConfig.mGuiding && passStart + 3 * passLength <= aConfig.mIterations)
+                passEnd = passStart + passLength;
 
-            // Print progress bar
-#pragma omp critical
+            if (aConfig.mGuiding)
+                aConfig.mGuiding->SetRecording(passEnd < aConfig.mIterations);
+
+#pragma omp parallel for
+            for (iter=passStart; iter < passEnd; iter++)
             {
-                globalCounter++;
-                const double progress   = (double)globalCounter / aConfig.mIterations;
-                const int barCount      = 20;
-
-                printf(
-                    "\rProgress:  %6.2f%% [", 
-                    100.0 * progress);
-                for (int bar = 1; bar <= barCount; bar++)
+                int threadId = omp_get_thread_num();
+                renderers[threadId]->RunIteration(iter);
+
+                // Print progress bar
+#pragma omp critical
                 {
-                    const double barProgress = (double)bar / barCount;
-                    if (barProgress <= progress)
-                        printf("|");
-                    else
-                        printf(".");
+                    globalCounter++;
+                    const double progress   = (double)globalCounter / aConfig.mIterations;
+                    const int barCount      = 20;
+
+                    printf(
+                        "\rProgress:  %6.2f%% [", 
+                        100.0 * progress);
+                    for (int bar = 1; bar <= barCount; bar++)
+                    {
+                        const double barProgress = (double)bar / barCount;
+                        if (barProgress <= progress)
+                            printf("|");
+                        else
+                            printf(".");
+                    }
+                    printf("]");
+                    fflush(stdout);
                 }
-                printf("]");
-                fflush(stdout);
             }
+
+            if (aConfig.mGuiding && passEnd < aConfig.mIterations)
+                aConfig.mGuiding->EndPass();
+
+            passStart = passEnd;
         }
     }
 
     clock_t endT = clock();
 
+    // the time based loop counts the iterations it started, the loop
+    // variable of the iterations based one is private to the threads
     if (oUsedIterations)
-        *oUsedIterations = iter+1;
+        *oUsedIterations = aConfig.mMaxTime > 0 ? iter : aConfig.mIterations;
 
     // Accumulate from all renderers into a common framebuffer
     int usedRenderers = 0;
@@ -112,12 +170,22 @@ float render(
         if (usedRenderers == 0)
         {
             renderers[i]->GetFramebuffer(*aConfig.mFramebuffer);
+
+            if (aConfig.mAovs)
+                renderers[i]->GetAovs(*aConfig.mAovs);
         }
         else
         {
             Framebuffer tmp;
             renderers[i]->GetFramebuffer(tmp);
             aConfig.mFramebuffer->Add(tmp);
+
+            if (aConfig.mAovs)
+            {
+                AovBuffer tmpAovs;
+                renderers[i]->GetAovs(tmpAovs);
+                aConfig.mAovs->Add(tmpAovs);
+            }
         }
 
         usedRenderers++;
@@ -126,6 +194,32 @@ float render(
     // Scale framebuffer by the number of used renderers
     aConfig.mFramebuffer->Scale(1.f / usedRenderers);
 
+    if (aConfig.mAovs)
+    {
+        aConfig.mAovs->Scale(1.f / usedRenderers);
+        aConfig.mAovs->Finalize();
+    }
+
+    if (oStats)
+    {
+        oStats->mRayCount       = 0;
+        oStats->mTraversalSteps = 0;
+        oStats->mTraversalTime  = 0;
+
+        for (int t=0; t<AbstractRenderer::kTechniqueCount; t++)
+            oStats->mTechniqueContrib[t] = 0;
+
+        for (int i=0; i<aConfig.mNumThreads; i++)
+        {
+            oStats->mRayCount       += renderers[i]->mRayCount;
+            oStats->mTraversalSteps += renderers[i]->mTraversalSteps;
+            oStats->mTraversalTime  += renderers[i]->mTraversalTime;
+
+            for (int t=0; t<AbstractRenderer::kTechniqueCount; t++)
+                oStats->mTechniqueContrib[t] += renderers[i]->mTechniqueContrib[t];
+        }
+    }
+
     // Clean up renderers
     for (int i=0; i<aConfig.mNumThreads; i++)
         delete renderers[i];
@@ -135,6 +229,291 @@ float render(
     return float(endT - startT) / CLOCKS_PER_SEC;
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Sampler benchmark
+
+float RootMeanSquareError(
+    const Framebuffer &aImage,
+    const Framebuffer &aReference)
+{
+    double sum = 0;
+
+    for (int y = 0; y < aImage.GetResY(); y++)
+    {
+        for (int x = 0; x < aImage.GetResX(); x++)
+        {
+            const Vec3f diff = aImage.GetColor(x, y) - aReference.GetColor(x, y);
+            sum += Dot(diff, diff) / 3.f;
+        }
+    }
+
+    return float(std::sqrt(sum / (aImage.GetResX() * aImage.GetResY())));
+}
+
+// Renders aConfig.mIterations iterations with every sampler and compares them
+// to a reference with 16x the iterations of independent random samples.
+// Under 1/sqrt(N) convergence, the squared ratio of the errors estimates
+// how many times fewer samples a sampler needs for the quality of random.
+// A sampler that costs more per sample can still lose, so each one is also
+// rendered for the time random took, where the squared ratio of the errors
+// is how many times less time it needs for the same error.
+void RunSamplerBenchmark(Config &aConfig)
+{
+    const int iterations = std::max(1, aConfig.mIterations);
+    const AbstractSampler *configSampler = aConfig.mSampler;
+    Framebuffer *configFramebuffer = aConfig.mFramebuffer;
+
+    aConfig.mMaxTime = -1.f;
+
+    Framebuffer reference;
+    RandomSampler referenceSampler(uint(aConfig.mBaseSeed) + 1);
+    aConfig.mSampler     = &referenceSampler;
+    aConfig.mFramebuffer = &reference;
+    aConfig.mIterations  = 16 * iterations;
+
+    printf("Reference: %d iterations with random samples\n", aConfig.mIterations);
+    float time = render(aConfig);
+    printf(" done in %.2f s\n", time);
+
+    aConfig.mIterations = iterations;
+    float randomError = 0, randomTime = 0;
+
+    for (int i = 0; i < AbstractSampler::kSamplerTypeMax; i++)
+    {
+        const AbstractSampler::SamplerType type = AbstractSampler::SamplerType(i);
+        AbstractSampler *sampler = AbstractSampler::Create(type, uint(aConfig.mBaseSeed));
+
+        Framebuffer image;
+        aConfig.mSampler     = sampler;
+        aConfig.mFramebuffer = &image;
+        aConfig.mMaxTime     = -1.f;
+
+        time = render(aConfig);
+        const float error = RootMeanSquareError(image, reference);
+
+        if (type == AbstractSampler::kRandom)
+        {
+            randomError = error;
+            randomTime  = time;
+        }
+
+        printf("\rSampler:   %-9s %d iterations, RMSE %.5f, %.2fx fewer samples than random, %.2f s\n",
+            AbstractSampler::GetName(type), iterations, error,
+            error > 0 ? Sqr(randomError / error) : 0.f, time);
+
+        // the fixed count run of random is its equal time run
+        if (type != AbstractSampler::kRandom)
+        {
+            Framebuffer equalTimeImage;
+            aConfig.mFramebuffer = &equalTimeImage;
+            aConfig.mMaxTime     = randomTime;
+
+            int equalTimeIterations = 0;
+            render(aConfig, &equalTimeIterations);
+            const float equalTimeError = RootMeanSquareError(equalTimeImage, reference);
+
+            printf("\r           %-9s %d iterations in %.2f s, RMSE %.5f, %.2fx less time than random\n",
+                AbstractSampler::GetName(type), equalTimeIterations, randomTime, equalTimeError,
+                equalTimeError > 0 ? Sqr(randomError / equalTimeError) : 0.f);
+        }
+
+        delete sampler;
+    }
+
+    aConfig.mMaxTime     = -1.f;
+    aConfig.mSampler     = configSampler;
+    aConfig.mFramebuffer = configFramebuffer;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Path guiding benchmark
+
+// Renders aConfig.mIterations iterations of path tracing with and without
+// path guiding and compares them to a reference with 16x the iterations.
+// The time to reach the same error scales with the render time times the
+// squared error, its ratio is the speedup given by guiding.
+void RunGuidingBenchmark(Config &aConfig)
+{
+    const int iterations = std::max(1, aConfig.mIterations);
+    Framebuffer *configFramebuffer = aConfig.mFramebuffer;
+
+    aConfig.mAlgorithm = Config::kPathTracing;
+    aConfig.mMaxTime   = -1.f;
+
+    Framebuffer reference;
+    SDTree guiding;
+    aConfig.mFramebuffer = &reference;
+    aConfig.mGuiding     = NULL;
+    aConfig.mIterations  = 16 * iterations;
+
+    printf("Reference: %d iterations without path guiding\n", aConfig.mIterations);
+    float time = render(aConfig);
+    printf(" done in %.2f s\n", time);
+
+    aConfig.mIterations = iterations;
+    float plainError = 0, plainTime = 0;
+
+    for (int guided = 0; guided < 2; guided++)
+    {
+        Framebuffer image;
+        aConfig.mFramebuffer = &image;
+        aConfig.mGuiding     = guided ? &guiding : NULL;
+
+        time = render(aConfig);
+        const float error = RootMeanSquareError(image, reference);
+
+        if (!guided)
+        {
+            plainError = error;
+            plainTime  = time;
+            printf("\rGuiding:   off, %d iterations, RMSE %.5f, %.2f s\n", iterations, error, time);
+        }
+        else
+        {
+            printf("\rGuiding:   on,  %d iterations, RMSE %.5f, %.2f s, %d passes, %d leaves\n",
+                iterations, error, time, guiding.GetPassCount(), guiding.GetLeafCount());
+            printf("Speedup:   %.2fx less time to the same error with guiding\n",
+                error > 0 && time > 0 ? (Sqr(plainError) * plainTime) / (Sqr(error) * time) : 0.f);
+        }
+    }
+
+    aConfig.mFramebuffer = configFramebuffer;
+    aConfig.mGuiding     = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Compressed mesh benchmark
+
+// Closest hits of aRays against aGeometry, returns the rays traced per
+// second over aPasses passes and the traversal steps per ray
+double TraceRays(
+    const AbstractGeometry   &aGeometry,
+    const std::vector<Ray>   &aRays,
+    int                      aPasses,
+    int                      aNumThreads,
+    std::vector<Isect>       &oHits,
+    double                   &oStepsPerRay)
+{
+    const int count = (int)aRays.size();
+    oHits.resize(count);
+
+    unsigned long long steps = 0;
+    const double start = omp_get_wtime();
+
+    for (int pass = 0; pass < aPasses; pass++)
+    {
+        #pragma omp parallel num_threads(aNumThreads) reduction(+:steps)
+        {
+            g_TraversalSteps = 0;
+
+            #pragma omp for schedule(dynamic, 1024)
+            for (int i = 0; i < count; i++)
+            {
+                oHits[i] = Isect(1e36f);
+                if (!aGeometry.Intersect(aRays[i], oHits[i]))
+                    oHits[i].dist = -1.f;
+            }
+
+            steps += g_TraversalSteps;
+        }
+    }
+
+    const double time = omp_get_wtime() - start;
+    oStepsPerRay = double(steps) / (double(aPasses) * std::max(count, 1));
+    return double(aPasses) * count / std::max(time, 1e-6);
+}
+
+// Traces the same rays against the mesh of the --input scene and its
+// CompressedMesh, a camera ray through each pixel and a cosine distributed
+// bounce off each hit of the full mesh. Prints the memory and speed of
+// both, the rays that hit only one of them or another material, and the
+// error of the other hit distances relative to those of the full mesh.
+void RunMeshBenchmark(Config &aConfig)
+{
+    const Scene &scene = *aConfig.mScene;
+    if (!scene.mMesh)
+    {
+        printf("Only scenes of one .obj or .ply mesh can be benchmarked\n");
+        return;
+    }
+
+    if (!scene.CanCompress(*scene.mMesh))
+    {
+        printf("Textured meshes cannot be compressed\n");
+        return;
+    }
+
+    const TriangleMesh &mesh = *scene.mMesh;
+
+    double time = omp_get_wtime();
+    const CompressedMesh compressed(mesh);
+    time = omp_get_wtime() - time;
+
+    // camera rays, then the bounces off their hits
+    const Camera &camera = scene.mCamera;
+    const int resX = int(camera.mResolution.x), resY = int(camera.mResolution.y);
+
+    std::vector<Ray> rays;
+    for (int y = 0; y < resY; y++)
+        for (int x = 0; x < resX; x++)
+            rays.push_back(camera.GenerateRay(Vec2f(x + 0.5f, y + 0.5f)));
+
+    std::vector<Isect> hits, compressedHits;
+    double steps, compressedSteps;
+    TraceRays(mesh, rays, 1, aConfig.mNumThreads, hits, steps);
+
+    Rng rng(aConfig.mBaseSeed);
+    const int cameraRays = (int)rays.size();
+    for (int i = 0; i < cameraRays; i++)
+    {
+        if (hits[i].dist < 0.f)
+            continue;
+
+        Frame frame;
+        frame.SetFromZ(Dot(hits[i].normal, rays[i].dir) < 0.f ? hits[i].normal : -hits[i].normal);
+
+        const Vec3f hitPoint = rays[i].org + rays[i].dir * hits[i].dist;
+        rays.push_back(Ray(hitPoint, frame.ToWorld(SampleCosHemisphereW(rng.GetVec2f(), NULL)), EPS_RAY));
+    }
+
+    const int passes = 4;
+    const double rate = TraceRays(mesh, rays, passes, aConfig.mNumThreads, hits, steps);
+    const double compressedRate = TraceRays(compressed, rays, passes, aConfig.mNumThreads,
+        compressedHits, compressedSteps);
+
+    int mismatches = 0, compared = 0;
+    double errorSum = 0, errorMax = 0;
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        const Isect &hit = hits[i], &compressedHit = compressedHits[i];
+        if ((hit.dist < 0.f) != (compressedHit.dist < 0.f) ||
+            (hit.dist >= 0.f && hit.matID != compressedHit.matID))
+        {
+            mismatches++;
+        }
+        else if (hit.dist > 0.f)
+        {
+            const double error = std::abs(compressedHit.dist - hit.dist) / hit.dist;
+            errorSum += error;
+            errorMax  = std::max(errorMax, error);
+            compared++;
+        }
+    }
+
+    const float fullMB = mesh.GetMemorySize() / (1024.f * 1024.f);
+    const float compressedMB = compressed.GetMemorySize() / (1024.f * 1024.f);
+    printf("Rays:      %d camera and %d bounce rays, %d passes\n",
+        cameraRays, (int)rays.size() - cameraRays, passes);
+    printf("Full:      %.1f MB, %.2f Mrays/s, %.2f steps/ray\n", fullMB, rate * 1e-6, steps);
+    printf("Compress:  %.1f MB (%.1f%%), %.2f Mrays/s (%.1f%%), %.2f steps/ray,\n"
+           "           %d clusters built in %.2f s\n",
+        compressedMB, 100.f * compressedMB / fullMB, compressedRate * 1e-6,
+        100.0 * compressedRate / rate, compressedSteps, compressed.GetClusterCount(), time);
+    printf("Error:     %d rays (%.3f%%) hit differently, hit distances off by %.2e mean,\n"
+           "           %.2e max relative to the full mesh\n",
+        mismatches, 100.0 * mismatches / rays.size(), errorSum / std::max(compared, 1), errorMax);
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Main
 
@@ -164,17 +543,179 @@ int main(int argc, const char *argv[])
 
     // Prints what we are doing
     printf("Scene:     %s\n", config.mScene->mSceneName.c_str());
+
+    if (!config.mBakeFile.empty())
+    {
+        printf("Baking:    %s\n", config.mBakeFile.c_str());
+
+        const bool baked = config.mScene->SaveCache(config.mBakeFile.c_str());
+        if (!baked)
+            printf("Could not bake the scene to %s\n", config.mBakeFile.c_str());
+
+        config.mScene->CleanUpScene();
+        delete config.mScene;
+        delete config.mSampler;
+        return baked ? 0 : 1;
+    }
+
+    if (config.mSamplerBenchmark)
+    {
+        printf("Benchmark: %s, samplers\n", config.GetName(config.mAlgorithm));
+        RunSamplerBenchmark(config);
+
+        config.mScene->CleanUpScene();
+        delete config.mScene;
+        delete config.mSampler;
+        return 0;
+    }
+
+    if (config.mGuidingBenchmark)
+    {
+        printf("Benchmark: %s, path guiding\n", config.GetName(Config::kPathTracing));
+        RunGuidingBenchmark(config);
+
+        config.mScene->CleanUpScene();
+        delete config.mScene;
+        delete config.mSampler;
+        return 0;
+    }
+
+    if (config.mMeshBenchmark)
+    {
+        printf("Benchmark: compressed mesh\n");
+        RunMeshBenchmark(config);
+
+        config.mScene->CleanUpScene();
+        delete config.mScene;
+        delete config.mSampler;
+        return 0;
+    }
+
     if (config.mMaxTime > 0)
         printf("Target:    %g seconds render time\n", config.mMaxTime);
     else
         printf("Target:    %d iteration(s)\n", config.mIterations);
+    printf("Sampler:   %s\n", AbstractSampler::GetName(config.mSamplerType));
+    if (config.mPartMedType != Config::kPartMedMax)
+        printf("Medium:    %s\n", Config::GetName(config.mPartMedType));
+
+    // Layers filled while rendering, the denoiser is guided by some of them
+    AovBuffer aovs;
+    const uint aovMask = config.mAovMask | (config.mDenoise ? Denoiser::kRequiredAovs : 0u);
+    if (aovMask)
+    {
+        aovs.Setup(config.mScene->mCamera.mResolution);
+        aovs.Enable(aovMask);
+        config.mAovs = &aovs;
+    }
+
+    // Learned by the path tracer while rendering
+    SDTree guiding;
+    if (config.mPathGuiding && config.mAlgorithm == Config::kPathTracing)
+        config.mGuiding = &guiding;
 
     // Renders the image
     printf("Running:   %s%s", config.GetName(config.mAlgorithm), (config.mMaxTime > 0) ? "..." : "\n");
     fflush(stdout);
-    float time = render(config);
+    RenderStats stats;
+    float time = render(config, NULL, &stats);
     printf(" done in %.2f s\n", time);
 
+    if (stats.mRayCount > 0)
+    {
+        printf("Traversal: %.2f steps/ray over %llu rays, %.2f Mrays/s (ray reordering %s)\n",
+            double(stats.mTraversalSteps) / stats.mRayCount, stats.mRayCount,
+            stats.mRayCount / (1e6 * std::max(time, 1e-3f)),
+            config.mRayReordering ? "on" : "off");
+
+        // only the binned ray batches are timed
+        if (stats.mTraversalTime > 0)
+            printf("           %.0f ns/ray tracing the binned batches\n",
+                1e9 * stats.mTraversalTime / stats.mRayCount);
+    }
+
+    const TextureCache &textures = config.mScene->mTextures;
+    if (textures.GetTextureCount() > 0)
+    {
+        unsigned long long requests, loads, evictions;
+        textures.GetTileCounts(requests, loads, evictions);
+
+        printf("Textures:  %d textures, %.1f MB tiled, %llu tile lookups, %.2f%% read from disk,\n"
+               "           %llu evicted, %.1f MB peak of %.1f MB cache\n",
+            textures.GetTextureCount(), textures.GetFileSize() / (1024.f * 1024.f), requests,
+            100.0 * loads / std::max(requests, 1ULL), evictions,
+            textures.GetPeakMemory() / (1024.f * 1024.f), textures.GetMemoryLimit() / (1024.f * 1024.f));
+    }
+
+    const StreamedMesh *geometry = config.mScene->mStreamedMesh;
+    if (geometry && geometry->GetMemoryLimit() > 0)
+    {
+        unsigned long long pageIns, evictions, deferred, skipped;
+        geometry->GetClusterCounts(pageIns, evictions, deferred, skipped);
+
+        printf("Geometry:  %llu clusters paged in, %.1f MB read, %llu evicted, %.1f MB peak of %.1f MB,\n"
+               "           %llu deferred by rays, %.2f%% of them skipped, %.2f s stalled\n",
+            pageIns, geometry->GetPageInBytes() / (1024.f * 1024.f), evictions,
+            geometry->GetPeakMemory() / (1024.f * 1024.f), geometry->GetMemoryLimit() / (1024.f * 1024.f),
+            deferred, 100.0 * skipped / std::max(deferred, 1ULL), geometry->GetStallTime());
+    }
+
+    // Objects of the scene by pool, used and allocated in blocks
+    const SceneArena &arena = config.mScene->mArena;
+    size_t arenaBlocks = 0;
+    printf("Arena:     ");
+    for (int i = 0; i < SceneArena::kPoolCount; i++)
+    {
+        const SceneArena::Pool pool = SceneArena::Pool(i);
+        printf("%s%d %s in %.1f KB", i > 0 ? ", " : "", arena.GetObjectCount(pool),
+            SceneArena::GetPoolName(pool), arena.GetUsedBytes(pool) / 1024.f);
+        arenaBlocks += arena.GetReservedBytes(pool);
+    }
+    printf(", %.1f KB of blocks\n", arenaBlocks / 1024.f);
+
+    if (config.mGuiding)
+    {
+        printf("Guiding:   %d training passes, %d spatial leaves, %d directional nodes\n",
+            guiding.GetPassCount(), guiding.GetLeafCount(), guiding.GetDirectionalNodeCount());
+    }
+
+    // Share of the image contributed by each technique
+    double techniqueSum = 0;
+    for (int t=0; t<AbstractRenderer::kTechniqueCount; t++)
+        techniqueSum += stats.mTechniqueContrib[t];
+
+    if (techniqueSum > 0)
+    {
+        printf("Techniques:");
+        for (int t=0; t<AbstractRenderer::kTechniqueCount; t++)
+        {
+            printf(" %s %.1f%%%s", AbstractRenderer::GetTechniqueName(AbstractRenderer::Technique(t)),
+                100.0 * stats.mTechniqueContrib[t] / techniqueSum,
+                t + 1 < AbstractRenderer::kTechniqueCount ? "," : "\n");
+        }
+    }
+
+    // Saves the layers with the unfiltered radiance
+    if (config.mAovMask)
+    {
+        const std::string aovName =
+            config.mOutputName.substr(0, config.mOutputName.length() - 4) + ".exr";
+
+        printf("Saving to: %s ... ", aovName.c_str());
+        printf(aovs.SaveEXR(aovName.c_str(), fbuffer) ? "done\n" : "failed\n");
+    }
+
+    // Filters the noise of the image
+    if (config.mDenoise)
+    {
+        printf("Denoising: ...");
+        fflush(stdout);
+
+        const clock_t denoiseStart = clock();
+        Denoiser().Apply(aovs, fbuffer);
+        printf(" done in %.2f s\n", float(clock() - denoiseStart) / CLOCKS_PER_SEC);
+    }
+
     // Saves the image
     printf("Saving to: %s ... ", config.mOutputName.c_str());
     std::string extension = config.mOutputName.substr(config.mOutputName.length() - 3, 3);
@@ -194,6 +735,7 @@ int main(int argc, const char *argv[])
     // Scene cleanup
     config.mScene->CleanUpScene();
     delete config.mScene;
+    delete config.mSampler;
 
     // debug
     getchar(); // Wait for pressing the enter key on the command line
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "renderer.hxx"
+#include "lightsampler.hxx"
+#include "hashgrid.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Progressive photon mapping
+//
+// Each iteration traces one photon path per pixel from the scene lights,
+// stores a photon at every surface hit and builds a hashed grid over them.
+// The camera rays then estimate the reflected radiance at their first hit
+// from the photons within the gather radius. The radius shrinks with the
+// iteration index, so the average of all iterations converges to the
+// correct image (probabilistic formulation of Knaus and Zwicker 2011).
+// The iterations keep no per-pixel statistics, so the per-thread renderers
+// can run them in any order.
+
+class ProgressivePhotonMapping : public AbstractRenderer
+{
+public:
+
+    // Photon paths draw their sample dimensions from here on,
+    // far beyond the dimensions used by the camera ray of the pixel
+    static const uint kPhotonPathDimension = 1 << 10;
+
+    // Photon stored at a surface hit
+    struct Photon
+    {
+        Vec3f mPosition;
+        Vec3f mThroughput; // flux carried by the photon
+        Vec3f mWig;        // direction towards the previous vertex
+        uint  mPathLength; // segments from the light to the photon
+
+        const Vec3f& GetPosition() const { return mPosition; }
+    };
+
+    ProgressivePhotonMapping(
+        const Scene           &aScene,
+        const AbstractSampler &aSampler,
+        float                 aRadiusFactor = 0.003f,
+        float                 aRadiusAlpha = 0.75f) :
+        AbstractRenderer(aScene, aSampler),
+        mLightPicker(aScene.mLights, aScene.mSceneSphere)
+    {
+        mBaseRadius  = aRadiusFactor * aScene.mSceneSphere.mSceneRadius;
+        mRadiusAlpha = aRadiusAlpha;
+    }
+
+    virtual void RunIteration(int aIteration)
+    {
+        const int resX = int(mScene.mCamera.mResolution.x);
+        const int resY = int(mScene.mCamera.mResolution.y);
+        const int pathCount = resX * resY;
+
+        // gather radius of this iteration, r_i = r_0 / i^((1 - alpha) / 2)
+        const float radius = std::max(1e-7f,
+            mBaseRadius / std::pow(float(aIteration + 1), 0.5f * (1.f - mRadiusAlpha)));
+
+        // density estimation kernel, one photon path is traced per pixel
+        mNormalization = 1.f / (PI_F * Sqr(radius) * pathCount);
+
+        //////////////////////////////////////////////////////////////////////////
+        // Trace the photon paths
+        mPhotons.clear();
+
+        for(int pathIdx = 0; pathIdx < pathCount; pathIdx++)
+        {
+            SamplerState sampler;
+            mSampler.StartPixelSample(pathIdx % resX, pathIdx / resX, uint(aIteration), sampler);
+            sampler.mDimension = kPhotonPathDimension;
+
+            TracePhotonPath(sampler);
+        }
+
+        mGrid.Reserve(pathCount);
+        mGrid.Build(mPhotons, radius);
+
+        //////////////////////////////////////////////////////////////////////////
+        // Gather at the camera ray hits
+        for(int pathIdx = 0; pathIdx < pathCount; pathIdx++)
+        {
+            const int x = pathIdx % resX;
+            const int y = pathIdx / resX;
+
+            SamplerState sampler;
+            mSampler.StartPixelSample(x, y, uint(aIteration), sampler);
+
+            const Vec2f sample = Vec2f(float(x), float(y)) + mSampler.Get2D(sampler);
+            Vec3f direct;
+            const Vec3f color = Gather(sample, mScene.mCamera.GenerateRay(sample), direct);
+            AddSample(sample, color, direct);
+        }
+
+        mIterations++;
+    }
+
+private:
+
+    // Sums up the photons around a camera ray hit
+    struct RangeQuery
+    {
+        RangeQuery(
+            const Material &aMat,
+            const Frame    &aFrame,
+            const Vec3f    &aWol) :
+            mMat(aMat), mFrame(aFrame), mWol(aWol), mContrib(0), mDirectContrib(0)
+        {}
+
+        void Process(const Photon &aPhoton)
+        {
+            // photons arriving at the back side
+            const Vec3f wil = mFrame.ToLocal(aPhoton.mWig);
+            if(wil.z <= 0)
+                return;
+
+            const Vec3f contrib = mMat.evalBrdf(wil, mWol) * aPhoton.mThroughput;
+
+            mContrib += contrib;
+            if(aPhoton.mPathLength == 1)
+                mDirectContrib += contrib;
+        }
+
+        const Material &mMat;
+        const Frame    &mFrame;
+        Vec3f          mWol;
+        Vec3f          mContrib;
+        Vec3f          mDirectContrib; // part of mContrib of the photons lit directly
+    };
+
+    // Radiance along the camera ray through aSample, oDirect is the part
+    // of it that reached the camera after at most one bounce
+    Vec3f Gather(
+        const Vec2f &aSample,
+        const Ray   &aRay,
+        Vec3f       &oDirect)
+    {
+        oDirect = Vec3f(0);
+
+        Isect isect;
+        Vec3f hitPoint;
+        const bool hit = IntersectNext(aRay, isect, hitPoint);
+        AddFirstHit(aSample, aRay, isect, hit);
+
+        if(!hit)
+        {
+            if(mScene.GetBackground() && mMinPathLength <= 1)
+                oDirect = mScene.GetBackground()->GetRadiance(aRay.dir);
+            return oDirect;
+        }
+
+        // emitters are only seen directly, their light
+        // reaches the other surfaces through the photons
+        if(isect.lightID >= 0)
+        {
+            if(mMinPathLength > 1)
+                return Vec3f(0);
+
+            float directPdfA, emissionPdfW;
+            oDirect = mScene.GetLightPtr(isect.lightID)->getEmittedRadiance(mScene.mSceneSphere,
+                aRay.dir, hitPoint, isect.primID, directPdfA, emissionPdfW);
+            return oDirect;
+        }
+
+        Frame frame;
+        frame.SetFromZ(isect.normal);
+        const Vec3f wol = frame.ToLocal(-aRay.dir);
+
+        if(wol.z <= 0)
+            return Vec3f(0);
+
+        const Material mat = mScene.GetMaterial(isect.matID, isect.uv);
+        RangeQuery query(mat, frame, wol);
+        mGrid.Process(mPhotons, hitPoint, query);
+
+        oDirect = query.mDirectContrib * mNormalization;
+        return query.mContrib * mNormalization;
+    }
+
+    // Emits a photon from a light picked by its power and stores it
+    // at every surface it hits until russian roulette ends the path
+    void TracePhotonPath(SamplerState &aoSampler)
+    {
+        float lightPickProb;
+        const int lightID = mLightPicker.SampleLight(mSampler.Get1D(aoSampler), lightPickProb);
+        const Vec2f rndDir = mSampler.Get2D(aoSampler);
+        const Vec3f rndPos = mSampler.Get3D(aoSampler);
+
+        if(lightID < 0 || lightPickProb == 0)
+            return;
+
+        Ray ray;
+        float emissionPdfW, directPdfA, cosLight;
+        const Vec3f energy = mScene.GetLightPtr(lightID)->emit(mScene.mSceneSphere,
+            rndDir, rndPos, ray.org, ray.dir, emissionPdfW, directPdfA, cosLight);
+
+        if(energy.Max() <= 0 || emissionPdfW <= 0)
+            return;
+
+        Vec3f throughput = energy / (emissionPdfW * lightPickProb);
+
+        // number of segments from the light, the camera adds one more
+        for(uint pathLength = 1; pathLength + 1 <= mMaxPathLength; pathLength++)
+        {
+            Isect isect;
+            Vec3f hitPoint;
+            if(!IntersectNext(ray, isect, hitPoint))
+                break;
+
+            Frame frame;
+            frame.SetFromZ(isect.normal);
+            const Vec3f wol = frame.ToLocal(-ray.dir);
+            const Material mat = mScene.GetMaterial(isect.matID, isect.uv);
+
+            // emitters do not reflect, surfaces are lit from the front only
+            if(isect.lightID >= 0 || wol.z <= 0)
+                break;
+
+            float pd = mat.getMaxElementInVector(mat.mDiffuseReflectance);
+            float ps = mat.getMaxElementInVector(mat.mPhongReflectance);
+            if(pd + ps <= 0)
+                break;
+
+            if(pathLength + 1 >= mMinPathLength)
+            {
+                Photon photon;
+                photon.mPosition   = hitPoint;
+                photon.mThroughput = throughput;
+                photon.mWig        = -ray.dir;
+                photon.mPathLength = pathLength;
+                mPhotons.push_back(photon);
+            }
+
+            // pick a BRDF component by its reflectance, like the path tracer
+            const float contProb = std::min(1.f, std::max(pd, ps));
+            pd /= (pd + ps);
+
+            Vec2f rnd = mSampler.Get2D(aoSampler);
+            const float rndComponent = mSampler.Get1D(aoSampler);
+            const float rndRoulette  = mSampler.Get1D(aoSampler);
+
+            const Vec3f wog = -ray.dir;
+            Vec3f wig;
+            if(rndComponent <= pd)
+                wig = frame.ToWorld(mat.sampleDiffuse(rnd.x, rnd.y));
+            else
+                wig = mat.sampleGlossy(wog, frame.Normal(), rnd.x, rnd.y);
+
+            const float cosThetaOut = Dot(frame.Normal(), wig);
+            const float pdf = mat.evalBrdfPdf(wog, wig, frame.Normal()) * contProb;
+
+            if(cosThetaOut <= EPS_COSINE || pdf <= 0 || rndRoulette > contProb)
+                break;
+
+            throughput *= mat.evalBrdf(frame.ToLocal(wig), wol) * (cosThetaOut / pdf);
+
+            ray.org = hitPoint;
+            ray.dir = wig;
+        }
+    }
+
+    // Traces the ray from slightly off its origin
+    bool IntersectNext(
+        const Ray &aRay,
+        Isect     &oIsect,
+        Vec3f     &oHitPoint)
+    {
+        Ray ray;
+        ray.org  = aRay.org + aRay.dir * EPS_RAY;
+        ray.dir  = aRay.dir;
+        ray.tmin = 0;
+
+        oIsect.dist = 1e36f;
+
+        const unsigned long long stepsBefore = g_TraversalSteps;
+        const bool hit = mScene.Intersect(ray, oIsect);
+        mTraversalSteps += g_TraversalSteps - stepsBefore;
+        mRayCount++;
+
+        if(hit)
+            oHitPoint = ray.org + ray.dir * oIsect.dist;
+
+        return hit;
+    }
+
+private:
+
+    PowerLightSampler   mLightPicker;   //!< Picks the lights emitting the photons
+    float               mBaseRadius;    //!< Gather radius of the first iteration
+    float               mRadiusAlpha;   //!< Rate of the radius reduction
+    float               mNormalization; //!< Density estimation kernel of the current iteration
+    std::vector<Photon> mPhotons;
+    HashGrid            mGrid;
+};
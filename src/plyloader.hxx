@@ -0,0 +1,615 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
+#include "math.hxx"
+#include "mappedfile.hxx"
+#include "objloader.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Binary little-endian PLY loader
+//
+// The file is memory mapped and decoded in place. The vertex element has
+// a fixed size, so its x, y and z columns are decoded in parallel blocks,
+// each by a loop specialized for the property type. The faces have
+// variable length index lists, so one sequential pass reads only the list
+// counts and notes where every block of kFacesPerBlock faces starts and
+// which triangle it writes first. The blocks are then decoded in parallel
+// by a loop specialized for the count and index types. Polygons are split
+// into triangle fans.
+//
+// Gives the same output as ObjLoader, the PLY file has no materials. The
+// texture coordinates are read from the u and v properties of the vertices
+// (or s and t, texture_u and texture_v), each triangle uses those of its
+// vertices.
+
+class PlyLoader
+{
+public:
+
+    static const size_t kFacesPerBlock    = 1 << 16;
+    static const size_t kVerticesPerBlock = 1 << 16;
+
+    bool Load(const char *aFilename)
+    {
+        mVertices.clear();
+        mTriangles.clear();
+        mTriangleMaterials.clear();
+        mTexCoords.clear();
+        mTriangleTexCoords.clear();
+        mMaterials.clear();
+
+        MappedFile file;
+        if(!file.Open(aFilename))
+            return false;
+
+        const char *data = file.GetData();
+        const char *end  = data + file.GetSize();
+
+        std::vector<Element> elements;
+        const char *body = ParseHeader(data, end, elements);
+        if(!body)
+            return false;
+
+        // finds the vertex and face elements, skipping the others
+        const Element *vertices = NULL, *faces = NULL;
+        const char *vertexData = NULL, *faceData = NULL;
+
+        const char *ptr = body;
+        for(size_t i=0; i<elements.size() && ptr; i++)
+        {
+            if(elements[i].mName == "vertex")
+            {
+                vertices   = &elements[i];
+                vertexData = ptr;
+            }
+            else if(elements[i].mName == "face")
+            {
+                faces    = &elements[i];
+                faceData = ptr;
+            }
+
+            // the data after the faces are not needed
+            if(vertices && faces)
+                break;
+
+            ptr = SkipElement(elements[i], ptr, end);
+        }
+
+        if(!ptr || !vertices || !faces)
+        {
+            printf("The PLY file has no vertex and face elements\n");
+            return false;
+        }
+
+        if(!DecodeVertices(*vertices, vertexData, end) || !DecodeFaces(*faces, faceData, end))
+            return false;
+
+        if(!mTexCoords.empty())
+            mTriangleTexCoords = mTriangles;
+        return true;
+    }
+
+public:
+
+    std::vector<Vec3f>       mVertices;
+    std::vector<Vec3i>       mTriangles;         //!< Indices into mVertices
+    std::vector<int>         mTriangleMaterials; //!< -1, the file has no materials
+    std::vector<Vec2f>       mTexCoords;         //!< One per vertex, empty when the file has none
+    std::vector<Vec3i>       mTriangleTexCoords; //!< Indices into mTexCoords, the same as mTriangles
+    std::vector<ObjMaterial> mMaterials;         //!< Empty
+
+private:
+
+    enum Type
+    {
+        kInt8, kUInt8, kInt16, kUInt16, kInt32, kUInt32, kFloat32, kFloat64, kTypeCount
+    };
+
+    struct Property
+    {
+        std::string mName;
+        Type        mType;
+        Type        mCountType; //!< Of the list length
+        bool        mIsList;
+    };
+
+    struct Element
+    {
+        std::string           mName;
+        size_t                mCount;
+        std::vector<Property> mProperties;
+    };
+
+    // Where a block of faces starts and which triangle it writes first
+    struct FaceBlock
+    {
+        const char *mData;
+        size_t     mTriangle;
+    };
+
+    static int GetSize(Type aType)
+    {
+        static const int sizes[kTypeCount] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+        return sizes[aType];
+    }
+
+    static bool ParseType(const std::string &aName, Type &oType)
+    {
+        static const char *names[kTypeCount][2] =
+        {
+            { "char",  "int8"   }, { "uchar",  "uint8"  },
+            { "short", "int16"  }, { "ushort", "uint16" },
+            { "int",   "int32"  }, { "uint",   "uint32" },
+            { "float", "float32"}, { "double", "float64"}
+        };
+
+        for(int i=0; i<kTypeCount; i++)
+        {
+            if(aName == names[i][0] || aName == names[i][1])
+            {
+                oType = Type(i);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    template<typename T>
+    static T Read(const char *aPtr)
+    {
+        T value;
+        memcpy(&value, aPtr, sizeof(T));
+        return value;
+    }
+
+    // List lengths and other cold reads of a type known only at run time
+    static size_t ReadCount(Type aType, const char *aPtr)
+    {
+        switch(aType)
+        {
+        case kInt8:   case kUInt8:  return Read<unsigned char>(aPtr);
+        case kInt16:  case kUInt16: return Read<unsigned short>(aPtr);
+        case kInt32:  case kUInt32: return Read<unsigned int>(aPtr);
+        default:                    return 0;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Header
+
+    // Returns the start of the data, NULL when the header is not supported
+    static const char* ParseHeader(
+        const char           *aData,
+        const char           *aEnd,
+        std::vector<Element> &oElements)
+    {
+        const char *ptr = aData;
+        bool first = true, binary = false;
+
+        while(ptr < aEnd)
+        {
+            const char *lineEnd = (const char*)memchr(ptr, '\n', aEnd - ptr);
+            if(!lineEnd)
+                return NULL;
+
+            std::istringstream line(std::string(ptr, lineEnd));
+            ptr = lineEnd + 1;
+
+            std::string keyword;
+            line >> keyword;
+
+            if(first)
+            {
+                if(keyword != "ply")
+                    return NULL;
+                first = false;
+            }
+            else if(keyword == "format")
+            {
+                std::string format;
+                line >> format;
+                binary = format == "binary_little_endian";
+            }
+            else if(keyword == "element")
+            {
+                Element element;
+                line >> element.mName >> element.mCount;
+                oElements.push_back(element);
+            }
+            else if(keyword == "property")
+            {
+                if(oElements.empty())
+                    return NULL;
+
+                Property property;
+                std::string type;
+                line >> type;
+
+                property.mIsList = type == "list";
+                if(property.mIsList)
+                {
+                    std::string countType;
+                    line >> countType >> type;
+                    if(!ParseType(countType, property.mCountType) || GetSize(property.mCountType) > 4 ||
+                        property.mCountType == kFloat32)
+                        return NULL;
+                }
+
+                if(!ParseType(type, property.mType))
+                    return NULL;
+
+                line >> property.mName;
+                oElements.back().mProperties.push_back(property);
+            }
+            else if(keyword == "end_header")
+            {
+                if(!binary)
+                {
+                    printf("Only binary little-endian PLY files are supported\n");
+                    return NULL;
+                }
+                return ptr;
+            }
+        }
+
+        return NULL;
+    }
+
+    // Bytes of an element without lists, 0 when it has some
+    static size_t GetFixedSize(const Element &aElement)
+    {
+        size_t size = 0;
+        for(size_t i=0; i<aElement.mProperties.size(); i++)
+        {
+            if(aElement.mProperties[i].mIsList)
+                return 0;
+            size += GetSize(aElement.mProperties[i].mType);
+        }
+        return size;
+    }
+
+    // End of the element data, NULL when the file is shorter
+    static const char* SkipElement(
+        const Element &aElement,
+        const char    *aPtr,
+        const char    *aEnd)
+    {
+        const size_t fixedSize = GetFixedSize(aElement);
+        if(fixedSize > 0)
+            return size_t(aEnd - aPtr) / fixedSize >= aElement.mCount ? aPtr + fixedSize * aElement.mCount : NULL;
+
+        for(size_t i=0; i<aElement.mCount; i++)
+        {
+            for(size_t j=0; j<aElement.mProperties.size(); j++)
+            {
+                const Property &property = aElement.mProperties[j];
+                size_t size = GetSize(property.mType);
+
+                if(property.mIsList)
+                {
+                    if(aEnd - aPtr < GetSize(property.mCountType))
+                        return NULL;
+                    size = size * ReadCount(property.mCountType, aPtr) + GetSize(property.mCountType);
+                }
+
+                if(size_t(aEnd - aPtr) < size)
+                    return NULL;
+                aPtr += size;
+            }
+        }
+
+        return aPtr;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Vertices
+
+    // Converts a property of all vertices to the floats at aoValues,
+    // every aValueStride-th one
+    template<typename T>
+    static void DecodeColumn(
+        const char *aData,
+        size_t     aStride,
+        long long  aCount,
+        float      *aoValues,
+        int        aValueStride)
+    {
+        const long long blocks = (aCount + kVerticesPerBlock - 1) / kVerticesPerBlock;
+
+#pragma omp parallel for
+        for(long long block=0; block<blocks; block++)
+        {
+            const long long last = std::min(aCount, (block + 1) * (long long)kVerticesPerBlock);
+            for(long long i=block * kVerticesPerBlock; i<last; i++)
+                aoValues[i * aValueStride] = float(Read<T>(aData + i * aStride));
+        }
+    }
+
+    // Decodes the named property, returns false when the vertices have none
+    static bool DecodeColumn(
+        const Element &aElement,
+        const char    *aData,
+        const char    *aName,
+        float         *aoValues,
+        int           aValueStride)
+    {
+        const size_t stride = GetFixedSize(aElement);
+        const long long count = (long long)aElement.mCount;
+
+        size_t offset = 0;
+        for(size_t i=0; i<aElement.mProperties.size(); i++)
+        {
+            const Property &property = aElement.mProperties[i];
+            if(property.mName != aName)
+            {
+                offset += GetSize(property.mType);
+                continue;
+            }
+
+            const char *column = aData + offset;
+            switch(property.mType)
+            {
+            case kInt8:    DecodeColumn<signed char>(column, stride, count, aoValues, aValueStride);    break;
+            case kUInt8:   DecodeColumn<unsigned char>(column, stride, count, aoValues, aValueStride);  break;
+            case kInt16:   DecodeColumn<short>(column, stride, count, aoValues, aValueStride);          break;
+            case kUInt16:  DecodeColumn<unsigned short>(column, stride, count, aoValues, aValueStride); break;
+            case kInt32:   DecodeColumn<int>(column, stride, count, aoValues, aValueStride);            break;
+            case kUInt32:  DecodeColumn<unsigned int>(column, stride, count, aoValues, aValueStride);   break;
+            case kFloat32: DecodeColumn<float>(column, stride, count, aoValues, aValueStride);          break;
+            case kFloat64: DecodeColumn<double>(column, stride, count, aoValues, aValueStride);         break;
+            default: break;
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    static bool HasProperty(
+        const Element &aElement,
+        const char    *aName)
+    {
+        for(size_t i=0; i<aElement.mProperties.size(); i++)
+        {
+            if(aElement.mProperties[i].mName == aName)
+                return true;
+        }
+        return false;
+    }
+
+    bool DecodeVertices(
+        const Element &aElement,
+        const char    *aData,
+        const char    *aEnd)
+    {
+        const size_t stride = GetFixedSize(aElement);
+        if(stride == 0 || SkipElement(aElement, aData, aEnd) == NULL)
+        {
+            printf("The PLY vertices have list properties or are cut off\n");
+            return false;
+        }
+
+        mVertices.assign(aElement.mCount, Vec3f(0.f));
+
+        static const char *names[3] = { "x", "y", "z" };
+        for(int c=0; c<3; c++)
+        {
+            if(!mVertices.empty())
+                DecodeColumn(aElement, aData, names[c], &mVertices[0].x + c, 3);
+        }
+
+        // the first pair of texture coordinate names the vertices have
+        static const char *uvNames[4][2] =
+        {
+            { "u", "v" }, { "s", "t" }, { "texture_u", "texture_v" }, { "texture_s", "texture_t" }
+        };
+
+        for(int n=0; n<4 && !mVertices.empty(); n++)
+        {
+            if(!HasProperty(aElement, uvNames[n][0]) || !HasProperty(aElement, uvNames[n][1]))
+                continue;
+
+            mTexCoords.assign(aElement.mCount, Vec2f(0.f));
+            for(int c=0; c<2; c++)
+                DecodeColumn(aElement, aData, uvNames[n][c], &mTexCoords[0].x + c, 2);
+            break;
+        }
+
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Faces
+
+    // Reads the list lengths, returns the end of the faces or NULL when
+    // the file is shorter
+    template<typename tCount>
+    const char* ScanFaces(
+        const char             *aData,
+        const char             *aEnd,
+        size_t                 aFaceCount,
+        size_t                 aPrefix,
+        size_t                 aSuffix,
+        size_t                 aIndexSize,
+        std::vector<FaceBlock> &oBlocks,
+        size_t                 &oTriangleCount) const
+    {
+        const char *ptr = aData;
+        size_t triangles = 0;
+
+        for(size_t i=0; i<aFaceCount; i++)
+        {
+            if(i % kFacesPerBlock == 0)
+            {
+                FaceBlock block = { ptr, triangles };
+                oBlocks.push_back(block);
+            }
+
+            if(size_t(aEnd - ptr) < aPrefix + sizeof(tCount))
+                return NULL;
+
+            const size_t corners = Read<tCount>(ptr + aPrefix);
+            ptr += aPrefix + sizeof(tCount) + corners * aIndexSize + aSuffix;
+            if(ptr > aEnd)
+                return NULL;
+
+            triangles += corners >= 3 ? corners - 2 : 0;
+        }
+
+        oTriangleCount = triangles;
+        return ptr;
+    }
+
+    // Decodes one block of faces, returns the number of faces with
+    // an index out of range, their triangles are marked invalid
+    template<typename tCount, typename tIndex>
+    int DecodeFaceBlock(
+        const FaceBlock &aBlock,
+        size_t          aFaceCount,
+        size_t          aPrefix,
+        size_t          aSuffix)
+    {
+        const unsigned int vertexCount = (unsigned int)mVertices.size();
+        const char *ptr = aBlock.mData;
+        size_t triangle = aBlock.mTriangle;
+        int invalid = 0;
+
+        for(size_t i=0; i<aFaceCount; i++)
+        {
+            ptr += aPrefix;
+            const size_t corners = Read<tCount>(ptr);
+            ptr += sizeof(tCount);
+
+            // negative signed indices turn into large ones
+            const unsigned int first = (unsigned int)Read<tIndex>(ptr);
+            unsigned int previous = corners > 1 ? (unsigned int)Read<tIndex>(ptr + sizeof(tIndex)) : 0;
+            bool valid = first < vertexCount && previous < vertexCount;
+
+            const size_t firstTriangle = triangle;
+            for(size_t c=2; c<corners; c++)
+            {
+                const unsigned int index = (unsigned int)Read<tIndex>(ptr + c * sizeof(tIndex));
+                valid = valid && index < vertexCount;
+
+                mTriangles[triangle++] = Vec3i(int(first), int(previous), int(index));
+                previous = index;
+            }
+
+            if(!valid && triangle > firstTriangle)
+            {
+                for(size_t t=firstTriangle; t<triangle; t++)
+                    mTriangles[t] = Vec3i(-1);
+                invalid++;
+            }
+
+            ptr += corners * sizeof(tIndex) + aSuffix;
+        }
+
+        return invalid;
+    }
+
+    template<typename tCount, typename tIndex>
+    bool DecodeFaces(
+        const Element &aElement,
+        const char    *aData,
+        const char    *aEnd,
+        size_t        aPrefix,
+        size_t        aSuffix)
+    {
+        std::vector<FaceBlock> blocks;
+        size_t triangleCount = 0;
+        if(!ScanFaces<tCount>(aData, aEnd, aElement.mCount, aPrefix, aSuffix,
+            sizeof(tIndex), blocks, triangleCount))
+        {
+            printf("The PLY faces are cut off\n");
+            return false;
+        }
+
+        mTriangles.resize(triangleCount);
+        mTriangleMaterials.assign(triangleCount, -1);
+
+        const int blockCount = (int)blocks.size();
+        int invalid = 0;
+
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:invalid)
+        for(int i=0; i<blockCount; i++)
+        {
+            const size_t faces = std::min(size_t(kFacesPerBlock), aElement.mCount - i * kFacesPerBlock);
+            invalid += DecodeFaceBlock<tCount, tIndex>(blocks[i], faces, aPrefix, aSuffix);
+        }
+
+        if(invalid > 0)
+        {
+            size_t kept = 0;
+            for(size_t i=0; i<mTriangles.size(); i++)
+            {
+                if(mTriangles[i].x >= 0)
+                    mTriangles[kept++] = mTriangles[i];
+            }
+
+            mTriangles.resize(kept);
+            mTriangleMaterials.resize(kept);
+            printf("Skipped %d faces with invalid vertex indices\n", invalid);
+        }
+
+        return true;
+    }
+
+    // Picks the decoding loop for the list types. The index list may be
+    // surrounded by other properties, which cannot be lists.
+    bool DecodeFaces(
+        const Element &aElement,
+        const char    *aData,
+        const char    *aEnd)
+    {
+        int list = -1;
+        size_t prefix = 0, suffix = 0;
+
+        for(size_t i=0; i<aElement.mProperties.size(); i++)
+        {
+            const Property &property = aElement.mProperties[i];
+
+            if(property.mIsList && list < 0 &&
+                (property.mName == "vertex_indices" || property.mName == "vertex_index"))
+                list = int(i);
+            else if(property.mIsList)
+            {
+                printf("The PLY faces have an unsupported list %s\n", property.mName.c_str());
+                return false;
+            }
+            else
+                (list < 0 ? prefix : suffix) += GetSize(property.mType);
+        }
+
+        if(list < 0 || GetSize(aElement.mProperties[list].mType) > 4 ||
+            aElement.mProperties[list].mType == kFloat32)
+        {
+            printf("The PLY faces have no integer vertex index list\n");
+            return false;
+        }
+
+        const int countSize = GetSize(aElement.mProperties[list].mCountType);
+        const int indexSize = GetSize(aElement.mProperties[list].mType);
+
+        // the signed types are read as unsigned ones of the same size
+        switch(countSize * 8 + indexSize)
+        {
+        case 1*8 + 1: return DecodeFaces<unsigned char,  unsigned char> (aElement, aData, aEnd, prefix, suffix);
+        case 1*8 + 2: return DecodeFaces<unsigned char,  unsigned short>(aElement, aData, aEnd, prefix, suffix);
+        case 1*8 + 4: return DecodeFaces<unsigned char,  unsigned int>  (aElement, aData, aEnd, prefix, suffix);
+        case 2*8 + 1: return DecodeFaces<unsigned short, unsigned char> (aElement, aData, aEnd, prefix, suffix);
+        case 2*8 + 2: return DecodeFaces<unsigned short, unsigned short>(aElement, aData, aEnd, prefix, suffix);
+        case 2*8 + 4: return DecodeFaces<unsigned short, unsigned int>  (aElement, aData, aEnd, prefix, suffix);
+        case 4*8 + 1: return DecodeFaces<unsigned int,   unsigned char> (aElement, aData, aEnd, prefix, suffix);
+        case 4*8 + 2: return DecodeFaces<unsigned int,   unsigned short>(aElement, aData, aEnd, prefix, suffix);
+        case 4*8 + 4: return DecodeFaces<unsigned int,   unsigned int>  (aElement, aData, aEnd, prefix, suffix);
+        default:      return false;
+        }
+    }
+};
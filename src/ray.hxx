@@ -36,5 +36,75 @@ struct Isect
     float dist;    //!< Distance to closest intersection (serves as ray.tmax)
     int   matID;   //!< ID of intersected material
     int   lightID; //!< ID of intersected light (if < 0, then none)
+    int   primID;  //!< ID of intersected primitive within its light (mesh lights)
     Vec3f normal;  //!< Normal at the intersection
+    Vec2f uv;      //!< Texture coordinates at the intersection
+    float uvScale; //!< Change of the texture coordinates per world distance, 0 without them
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Ray differentials
+//
+// How the origin and direction of a ray change towards the rays through
+// the neighboring pixels in x and y (Igehy 1999). Transferred to a hit
+// they give the footprint of a pixel on the surface, which picks the
+// texture level to look up. Surfaces other than mirrors scatter the
+// neighboring rays over the lobe they are sampled from, so after a bounce
+// the directions spread by the width of that lobe.
+struct RayDifferential
+{
+    RayDifferential() :
+        dOdx(0), dOdy(0), dDdx(0), dDdy(0)
+    {}
+
+    // Offsets of the point at aDist along aRay towards the neighboring
+    // rays, on the plane through it with aNormal
+    void Transfer(
+        const Ray   &aRay,
+        float       aDist,
+        const Vec3f &aNormal,
+        Vec3f       &oDPdx,
+        Vec3f       &oDPdy) const
+    {
+        oDPdx = dOdx + dDdx * aDist;
+        oDPdy = dOdy + dDdy * aDist;
+
+        const float cosTheta = Dot(aRay.dir, aNormal);
+        if(cosTheta != 0.f)
+        {
+            oDPdx -= aRay.dir * (Dot(oDPdx, aNormal) / cosTheta);
+            oDPdy -= aRay.dir * (Dot(oDPdy, aNormal) / cosTheta);
+        }
+    }
+
+    // The differentials of the ray leaving the point with the offsets
+    // aDPdx and aDPdy in aDir, sampled from a lobe aSpread radians wide
+    void Scatter(
+        const Vec3f &aDPdx,
+        const Vec3f &aDPdy,
+        const Vec3f &aDir,
+        float       aSpread)
+    {
+        Frame frame;
+        frame.SetFromZ(aDir);
+
+        dOdx = aDPdx;
+        dOdy = aDPdy;
+        dDdx = frame.Binormal() * (dDdx.Length() + aSpread);
+        dDdy = frame.Tangent()  * (dDdy.Length() + aSpread);
+    }
+
+    // Width of the footprint of the offsets in texture space
+    static float GetTextureWidth(
+        const Vec3f &aDPdx,
+        const Vec3f &aDPdy,
+        float       aUVScale)
+    {
+        return aUVScale * std::sqrt(std::max(aDPdx.LenSqr(), aDPdy.LenSqr()));
+    }
+
+    Vec3f dOdx; //!< Origin change to the ray of the next pixel in x
+    Vec3f dOdy;
+    Vec3f dDdx; //!< Direction change to the ray of the next pixel in x
+    Vec3f dDdy;
 };
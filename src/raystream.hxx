@@ -0,0 +1,122 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "math.hxx"
+#include "ray.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Ray binning
+//
+// Sorts a stream of rays so that rays with similar direction and origin
+// are traced one after another. The sort key holds the direction octant
+// in the top 3 bits and a 27-bit Morton code of the ray origin (9 bits per
+// axis, quantized in the scene bounding box) below it.
+
+class RayBinning
+{
+public:
+
+    RayBinning()
+    {
+        mBBoxMin = Vec3f(0);
+        mInvExtent = Vec3f(1);
+    }
+
+    void Setup(
+        const Vec3f &aBBoxMin,
+        const Vec3f &aBBoxMax)
+    {
+        mBBoxMin = aBBoxMin;
+
+        for(int i=0; i<3; i++)
+        {
+            const float extent = aBBoxMax.Get(i) - aBBoxMin.Get(i);
+            mInvExtent.Get(i) = extent > 0 ? 1.f / extent : 0.f;
+        }
+    }
+
+    uint GetKey(const Ray &aRay) const
+    {
+        const uint octant =
+            (aRay.dir.x < 0 ? 1u : 0u) |
+            (aRay.dir.y < 0 ? 2u : 0u) |
+            (aRay.dir.z < 0 ? 4u : 0u);
+
+        uint cell[3];
+        for(int i=0; i<3; i++)
+        {
+            const float t = (aRay.org.Get(i) - mBBoxMin.Get(i)) * mInvExtent.Get(i);
+            cell[i] = uint(std::min(511.f, std::max(0.f, t * 512.f)));
+        }
+
+        return (octant << 27) |
+            (SpreadBits(cell[0]) << 2) |
+            (SpreadBits(cell[1]) << 1) |
+             SpreadBits(cell[2]);
+    }
+
+    // Reorders aoIndices so that the rays aRays[aoIndices[i]] are sorted by
+    // their key. Uses a 3-pass LSD radix sort over the 30-bit keys.
+    void Sort(
+        const std::vector<Ray> &aRays,
+        std::vector<int>       &aoIndices)
+    {
+        const size_t count = aoIndices.size();
+
+        mKeys.resize(count);
+        mTmpKeys.resize(count);
+        mTmpIndices.resize(count);
+
+        for(size_t i=0; i<count; i++)
+            mKeys[i] = GetKey(aRays[aoIndices[i]]);
+
+        for(int pass=0; pass<3; pass++)
+        {
+            const int shift = pass * 10;
+            uint histogram[1024];
+            memset(histogram, 0, sizeof(histogram));
+
+            for(size_t i=0; i<count; i++)
+                histogram[(mKeys[i] >> shift) & 1023]++;
+
+            uint sum = 0;
+            for(int b=0; b<1024; b++)
+            {
+                const uint c = histogram[b];
+                histogram[b] = sum;
+                sum += c;
+            }
+
+            for(size_t i=0; i<count; i++)
+            {
+                const uint dst = histogram[(mKeys[i] >> shift) & 1023]++;
+                mTmpKeys[dst]    = mKeys[i];
+                mTmpIndices[dst] = aoIndices[i];
+            }
+
+            mKeys.swap(mTmpKeys);
+            aoIndices.swap(mTmpIndices);
+        }
+    }
+
+private:
+
+    // Inserts two zero bits between each of the lower 9 bits
+    static uint SpreadBits(uint aValue)
+    {
+        aValue = (aValue | (aValue << 16)) & 0x030000FFu;
+        aValue = (aValue | (aValue <<  8)) & 0x0300F00Fu;
+        aValue = (aValue | (aValue <<  4)) & 0x030C30C3u;
+        aValue = (aValue | (aValue <<  2)) & 0x09249249u;
+        return aValue;
+    }
+
+    Vec3f             mBBoxMin;
+    Vec3f             mInvExtent;
+    std::vector<uint> mKeys;
+    std::vector<uint> mTmpKeys;
+    std::vector<int>  mTmpIndices;
+};
@@ -4,16 +4,53 @@
 #include <cmath>
 #include "scene.hxx"
 #include "framebuffer.hxx"
+#include "sampler.hxx"
+#include "aov.hxx"
 
 class AbstractRenderer
 {
 public:
 
-    AbstractRenderer(const Scene& aScene) : mScene(aScene)
+    // Light transport techniques of the renderers that combine several
+    enum Technique
+    {
+        kTechEmission,   //!< emitter hit by a scattered ray
+        kTechDirect,     //!< next event estimation
+        kTechConnection, //!< connection of two subpath vertices
+        kTechLightTrace, //!< light subpath vertex connected to the camera
+        kTechMerging,    //!< merging of two subpath vertices
+        kTechniqueCount
+    };
+
+    static const char* GetTechniqueName(Technique aTechnique)
+    {
+        static const char* techniqueNames[kTechniqueCount] =
+        {
+            "emission",
+            "direct",
+            "connection",
+            "light tracing",
+            "merging"
+        };
+
+        return techniqueNames[aTechnique];
+    }
+
+    AbstractRenderer(
+        const Scene           &aScene,
+        const AbstractSampler &aSampler) :
+        mScene(aScene), mSampler(aSampler)
     {
         mMinPathLength = 0;
         mMaxPathLength = 2;
+        mLightSamples = 1;
         mIterations = 0;
+        mRayCount = 0;
+        mTraversalSteps = 0;
+        mTraversalTime = 0;
+
+        for(int i=0; i<kTechniqueCount; i++)
+            mTechniqueContrib[i] = 0;
         mFramebuffer.Setup(aScene.mCamera.mResolution);
     }
 
@@ -29,6 +66,21 @@ public:
             oFramebuffer.Scale(1.f / mIterations);
     }
 
+    // Makes the renderer fill the AOV layers of the mask
+    void EnableAovs(uint aMask)
+    {
+        mAovs.Setup(mScene.mCamera.mResolution);
+        mAovs.Enable(aMask);
+    }
+
+    void GetAovs(AovBuffer& oAovs)
+    {
+        oAovs = mAovs;
+
+        if(mIterations > 0)
+            oAovs.Scale(1.f / mIterations);
+    }
+
     //! Whether this renderer was used at all
     bool WasUsed() const { return mIterations > 0; }
 
@@ -36,10 +88,116 @@ public:
 
     uint         mMaxPathLength;
     uint         mMinPathLength;
+    uint         mLightSamples;  //!< Light samples taken per shading point
+
+    // Traversal statistics of the extension rays traced by the renderer.
+    // The steps of a ray do not depend on the order the rays are traced
+    // in, the time spent tracing them does, through the caches. Only the
+    // ray batches of stream tracing are timed.
+    unsigned long long mRayCount;
+    unsigned long long mTraversalSteps;
+    double             mTraversalTime;  //!< Seconds
+
+    // Luminance contributed by each technique, summed over all pixels
+    double mTechniqueContrib[kTechniqueCount];
+
+protected:
+
+    // Adds the radiance of the camera sample through aSample, aDirect is
+    // the part of it that reached the camera after at most one bounce
+    void AddSample(
+        const Vec2f &aSample,
+        const Vec3f &aRadiance,
+        const Vec3f &aDirect)
+    {
+        mFramebuffer.AddColor(aSample, aRadiance);
+
+        if(!mAovs.IsEmpty())
+            mAovs.AddSample(aSample, aRadiance, aDirect);
+    }
+
+    // Adds radiance reaching aSample from outside of a camera sample
+    void AddSplat(
+        const Vec2f &aSample,
+        const Vec3f &aRadiance,
+        bool        aDirect)
+    {
+        mFramebuffer.AddColor(aSample, aRadiance);
+
+        if(!mAovs.IsEmpty())
+            mAovs.AddSplat(aSample, aRadiance, aDirect);
+    }
+
+    // Records the first hit of the camera ray through aSample
+    // in the AOV layers
+    void AddFirstHit(
+        const Vec2f &aSample,
+        const Ray   &aRay,
+        const Isect &aIsect,
+        bool        aHit)
+    {
+        if(mAovs.IsEmpty())
+            return;
+
+        if(!aHit)
+        {
+            mAovs.AddHit(aSample, Vec3f(1), Vec3f(0), 0.f, -1);
+            return;
+        }
+
+        // emitters keep their radiance, other surfaces are
+        // demodulated by their total reflectance
+        Vec3f albedo(1);
+        if(aIsect.lightID < 0)
+        {
+            const Material mat = mScene.GetMaterial(aIsect.matID, aIsect.uv);
+            albedo = mat.mDiffuseReflectance + mat.mPhongReflectance;
+            for(int i=0; i<3; i++)
+                albedo.Get(i) = std::min(albedo.Get(i), 1.f);
+        }
+
+        // normals face the camera
+        const Vec3f normal = Dot(aIsect.normal, aRay.dir) > 0 ? -aIsect.normal : aIsect.normal;
+
+        mAovs.AddHit(aSample, albedo, normal, aIsect.dist, aIsect.matID);
+    }
+
+    // Picks the lights and their primitives for next event estimation into
+    // mLightBatch, mPickPdf is the probability of the light strategy
+    // picking each of them
+    void PickLights(
+        const Vec3f  &aSurfPt,
+        const Vec3f  &aNormal,
+        SamplerState &aoSampler)
+    {
+        const int lightSamples = mScene.GetLightCount() > 0 ? int(mLightSamples) : 0;
+        mLightBatch.Resize(lightSamples);
+        mLightBatch.mCount = 0;
+
+        for(int s=0; s<lightSamples; s++)
+        {
+            int primID;
+            float lightPickPdf;
+            const int lightID = mScene.SampleLight(aSurfPt, aNormal, mSampler.Get1D(aoSampler), primID, lightPickPdf);
+            const Vec3f rnd = mSampler.Get3D(aoSampler);
+
+            if(lightID < 0)
+                continue; // no light can reach the point
+
+            const int idx = mLightBatch.mCount++;
+            mLightBatch.mLightIdx[idx] = lightID;
+            mLightBatch.mPrimID[idx] = primID;
+            mLightBatch.mPickPdf[idx] = lightPickPdf * lightSamples;
+            mLightBatch.mRnd[idx] = rnd;
+        }
+    }
 
 protected:
 
-    int          mIterations;
-    Framebuffer  mFramebuffer;
-    const Scene& mScene;
+    int           mIterations;
+    Framebuffer   mFramebuffer;
+    AovBuffer     mAovs;             //!< Layers enabled by EnableAovs
+    const Scene&  mScene;
+    const AbstractSampler& mSampler; //!< Source of all sample dimensions
+    LightSampleBatch mLightBatch;    //!< Lights picked by PickLights
 };
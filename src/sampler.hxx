@@ -0,0 +1,576 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Sample generators
+//
+// A sampler maps (pixel, sample index, dimension) to a value in [0, 1).
+// The renderers use the iteration as the sample index and request the
+// dimensions of one pixel sample in a fixed order through a SamplerState,
+// so the values do not depend on the thread or on the order of the pixels.
+// The hashes of the pixel and of the pixel sample are computed once in
+// StartPixelSample, and the dimensions are drawn without a virtual call,
+// as a path takes dozens of them.
+
+// Position of a pixel sample in the sample space
+struct SamplerState
+{
+    int  mPixelX;
+    int  mPixelY;
+    uint mSampleIndex;
+    uint mDimension;   //!< Next dimension to be used
+    uint mPixelHash;   //!< Of the sampler seed and the pixel
+    uint mSampleHash;  //!< Of mPixelHash and the sample index
+};
+
+class AbstractSampler
+{
+public:
+
+    enum SamplerType
+    {
+        kRandom,
+        kSobol,
+        kHalton,
+        kBlueNoise,
+        kSamplerTypeMax
+    };
+
+    AbstractSampler(SamplerType aType, uint aSeed) :
+        mType(aType),
+        mSeed(aSeed)
+    {}
+
+    virtual ~AbstractSampler(){}
+
+    SamplerType GetType() const
+    {
+        return mType;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Sequential access to the dimensions of a pixel sample
+
+    void StartPixelSample(
+        int          aPixelX,
+        int          aPixelY,
+        uint         aSampleIndex,
+        SamplerState &oState) const
+    {
+        oState.mPixelX      = aPixelX;
+        oState.mPixelY      = aPixelY;
+        oState.mSampleIndex = aSampleIndex;
+        oState.mDimension   = 0;
+        oState.mPixelHash   = HashCombine(HashCombine(mSeed, uint(aPixelX)), uint(aPixelY));
+        oState.mSampleHash  = HashCombine(oState.mPixelHash, aSampleIndex);
+    }
+
+    // Defined below the samplers, they dispatch on mType to them
+    float Get1D(SamplerState &aoState) const;
+
+    // Two dimensions that form a well distributed 2D point set over the
+    // sample indices
+    Vec2f Get2D(SamplerState &aoState) const;
+
+    // 2D point in x and y, a separate dimension in z
+    Vec3f Get3D(SamplerState &aoState) const
+    {
+        const Vec2f xy = Get2D(aoState);
+        const float z  = Get1D(aoState);
+        return Vec3f(xy.x, xy.y, z);
+    }
+
+    static const char* GetName(SamplerType aType)
+    {
+        static const char* names[] = { "random", "sobol", "halton", "bluenoise" };
+
+        if(aType < 0 || aType >= kSamplerTypeMax)
+            return "unknown";
+        return names[aType];
+    }
+
+    static AbstractSampler* Create(SamplerType aType, uint aSeed);
+
+protected:
+
+    //////////////////////////////////////////////////////////////////////////
+    // Hashing helpers
+
+    static uint Hash(uint aValue)
+    {
+        // lowbias32 by Chris Wellons
+        aValue ^= aValue >> 16;
+        aValue *= 0x7feb352du;
+        aValue ^= aValue >> 15;
+        aValue *= 0x846ca68bu;
+        aValue ^= aValue >> 16;
+        return aValue;
+    }
+
+    static uint HashCombine(uint aSeed, uint aValue)
+    {
+        return aSeed ^ (Hash(aValue) + 0x9e3779b9u + (aSeed << 6) + (aSeed >> 2));
+    }
+
+    // Maps 32 bits to [0, 1)
+    static float ToFloat(uint aValue)
+    {
+        return std::min(float(aValue) * (1.f / 4294967296.f), 1.f - 1e-7f);
+    }
+
+    SamplerType mType;
+    uint        mSeed;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Independent uniform random values, hashed from the sample address
+class RandomSampler : public AbstractSampler
+{
+public:
+
+    RandomSampler(uint aSeed) : AbstractSampler(kRandom, aSeed)
+    {}
+
+    float GetSample(
+        const SamplerState &aState,
+        uint               aDimension) const
+    {
+        return ToFloat(Hash(HashCombine(aState.mSampleHash, aDimension)));
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Owen-scrambled Sobol points
+//
+// Uses the first two Sobol dimensions for every pair of requested
+// dimensions. Each pair gets its own Owen scrambling and its own shuffle
+// of the sample indices (Burley 2020, Practical Hash-based Owen
+// Scrambling), which decorrelates the pairs without a large table of
+// direction numbers. The shuffled index has all 32 bits set at random, so
+// the second dimension is looked up a byte of the index at a time.
+class SobolSampler : public AbstractSampler
+{
+public:
+
+    SobolSampler(uint aSeed) : AbstractSampler(kSobol, aSeed)
+    {
+        // second dimension, primitive polynomial x + 1
+        uint directions[32];
+        uint v = 1u << 31;
+        for(int i=0; i<32; i++)
+        {
+            directions[i] = v;
+            v ^= v >> 1;
+        }
+
+        for(int i=0; i<4; i++)
+        {
+            for(uint bits=0; bits<256; bits++)
+            {
+                uint y = 0;
+                for(int j=0; j<8; j++)
+                {
+                    if(bits & (1u << j))
+                        y ^= directions[8 * i + j];
+                }
+                mDirectionBytes[i][bits] = y;
+            }
+        }
+    }
+
+    float GetSample(
+        const SamplerState &aState,
+        uint               aDimension) const
+    {
+        const uint seed = HashCombine(aState.mPixelHash, aDimension);
+        const uint index = NestedUniformScramble(aState.mSampleIndex, seed);
+
+        // the first Sobol dimension is the reversed index, reversing it
+        // back for the scrambling is a no-op
+        return ToFloat(ReverseBits(LaineKarrasPermutation(index, Hash(seed))));
+    }
+
+    Vec2f GetSample2D(
+        const SamplerState &aState,
+        uint               aDimension) const
+    {
+        const uint seed = HashCombine(aState.mPixelHash, aDimension);
+        const uint index = NestedUniformScramble(aState.mSampleIndex, seed);
+
+        const uint y =
+            mDirectionBytes[0][ index        & 0xFF] ^
+            mDirectionBytes[1][(index >>  8) & 0xFF] ^
+            mDirectionBytes[2][(index >> 16) & 0xFF] ^
+            mDirectionBytes[3][ index >> 24];
+
+        return Vec2f(
+            ToFloat(ReverseBits(LaineKarrasPermutation(index, Hash(seed)))),
+            ToFloat(NestedUniformScramble(y, Hash(seed + 1))));
+    }
+
+private:
+
+    static uint ReverseBits(uint aValue)
+    {
+        aValue = ((aValue >> 1) & 0x55555555u) | ((aValue & 0x55555555u) << 1);
+        aValue = ((aValue >> 2) & 0x33333333u) | ((aValue & 0x33333333u) << 2);
+        aValue = ((aValue >> 4) & 0x0F0F0F0Fu) | ((aValue & 0x0F0F0F0Fu) << 4);
+        aValue = ((aValue >> 8) & 0x00FF00FFu) | ((aValue & 0x00FF00FFu) << 8);
+        return (aValue >> 16) | (aValue << 16);
+    }
+
+    // Hash that only lets bits influence the bits above them
+    static uint LaineKarrasPermutation(uint aValue, uint aSeed)
+    {
+        aValue += aSeed;
+        aValue ^= aValue * 0x6c50b47cu;
+        aValue ^= aValue * 0xb82f1e52u;
+        aValue ^= aValue * 0xc7afe638u;
+        aValue ^= aValue * 0x8d22f6e6u;
+        return aValue;
+    }
+
+    // Owen scrambling of a value in [0, 1) given as 32-bit fixed point
+    static uint NestedUniformScramble(uint aValue, uint aSeed)
+    {
+        return ReverseBits(LaineKarrasPermutation(ReverseBits(aValue), aSeed));
+    }
+
+    uint mDirectionBytes[4][256]; //!< Second dimension of each byte of the index
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Scrambled Halton points
+//
+// Dimension i uses the radical inverse in the i-th prime base. The digits
+// are scrambled per pixel with random permutations that depend on the
+// preceding digits (Owen scrambling). Without it the first samples of two
+// large bases lie on a line. Dimensions past the prime table fall back to
+// random values.
+class HaltonSampler : public AbstractSampler
+{
+public:
+
+    HaltonSampler(uint aSeed) : AbstractSampler(kHalton, aSeed)
+    {
+        std::vector<uint> primes;
+        for(uint n=2; primes.size() < 128; n++)
+        {
+            bool prime = true;
+            for(size_t i=0; i<primes.size() && primes[i] * primes[i] <= n; i++)
+            {
+                if(n % primes[i] == 0)
+                {
+                    prime = false;
+                    break;
+                }
+            }
+
+            if(prime)
+                primes.push_back(n);
+        }
+
+        // the first 16 bits worth of digits are scrambled even when they are
+        // leading zeros, to keep up to 65536 samples stratified
+        mBases.resize(primes.size());
+        for(size_t i=0; i<primes.size(); i++)
+        {
+            Base &base = mBases[i];
+            base.mBase      = primes[i];
+            base.mInvBase   = 1.0 / primes[i];
+            base.mMinDigits = 0;
+            base.mInvBaseN  = 1.0;
+            for(; base.mInvBaseN > 1.0 / 65536; base.mMinDigits++)
+                base.mInvBaseN *= base.mInvBase;
+        }
+    }
+
+    float GetSample(
+        const SamplerState &aState,
+        uint               aDimension) const
+    {
+        const uint seed = HashCombine(aState.mPixelHash, aDimension);
+
+        if(aDimension >= mBases.size())
+            return ToFloat(Hash(HashCombine(seed, aState.mSampleIndex)));
+
+        return ScrambledRadicalInverse(mBases[aDimension], aState.mSampleIndex, seed);
+    }
+
+private:
+
+    struct Base
+    {
+        uint   mBase;
+        uint   mMinDigits; //!< Digits scrambled at least
+        double mInvBase;
+        double mInvBaseN;  //!< mInvBase to the power of mMinDigits
+    };
+
+    static float ScrambledRadicalInverse(const Base &aBase, uint aIndex, uint aSeed)
+    {
+        unsigned long long reversed = 0;
+
+        uint digitIdx = 0;
+        for(; aIndex > 0 || digitIdx < aBase.mMinDigits; digitIdx++)
+        {
+            const uint next  = aIndex / aBase.mBase;
+            const uint digit = aIndex - next * aBase.mBase;
+
+            // permutation depends on the position and the preceding digits
+            const uint prefix = Hash(HashCombine(aSeed + digitIdx, uint(reversed)));
+
+            reversed = reversed * aBase.mBase + PermutationElement(digit, aBase.mBase, prefix);
+            aIndex = next;
+        }
+
+        double invBaseN = aBase.mInvBaseN;
+        for(uint i=aBase.mMinDigits; i<digitIdx; i++)
+            invBaseN *= aBase.mInvBase;
+
+        // the remaining scrambled zeros are a uniform offset within the
+        // last interval
+        const uint prefix = Hash(HashCombine(aSeed + digitIdx, uint(reversed)));
+        const double value = (reversed + ToFloat(prefix)) * invBaseN;
+
+        return std::min(float(value), 1.f - 1e-7f);
+    }
+
+    // Element aIndex of the random permutation of [0, aCount) selected by
+    // aSeed, Kensler 2013, Correlated Multi-Jittered Sampling
+    static uint PermutationElement(uint aIndex, uint aCount, uint aSeed)
+    {
+        uint w = aCount - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+
+        do
+        {
+            aIndex ^= aSeed;
+            aIndex *= 0xe170893du;
+            aIndex ^= aSeed >> 16;
+            aIndex ^= (aIndex & w) >> 4;
+            aIndex ^= aSeed >> 8;
+            aIndex *= 0x0929eb3fu;
+            aIndex ^= aSeed >> 23;
+            aIndex ^= (aIndex & w) >> 1;
+            aIndex *= 1 | aSeed >> 27;
+            aIndex *= 0x6935fa69u;
+            aIndex ^= (aIndex & w) >> 11;
+            aIndex *= 0x74dcb303u;
+            aIndex ^= (aIndex & w) >> 2;
+            aIndex *= 0x9e501cc3u;
+            aIndex ^= (aIndex & w) >> 2;
+            aIndex *= 0xc860a3dfu;
+            aIndex &= w;
+            aIndex ^= aIndex >> 5;
+        } while(aIndex >= aCount);
+
+        return (aIndex + aSeed) % aCount;
+    }
+
+    std::vector<Base> mBases; //!< Of the dimensions, the primes in order
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Tiled blue noise
+//
+// A 64x64 blue noise mask (void-and-cluster) is tiled over the image with
+// a random offset per dimension, and shifted by the golden ratio sequence
+// over the sample indices. Neighbouring pixels get well separated values,
+// which pushes the error of low sample counts to high frequencies.
+class BlueNoiseSampler : public AbstractSampler
+{
+public:
+
+    enum { kTileSize = 64 };
+
+    BlueNoiseSampler(uint aSeed) : AbstractSampler(kBlueNoise, aSeed)
+    {
+        BuildTile();
+    }
+
+    float GetSample(
+        const SamplerState &aState,
+        uint               aDimension) const
+    {
+        const uint offset = Hash(HashCombine(mSeed, aDimension));
+        const int  x = int((uint(aState.mPixelX) + offset) & (kTileSize - 1));
+        const int  y = int((uint(aState.mPixelY) + (offset >> 16)) & (kTileSize - 1));
+
+        double value = mTile[x + y * kTileSize] + aState.mSampleIndex * 0.6180339887498949;
+        value -= std::floor(value);
+
+        return std::min(float(value), 1.f - 1e-7f);
+    }
+
+private:
+
+    // Void-and-cluster (Ulichney 1993) on a toroidal tile
+    void BuildTile()
+    {
+        const int   count = kTileSize * kTileSize;
+        const float sigma = 1.9f;
+
+        // toroidal Gaussian filter, indexed by the offset between pixels
+        std::vector<float> kernel(count);
+        for(int y=0; y<kTileSize; y++)
+        {
+            for(int x=0; x<kTileSize; x++)
+            {
+                const int dx = std::min(x, kTileSize - x);
+                const int dy = std::min(y, kTileSize - y);
+                kernel[x + y * kTileSize] = std::exp(-(dx*dx + dy*dy) / (2 * sigma * sigma));
+            }
+        }
+
+        std::vector<unsigned char> pattern(count, 0);
+        std::vector<float>         energy(count, 0.f);
+
+        // initial pattern: a tenth of the pixels set at random
+        const int initialCount = count / 10;
+        uint rnd = Hash(mSeed);
+        for(int set = 0; set < initialCount; )
+        {
+            rnd = Hash(rnd + 1);
+            const int idx = int(rnd % count);
+            if(pattern[idx])
+                continue;
+
+            Splat(kernel, idx, 1.f, pattern, energy);
+            set++;
+        }
+
+        // spread it out: move the tightest cluster into the largest void
+        for(int iter = 0; iter < count; iter++)
+        {
+            const int cluster = FindExtreme(energy, pattern, 1, true);
+            Splat(kernel, cluster, -1.f, pattern, energy);
+
+            const int voidIdx = FindExtreme(energy, pattern, 0, false);
+            Splat(kernel, voidIdx, 1.f, pattern, energy);
+
+            if(voidIdx == cluster)
+                break;
+        }
+
+        std::vector<int> rank(count, 0);
+
+        // ranks below the initial pattern: remove the tightest clusters
+        {
+            std::vector<unsigned char> pat = pattern;
+            std::vector<float>         en  = energy;
+
+            for(int r = initialCount - 1; r >= 0; r--)
+            {
+                const int cluster = FindExtreme(en, pat, 1, true);
+                Splat(kernel, cluster, -1.f, pat, en);
+                rank[cluster] = r;
+            }
+        }
+
+        // ranks above the initial pattern: fill the largest voids
+        for(int r = initialCount; r < count; r++)
+        {
+            const int voidIdx = FindExtreme(energy, pattern, 0, false);
+            Splat(kernel, voidIdx, 1.f, pattern, energy);
+            rank[voidIdx] = r;
+        }
+
+        mTile.resize(count);
+        for(int i=0; i<count; i++)
+            mTile[i] = (rank[i] + 0.5f) / count;
+    }
+
+    static void Splat(
+        const std::vector<float>   &aKernel,
+        int                        aIdx,
+        float                      aSign,
+        std::vector<unsigned char> &aoPattern,
+        std::vector<float>         &aoEnergy)
+    {
+        const int px = aIdx % kTileSize;
+        const int py = aIdx / kTileSize;
+
+        aoPattern[aIdx] = aSign > 0 ? 1 : 0;
+
+        for(int y=0; y<kTileSize; y++)
+        {
+            const int ky = ((y - py) & (kTileSize - 1)) * kTileSize;
+            for(int x=0; x<kTileSize; x++)
+                aoEnergy[x + y * kTileSize] += aSign * aKernel[((x - px) & (kTileSize - 1)) + ky];
+        }
+    }
+
+    // Pixel with the highest (aMax) or lowest energy among the pixels
+    // whose pattern value equals aValue
+    static int FindExtreme(
+        const std::vector<float>         &aEnergy,
+        const std::vector<unsigned char> &aPattern,
+        unsigned char                    aValue,
+        bool                             aMax)
+    {
+        int best = -1;
+        for(int i=0; i<(int)aEnergy.size(); i++)
+        {
+            if(aPattern[i] != aValue)
+                continue;
+
+            if(best < 0 || (aMax ? aEnergy[i] > aEnergy[best] : aEnergy[i] < aEnergy[best]))
+                best = i;
+        }
+
+        return best;
+    }
+
+    std::vector<float> mTile;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Dispatch to the samplers, a switch the branch predictor learns instead
+// of a virtual call per dimension
+
+inline float AbstractSampler::Get1D(SamplerState &aoState) const
+{
+    const uint dimension = aoState.mDimension++;
+
+    switch(mType)
+    {
+    case kSobol:     return static_cast<const SobolSampler*>(this)->GetSample(aoState, dimension);
+    case kHalton:    return static_cast<const HaltonSampler*>(this)->GetSample(aoState, dimension);
+    case kBlueNoise: return static_cast<const BlueNoiseSampler*>(this)->GetSample(aoState, dimension);
+    default:         return static_cast<const RandomSampler*>(this)->GetSample(aoState, dimension);
+    }
+}
+
+inline Vec2f AbstractSampler::Get2D(SamplerState &aoState) const
+{
+    if(mType == kSobol)
+    {
+        const Vec2f res = static_cast<const SobolSampler*>(this)->GetSample2D(aoState, aoState.mDimension);
+        aoState.mDimension += 2;
+        return res;
+    }
+
+    const float x = Get1D(aoState);
+    const float y = Get1D(aoState);
+    return Vec2f(x, y);
+}
+
+AbstractSampler* AbstractSampler::Create(SamplerType aType, uint aSeed)
+{
+    switch(aType)
+    {
+    case kSobol:     return new SobolSampler(aSeed);
+    case kHalton:    return new HaltonSampler(aSeed);
+    case kBlueNoise: return new BlueNoiseSampler(aSeed);
+    default:         return new RandomSampler(aSeed);
+    }
+}
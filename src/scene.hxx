@@ -7,26 +7,62 @@
 #include <cmath>
 #include "math.hxx"
 #include "geometry.hxx"
+#include "mesh.hxx"
+#include "instance.hxx"
+#include "texture.hxx"
+#include "objloader.hxx"
+#include "plyloader.hxx"
+#include "scenecache.hxx"
+#include "streamedmesh.hxx"
+#include "compressedmesh.hxx"
+#include "scenefile.hxx"
 #include "camera.hxx"
 #include "materials.hxx"
 #include "lights.hxx"
+#include "lightsampler.hxx"
+#include "lightbvh.hxx"
+#include "lightstorage.hxx"
+#include "medium.hxx"
+#include "arena.hxx"
 #include "embree_util.hxx"
 
+// Own nothing, the arena frees them with its blocks
+template<> struct ArenaDestroys<Triangle>     { static const bool value = false; };
+template<> struct ArenaDestroys<Sphere>       { static const bool value = false; };
+template<> struct ArenaDestroys<MeshInstance> { static const bool value = false; };
+template<> struct ArenaDestroys<PointLight>   { static const bool value = false; };
+
 class Scene
 {
 public:
+    // How the lights for next event estimation are picked
+    enum LightSamplerType
+    {
+        kLightSamplerPower,
+        kLightSamplerBVH
+    };
+
     Scene() :
         mGeometry(NULL),
-        mBackground(NULL)
+        mMesh(NULL),
+        mStreamedMesh(NULL),
+        mCache(NULL),
+        mGeometryMemory(0),
+        mCompressMeshes(false),
+        mLightSampler(NULL),
+        mLightSamplerType(kLightSamplerBVH),
+        mBackground(NULL),
+        mBackgroundID(-1),
+        mMedium(NULL)
     {
     }
 
     ~Scene()
     {
-        delete mGeometry;
-
-        for(size_t i=0; i<mLights.size(); i++)
-            delete mLights[i];
+        delete mLightSampler;
+        delete mMedium;
+        mArena.Release();
+        delete mCache; // after the mesh tracing it
     }
 
     bool Intersect(
@@ -68,6 +104,28 @@ public:
         return mMaterials[aMaterialIdx];
     }
 
+    // The material at a surface point, its textures looked up at aUV over
+    // the footprint aWidth in texture space
+    Material GetMaterial(
+        const int    aMaterialIdx,
+        const Vec2f &aUV,
+        float        aWidth = 0.f) const
+    {
+        Material mat = mMaterials[aMaterialIdx];
+
+        if(mat.mDiffuseTexture >= 0)
+            mat.mDiffuseReflectance *= mTextures.Lookup(mat.mDiffuseTexture, aUV, aWidth);
+        if(mat.mPhongTexture >= 0)
+            mat.mPhongReflectance *= mTextures.Lookup(mat.mPhongTexture, aUV, aWidth);
+        if(mat.mExponentTexture >= 0)
+        {
+            mat.mPhongExponent = std::max(1.f,
+                mat.mPhongExponent * mTextures.Lookup(mat.mExponentTexture, aUV, aWidth).x);
+        }
+
+        return mat;
+    }
+
     int GetMaterialCount() const
     {
         return (int)mMaterials.size();
@@ -90,6 +148,86 @@ public:
         return mBackground;
     }
 
+    // Index of the background light in mLights, -1 if there is none
+    int GetBackgroundID() const
+    {
+        return mBackgroundID;
+    }
+
+    // Participating medium of the scene, NULL when there is none
+    const AbstractMedium* GetMedium() const
+    {
+        return mMedium;
+    }
+
+    // Takes ownership of the medium
+    void SetMedium(AbstractMedium *aMedium)
+    {
+        delete mMedium;
+        mMedium = aMedium;
+    }
+
+    // Lights in per-type arrays, used on the hot paths instead of GetLightPtr
+    const LightStorage& GetLightStorage() const
+    {
+        return mLightStorage;
+    }
+
+    // Picks a light and its primitive oPrimID for the shading point,
+    // returns the light index and the probability of picking the pair,
+    // or -1 when no light can contribute. The light is then sampled on
+    // that primitive alone.
+    // Points in a medium have no orientation, they pass a zero normal.
+    int SampleLight(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        float       aRnd,
+        int         &oPrimID,
+        float       &oPdf) const
+    {
+        return mLightSampler->Sample(aSurfPt, aNormal, aRnd, oPrimID, oPdf);
+    }
+
+    // Probability of SampleLight picking primitive aPrimID of the given
+    // light at the shading point
+    float LightSelectionPdf(
+        const Vec3f &aSurfPt,
+        const Vec3f &aNormal,
+        int         aLightIdx,
+        int         aPrimID) const
+    {
+        return mLightSampler->Pdf(aSurfPt, aNormal, aLightIdx, aPrimID);
+    }
+
+    // Computes the scene bounds and builds the light sampler,
+    // has to be called once the geometry and lights are set up
+    void BuildSceneData()
+    {
+        mBBoxMin = Vec3f( 1e36f);
+        mBBoxMax = Vec3f(-1e36f);
+        mGeometry->GrowBBox(mBBoxMin, mBBoxMax);
+
+        mSceneSphere.mSceneCenter = (mBBoxMax + mBBoxMin) * 0.5f;
+        mSceneSphere.mSceneRadius = (mBBoxMax - mBBoxMin).Length() * 0.5f;
+        mSceneSphere.mInvSceneRadiusSqr = 1.f / Sqr(mSceneSphere.mSceneRadius);
+
+        mBackgroundID = -1;
+        for(size_t i=0; i<mLights.size(); i++)
+        {
+            if(mLights[i] == mBackground)
+                mBackgroundID = (int)i;
+        }
+
+        mLightStorage.Build(mLights);
+
+        delete mLightSampler;
+
+        if(mLightSamplerType == kLightSamplerBVH)
+            mLightSampler = new LightBVH(mLights, mSceneSphere);
+        else
+            mLightSampler = new PowerLightSampler(mLights, mSceneSphere);
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Loads a Cornell Box scene
     enum BoxMask
@@ -132,7 +270,7 @@ public:
                                 const Vec3f &p2,
                                 int         aMatID) {
 
-	    Triangle* triangle = new Triangle(p0, p1, p2, aMatID);
+	    Triangle* triangle = mArena.Create<Triangle>(SceneArena::kPoolPrimitives, p0, p1, p2, aMatID);
 
         RTCGeometry _geomTriangle = rtcNewGeometry(_device, RTC_GEOMETRY_TYPE_USER);
         rtcSetGeometryUserPrimitiveCount(_geomTriangle,1);
@@ -148,12 +286,24 @@ public:
         return triangle;
 	}
 
+	// creating a triangle that is part of the given mesh light
+	Triangle* CreateEmissiveTriangleInstance(RTCScene _scene, RTCDevice _device, MeshLight *aoLight,
+                                const Vec3f &p0,
+                                const Vec3f &p1,
+                                const Vec3f &p2,
+                                int         aMatID) {
+
+	    Triangle* triangle = CreateTriangleInstance(_scene, _device, p0, p1, p2, aMatID);
+	    triangle->primID = aoLight->AddTriangle(p0, p1, p2);
+	    return triangle;
+	}
+
     // creating a triangle
     Sphere* CreateSphereInstance(RTCScene _scene, RTCDevice _device, const Vec3f &aCenter,
                                  float       aRadius,
                                  int         aMatID) {
 
-        Sphere* sphere = new Sphere(aCenter, aRadius, aMatID);
+        Sphere* sphere = mArena.Create<Sphere>(SceneArena::kPoolPrimitives, aCenter, aRadius, aMatID);
 
         RTCGeometry _geomSphere = rtcNewGeometry(_device, RTC_GEOMETRY_TYPE_USER);
         rtcSetGeometryUserPrimitiveCount(_geomSphere,1);
@@ -169,6 +319,50 @@ public:
         return sphere;
     }
 
+    // registering a mesh, Embree shares its vertices and triangles
+    void CreateMeshInstance(RTCScene _scene, RTCDevice _device, TriangleMesh *aMesh) {
+
+        const TriangleMesh::Arrays &arrays = aMesh->GetArrays();
+
+        RTCGeometry _geomMesh = rtcNewGeometry(_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+        rtcSetSharedGeometryBuffer(_geomMesh, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+            arrays.mVertices, 0, sizeof(Vec3f), arrays.mVertexCount);
+        rtcSetSharedGeometryBuffer(_geomMesh, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+            arrays.mIndices, 0, sizeof(Vec3i), arrays.mTriangleCount);
+        rtcSetGeometryUserData(_geomMesh, aMesh);
+
+        // add geometry to scene
+        rtcCommitGeometry(_geomMesh);
+        rtcAttachGeometry(_scene,_geomMesh);
+        rtcReleaseGeometry(_geomMesh);
+    }
+
+    // placing a prototype mesh, Embree shares the committed scene of the
+    // prototype between all its instances
+    MeshInstance* CreateTransformedInstance(RTCScene _scene, RTCDevice _device, RTCScene aPrototypeScene,
+        const TriangleMesh *aPrototype, const Mat4f &aTransform, int aMatID) {
+
+        MeshInstance *instance = mArena.Create<MeshInstance>(SceneArena::kPoolPrimitives, aPrototype,
+            aTransform, aMatID);
+
+        float transform[12];
+        for(int c=0; c<4; c++)
+            for(int r=0; r<3; r++)
+                transform[3*c + r] = aTransform.Get(r, c);
+
+        RTCGeometry _geomInstance = rtcNewGeometry(_device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryInstancedScene(_geomInstance, aPrototypeScene);
+        rtcSetGeometryTransform(_geomInstance, 0, RTC_FORMAT_FLOAT3X4_COLUMN_MAJOR, transform);
+        rtcSetGeometryUserData(_geomInstance, instance);
+
+        // add geometry to scene
+        rtcCommitGeometry(_geomInstance);
+        rtcAttachGeometry(_scene,_geomInstance);
+        rtcReleaseGeometry(_geomInstance);
+
+        return instance;
+    }
+
     void LoadCornellBox(
         const Vec2i &aResolution,
         uint aBoxMask = kDefault)
@@ -194,9 +388,9 @@ public:
 
         // Materials
         Material mat;
-        // 0) light1, will only emit
+        // 0) light, will only emit
         mMaterials.push_back(mat);
-        // 1) light2, will only emit
+        // 1) unused, keeps the indices of the materials below
         mMaterials.push_back(mat);
 
         // 2) white floor (and possibly ceiling)
@@ -223,8 +417,6 @@ public:
 		SetMaterial(mat, Vec3f(0.152941f, 0.152941f, 0.803922f), Vec3f(0.7f), 600, aBoxMask & kSpheresDiffuse, aBoxMask & kSpheresGlossy);
         mMaterials.push_back(mat);
 
-        delete mGeometry;
-
         //////////////////////////////////////////////////////////////////////////
 
         // Cornell box
@@ -239,9 +431,14 @@ public:
             Vec3f(-1.27029f, -1.25549f,  1.28002f)
         };
 
-        GeometryList *geometryList = new GeometryList;
+        GeometryList *geometryList = mArena.Create<GeometryList>(SceneArena::kPoolMeshes);
         mGeometry = geometryList;
 
+        // all emitting triangles (material 0) form one mesh light
+        MeshLight *meshLight = NULL;
+        if(light_ceiling != light_box)
+            meshLight = mArena.Create<MeshLight>(SceneArena::kPoolLights);
+
 		// Floor
 		geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,cb[0], cb[4], cb[5], 2));
 		geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,cb[5], cb[1], cb[0], 2));
@@ -263,8 +460,8 @@ public:
 			// Ceiling
 			if(light_ceiling && !light_box)
 			{
-				geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,cb[2], cb[6], cb[7], 0));
-				geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,cb[7], cb[3], cb[2], 1));
+				geometryList->mGeometry.push_back(CreateEmissiveTriangleInstance(_embreeScene, _device, meshLight, cb[2], cb[6], cb[7], 0));
+				geometryList->mGeometry.push_back(CreateEmissiveTriangleInstance(_embreeScene, _device, meshLight, cb[7], cb[3], cb[2], 0));
 			}
 			else
 			{
@@ -316,56 +513,805 @@ public:
             geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,lb[4], lb[5], lb[6], 5));
             geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,lb[6], lb[7], lb[4], 5));
 			// Floor
-			geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,lb[0], lb[5], lb[4], 0));
-			geometryList->mGeometry.push_back(CreateTriangleInstance(_embreeScene, _device,lb[5], lb[0], lb[1], 1));
+			geometryList->mGeometry.push_back(CreateEmissiveTriangleInstance(_embreeScene, _device, meshLight, lb[0], lb[5], lb[4], 0));
+			geometryList->mGeometry.push_back(CreateEmissiveTriangleInstance(_embreeScene, _device, meshLight, lb[5], lb[0], lb[1], 0));
         }
 
         //////////////////////////////////////////////////////////////////////////
         // Lights
         
-		if(light_ceiling && !light_box)
+		if(meshLight)
         {
-            // entire ceiling is a light source
-            mLights.resize(2);
-            AreaLight *l = new AreaLight(cb[2], cb[6], cb[7]);
-            l->mRadiance = Vec3f(1.21f);
-            mLights[0] = l;
-            mMaterial2Light.insert(std::make_pair(0, 0));
+            if(light_ceiling)
+                meshLight->mRadiance = Vec3f(1.21f); // entire ceiling is a light source
+            else
+                meshLight->mRadiance = Vec3f(31.831f); // light box, 25 Watts
+
+            // the ceiling needs the walls, without them no triangle was added
+            if(meshLight->GetTriangleCount() > 0)
+            {
+                meshLight->Finalize();
+                mLights.push_back(meshLight);
+                mMaterial2Light.insert(std::make_pair(0, 0));
+            }
+        }
 
-            l = new AreaLight(cb[7], cb[3], cb[2]);
-            l->mRadiance = Vec3f(1.21f);
-            mLights[1] = l;
-            mMaterial2Light.insert(std::make_pair(1, 1));
+        if(light_point)
+        {
+            PointLight *l = mArena.Create<PointLight>(SceneArena::kPoolLights, Vec3f(0.0, -0.5, 1.0));
+            l->mIntensity = Vec3f( 50.f/*Watts*/ / (4*PI_F) );
+            mLights.push_back(l);
         }
 
-        if(light_box && !light_ceiling)
+        if(light_env)
         {
-            // With light box
-            mLights.resize(2);
-            AreaLight *l = new AreaLight(lb[0], lb[5], lb[4]);
-            l->mRadiance = Vec3f(31.831f); // 25 Watts
-            mLights[0] = l;
-            mMaterial2Light.insert(std::make_pair(0, 0));
+            BackgroundLight *l = mArena.Create<BackgroundLight>(SceneArena::kPoolLights);
+
+            if(!mEnvMapFile.empty() && !l->LoadEnvMap(mEnvMapFile.c_str()))
+                printf("Could not load environment map %s, using constant background\n", mEnvMapFile.c_str());
 
-            l = new AreaLight(lb[5], lb[0], lb[1]);
-            l->mRadiance = Vec3f(31.831f); // 25 Watts
-            mLights[1] = l;
-            mMaterial2Light.insert(std::make_pair(1, 1));
+            mLights.push_back(l);
+            mBackground = l;
         }
 
-        if(light_point)
+        BuildSceneData();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Scene files
+
+    // Adds a material, scaled down where it reflects more than it receives,
+    // and a mesh light for it when it has an emission. aoMaterialLights
+    // stays parallel to mMaterials.
+    int AddMaterial(
+        const Vec3f                &aDiffuse,
+        const Vec3f                &aPhong,
+        float                      aExponent,
+        const Vec3f                &aEmission,
+        std::vector<MeshLight*>    &aoMaterialLights)
+    {
+        Material mat;
+        mat.mDiffuseReflectance = Max(aDiffuse, Vec3f(0));
+        mat.mPhongReflectance   = Max(aPhong, Vec3f(0));
+        mat.mPhongExponent      = std::max(1.f, aExponent);
+
+        // to make it energy conserving
+        const float reflectance = (mat.mDiffuseReflectance + mat.mPhongReflectance).Max();
+        if(reflectance > 1.f)
         {
-            PointLight *l = new PointLight(Vec3f(0.0, -0.5, 1.0));
-            l->mIntensity = Vec3f( 50.f/*Watts*/ / (4*PI_F) );
+            mat.mDiffuseReflectance /= reflectance;
+            mat.mPhongReflectance   /= reflectance;
+        }
+
+        mMaterials.push_back(mat);
+
+        MeshLight *light = NULL;
+        if(aEmission.Max() > 0.f)
+        {
+            light = mArena.Create<MeshLight>(SceneArena::kPoolLights);
+            light->mRadiance = aEmission;
+        }
+
+        aoMaterialLights.resize(mMaterials.size(), (MeshLight*)NULL);
+        aoMaterialLights.back() = light;
+
+        return (int)mMaterials.size() - 1;
+    }
+
+    // Textures the material with the images, an image that cannot be
+    // loaded leaves its value untextured
+    void SetMaterialTextures(
+        int               aMaterial,
+        const std::string &aDiffuseMap,
+        const std::string &aPhongMap,
+        const std::string &aExponentMap)
+    {
+        Material &mat = mMaterials[aMaterial];
+
+        if(!aDiffuseMap.empty())
+            mat.mDiffuseTexture = mTextures.AddTexture(aDiffuseMap, true);
+        if(!aPhongMap.empty())
+            mat.mPhongTexture = mTextures.AddTexture(aPhongMap, true);
+        if(!aExponentMap.empty())
+            mat.mExponentTexture = mTextures.AddTexture(aExponentMap, false);
+    }
+
+    // Registers the mesh lights with triangles, the others are left unused
+    void AddMaterialLights(std::vector<MeshLight*> &aoMaterialLights)
+    {
+        for(size_t i=0; i<aoMaterialLights.size(); i++)
+        {
+            if(!aoMaterialLights[i])
+                continue;
+
+            if(aoMaterialLights[i]->GetTriangleCount() > 0)
+            {
+                aoMaterialLights[i]->Finalize();
+                mMaterial2Light.insert(std::make_pair(int(i), (int)mLights.size()));
+                mLights.push_back(aoMaterialLights[i]);
+            }
+
+            aoMaterialLights[i] = NULL;
+        }
+    }
+
+    void AddBackgroundLight(
+        const std::string &aEnvMapFile,
+        const Vec3f       &aColor = Vec3f(135, 206, 250) / Vec3f(255.f))
+    {
+        BackgroundLight *l = mArena.Create<BackgroundLight>(SceneArena::kPoolLights);
+        l->mBackgroundColor = aColor;
+
+        if(!aEnvMapFile.empty() && !l->LoadEnvMap(aEnvMapFile.c_str()))
+            printf("Could not load environment map %s, using constant background\n", aEnvMapFile.c_str());
+
+        mLights.push_back(l);
+        mBackground = l;
+    }
+
+    // Loads a mesh file into a triangle mesh registered with the Embree
+    // scene aEmbreeScene, tLoader is ObjLoader or PlyLoader. All triangles get aMaterial, or
+    // with -1 the materials of the file, converted as by AddMaterial. The
+    // emissive triangles are added to the lights of their materials.
+    template<typename tLoader>
+    TriangleMesh* LoadMeshGeometry(
+        const char              *aFilename,
+        int                     aMaterial,
+        std::vector<MeshLight*> &aoMaterialLights,
+        RTCScene                aEmbreeScene)
+    {
+        const double loadStart = omp_get_wtime();
+
+        tLoader loader;
+        if(!loader.Load(aFilename))
+            return NULL;
+
+        if(loader.mTriangles.empty())
+        {
+            printf("No triangles in %s\n", aFilename);
+            return NULL;
+        }
+
+        const double buildStart = omp_get_wtime();
+
+        // Materials, the triangles without one get a default gray
+        std::vector<int> materials;
+        int defaultMaterial = aMaterial;
+
+        if(aMaterial < 0)
+        {
+            for(size_t i=0; i<loader.mMaterials.size(); i++)
+            {
+                const ObjMaterial &objMaterial = loader.mMaterials[i];
+                materials.push_back(AddMaterial(objMaterial.mDiffuse, objMaterial.mSpecular,
+                    objMaterial.mShininess, objMaterial.mEmission, aoMaterialLights));
+                SetMaterialTextures(materials.back(), objMaterial.mDiffuseMap, objMaterial.mSpecularMap,
+                    objMaterial.mShininessMap);
+            }
+
+            for(size_t i=0; i<loader.mTriangleMaterials.size(); i++)
+            {
+                if(loader.mTriangleMaterials[i] < 0)
+                {
+                    const ObjMaterial objMaterial("default");
+                    defaultMaterial = AddMaterial(objMaterial.mDiffuse, objMaterial.mSpecular,
+                        objMaterial.mShininess, objMaterial.mEmission, aoMaterialLights);
+                    break;
+                }
+            }
+        }
+
+        // Geometry
+        TriangleMesh *mesh = mArena.Create<TriangleMesh>(SceneArena::kPoolMeshes);
+
+        mesh->mVertices.swap(loader.mVertices);
+        mesh->mIndices.swap(loader.mTriangles);
+        mesh->mMatIDs.swap(loader.mTriangleMaterials);
+        mesh->mPrimIDs.assign(mesh->mIndices.size(), -1);
+        mesh->mTexCoords.swap(loader.mTexCoords);
+        mesh->mTexIndices.swap(loader.mTriangleTexCoords);
+
+        for(size_t i=0; i<mesh->mIndices.size(); i++)
+        {
+            int &matID = mesh->mMatIDs[i];
+            matID = (aMaterial >= 0 || matID < 0) ? defaultMaterial : materials[matID];
+
+            if(aoMaterialLights[matID])
+            {
+                const Vec3i &tri = mesh->mIndices[i];
+                mesh->mPrimIDs[i] = aoMaterialLights[matID]->AddTriangle(
+                    mesh->mVertices[tri.x], mesh->mVertices[tri.y], mesh->mVertices[tri.z]);
+            }
+        }
+
+        mesh->Build();
+        if(aEmbreeScene)
+            CreateMeshInstance(aEmbreeScene, _device, mesh);
+
+        const double buildEnd = omp_get_wtime();
+
+        printf("Mesh:      %d triangles, %d vertices, %.1f MB, parsed in %.2f s,\n"
+               "           BVH of %d nodes built in %.2f s\n",
+            mesh->GetTriangleCount(), (int)mesh->mVertices.size(),
+            mesh->GetMemorySize() / (1024.f * 1024.f), buildStart - loadStart,
+            mesh->GetNodeCount(), buildEnd - buildStart);
+
+        return mesh;
+    }
+
+    // LoadMeshGeometry with the loader of the file extension
+    TriangleMesh* LoadMeshFile(
+        const char              *aFilename,
+        int                     aMaterial,
+        std::vector<MeshLight*> &aoMaterialLights,
+        RTCScene                aEmbreeScene)
+    {
+        if(GetExtension(aFilename) == ".ply")
+            return LoadMeshGeometry<PlyLoader>(aFilename, aMaterial, aoMaterialLights, aEmbreeScene);
+        return LoadMeshGeometry<ObjLoader>(aFilename, aMaterial, aoMaterialLights, aEmbreeScene);
+    }
+
+    // The Embree scene a loaded mesh goes to, none when it is compressed
+    // and the mesh freed
+    RTCScene GetMeshEmbreeScene() const
+    {
+        return mCompressMeshes ? NULL : _embreeScene;
+    }
+
+    // A CompressedMesh has no texture coordinates, meshes with textured
+    // materials are not compressed
+    bool CanCompress(const TriangleMesh &aMesh) const
+    {
+        if(!CompressedMesh::CanCompress(aMesh))
+            return false;
+
+        const TriangleMesh::Arrays &arrays = aMesh.GetArrays();
+        for(int i=0; i<arrays.mTriangleCount; i++)
+        {
+            const Material &material = mMaterials[arrays.mMatIDs[i]];
+            if(material.mDiffuseTexture >= 0 || material.mPhongTexture >= 0 || material.mExponentTexture >= 0)
+                return false;
+        }
+        return true;
+    }
+
+    // Replaces a mesh loaded for GetMeshEmbreeScene by its CompressedMesh
+    // when meshes are compressed, the full mesh is emptied. Meshes that
+    // cannot be are kept and registered with Embree after all.
+    AbstractGeometry* CompressMesh(TriangleMesh *aMesh)
+    {
+        if(!mCompressMeshes)
+            return aMesh;
+
+        if(!CanCompress(*aMesh))
+        {
+            printf("Compress:  mesh kept, it is textured or has too many materials\n");
+            CreateMeshInstance(_embreeScene, _device, aMesh);
+            return aMesh;
+        }
+
+        const double compressStart = omp_get_wtime();
+        CompressedMesh *compressed = mArena.Create<CompressedMesh>(SceneArena::kPoolMeshes, *aMesh);
+
+        printf("Compress:  %d clusters, %.1f MB instead of %.1f MB, in %.2f s\n",
+            compressed->GetClusterCount(), compressed->GetMemorySize() / (1024.f * 1024.f),
+            aMesh->GetMemorySize() / (1024.f * 1024.f), omp_get_wtime() - compressStart);
+
+        aMesh->Clear();
+        return compressed;
+    }
+
+    static std::string GetExtension(const std::string &aFilename)
+    {
+        return aFilename.substr(std::min(aFilename.size(), aFilename.find_last_of('.')));
+    }
+
+    void SetSceneName(const char *aFilename)
+    {
+        std::string filename(aFilename);
+        const size_t slash = filename.find_last_of("/\\");
+        if(slash != std::string::npos)
+            filename = filename.substr(slash + 1);
+
+        mSceneName    = filename + " ";
+        mSceneAcronym = filename.substr(0, filename.find_last_of('.'));
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Loads an .obj or .ply file as one triangle mesh
+    //
+    // The MTL Kd, Ks and Ns become the diffuse and Phong reflectance and
+    // the Phong exponent, scaled by the map_Kd, map_Ks and map_Ns .bmp or
+    // .hdr textures at the vt coordinates. The triangles of each material
+    // with a Ke color form a mesh light, a scene without them is lit by the
+    // background. The camera looks along -z at the whole mesh, with y up as
+    // is usual for OBJ and PLY files.
+    bool LoadMesh(
+        const char  *aFilename,
+        const Vec2i &aResolution)
+    {
+        // Set up Embree
+        _device = rtcNewDevice(NULL);
+        _embreeScene = rtcNewScene(_device);
+
+        SetSceneName(aFilename);
+
+        std::vector<MeshLight*> materialLights;
+        TriangleMesh *mesh = LoadMeshFile(aFilename, -1, materialLights, GetMeshEmbreeScene());
+        if(!mesh)
+            return false;
+
+        mGeometry = CompressMesh(mesh);
+        mMesh     = mGeometry == mesh ? mesh : NULL;
+
+        // Lights
+        AddMaterialLights(materialLights);
+
+        if(mLights.empty())
+            AddBackgroundLight(mEnvMapFile);
+
+        BuildSceneData();
+
+        // Camera, fits the bounding sphere into the field of view
+        const float distance = mSceneSphere.mSceneRadius / std::sin(22.5f * PI_F / 180.f);
+        mCamera.Setup(
+            mSceneSphere.mSceneCenter + Vec3f(0, 0, distance),
+            Vec3f(0, 0, -1),
+            Vec3f(0, 1, 0),
+            Vec2f(float(aResolution.x), float(aResolution.y)), 45);
+
+        printf("Materials: %d materials, %d lights\n", (int)mMaterials.size(), (int)mLights.size());
+
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Builds a scene from a parsed SceneDescription
+    //
+    // The description is already validated, its material indices become the
+    // scene ones. The triangles and quads are single primitives like those
+    // of the Cornell box, each mesh is a TriangleMesh or its CompressedMesh
+    // when meshes are compressed. Each prototype is one TriangleMesh in
+    // its own Embree scene, its instances reference both. All of them go
+    // into one GeometryBVH, the top level over the BVHs of the meshes and
+    // prototypes. The background color is replaced by --env when that is
+    // given.
+    bool LoadDescription(
+        const SceneDescription &aDescription,
+        const Vec2i            &aResolution)
+    {
+        typedef SceneDescription::ShapeDesc     ShapeDesc;
+        typedef SceneDescription::PrototypeDesc PrototypeDesc;
+        typedef SceneDescription::InstanceDesc  InstanceDesc;
+
+        const double loadStart = omp_get_wtime();
+
+        // Set up Embree
+        _device = rtcNewDevice(NULL);
+        _embreeScene = rtcNewScene(_device);
+
+        SetSceneName(aDescription.mFilename.c_str());
+
+        // Materials
+        std::vector<MeshLight*> materialLights;
+        for(size_t i=0; i<aDescription.mMaterials.size(); i++)
+        {
+            const SceneDescription::MaterialDesc &material = aDescription.mMaterials[i];
+            const int matID = AddMaterial(material.mDiffuse, material.mPhong, material.mExponent,
+                material.mEmission, materialLights);
+            SetMaterialTextures(matID, material.mDiffuseMap, material.mPhongMap, material.mExponentMap);
+        }
+
+        // Geometry
+        GeometryBVH *geometry = mArena.Create<GeometryBVH>(SceneArena::kPoolMeshes);
+        mGeometry = geometry;
+
+        int meshCount = 0;
+        for(size_t i=0; i<aDescription.mShapes.size(); i++)
+        {
+            const ShapeDesc &shape = aDescription.mShapes[i];
+            const Vec3f *p = shape.mPoints;
+
+            if(shape.mType == ShapeDesc::kSphere)
+            {
+                geometry->mGeometry.push_back(CreateSphereInstance(_embreeScene, _device,
+                    p[0], shape.mRadius, shape.mMaterial));
+            }
+            else if(shape.mType == ShapeDesc::kMesh)
+            {
+                TriangleMesh *mesh = LoadMeshFile(shape.mFile.c_str(), shape.mMaterial, materialLights,
+                    GetMeshEmbreeScene());
+                if(!mesh)
+                    return false;
+
+                geometry->mGeometry.push_back(CompressMesh(mesh));
+                meshCount++;
+            }
+            else
+            {
+                // a quad is split along its p0 p2 diagonal
+                MeshLight *light = materialLights[shape.mMaterial];
+                const int triangles = shape.mType == ShapeDesc::kQuad ? 2 : 1;
+
+                for(int t=0; t<triangles; t++)
+                {
+                    const int corners[3] = { 2*t, 2*t + 1, (2*t + 2) % 4 };
+                    const Vec3f &p0 = p[corners[0]], &p1 = p[corners[1]], &p2 = p[corners[2]];
+
+                    Triangle *triangle = light ?
+                        CreateEmissiveTriangleInstance(_embreeScene, _device, light, p0, p1, p2, shape.mMaterial) :
+                        CreateTriangleInstance(_embreeScene, _device, p0, p1, p2, shape.mMaterial);
+
+                    triangle->SetTexCoords(shape.mTexCoords[corners[0]], shape.mTexCoords[corners[1]],
+                        shape.mTexCoords[corners[2]]);
+                    geometry->mGeometry.push_back(triangle);
+                }
+            }
+        }
+
+        // Prototypes, instances cannot emit as the lights would have to be
+        // copied for each of them
+        std::vector<RTCScene> prototypeScenes;
+        for(size_t i=0; i<aDescription.mPrototypes.size(); i++)
+        {
+            const PrototypeDesc &prototype = aDescription.mPrototypes[i];
+
+            RTCScene prototypeScene = rtcNewScene(_device);
+            TriangleMesh *mesh = LoadMeshFile(prototype.mFile.c_str(), prototype.mMaterial, materialLights,
+                prototypeScene);
+
+            bool emissive = false;
+            for(int j=0; mesh && j<mesh->GetTriangleCount(); j++)
+                emissive |= mesh->mPrimIDs[j] >= 0;
+
+            if(!mesh || emissive)
+            {
+                if(emissive)
+                    printf("The prototype %s has emissive materials, instances cannot emit\n",
+                        prototype.mName.c_str());
+
+                rtcReleaseScene(prototypeScene);
+                for(size_t j=0; j<prototypeScenes.size(); j++)
+                    rtcReleaseScene(prototypeScenes[j]);
+                return false;
+            }
+
+            rtcCommitScene(prototypeScene);
+            prototypeScenes.push_back(prototypeScene);
+            mPrototypes.push_back(mesh);
+        }
+
+        // Instances
+        size_t prototypeMemory = 0, flattenedMemory = 0;
+        for(size_t i=0; i<mPrototypes.size(); i++)
+            prototypeMemory += mPrototypes[i]->GetMemorySize();
+
+        for(size_t i=0; i<aDescription.mInstances.size(); i++)
+        {
+            const InstanceDesc &instance = aDescription.mInstances[i];
+
+            geometry->mGeometry.push_back(CreateTransformedInstance(_embreeScene, _device,
+                prototypeScenes[instance.mPrototype], mPrototypes[instance.mPrototype],
+                instance.mTransform, instance.mMaterial));
+            flattenedMemory += mPrototypes[instance.mPrototype]->GetMemorySize();
+        }
+
+        // the instances keep their prototype scenes
+        for(size_t i=0; i<prototypeScenes.size(); i++)
+            rtcReleaseScene(prototypeScenes[i]);
+
+        geometry->Build();
+
+        if(!aDescription.mInstances.empty())
+        {
+            printf("Instances: %d instances of %d prototypes, %.1f MB prototypes and %.1f MB instances,\n"
+                   "           %.1f MB as separate meshes\n",
+                (int)aDescription.mInstances.size(), (int)mPrototypes.size(),
+                prototypeMemory / (1024.f * 1024.f),
+                aDescription.mInstances.size() * sizeof(MeshInstance) / (1024.f * 1024.f),
+                flattenedMemory / (1024.f * 1024.f));
+        }
+
+        // Lights
+        AddMaterialLights(materialLights);
+
+        for(size_t i=0; i<aDescription.mPointLights.size(); i++)
+        {
+            PointLight *l = mArena.Create<PointLight>(SceneArena::kPoolLights,
+                aDescription.mPointLights[i].mPosition);
+            l->mIntensity = aDescription.mPointLights[i].mIntensity;
             mLights.push_back(l);
         }
 
-        if(light_env)
+        if(aDescription.mHasBackground)
+        {
+            AddBackgroundLight(mEnvMapFile.empty() ? aDescription.mEnvMapFile : mEnvMapFile,
+                aDescription.mBackgroundColor);
+        }
+
+        if(mLights.empty())
+        {
+            printf("The meshes of %s have no emissive materials and the scene has no lights\n",
+                aDescription.mFilename.c_str());
+            return false;
+        }
+
+        BuildSceneData();
+
+        // Medium
+        const SceneDescription::MediumDesc &medium = aDescription.mMedium;
+        if(medium.mType == SceneDescription::MediumDesc::kHomogeneous)
+        {
+            SetMedium(new HomogeneousMedium(medium.mAbsorption, medium.mScattering,
+                PhaseFunction(medium.mAnisotropy), mSceneSphere.mSceneCenter, mSceneSphere.mSceneRadius));
+        }
+        else if(medium.mType == SceneDescription::MediumDesc::kHeterogeneous)
+        {
+            SetMedium(CreateGridMedium(PhaseFunction(medium.mAnisotropy), medium.mAlbedo,
+                medium.mDensity, medium.mGridFile));
+        }
+
+        // Camera
+        mCamera.Setup(
+            aDescription.mCameraPosition,
+            aDescription.mCameraForward,
+            aDescription.mCameraUp,
+            Vec2f(float(aResolution.x), float(aResolution.y)), aDescription.mCameraFOV);
+
+        printf("Shapes:    %d shapes, %d meshes, %d materials, %d lights, built in %.2f s\n",
+            (int)aDescription.mShapes.size(), meshCount, (int)mMaterials.size(), (int)mLights.size(),
+            omp_get_wtime() - loadStart);
+
+        return true;
+    }
+
+    // Fills the bounding box with smoke given by a density grid, the
+    // density scales it to the optical thickness over the scene radius.
+    // A procedural cloud is used without a grid file or when it cannot
+    // be loaded.
+    HeterogeneousMedium* CreateGridMedium(
+        const PhaseFunction &aPhase,
+        const Vec3f         &aAlbedo,
+        float               aDensity,
+        const std::string   &aGridFile) const
+    {
+        HeterogeneousMedium *medium = new HeterogeneousMedium(aPhase, aAlbedo,
+            aDensity / mSceneSphere.mSceneRadius, mBBoxMin, mBBoxMax);
+        BrickGrid &grid = medium->GetGrid();
+
+        if(aGridFile.empty() || !grid.LoadRaw(aGridFile.c_str()))
+        {
+            if(!aGridFile.empty())
+                printf("Could not load volume %s, using a procedural cloud\n", aGridFile.c_str());
+
+            grid.Build(Vec3i(128), ProceduralCloud());
+        }
+
+        const Vec3i &bricks = grid.GetBrickResolution();
+        printf("Volume:    %d x %d x %d voxels, %d of %d bricks occupied, %.1f MB\n",
+            grid.GetResolution().x, grid.GetResolution().y, grid.GetResolution().z,
+            grid.GetOccupiedBrickCount(), bricks.x * bricks.y * bricks.z,
+            grid.GetMemorySize() / (1024.f * 1024.f));
+
+        return medium;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Loads a scene file by its extension, an .obj, a .ply or a .pg3s
+    // scene cache
+    bool LoadFile(
+        const char  *aFilename,
+        const Vec2i &aResolution)
+    {
+        const std::string extension = GetExtension(aFilename);
+
+        if(extension == ".pg3s")
+            return LoadCache(aFilename, aResolution);
+        if(extension == ".obj" || extension == ".ply")
+            return LoadMesh(aFilename, aResolution);
+
+        printf("Unknown scene file type %s\n", extension.c_str());
+        return false;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Loads a scene baked by SaveCache
+    //
+    // The clusters of the mesh are traced by a StreamedMesh from the mapped
+    // file, which stays open as long as the scene. They are traced in place,
+    // or paged in on demand when mGeometryMemory limits the memory they may
+    // take. Only the materials and the mesh lights are set up, the lights
+    // copy their triangles. The Embree scene gets the clusters traced in
+    // place, the paged ones are left out of it.
+    bool LoadCache(
+        const char  *aFilename,
+        const Vec2i &aResolution)
+    {
+        const double loadStart = omp_get_wtime();
+
+        SceneCache *cache = new SceneCache;
+        if(!cache->Open(aFilename, mGeometryMemory == 0))
         {
-            BackgroundLight *l = new BackgroundLight;
+            printf("%s is not a scene cache of version %d\n", aFilename, SceneCache::kVersion);
+            delete cache;
+            return false;
+        }
+
+        delete mCache;
+        mCache = cache;
+
+        const SceneCache::Header &header = cache->GetHeader();
+
+        // Set up Embree
+        _device = rtcNewDevice(NULL);
+        _embreeScene = rtcNewScene(_device);
+
+        std::string filename(aFilename);
+        const size_t slash = filename.find_last_of("/\\");
+        if(slash != std::string::npos)
+            filename = filename.substr(slash + 1);
+
+        mSceneName    = std::string(header.mSceneName) + " ";
+        mSceneAcronym = filename.substr(0, filename.find_last_of('.'));
+
+        // Materials
+        const SceneCache::MaterialRecord *materials =
+            cache->GetSection<SceneCache::MaterialRecord>(SceneCache::kMaterials);
+
+        for(uint i=0; i<header.mMaterialCount; i++)
+        {
+            Material mat;
+            mat.mDiffuseReflectance = materials[i].mDiffuseReflectance;
+            mat.mPhongReflectance   = materials[i].mPhongReflectance;
+            mat.mPhongExponent      = materials[i].mPhongExponent;
+            mMaterials.push_back(mat);
+        }
+
+        // Geometry
+        StreamedMesh *mesh = mArena.Create<StreamedMesh>(SceneArena::kPoolMeshes, cache, mGeometryMemory);
+        mGeometry = mStreamedMesh = mesh;
+        mMesh = NULL;
+
+        for(int i=0; i<mesh->GetClusterCount(); i++)
+        {
+            if(TriangleMesh *cluster = mesh->GetInPlaceCluster(i))
+                CreateMeshInstance(_embreeScene, _device, cluster);
+        }
+
+        // Lights
+        const SceneCache::LightRecord *lights =
+            cache->GetSection<SceneCache::LightRecord>(SceneCache::kLights);
+        const Vec3f *emitters = cache->GetSection<Vec3f>(SceneCache::kEmitters);
+
+        for(uint i=0; i<header.mLightCount; i++)
+        {
+            MeshLight *light = mArena.Create<MeshLight>(SceneArena::kPoolLights);
+            light->mRadiance = lights[i].mRadiance;
+
+            for(uint j=0; j<lights[i].mEmitterCount; j++)
+            {
+                const Vec3f *vertices = emitters + 3 * (lights[i].mFirstEmitter + j);
+                light->AddTriangle(vertices[0], vertices[1], vertices[2]);
+            }
+
+            light->Finalize();
+            mMaterial2Light.insert(std::make_pair(lights[i].mMaterialID, (int)mLights.size()));
+            mLights.push_back(light);
+        }
+
+        if(header.mFlags & SceneCache::kFlagBackground)
+        {
+            BackgroundLight *l = mArena.Create<BackgroundLight>(SceneArena::kPoolLights);
+
+            if(!mEnvMapFile.empty() && !l->LoadEnvMap(mEnvMapFile.c_str()))
+                printf("Could not load environment map %s, using constant background\n", mEnvMapFile.c_str());
+
             mLights.push_back(l);
             mBackground = l;
         }
+
+        BuildSceneData();
+
+        mCamera.Setup(header.mCameraPosition, header.mCameraForward, header.mCameraUp,
+            Vec2f(float(aResolution.x), float(aResolution.y)), header.mCameraFOV);
+
+        char paging[64];
+        if(mGeometryMemory > 0)
+            sprintf(paging, "paged in with %.1f MB", mesh->GetMemoryLimit() / (1024.f * 1024.f));
+        else
+            strcpy(paging, "traced in place");
+
+        printf("Cache:     %d triangles, %d vertices, %d materials, %d lights, %.1f MB mapped,\n"
+               "           %d clusters %s, loaded in %.3f s\n",
+            int(header.mTriangleCount), int(header.mVertexCount), (int)mMaterials.size(), (int)mLights.size(),
+            cache->GetFileSize() / (1024.f * 1024.f), mesh->GetClusterCount(), paging,
+            omp_get_wtime() - loadStart);
+
+        return true;
+    }
+
+    // Writes the scene to a cache for LoadCache, only scenes made of one
+    // mesh lit by its mesh lights or the background can be baked
+    bool SaveCache(const char *aFilename) const
+    {
+        if(!mMesh)
+        {
+            printf("Only scenes of one uncompressed mesh file can be baked\n");
+            return false;
+        }
+
+        // the cache has no texture coordinates
+        if(mTextures.GetTextureCount() > 0)
+        {
+            printf("Textured scenes cannot be baked\n");
+            return false;
+        }
+
+        SceneCache::Contents contents;
+        contents.mCameraPosition = mCamera.mPosition;
+        contents.mCameraForward  = mCamera.mForward;
+        contents.mCameraUp       = mCamera.mUp;
+        contents.mCameraFOV      = mCamera.mHorizontalFOV;
+        contents.mSceneName      = mSceneName.substr(0, mSceneName.find_last_not_of(' ') + 1);
+        contents.mMesh           = mMesh;
+
+        for(size_t i=0; i<mMaterials.size(); i++)
+        {
+            SceneCache::MaterialRecord record;
+            record.mDiffuseReflectance = mMaterials[i].mDiffuseReflectance;
+            record.mPhongReflectance   = mMaterials[i].mPhongReflectance;
+            record.mPhongExponent      = mMaterials[i].mPhongExponent;
+            contents.mMaterials.push_back(record);
+        }
+
+        // the emissive triangles of each material, by their primitive ID
+        const TriangleMesh::Arrays &arrays = mMesh->GetArrays();
+        std::map<int, std::vector<int> > emitters;
+        for(int i=0; i<arrays.mTriangleCount; i++)
+        {
+            if(arrays.mPrimIDs[i] < 0)
+                continue;
+
+            std::vector<int> &triangles = emitters[arrays.mMatIDs[i]];
+            if((int)triangles.size() <= arrays.mPrimIDs[i])
+                triangles.resize(arrays.mPrimIDs[i] + 1, -1);
+            triangles[arrays.mPrimIDs[i]] = i;
+        }
+
+        for(size_t i=0; i<mLights.size(); i++)
+        {
+            if(mLights[i] == mBackground)
+            {
+                contents.mFlags |= SceneCache::kFlagBackground;
+                continue;
+            }
+
+            int matID = -1;
+            for(std::map<int, int>::const_iterator it = mMaterial2Light.begin(); it != mMaterial2Light.end(); ++it)
+            {
+                if(it->second == (int)i)
+                    matID = it->first;
+            }
+
+            if(mLights[i]->GetType() != AbstractLight::kMesh || matID < 0)
+            {
+                printf("Only mesh lights and the background can be baked\n");
+                return false;
+            }
+
+            const std::vector<int> &triangles = emitters[matID];
+
+            SceneCache::LightRecord record;
+            record.mMaterialID   = matID;
+            record.mFirstEmitter = uint(contents.mEmitters.size());
+            record.mEmitterCount = uint(triangles.size());
+            record.mRadiance     = static_cast<const MeshLight*>(mLights[i])->mRadiance;
+            contents.mLights.push_back(record);
+
+            contents.mEmitters.insert(contents.mEmitters.end(), triangles.begin(), triangles.end());
+        }
+
+        return SceneCache::Write(aFilename, contents);
     }
 
     static std::string GetSceneName(
@@ -461,13 +1407,29 @@ public:
 
 public:
 
+    SceneArena            mArena;   //!< Owns the geometry and lights below
     AbstractGeometry      *mGeometry;
+    TriangleMesh          *mMesh;   //!< The geometry of scenes loaded from an .obj or .ply file, NULL otherwise or when compressed
+    std::vector<TriangleMesh*> mPrototypes; //!< Shared by the instances in mGeometry
+    StreamedMesh          *mStreamedMesh; //!< The geometry of a scene cache, NULL otherwise
+    SceneCache            *mCache;  //!< Mapped file the mesh is traced from, NULL when none
+    size_t                mGeometryMemory; //!< Bytes of scene cache clusters kept in memory, 0 traces them in place
+    bool                  mCompressMeshes; //!< Loaded meshes are traced as CompressedMesh
     Camera                mCamera;
     std::vector<Material> mMaterials;
+    TextureCache          mTextures;
     std::vector<AbstractLight*>   mLights;
     std::map<int, int>    mMaterial2Light;
-    // SceneSphere           mSceneSphere;
+    SceneSphere           mSceneSphere;
+    AbstractLightSampler  *mLightSampler;
+    LightStorage          mLightStorage;
+    LightSamplerType      mLightSamplerType;
     BackgroundLight*      mBackground;
+    int                   mBackgroundID;
+    AbstractMedium*       mMedium;
+    std::string           mEnvMapFile;
+    Vec3f                 mBBoxMin;
+    Vec3f                 mBBoxMax;
 
     std::string           mSceneName;
     std::string           mSceneAcronym;
@@ -0,0 +1,405 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include "math.hxx"
+#include "mesh.hxx"
+#include "mappedfile.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Binary scene cache
+//
+// Holds a scene made of one triangle mesh in the layout the renderer
+// traces it in, so loading it is mapping the file: the mesh is traced in
+// place, only the few materials and the emissive triangles of the mesh
+// lights are copied out.
+//
+// The mesh is stored as spatial clusters, the subtrees of its BVH with at
+// most kClusterTriangles triangles. Each cluster is a small mesh of its own,
+// with its vertices, triangles and BVH nodes next to each other in the
+// file, the vertices it shares with other clusters repeated. The nodes of
+// the BVH above the clusters form a hierarchy with one cluster per leaf.
+// So a cluster can be read on its own, StreamedMesh keeps only the top
+// hierarchy in memory and pages the clusters in as the rays reach them.
+//
+// The file starts with a Header, followed by the sections it lists and the
+// clusters, each 64 byte aligned. The data are in the byte order of the
+// machine that baked the file, Open rejects a file of another byte order
+// or version.
+
+class SceneCache
+{
+public:
+
+    static const uint kVersion   = 2;
+    static const uint kByteOrder = 0x01020304;
+    static const uint kAlignment = 64;
+    static const int  kClusterTriangles = 4096; //!< Most triangles of a cluster
+
+    enum Flags
+    {
+        kFlagBackground = 1  //!< The scene is lit by the background
+    };
+
+    enum Section
+    {
+        kMaterials, //!< MaterialRecord per material
+        kLights,    //!< LightRecord per mesh light
+        kEmitters,  //!< Three vertices per triangle of the mesh lights, in the order of their primitive IDs
+        kClusters,  //!< ClusterRecord per cluster
+        kTopNodes,  //!< Hierarchy over the clusters, the entry of a leaf is a cluster
+        kSectionCount
+    };
+
+    // Arrays of a cluster, at these offsets from its start
+    enum ClusterPart
+    {
+        kPartVertices,
+        kPartIndices,
+        kPartMatIDs,
+        kPartPrimIDs,
+        kPartNodes,
+        kPartCount
+    };
+
+    struct Header
+    {
+        char  mMagic[4];  //!< PG3S
+        uint  mVersion;
+        uint  mByteOrder;
+        uint  mFlags;
+        uint  mMaterialCount;
+        uint  mLightCount;
+        uint  mEmitterCount;
+        uint  mClusterCount;
+        uint  mTopNodeCount;
+        uint  mTriangleCount;
+        uint  mVertexCount; //!< Of all clusters, the shared ones counted in each
+        Vec3f mCameraPosition;
+        Vec3f mCameraForward;
+        Vec3f mCameraUp;
+        float mCameraFOV;
+        char  mSceneName[64];
+        unsigned long long mSections[kSectionCount]; //!< Byte offsets from the file start
+    };
+
+    struct MaterialRecord
+    {
+        Vec3f mDiffuseReflectance;
+        Vec3f mPhongReflectance;
+        float mPhongExponent;
+    };
+
+    struct LightRecord
+    {
+        int   mMaterialID;
+        uint  mFirstEmitter;
+        uint  mEmitterCount;
+        Vec3f mRadiance;
+    };
+
+    struct ClusterRecord
+    {
+        Vec3f mBBoxMin;
+        uint  mVertexCount;
+        Vec3f mBBoxMax;
+        uint  mTriangleCount;
+        uint  mNodeCount;
+        uint  mReserved;
+        unsigned long long mOffset; //!< Of the cluster from the file start
+    };
+
+    // Everything a cache is written from
+    struct Contents
+    {
+        Contents() :
+            mFlags(0), mCameraFOV(45.f), mMesh(NULL)
+        {}
+
+        uint                        mFlags;
+        Vec3f                       mCameraPosition;
+        Vec3f                       mCameraForward;
+        Vec3f                       mCameraUp;
+        float                       mCameraFOV;
+        std::string                 mSceneName;
+        std::vector<MaterialRecord> mMaterials;
+        std::vector<LightRecord>    mLights;
+        std::vector<int>            mEmitters; //!< Triangles of mMesh
+        const TriangleMesh          *mMesh;    //!< Built
+    };
+
+    SceneCache() :
+        mHeader(NULL)
+    {}
+
+    static bool Write(
+        const char     *aFilename,
+        const Contents &aContents)
+    {
+        std::ofstream file(aFilename, std::ios::binary);
+        if(!file)
+            return false;
+
+        const TriangleMesh::Arrays &arrays = aContents.mMesh->GetArrays();
+
+        std::vector<TriangleMesh::Node> topNodes;
+        std::vector<int> clusterRoots;
+        std::vector<std::pair<int, int> > clusterTriangles;
+        TriangleMesh::BuildClusters(arrays, kClusterTriangles, topNodes, clusterRoots, clusterTriangles);
+
+        std::vector<Vec3f> emitters;
+        for(size_t i=0; i<aContents.mEmitters.size(); i++)
+        {
+            const Vec3i &tri = arrays.mIndices[aContents.mEmitters[i]];
+            emitters.push_back(arrays.mVertices[tri.x]);
+            emitters.push_back(arrays.mVertices[tri.y]);
+            emitters.push_back(arrays.mVertices[tri.z]);
+        }
+
+        Header header = Header();
+        memcpy(header.mMagic, "PG3S", 4);
+        header.mVersion        = kVersion;
+        header.mByteOrder      = kByteOrder;
+        header.mFlags          = aContents.mFlags;
+        header.mMaterialCount  = uint(aContents.mMaterials.size());
+        header.mLightCount     = uint(aContents.mLights.size());
+        header.mEmitterCount   = uint(aContents.mEmitters.size());
+        header.mClusterCount   = uint(clusterRoots.size());
+        header.mTopNodeCount   = uint(topNodes.size());
+        header.mTriangleCount  = uint(arrays.mTriangleCount);
+        header.mCameraPosition = aContents.mCameraPosition;
+        header.mCameraForward  = aContents.mCameraForward;
+        header.mCameraUp       = aContents.mCameraUp;
+        header.mCameraFOV      = aContents.mCameraFOV;
+        strncpy(header.mSceneName, aContents.mSceneName.c_str(), sizeof(header.mSceneName) - 1);
+
+        size_t sizes[kSectionCount];
+        GetSectionSizes(header, sizes);
+
+        unsigned long long offset = Align(sizeof(Header));
+        for(int i=0; i<kSectionCount; i++)
+        {
+            header.mSections[i] = offset;
+            offset = Align(offset + sizes[i]);
+        }
+
+        // the clusters follow the sections, one at a time so the mesh is
+        // not copied as a whole, their records are written at the end
+        std::vector<ClusterRecord> clusters(clusterRoots.size());
+        std::vector<int> vertexMap(arrays.mVertexCount, -1);
+        TriangleMesh::Cluster cluster;
+
+        file.seekp(std::streamoff(offset));
+        for(size_t i=0; i<clusterRoots.size(); i++)
+        {
+            TriangleMesh::ExtractCluster(arrays, clusterRoots[i], clusterTriangles[i], vertexMap, cluster);
+
+            ClusterRecord &record = clusters[i];
+            record = ClusterRecord();
+            record.mBBoxMin       = arrays.mNodes[clusterRoots[i]].mBBoxMin;
+            record.mBBoxMax       = arrays.mNodes[clusterRoots[i]].mBBoxMax;
+            record.mVertexCount   = uint(cluster.mVertices.size());
+            record.mTriangleCount = uint(cluster.mIndices.size());
+            record.mNodeCount     = uint(cluster.mNodes.size());
+            record.mOffset        = offset;
+            header.mVertexCount  += record.mVertexCount;
+
+            size_t parts[kPartCount];
+            const size_t size = GetClusterLayout(record, parts);
+
+            const void *data[kPartCount] =
+            {
+                &cluster.mVertices[0], &cluster.mIndices[0], &cluster.mMatIDs[0],
+                &cluster.mPrimIDs[0], &cluster.mNodes[0]
+            };
+            const size_t dataSizes[kPartCount] =
+            {
+                cluster.mVertices.size() * sizeof(Vec3f), cluster.mIndices.size() * sizeof(Vec3i),
+                cluster.mMatIDs.size() * sizeof(int), cluster.mPrimIDs.size() * sizeof(int),
+                cluster.mNodes.size() * sizeof(TriangleMesh::Node)
+            };
+
+            for(int j=0; j<kPartCount; j++)
+            {
+                Pad(file, offset + parts[j]);
+                file.write((const char*)data[j], dataSizes[j]);
+            }
+
+            offset = Align(offset + size);
+        }
+        Pad(file, offset);
+
+        const void *sections[kSectionCount] =
+        {
+            aContents.mMaterials.empty() ? NULL : &aContents.mMaterials[0],
+            aContents.mLights.empty()    ? NULL : &aContents.mLights[0],
+            emitters.empty()             ? NULL : &emitters[0],
+            clusters.empty()             ? NULL : &clusters[0],
+            topNodes.empty()             ? NULL : &topNodes[0]
+        };
+
+        file.seekp(0);
+        file.write((const char*)&header, sizeof(header));
+
+        for(int i=0; i<kSectionCount; i++)
+        {
+            Pad(file, header.mSections[i]);
+            if(sizes[i] > 0)
+                file.write((const char*)sections[i], sizes[i]);
+        }
+
+        return bool(file);
+    }
+
+    // Maps the file and checks that it is a complete cache of this version.
+    // aPrefetch starts reading the whole file, it is left out when the
+    // clusters are paged in on demand.
+    bool Open(
+        const char *aFilename,
+        bool       aPrefetch = true)
+    {
+        mHeader = NULL;
+        if(!mFile.Open(aFilename, aPrefetch) || mFile.GetSize() < sizeof(Header))
+            return false;
+
+        const Header *header = (const Header*)mFile.GetData();
+        if(memcmp(header->mMagic, "PG3S", 4) != 0 || header->mVersion != kVersion ||
+            header->mByteOrder != kByteOrder)
+            return false;
+
+        size_t sizes[kSectionCount];
+        GetSectionSizes(*header, sizes);
+
+        for(int i=0; i<kSectionCount; i++)
+        {
+            if(header->mSections[i] % kAlignment != 0 ||
+                header->mSections[i] + sizes[i] > mFile.GetSize())
+                return false;
+        }
+
+        mHeader = header;
+
+        const ClusterRecord *clusters = GetSection<ClusterRecord>(kClusters);
+        for(uint i=0; i<header->mClusterCount; i++)
+        {
+            size_t parts[kPartCount];
+            if(clusters[i].mOffset % kAlignment != 0 ||
+                clusters[i].mOffset + GetClusterLayout(clusters[i], parts) > mFile.GetSize())
+            {
+                mHeader = NULL;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    const Header& GetHeader() const
+    {
+        return *mHeader;
+    }
+
+    template<typename T>
+    const T* GetSection(Section aSection) const
+    {
+        return (const T*)(mFile.GetData() + mHeader->mSections[aSection]);
+    }
+
+    const ClusterRecord& GetCluster(int aCluster) const
+    {
+        return GetSection<ClusterRecord>(kClusters)[aCluster];
+    }
+
+    // The cluster in the mapping, GetClusterSize bytes
+    const char* GetClusterData(int aCluster) const
+    {
+        return mFile.GetData() + GetCluster(aCluster).mOffset;
+    }
+
+    size_t GetClusterSize(int aCluster) const
+    {
+        size_t parts[kPartCount];
+        return GetClusterLayout(GetCluster(aCluster), parts);
+    }
+
+    // Drops the pages of a cluster from memory once it is copied out
+    void ReleaseClusterData(int aCluster) const
+    {
+        mFile.Release(size_t(GetCluster(aCluster).mOffset), GetClusterSize(aCluster));
+    }
+
+    // Mesh arrays of a cluster at aData, in the mapping or a copy of it
+    static TriangleMesh::Arrays GetClusterArrays(
+        const ClusterRecord &aRecord,
+        const char          *aData)
+    {
+        size_t parts[kPartCount];
+        GetClusterLayout(aRecord, parts);
+
+        TriangleMesh::Arrays arrays;
+        arrays.mVertices      = (const Vec3f*)(aData + parts[kPartVertices]);
+        arrays.mIndices       = (const Vec3i*)(aData + parts[kPartIndices]);
+        arrays.mMatIDs        = (const int*)(aData + parts[kPartMatIDs]);
+        arrays.mPrimIDs       = (const int*)(aData + parts[kPartPrimIDs]);
+        arrays.mNodes         = (const TriangleMesh::Node*)(aData + parts[kPartNodes]);
+        arrays.mTexCoords     = NULL;
+        arrays.mTexIndices    = NULL;
+        arrays.mVertexCount   = int(aRecord.mVertexCount);
+        arrays.mTriangleCount = int(aRecord.mTriangleCount);
+        arrays.mNodeCount     = int(aRecord.mNodeCount);
+        arrays.mTexCoordCount = 0;
+        return arrays;
+    }
+
+    size_t GetFileSize() const
+    {
+        return mFile.GetSize();
+    }
+
+private:
+
+    // Offsets of the arrays of a cluster, returns its size in bytes
+    static size_t GetClusterLayout(
+        const ClusterRecord &aRecord,
+        size_t              oParts[kPartCount])
+    {
+        // the vertices are followed by 16 bytes at least for Embree
+        oParts[kPartVertices] = 0;
+        oParts[kPartIndices]  = size_t(Align(aRecord.mVertexCount * sizeof(Vec3f) + 16));
+        oParts[kPartMatIDs]   = size_t(Align(oParts[kPartIndices] + aRecord.mTriangleCount * sizeof(Vec3i)));
+        oParts[kPartPrimIDs]  = size_t(Align(oParts[kPartMatIDs]  + aRecord.mTriangleCount * sizeof(int)));
+        oParts[kPartNodes]    = size_t(Align(oParts[kPartPrimIDs] + aRecord.mTriangleCount * sizeof(int)));
+        return oParts[kPartNodes] + aRecord.mNodeCount * sizeof(TriangleMesh::Node);
+    }
+
+    static unsigned long long Align(unsigned long long aOffset)
+    {
+        return (aOffset + kAlignment - 1) / kAlignment * kAlignment;
+    }
+
+    static void Pad(std::ofstream &aoFile, unsigned long long aOffset)
+    {
+        static const char zeros[kAlignment] = {};
+        const unsigned long long position = (unsigned long long)aoFile.tellp();
+        if(aOffset > position)
+            aoFile.write(zeros, size_t(aOffset - position));
+    }
+
+    static void GetSectionSizes(
+        const Header &aHeader,
+        size_t       oSizes[kSectionCount])
+    {
+        oSizes[kMaterials] = aHeader.mMaterialCount * sizeof(MaterialRecord);
+        oSizes[kLights]    = aHeader.mLightCount    * sizeof(LightRecord);
+        oSizes[kEmitters]  = aHeader.mEmitterCount  * 3 * sizeof(Vec3f);
+        oSizes[kClusters]  = aHeader.mClusterCount  * sizeof(ClusterRecord);
+        oSizes[kTopNodes]  = aHeader.mTopNodeCount  * sizeof(TriangleMesh::Node);
+    }
+
+private:
+
+    MappedFile   mFile;
+    const Header *mHeader; //!< Start of the mapping, NULL until opened
+};
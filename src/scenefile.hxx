@@ -0,0 +1,974 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Declarative scene description
+//
+// A text file with one statement per line, a keyword followed by named
+// attributes and their values. # starts a comment, file names with spaces
+// are quoted and relative to the scene file.
+//
+//   camera     position x y z  (forward x y z | target x y z)  [up x y z]  [fov degrees]
+//   render     [resolution w h] [algorithm el|di|pt|bpt|ppm|vcm] [iterations n] [time s]
+//              [light_samples n] [light_sampler power|bvh] [sampler name]
+//              [max_path_length n] [output file]
+//   material   <name> [diffuse r g b] [phong r g b] [exponent e] [emission r g b]
+//              [diffuse_map <image>] [phong_map <image>] [exponent_map <image>]
+//   triangle   material <name> p0 x y z p1 x y z p2 x y z [uv u0 v0 u1 v1 u2 v2]
+//   quad       material <name> p0 x y z p1 x y z p2 x y z p3 x y z [uv u0 v0 .. u3 v3]
+//   sphere     material <name> center x y z radius r
+//   mesh       file <obj or ply file> [material <name>]
+//   prototype  <name> file <obj or ply file> [material <name>]
+//   instance   <prototype> [material <name>] [scale x y z] [rotate x y z degrees] [translate x y z]
+//   instance   <prototype> [material <name>] matrix <3x4 row major>
+//   point      position x y z intensity r g b
+//   background [color r g b] [envmap <hdr file>]
+//   medium     homogeneous [absorption r g b] [scattering r g b] [g anisotropy]
+//   medium     heterogeneous [albedo r g b] [density d] [g anisotropy] [grid <grid file>]
+//
+// Load parses and validates the whole file, so the scene is built from it
+// without further checks: materials are referenced by index, the files
+// exist and the values are in range. The triangles and quads of materials
+// with an emission form one mesh light per material, a mesh without a
+// material keeps the materials of its file. A prototype is a mesh that is
+// only loaded once and placed by its instances, scaled, then rotated around
+// the axis, then translated, or by the rows of an affine matrix. Instances
+// cannot emit, a prototype must not have emissive materials and the
+// material of an instance replaces all of them. The maps of a material are
+// .bmp or .hdr images scaling its colors and exponent, a map without its
+// color scales white. A triangle without uv is mapped to (0,0) (1,0) (0,1),
+// a quad to the corners of the texture. The medium density is the optical
+// thickness over the scene radius. The render settings are only stored,
+// Config takes them as defaults the command line overrides.
+
+class SceneDescription
+{
+public:
+
+    struct MaterialDesc
+    {
+        std::string mName;
+        Vec3f       mDiffuse;
+        Vec3f       mPhong;
+        float       mExponent;
+        Vec3f       mEmission;
+        std::string mDiffuseMap;  //!< Image files of the textures, none when empty
+        std::string mPhongMap;
+        std::string mExponentMap;
+    };
+
+    struct ShapeDesc
+    {
+        enum Type
+        {
+            kTriangle,
+            kQuad,
+            kSphere,
+            kMesh
+        };
+
+        Type        mType;
+        int         mMaterial;  //!< Index into mMaterials, -1 for a mesh with its own materials
+        Vec3f       mPoints[4]; //!< Corners, the center of a sphere
+        Vec2f       mTexCoords[4]; //!< Of the corners
+        float       mRadius;
+        std::string mFile;      //!< Of a mesh
+    };
+
+    struct PrototypeDesc
+    {
+        std::string mName;
+        std::string mFile;
+        int         mMaterial;  //!< Index into mMaterials, -1 for the materials of the file
+    };
+
+    struct InstanceDesc
+    {
+        int         mPrototype; //!< Index into mPrototypes
+        int         mMaterial;  //!< Index into mMaterials, -1 for those of the prototype
+        Mat4f       mTransform; //!< Object to world, affine and invertible
+    };
+
+    struct PointLightDesc
+    {
+        Vec3f mPosition;
+        Vec3f mIntensity;
+    };
+
+    struct MediumDesc
+    {
+        enum Type
+        {
+            kNone,
+            kHomogeneous,
+            kHeterogeneous
+        };
+
+        Type        mType;
+        Vec3f       mAbsorption; //!< Homogeneous
+        Vec3f       mScattering; //!< Homogeneous
+        Vec3f       mAlbedo;     //!< Heterogeneous
+        float       mDensity;    //!< Heterogeneous, optical thickness over the scene radius
+        float       mAnisotropy;
+        std::string mGridFile;   //!< Heterogeneous, a procedural cloud when empty
+    };
+
+    // Unset settings are empty or 0
+    struct RenderSettings
+    {
+        Vec2i       mResolution;
+        std::string mAlgorithm;
+        int         mIterations;
+        float       mMaxTime;
+        int         mLightSamples;
+        std::string mLightSampler;
+        std::string mSampler;
+        int         mMaxPathLength;
+        std::string mOutputName;
+    };
+
+    SceneDescription()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        mFilename.clear();
+        mMaterials.clear();
+        mShapes.clear();
+        mPrototypes.clear();
+        mInstances.clear();
+        mPointLights.clear();
+
+        mHasCamera      = false;
+        mCameraPosition = Vec3f(0);
+        mCameraForward  = Vec3f(0, 1, 0);
+        mCameraUp       = Vec3f(0, 0, 1);
+        mCameraFOV      = 45.f;
+
+        mHasBackground   = false;
+        mBackgroundColor = Vec3f(135, 206, 250) / Vec3f(255.f);
+        mEnvMapFile.clear();
+
+        mMedium.mType       = MediumDesc::kNone;
+        mMedium.mAbsorption = Vec3f(0.05f);
+        mMedium.mScattering = Vec3f(0.5f);
+        mMedium.mAlbedo     = Vec3f(0.9f);
+        mMedium.mDensity    = 10.f;
+        mMedium.mAnisotropy = 0.f;
+        mMedium.mGridFile.clear();
+
+        mSettings.mResolution    = Vec2i(0);
+        mSettings.mAlgorithm.clear();
+        mSettings.mIterations    = 0;
+        mSettings.mMaxTime       = 0.f;
+        mSettings.mLightSamples  = 0;
+        mSettings.mLightSampler.clear();
+        mSettings.mSampler.clear();
+        mSettings.mMaxPathLength = 0;
+        mSettings.mOutputName.clear();
+
+        mHasRender = false;
+    }
+
+    // Parses and validates the file, prints the first error
+    bool Load(const char *aFilename)
+    {
+        Clear();
+
+        std::ifstream file(aFilename);
+        if(!file)
+        {
+            printf("Could not open %s\n", aFilename);
+            return false;
+        }
+
+        mFilename = aFilename;
+
+        const size_t slash = mFilename.find_last_of("/\\");
+        mDirectory = slash == std::string::npos ? std::string() : mFilename.substr(0, slash + 1);
+
+        std::string text;
+        for(mLine = 1; std::getline(file, text); mLine++)
+        {
+            Statement statement;
+            if(!statement.Tokenize(text))
+                return Error("Unterminated quote");
+
+            if(statement.IsEmpty())
+                continue;
+
+            if(!ParseStatement(statement))
+                return false;
+        }
+
+        mLine = 0;
+        return Validate();
+    }
+
+    static bool IsDescriptionFile(const std::string &aFilename)
+    {
+        const size_t dot = aFilename.find_last_of('.');
+        return dot != std::string::npos && aFilename.substr(dot) == ".scene";
+    }
+
+public:
+
+    std::string                 mFilename;
+    std::vector<MaterialDesc>   mMaterials;
+    std::vector<ShapeDesc>      mShapes;
+    std::vector<PrototypeDesc>  mPrototypes;
+    std::vector<InstanceDesc>   mInstances;
+    std::vector<PointLightDesc> mPointLights;
+
+    bool                        mHasCamera;
+    Vec3f                       mCameraPosition;
+    Vec3f                       mCameraForward;
+    Vec3f                       mCameraUp;
+    float                       mCameraFOV;
+
+    bool                        mHasBackground;
+    Vec3f                       mBackgroundColor;
+    std::string                 mEnvMapFile;  //!< Of the background, none when empty
+
+    MediumDesc                  mMedium;
+    RenderSettings              mSettings;
+
+private:
+
+    //////////////////////////////////////////////////////////////////////////
+    // The tokens of one line and the attributes found in them
+
+    class Statement
+    {
+    public:
+
+        // Splits at white space, keeps quoted tokens together and
+        // drops the comment
+        bool Tokenize(const std::string &aText)
+        {
+            mTokens.clear();
+
+            size_t i = 0;
+            while(i < aText.size())
+            {
+                const char c = aText[i];
+
+                if(c == '#')
+                    break;
+
+                if(c == ' ' || c == '\t' || c == '\r')
+                {
+                    i++;
+                    continue;
+                }
+
+                if(c == '"')
+                {
+                    const size_t end = aText.find('"', i + 1);
+                    if(end == std::string::npos)
+                        return false;
+
+                    mTokens.push_back(aText.substr(i + 1, end - i - 1));
+                    i = end + 1;
+                    continue;
+                }
+
+                const size_t end = aText.find_first_of(" \t\r#", i);
+                mTokens.push_back(aText.substr(i, end == std::string::npos ? std::string::npos : end - i));
+                i = end == std::string::npos ? aText.size() : end;
+            }
+
+            return true;
+        }
+
+        bool IsEmpty() const
+        {
+            return mTokens.empty();
+        }
+
+        const std::string& GetToken(size_t aIndex) const
+        {
+            return mTokens[aIndex];
+        }
+
+        size_t GetTokenCount() const
+        {
+            return mTokens.size();
+        }
+
+        // Groups the tokens from aFirst on into attributes. aSpec lists the
+        // allowed ones with their value counts, "position 3 fov 1".
+        bool Split(
+            size_t      aFirst,
+            const char  *aSpec,
+            std::string &oError)
+        {
+            std::map<std::string, int> counts;
+            std::istringstream spec(aSpec);
+            std::string name;
+            int count;
+            while(spec >> name >> count)
+                counts[name] = count;
+
+            for(size_t i=aFirst; i<mTokens.size(); )
+            {
+                const std::map<std::string, int>::const_iterator it = counts.find(mTokens[i]);
+                if(it == counts.end())
+                {
+                    oError = "Unknown attribute " + mTokens[i];
+                    return false;
+                }
+
+                if(mAttributes.count(it->first))
+                {
+                    oError = "Repeated attribute " + it->first;
+                    return false;
+                }
+
+                if(i + it->second >= mTokens.size())
+                {
+                    oError = "Missing values of " + it->first;
+                    return false;
+                }
+
+                mAttributes[it->first] = i + 1;
+                i += it->second + 1;
+            }
+
+            return true;
+        }
+
+        bool Has(const char *aName) const
+        {
+            return mAttributes.count(aName) > 0;
+        }
+
+        // Reads the values of an attribute, returns false when they are not
+        // numbers. An absent attribute keeps the given values.
+        bool GetFloats(
+            const char *aName,
+            float      *aoValues,
+            int        aCount) const
+        {
+            const std::map<std::string, size_t>::const_iterator it = mAttributes.find(aName);
+            if(it == mAttributes.end())
+                return true;
+
+            for(int i=0; i<aCount; i++)
+            {
+                const std::string &token = mTokens[it->second + i];
+                char *end;
+                aoValues[i] = (float)strtod(token.c_str(), &end);
+                if(end != token.c_str() + token.size() || !std::isfinite(aoValues[i]))
+                    return false;
+            }
+
+            return true;
+        }
+
+        bool GetVec3(const char *aName, Vec3f &aoValue) const
+        {
+            return GetFloats(aName, &aoValue.x, 3);
+        }
+
+        bool GetFloat(const char *aName, float &aoValue) const
+        {
+            return GetFloats(aName, &aoValue, 1);
+        }
+
+        bool GetInt(const char *aName, int &aoValue) const
+        {
+            float value = float(aoValue);
+            if(!GetFloats(aName, &value, 1) || value != std::floor(value))
+                return false;
+            aoValue = int(value);
+            return true;
+        }
+
+        void GetString(const char *aName, std::string &aoValue) const
+        {
+            const std::map<std::string, size_t>::const_iterator it = mAttributes.find(aName);
+            if(it != mAttributes.end())
+                aoValue = mTokens[it->second];
+        }
+
+    private:
+
+        std::vector<std::string>      mTokens;
+        std::map<std::string, size_t> mAttributes; //!< Index of the first value
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // Statements
+
+    bool ParseStatement(Statement &aoStatement)
+    {
+        const std::string &keyword = aoStatement.GetToken(0);
+
+        if(keyword == "camera")
+            return ParseCamera(aoStatement);
+        if(keyword == "render")
+            return ParseRender(aoStatement);
+        if(keyword == "material")
+            return ParseMaterial(aoStatement);
+        if(keyword == "triangle" || keyword == "quad" || keyword == "sphere" || keyword == "mesh")
+            return ParseShape(aoStatement);
+        if(keyword == "prototype")
+            return ParsePrototype(aoStatement);
+        if(keyword == "instance")
+            return ParseInstance(aoStatement);
+        if(keyword == "point")
+            return ParsePointLight(aoStatement);
+        if(keyword == "background")
+            return ParseBackground(aoStatement);
+        if(keyword == "medium")
+            return ParseMedium(aoStatement);
+
+        return Error("Unknown statement " + keyword);
+    }
+
+    bool ParseCamera(Statement &aoStatement)
+    {
+        std::string error;
+        if(!aoStatement.Split(1, "position 3 forward 3 target 3 up 3 fov 1", error))
+            return Error(error);
+
+        if(mHasCamera)
+            return Error("Repeated camera");
+        if(!aoStatement.Has("position"))
+            return Error("The camera needs a position");
+        if(aoStatement.Has("forward") == aoStatement.Has("target"))
+            return Error("The camera needs either a forward direction or a target");
+
+        Vec3f target(0);
+        if(!aoStatement.GetVec3("position", mCameraPosition) ||
+            !aoStatement.GetVec3("forward", mCameraForward) ||
+            !aoStatement.GetVec3("target", target) ||
+            !aoStatement.GetVec3("up", mCameraUp) ||
+            !aoStatement.GetFloat("fov", mCameraFOV))
+            return Error("Invalid camera value");
+
+        if(aoStatement.Has("target"))
+            mCameraForward = target - mCameraPosition;
+
+        if(mCameraForward.LenSqr() == 0.f || Cross(mCameraForward, mCameraUp).LenSqr() == 0.f)
+            return Error("The camera forward direction is zero or along the up direction");
+        if(mCameraFOV <= 0.f || mCameraFOV >= 180.f)
+            return Error("The camera fov is not between 0 and 180 degrees");
+
+        mHasCamera = true;
+        return true;
+    }
+
+    bool ParseRender(Statement &aoStatement)
+    {
+        std::string error;
+        if(!aoStatement.Split(1, "resolution 2 algorithm 1 iterations 1 time 1 light_samples 1 "
+            "light_sampler 1 sampler 1 max_path_length 1 output 1", error))
+            return Error(error);
+
+        if(mHasRender)
+            return Error("Repeated render settings");
+
+        RenderSettings &settings = mSettings;
+
+        float resolution[2] = { 0.f, 0.f };
+        if(!aoStatement.GetFloats("resolution", resolution, 2) ||
+            !aoStatement.GetInt("iterations", settings.mIterations) ||
+            !aoStatement.GetFloat("time", settings.mMaxTime) ||
+            !aoStatement.GetInt("light_samples", settings.mLightSamples) ||
+            !aoStatement.GetInt("max_path_length", settings.mMaxPathLength))
+            return Error("Invalid render setting value");
+
+        aoStatement.GetString("algorithm", settings.mAlgorithm);
+        aoStatement.GetString("light_sampler", settings.mLightSampler);
+        aoStatement.GetString("sampler", settings.mSampler);
+        aoStatement.GetString("output", settings.mOutputName);
+
+        settings.mResolution = Vec2i(int(resolution[0]), int(resolution[1]));
+
+        if(aoStatement.Has("resolution") && (settings.mResolution.x < 1 || settings.mResolution.y < 1 ||
+            float(settings.mResolution.x) != resolution[0] || float(settings.mResolution.y) != resolution[1]))
+            return Error("The resolution is not two positive integers");
+        if(aoStatement.Has("iterations") && settings.mIterations < 1)
+            return Error("The iterations are not positive");
+        if(aoStatement.Has("time") && settings.mMaxTime <= 0.f)
+            return Error("The time is not positive");
+        if(aoStatement.Has("light_samples") && settings.mLightSamples < 1)
+            return Error("The light samples are not positive");
+        if(aoStatement.Has("max_path_length") && settings.mMaxPathLength < 1)
+            return Error("The max path length is not positive");
+
+        mHasRender = true;
+        return true;
+    }
+
+    bool ParseMaterial(Statement &aoStatement)
+    {
+        std::string error;
+        if(aoStatement.GetTokenCount() < 2)
+            return Error("The material needs a name");
+        if(!aoStatement.Split(2, "diffuse 3 phong 3 exponent 1 emission 3 "
+            "diffuse_map 1 phong_map 1 exponent_map 1", error))
+            return Error(error);
+
+        MaterialDesc material;
+        material.mName     = aoStatement.GetToken(1);
+        material.mDiffuse  = Vec3f(0);
+        material.mPhong    = Vec3f(0);
+        material.mExponent = 1.f;
+        material.mEmission = Vec3f(0);
+
+        if(FindMaterial(material.mName) >= 0)
+            return Error("Repeated material " + material.mName);
+
+        if(!aoStatement.GetVec3("diffuse", material.mDiffuse) ||
+            !aoStatement.GetVec3("phong", material.mPhong) ||
+            !aoStatement.GetFloat("exponent", material.mExponent) ||
+            !aoStatement.GetVec3("emission", material.mEmission))
+            return Error("Invalid value of material " + material.mName);
+
+        if(material.mDiffuse.Min() < 0.f || material.mPhong.Min() < 0.f || material.mEmission.Min() < 0.f)
+            return Error("Negative color of material " + material.mName);
+        if(material.mExponent < 1.f)
+            return Error("The exponent of material " + material.mName + " is below 1");
+
+        // Textures, scale white without a color
+        if(!GetImageFile(aoStatement, "diffuse_map", material.mDiffuseMap) ||
+            !GetImageFile(aoStatement, "phong_map", material.mPhongMap) ||
+            !GetImageFile(aoStatement, "exponent_map", material.mExponentMap))
+            return false;
+
+        if(!material.mDiffuseMap.empty() && !aoStatement.Has("diffuse"))
+            material.mDiffuse = Vec3f(1.f);
+        if(!material.mPhongMap.empty() && !aoStatement.Has("phong"))
+            material.mPhong = Vec3f(1.f);
+
+        mMaterials.push_back(material);
+        return true;
+    }
+
+    bool ParseShape(Statement &aoStatement)
+    {
+        const std::string &keyword = aoStatement.GetToken(0);
+
+        ShapeDesc shape;
+        shape.mMaterial = -1;
+        shape.mRadius   = 0.f;
+        for(int i=0; i<4; i++)
+            shape.mPoints[i] = Vec3f(0);
+
+        // the corners of the texture
+        shape.mTexCoords[0] = Vec2f(0.f, 0.f);
+        shape.mTexCoords[1] = Vec2f(1.f, 0.f);
+        shape.mTexCoords[2] = Vec2f(1.f, 1.f);
+        shape.mTexCoords[3] = Vec2f(0.f, 1.f);
+
+        const char *spec;
+        int corners = 0;
+
+        if(keyword == "triangle")
+        {
+            shape.mType = ShapeDesc::kTriangle;
+            spec        = "material 1 p0 3 p1 3 p2 3 uv 6";
+            corners     = 3;
+
+            shape.mTexCoords[2] = Vec2f(0.f, 1.f);
+        }
+        else if(keyword == "quad")
+        {
+            shape.mType = ShapeDesc::kQuad;
+            spec        = "material 1 p0 3 p1 3 p2 3 p3 3 uv 8";
+            corners     = 4;
+        }
+        else if(keyword == "sphere")
+        {
+            shape.mType = ShapeDesc::kSphere;
+            spec        = "material 1 center 3 radius 1";
+        }
+        else
+        {
+            shape.mType = ShapeDesc::kMesh;
+            spec        = "file 1 material 1";
+        }
+
+        std::string error;
+        if(!aoStatement.Split(1, spec, error))
+            return Error(error);
+
+        // Material
+        if(aoStatement.Has("material"))
+        {
+            std::string name;
+            aoStatement.GetString("material", name);
+
+            shape.mMaterial = FindMaterial(name);
+            if(shape.mMaterial < 0)
+                return Error("Unknown material " + name);
+        }
+        else if(shape.mType != ShapeDesc::kMesh)
+            return Error("The " + keyword + " needs a material");
+
+        // Geometry
+        static const char *corner[4] = { "p0", "p1", "p2", "p3" };
+        for(int i=0; i<corners; i++)
+        {
+            if(!aoStatement.Has(corner[i]))
+                return Error("The " + keyword + " needs the corner " + corner[i]);
+            if(!aoStatement.GetVec3(corner[i], shape.mPoints[i]))
+                return Error("Invalid corner " + std::string(corner[i]));
+        }
+
+        if(!aoStatement.GetFloats("uv", &shape.mTexCoords[0].x, 2 * corners))
+            return Error("Invalid uv of the " + keyword);
+
+        for(int i=2; i<corners; i++)
+        {
+            if(Cross(shape.mPoints[i-1] - shape.mPoints[0], shape.mPoints[i] - shape.mPoints[0]).LenSqr() == 0.f)
+                return Error("The " + keyword + " has no area");
+        }
+
+        if(shape.mType == ShapeDesc::kSphere)
+        {
+            if(!aoStatement.Has("center") || !aoStatement.Has("radius"))
+                return Error("The sphere needs a center and a radius");
+            if(!aoStatement.GetVec3("center", shape.mPoints[0]) || !aoStatement.GetFloat("radius", shape.mRadius))
+                return Error("Invalid sphere value");
+            if(shape.mRadius <= 0.f)
+                return Error("The sphere radius is not positive");
+
+            // spheres cannot be sampled as lights
+            if(mMaterials[shape.mMaterial].mEmission.Max() > 0.f)
+                return Error("Spheres cannot have an emissive material");
+        }
+
+        if(shape.mType == ShapeDesc::kMesh && !GetMeshFile(aoStatement, keyword, shape.mFile))
+            return false;
+
+        mShapes.push_back(shape);
+        return true;
+    }
+
+    bool ParsePrototype(Statement &aoStatement)
+    {
+        std::string error;
+        if(aoStatement.GetTokenCount() < 2)
+            return Error("The prototype needs a name");
+        if(!aoStatement.Split(2, "file 1 material 1", error))
+            return Error(error);
+
+        PrototypeDesc prototype;
+        prototype.mName     = aoStatement.GetToken(1);
+        prototype.mMaterial = -1;
+
+        if(FindPrototype(prototype.mName) >= 0)
+            return Error("Repeated prototype " + prototype.mName);
+
+        if(aoStatement.Has("material") && !GetInstanceMaterial(aoStatement, prototype.mMaterial))
+            return false;
+
+        if(!GetMeshFile(aoStatement, "prototype", prototype.mFile))
+            return false;
+
+        mPrototypes.push_back(prototype);
+        return true;
+    }
+
+    bool ParseInstance(Statement &aoStatement)
+    {
+        std::string error;
+        if(aoStatement.GetTokenCount() < 2)
+            return Error("The instance needs a prototype");
+        if(!aoStatement.Split(2, "material 1 scale 3 rotate 4 translate 3 matrix 12", error))
+            return Error(error);
+
+        InstanceDesc instance;
+        instance.mPrototype = FindPrototype(aoStatement.GetToken(1));
+        instance.mMaterial  = -1;
+
+        if(instance.mPrototype < 0)
+            return Error("Unknown prototype " + aoStatement.GetToken(1));
+
+        if(aoStatement.Has("material") && !GetInstanceMaterial(aoStatement, instance.mMaterial))
+            return false;
+
+        // Transform
+        if(aoStatement.Has("matrix"))
+        {
+            if(aoStatement.Has("scale") || aoStatement.Has("rotate") || aoStatement.Has("translate"))
+                return Error("The instance has both a matrix and a scale, rotation or translation");
+
+            float rows[12];
+            if(!aoStatement.GetFloats("matrix", rows, 12))
+                return Error("Invalid instance matrix");
+
+            instance.mTransform = Mat4f::Indetity();
+            for(int r=0; r<3; r++)
+                instance.mTransform.SetRow(r, rows[4*r], rows[4*r+1], rows[4*r+2], rows[4*r+3]);
+        }
+        else
+        {
+            Vec3f scale(1), translation(0);
+            float rotation[4] = { 0.f, 0.f, 1.f, 0.f };
+
+            if(!aoStatement.GetVec3("scale", scale) ||
+                !aoStatement.GetFloats("rotate", rotation, 4) ||
+                !aoStatement.GetVec3("translate", translation))
+                return Error("Invalid instance transform");
+
+            const Vec3f axis(rotation[0], rotation[1], rotation[2]);
+            if(axis.LenSqr() == 0.f)
+                return Error("The instance rotation axis is zero");
+
+            instance.mTransform = Mat4f::Translate(translation) *
+                Mat4f::Rotate(Normalize(axis), rotation[3]) * Mat4f::Scale(scale);
+        }
+
+        const Mat4f &m = instance.mTransform;
+        const float determinant = Dot(Vec3f(m.m00, m.m10, m.m20),
+            Cross(Vec3f(m.m01, m.m11, m.m21), Vec3f(m.m02, m.m12, m.m22)));
+        if(determinant == 0.f)
+            return Error("The instance transform is not invertible");
+
+        mInstances.push_back(instance);
+        return true;
+    }
+
+    bool ParsePointLight(Statement &aoStatement)
+    {
+        std::string error;
+        if(!aoStatement.Split(1, "position 3 intensity 3", error))
+            return Error(error);
+
+        PointLightDesc light;
+        light.mPosition  = Vec3f(0);
+        light.mIntensity = Vec3f(0);
+
+        if(!aoStatement.Has("position") || !aoStatement.Has("intensity"))
+            return Error("The point light needs a position and an intensity");
+        if(!aoStatement.GetVec3("position", light.mPosition) || !aoStatement.GetVec3("intensity", light.mIntensity))
+            return Error("Invalid point light value");
+        if(light.mIntensity.Min() < 0.f)
+            return Error("Negative point light intensity");
+
+        mPointLights.push_back(light);
+        return true;
+    }
+
+    bool ParseBackground(Statement &aoStatement)
+    {
+        std::string error;
+        if(!aoStatement.Split(1, "color 3 envmap 1", error))
+            return Error(error);
+
+        if(mHasBackground)
+            return Error("Repeated background");
+
+        if(!aoStatement.GetVec3("color", mBackgroundColor))
+            return Error("Invalid background color");
+        if(mBackgroundColor.Min() < 0.f)
+            return Error("Negative background color");
+
+        if(aoStatement.Has("envmap"))
+        {
+            aoStatement.GetString("envmap", mEnvMapFile);
+            mEnvMapFile = GetPath(mEnvMapFile);
+            if(!std::ifstream(mEnvMapFile.c_str()))
+                return Error("Could not open " + mEnvMapFile);
+        }
+
+        mHasBackground = true;
+        return true;
+    }
+
+    bool ParseMedium(Statement &aoStatement)
+    {
+        if(mMedium.mType != MediumDesc::kNone)
+            return Error("Repeated medium");
+
+        const std::string type = aoStatement.GetTokenCount() > 1 ? aoStatement.GetToken(1) : std::string();
+
+        std::string error;
+        if(type == "homogeneous")
+        {
+            if(!aoStatement.Split(2, "absorption 3 scattering 3 g 1", error))
+                return Error(error);
+
+            mMedium.mType       = MediumDesc::kHomogeneous;
+            mMedium.mAnisotropy = 0.5f;
+        }
+        else if(type == "heterogeneous")
+        {
+            if(!aoStatement.Split(2, "albedo 3 density 1 g 1 grid 1", error))
+                return Error(error);
+
+            mMedium.mType       = MediumDesc::kHeterogeneous;
+            mMedium.mAnisotropy = 0.3f;
+        }
+        else
+            return Error("The medium is not homogeneous or heterogeneous");
+
+        if(!aoStatement.GetVec3("absorption", mMedium.mAbsorption) ||
+            !aoStatement.GetVec3("scattering", mMedium.mScattering) ||
+            !aoStatement.GetVec3("albedo", mMedium.mAlbedo) ||
+            !aoStatement.GetFloat("density", mMedium.mDensity) ||
+            !aoStatement.GetFloat("g", mMedium.mAnisotropy))
+            return Error("Invalid medium value");
+
+        if(mMedium.mAbsorption.Min() < 0.f || mMedium.mScattering.Min() < 0.f ||
+            mMedium.mAlbedo.Min() < 0.f || mMedium.mAlbedo.Max() > 1.f || mMedium.mDensity <= 0.f)
+            return Error("The medium coefficients are out of range");
+        if(std::abs(mMedium.mAnisotropy) >= 1.f)
+            return Error("The medium g is not between -1 and 1");
+
+        if(aoStatement.Has("grid"))
+        {
+            aoStatement.GetString("grid", mMedium.mGridFile);
+            mMedium.mGridFile = GetPath(mMedium.mGridFile);
+            if(!std::ifstream(mMedium.mGridFile.c_str()))
+                return Error("Could not open " + mMedium.mGridFile);
+        }
+
+        return true;
+    }
+
+    // Checks what needs the whole file
+    bool Validate()
+    {
+        if(!mHasCamera)
+            return Error("The scene has no camera");
+        if(mShapes.empty() && mInstances.empty())
+            return Error("The scene has no shapes");
+
+        // meshes with their own materials may bring lights
+        bool lit = mHasBackground || !mPointLights.empty();
+        for(size_t i=0; i<mShapes.size(); i++)
+        {
+            const int material = mShapes[i].mMaterial;
+            if(material < 0 || mMaterials[material].mEmission.Max() > 0.f)
+                lit = true;
+        }
+
+        if(!lit)
+            return Error("The scene has no lights");
+
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Utilities
+
+    int FindMaterial(const std::string &aName) const
+    {
+        for(size_t i=0; i<mMaterials.size(); i++)
+        {
+            if(mMaterials[i].mName == aName)
+                return int(i);
+        }
+        return -1;
+    }
+
+    int FindPrototype(const std::string &aName) const
+    {
+        for(size_t i=0; i<mPrototypes.size(); i++)
+        {
+            if(mPrototypes[i].mName == aName)
+                return int(i);
+        }
+        return -1;
+    }
+
+    // Instances are not lights, their materials must not emit
+    bool GetInstanceMaterial(
+        const Statement &aStatement,
+        int             &oMaterial) const
+    {
+        std::string name;
+        aStatement.GetString("material", name);
+
+        oMaterial = FindMaterial(name);
+        if(oMaterial < 0)
+            return Error("Unknown material " + name);
+        if(mMaterials[oMaterial].mEmission.Max() > 0.f)
+            return Error("Instances cannot have an emissive material");
+        return true;
+    }
+
+    // The file attribute of a mesh or prototype, relative to the scene file
+    bool GetMeshFile(
+        const Statement   &aStatement,
+        const std::string &aKeyword,
+        std::string       &oFile) const
+    {
+        if(!aStatement.Has("file"))
+            return Error("The " + aKeyword + " needs a file");
+
+        aStatement.GetString("file", oFile);
+        oFile = GetPath(oFile);
+
+        const size_t dot = oFile.find_last_of('.');
+        const std::string extension = dot == std::string::npos ? std::string() : oFile.substr(dot);
+        if(extension != ".obj" && extension != ".ply")
+            return Error("The mesh file " + oFile + " is not an .obj or .ply file");
+        if(!std::ifstream(oFile.c_str()))
+            return Error("Could not open " + oFile);
+        return true;
+    }
+
+    // The image file of a texture attribute, relative to the scene file,
+    // stays empty without the attribute
+    bool GetImageFile(
+        const Statement &aStatement,
+        const char      *aName,
+        std::string     &oFile) const
+    {
+        if(!aStatement.Has(aName))
+            return true;
+
+        aStatement.GetString(aName, oFile);
+        oFile = GetPath(oFile);
+
+        const size_t dot = oFile.find_last_of('.');
+        const std::string extension = dot == std::string::npos ? std::string() : oFile.substr(dot);
+        if(extension != ".bmp" && extension != ".hdr")
+            return Error("The texture " + oFile + " is not a .bmp or .hdr image");
+        if(!std::ifstream(oFile.c_str()))
+            return Error("Could not open " + oFile);
+        return true;
+    }
+
+    // Relative to the scene file
+    std::string GetPath(const std::string &aFile) const
+    {
+        if(aFile.empty() || aFile[0] == '/' || aFile[0] == '\\' ||
+            (aFile.size() > 1 && aFile[1] == ':'))
+            return aFile;
+        return mDirectory + aFile;
+    }
+
+    bool Error(const std::string &aMessage) const
+    {
+        if(mLine > 0)
+            printf("%s:%d: %s\n", mFilename.c_str(), mLine, aMessage.c_str());
+        else
+            printf("%s: %s\n", mFilename.c_str(), aMessage.c_str());
+        return false;
+    }
+
+private:
+
+    std::string mDirectory; //!< Of the scene file, with the trailing slash
+    int         mLine;      //!< Being parsed, 0 once done
+    bool        mHasRender;
+};
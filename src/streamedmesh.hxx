@@ -0,0 +1,440 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <omp.h>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+#include "mesh.hxx"
+#include "scenecache.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Clustered mesh of a scene cache, paged in on demand
+//
+// Only the hierarchy over the clusters and their boxes are kept in memory
+// for good. Without a memory limit every cluster is traced in place from
+// the mapped file. With one, a cluster is copied out of the mapping when a
+// ray first reaches it, and its pages of the mapping are dropped, so the
+// mesh may be much larger than the memory. The clusters in memory, those
+// rays trace included, never take more than the given bytes. Before a
+// cluster is read the least recently used clusters no ray traces are
+// evicted until it fits, and when the traced ones alone leave no room the
+// read waits for the rays to leave them. The limit is raised to the
+// largest cluster when it is below it.
+//
+// A ray defers the clusters it reaches that are not in memory and first
+// traces those that are. The deferred ones are then paged in and traced
+// front to back, those behind the closest hit found by then are skipped,
+// and a shadow ray blocked in memory pages in nothing. Rays of several
+// threads waiting for the same cluster wait for one read of it. The time
+// the rays wait for clusters is counted as stall time.
+
+class StreamedMesh : public AbstractGeometry
+{
+public:
+
+    static const int kMaxDeferred = 32; //!< Clusters a ray defers, further ones are paged in at once
+
+    // At most aMemoryLimit bytes of clusters are kept in memory, 0 traces
+    // all of them in place. aCache has to outlive the mesh.
+    StreamedMesh(
+        const SceneCache *aCache,
+        size_t           aMemoryLimit) :
+        mCache(aCache),
+        mMemoryLimit(aMemoryLimit),
+        mClock(0),
+        mResidentBytes(0),
+        mPeakBytes(0),
+        mEvictions(0),
+        mPageIns(0),
+        mPageInBytes(0),
+        mDeferred(0),
+        mSkipped(0),
+        mStallTime(0)
+    {
+        const SceneCache::Header &header = mCache->GetHeader();
+
+        const TriangleMesh::Node *topNodes = mCache->GetSection<TriangleMesh::Node>(SceneCache::kTopNodes);
+        mTopNodes.assign(topNodes, topNodes + header.mTopNodeCount);
+
+        mClusters.resize(header.mClusterCount);
+        mBoxes.resize(header.mClusterCount);
+        for(int i=0; i<(int)mClusters.size(); i++)
+        {
+            const SceneCache::ClusterRecord &record = mCache->GetCluster(i);
+
+            Cluster &cluster = mClusters[i];
+            omp_init_lock(&cluster.mLock);
+            cluster.mMesh    = NULL;
+            cluster.mData    = NULL;
+            cluster.mBytes   = 0;
+            cluster.mPins    = 0;
+            cluster.mLastUse = 0;
+
+            mBoxes[i] = TriangleMesh::Node();
+            mBoxes[i].mBBoxMin = record.mBBoxMin;
+            mBoxes[i].mBBoxMax = record.mBBoxMax;
+
+            if(mMemoryLimit == 0)
+            {
+                cluster.mMesh = new TriangleMesh;
+                cluster.mMesh->Share(SceneCache::GetClusterArrays(record, mCache->GetClusterData(i)));
+            }
+            else
+            {
+                // each cluster has to fit on its own
+                mMemoryLimit = std::max(mMemoryLimit, mCache->GetClusterSize(i));
+            }
+        }
+
+        omp_init_lock(&mEvictLock);
+    }
+
+    virtual ~StreamedMesh()
+    {
+        for(size_t i=0; i<mClusters.size(); i++)
+        {
+            delete mClusters[i].mMesh;
+            delete[] mClusters[i].mData;
+            omp_destroy_lock(&mClusters[i].mLock);
+        }
+        omp_destroy_lock(&mEvictLock);
+    }
+
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        return Traverse<false>(aRay, oResult);
+    }
+
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        return Traverse<true>(aRay, oResult);
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        if(mTopNodes.empty())
+            return;
+
+        aoBBoxMin = Min(aoBBoxMin, mTopNodes[0].mBBoxMin);
+        aoBBoxMax = Max(aoBBoxMax, mTopNodes[0].mBBoxMax);
+    }
+
+    int GetClusterCount() const
+    {
+        return (int)mClusters.size();
+    }
+
+    // A cluster traced in place, NULL when the clusters are paged in
+    TriangleMesh* GetInPlaceCluster(int aCluster)
+    {
+        return mMemoryLimit == 0 ? mClusters[aCluster].mMesh : NULL;
+    }
+
+    size_t GetMemoryLimit() const
+    {
+        return mMemoryLimit;
+    }
+
+    size_t GetPeakMemory() const
+    {
+        return mPeakBytes;
+    }
+
+    // Clusters paged in and evicted, clusters deferred by the rays and
+    // those of them skipped as they were not needed after all
+    void GetClusterCounts(
+        unsigned long long &oPageIns,
+        unsigned long long &oEvictions,
+        unsigned long long &oDeferred,
+        unsigned long long &oSkipped) const
+    {
+        oPageIns   = mPageIns;
+        oEvictions = mEvictions;
+        oDeferred  = mDeferred;
+        oSkipped   = mSkipped;
+    }
+
+    unsigned long long GetPageInBytes() const
+    {
+        return mPageInBytes;
+    }
+
+    // Seconds the rays waited for clusters, summed over the threads
+    double GetStallTime() const
+    {
+        return mStallTime;
+    }
+
+private:
+
+    struct Cluster
+    {
+        omp_lock_t         mLock;
+        TriangleMesh       *mMesh;    //!< NULL while not in memory
+        char               *mData;    //!< Copy of the cluster the mesh traces, NULL in place
+        size_t             mBytes;
+        int                mPins;     //!< Rays tracing the cluster
+        unsigned long long mLastUse;
+    };
+
+    template<bool tAnyHit>
+    bool Traverse(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mTopNodes.empty())
+            return false;
+
+        int deferred[kMaxDeferred];
+        int deferredCount = 0;
+
+        bool hit = TriangleMesh::TraverseNodes<tAnyHit>(&mTopNodes[0], (int)mTopNodes.size(), aRay, oResult,
+            [&](int aCluster, const Ray &aLeafRay, Isect &aoLeafResult)
+            {
+                const TriangleMesh *mesh = Pin(aCluster);
+                if(!mesh)
+                {
+                    if(deferredCount < kMaxDeferred)
+                    {
+                        deferred[deferredCount++] = aCluster;
+                        return false;
+                    }
+                    mesh = PageIn(aCluster);
+                }
+
+                const bool clusterHit = tAnyHit ?
+                    mesh->IntersectP(aLeafRay, aoLeafResult) : mesh->Intersect(aLeafRay, aoLeafResult);
+                Unpin(aCluster);
+                return clusterHit;
+            });
+
+        if(deferredCount == 0)
+            return hit;
+
+        // the nearest deferred cluster first, it may hide the others
+        const Vec3f invDir(1.f / aRay.dir.x, 1.f / aRay.dir.y, 1.f / aRay.dir.z);
+
+        float distances[kMaxDeferred];
+        for(int i=0; i<deferredCount; i++)
+            distances[i] = TriangleMesh::IntersectBox(mBoxes[deferred[i]], aRay, invDir, oResult.dist);
+
+        for(int i=1; i<deferredCount; i++)
+        {
+            for(int j=i; j>0 && distances[j] < distances[j - 1]; j--)
+            {
+                std::swap(distances[j], distances[j - 1]);
+                std::swap(deferred[j], deferred[j - 1]);
+            }
+        }
+
+        int skipped = 0;
+        for(int i=0; i<deferredCount; i++)
+        {
+            if((tAnyHit && hit) ||
+                TriangleMesh::IntersectBox(mBoxes[deferred[i]], aRay, invDir, oResult.dist) == 1e36f)
+            {
+                skipped++;
+                continue;
+            }
+
+            const TriangleMesh *mesh = PageIn(deferred[i]);
+            if(tAnyHit ? mesh->IntersectP(aRay, oResult) : mesh->Intersect(aRay, oResult))
+                hit = true;
+            Unpin(deferred[i]);
+        }
+
+#pragma omp atomic
+        mDeferred += deferredCount;
+#pragma omp atomic
+        mSkipped += skipped;
+
+        return hit;
+    }
+
+    // The cluster when it is in memory, it stays until unpinned
+    const TriangleMesh* Pin(int aCluster) const
+    {
+        Cluster &cluster = mClusters[aCluster];
+        if(mMemoryLimit == 0)
+            return cluster.mMesh;
+
+        omp_set_lock(&cluster.mLock);
+        const TriangleMesh *mesh = cluster.mMesh;
+        if(mesh)
+            Use(cluster);
+        omp_unset_lock(&cluster.mLock);
+
+        return mesh;
+    }
+
+    void Unpin(int aCluster) const
+    {
+        if(mMemoryLimit == 0)
+            return;
+
+#pragma omp atomic
+        mClusters[aCluster].mPins--;
+    }
+
+    // Pins the cluster, copies it out of the mapping first when it is not
+    // in memory. A thread asking for a cluster another one is reading
+    // waits for that read.
+    const TriangleMesh* PageIn(int aCluster) const
+    {
+        const double stallStart = omp_get_wtime();
+
+        Cluster &cluster = mClusters[aCluster];
+        omp_set_lock(&cluster.mLock);
+
+        const bool load = cluster.mMesh == NULL;
+        if(load)
+        {
+            cluster.mBytes = mCache->GetClusterSize(aCluster);
+            Reserve(cluster.mBytes);
+
+            cluster.mData  = new char[cluster.mBytes];
+            memcpy(cluster.mData, mCache->GetClusterData(aCluster), cluster.mBytes);
+            mCache->ReleaseClusterData(aCluster);
+
+            TriangleMesh *mesh = new TriangleMesh;
+            mesh->Share(SceneCache::GetClusterArrays(mCache->GetCluster(aCluster), cluster.mData));
+            cluster.mMesh = mesh;
+        }
+
+        Use(cluster);
+        const TriangleMesh *mesh = cluster.mMesh;
+        omp_unset_lock(&cluster.mLock);
+
+        if(load)
+        {
+#pragma omp atomic
+            mPageIns++;
+#pragma omp atomic
+            mPageInBytes += cluster.mBytes;
+
+            omp_set_lock(&mEvictLock);
+            mResidentClusters.push_back(aCluster);
+            omp_unset_lock(&mEvictLock);
+        }
+
+        const double stall = omp_get_wtime() - stallStart;
+#pragma omp atomic
+        mStallTime += stall;
+
+        return mesh;
+    }
+
+    // Pins a cluster in memory, under its lock
+    void Use(Cluster &aoCluster) const
+    {
+#pragma omp atomic
+        aoCluster.mPins++;
+
+#pragma omp atomic capture
+        aoCluster.mLastUse = ++mClock;
+    }
+
+    // Counts aBytes more as resident once they fit the memory limit, under
+    // the lock of the cluster about to be read. A ray pins one cluster at a
+    // time and none while it pages one in, so the pinned clusters that
+    // leave no room are soon unpinned and this waits for them. Clusters
+    // being read are not resident yet, so Evict never waits for the lock
+    // held here.
+    void Reserve(size_t aBytes) const
+    {
+        for(;;)
+        {
+            omp_set_lock(&mEvictLock);
+            Evict(aBytes);
+
+            const bool fits = mResidentBytes + aBytes <= mMemoryLimit;
+            if(fits)
+            {
+                mResidentBytes += aBytes;
+                mPeakBytes = std::max(mPeakBytes, mResidentBytes);
+            }
+            omp_unset_lock(&mEvictLock);
+
+            if(fits)
+                return;
+        }
+    }
+
+    // Drops the least recently used clusters no ray traces until aBytes
+    // more fit the memory limit, under mEvictLock. Pins only go up under
+    // the lock of their cluster, so an unpinned cluster found under it
+    // stays unpinned.
+    void Evict(size_t aBytes) const
+    {
+        if(mResidentBytes + aBytes <= mMemoryLimit)
+            return;
+
+        std::vector<std::pair<unsigned long long, int> > candidates;
+        for(size_t i=0; i<mResidentClusters.size(); i++)
+        {
+            Cluster &cluster = mClusters[mResidentClusters[i]];
+            omp_set_lock(&cluster.mLock);
+            candidates.push_back(std::make_pair(cluster.mLastUse, mResidentClusters[i]));
+            omp_unset_lock(&cluster.mLock);
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        for(size_t i=0; i<candidates.size() && mResidentBytes + aBytes > mMemoryLimit; i++)
+        {
+            Cluster &cluster = mClusters[candidates[i].second];
+            omp_set_lock(&cluster.mLock);
+
+            int pins;
+#pragma omp atomic read
+            pins = cluster.mPins;
+
+            if(pins == 0)
+            {
+                delete cluster.mMesh;
+                delete[] cluster.mData;
+                cluster.mMesh = NULL;
+                cluster.mData = NULL;
+
+                mResidentBytes -= cluster.mBytes;
+                mResidentClusters.erase(std::find(mResidentClusters.begin(), mResidentClusters.end(),
+                    candidates[i].second));
+                mEvictions++;
+            }
+
+            omp_unset_lock(&cluster.mLock);
+        }
+    }
+
+private:
+
+    const SceneCache                *mCache;
+    size_t                          mMemoryLimit;
+    std::vector<TriangleMesh::Node> mTopNodes;  //!< Over the clusters, one per leaf
+    std::vector<TriangleMesh::Node> mBoxes;     //!< Of the clusters
+
+    mutable std::vector<Cluster>    mClusters;
+    mutable unsigned long long      mClock;     //!< Counts the uses of the clusters
+
+    // guarded by mEvictLock
+    mutable omp_lock_t              mEvictLock;
+    mutable std::vector<int>        mResidentClusters;
+    mutable size_t                  mResidentBytes; //!< With those of the clusters being read
+    mutable size_t                  mPeakBytes;
+    mutable unsigned long long      mEvictions;
+
+    // counted atomically
+    mutable unsigned long long      mPageIns;
+    mutable unsigned long long      mPageInBytes;
+    mutable unsigned long long      mDeferred;
+    mutable unsigned long long      mSkipped;
+    mutable double                  mStallTime;
+};
@@ -0,0 +1,909 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <omp.h>
+#include <sys/stat.h>
+#include "math.hxx"
+#include "framebuffer.hxx"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Tiled, mip-mapped textures served by a bounded tile cache
+//
+// An image is converted once into a tiled file in the cache directory,
+// <image name>.<hash of its path>.pg3t: the mip pyramid down to one texel,
+// box filtered in linear space, each level cut into kTileSize x kTileSize
+// tiles of one fixed size, the levels from the finest and their tiles row
+// by row. The tiles of .bmp images keep 8 bit sRGB texels, those of .hdr
+// images floats. The file is converted again when it is older than the
+// image. Data textures, like an exponent, have 8 bit linear texels and are
+// kept in <image name>.<hash>.data.pg3t. When the tiled file cannot be
+// written, the tiles are kept in the cache instead. They are never evicted
+// and count against its ceiling, a texture that does not fit is left out.
+//
+// Rendering reads the tiles from the files on demand into a cache with a
+// memory ceiling, so the textures of a scene may be much larger than the
+// memory. The tiles are hashed into kShardCount shards, each with its own
+// lock, least recently used list and share of the ceiling, so the threads
+// rarely wait for each other. A lookup pins the tiles it reads, a shard
+// over its share evicts the least recently used tiles that are not pinned.
+
+class TextureCache
+{
+public:
+
+    static const int kTileSize   = 64;  //!< Texels along a tile edge
+    static const int kShardCount = 64;
+    static const int kVersion    = 1;
+
+    enum Format
+    {
+        kFormatSRGB8,   //!< 8 bit sRGB texels of a color image
+        kFormatLinear8, //!< 8 bit texels of a data image
+        kFormatFloat    //!< 32 bit float texels of a high dynamic range image
+    };
+
+    TextureCache() :
+        mCacheDirectory("pg3t_cache"),
+        mMemoryLimit(size_t(1024) << 20),
+        mKeptBytes(0),
+        mResidentBytes(0),
+        mPeakBytes(0)
+    {
+        for(int i=0; i<kShardCount; i++)
+        {
+            Shard &shard = mShards[i];
+            omp_init_lock(&shard.mLock);
+            shard.mHead = shard.mTail = NULL;
+            shard.mBytes = 0;
+            shard.mRequests = shard.mLoads = shard.mEvictions = 0;
+        }
+    }
+
+    ~TextureCache()
+    {
+        for(int i=0; i<kShardCount; i++)
+        {
+            Shard &shard = mShards[i];
+            for(std::unordered_map<unsigned long long, Tile*>::iterator it = shard.mTiles.begin();
+                it != shard.mTiles.end(); ++it)
+            {
+                delete[] it->second->mData;
+                delete it->second;
+            }
+            omp_destroy_lock(&shard.mLock);
+        }
+
+        for(size_t i=0; i<mTextures.size(); i++)
+        {
+            if(!mTextures[i].mKept)
+                CloseFile(mTextures[i].mFile);
+        }
+    }
+
+    // Directory of the tiled files, created when a texture is converted.
+    // Has to be set before the textures are added.
+    void SetCacheDirectory(const std::string &aDirectory)
+    {
+        mCacheDirectory = aDirectory;
+    }
+
+    // Bytes of tiles kept in memory, shared evenly by the shards. Has to be
+    // set before the textures are added.
+    void SetMemoryLimit(size_t aBytes)
+    {
+        mMemoryLimit = aBytes;
+    }
+
+    size_t GetMemoryLimit() const
+    {
+        return mMemoryLimit;
+    }
+
+    // Adds a .bmp or .hdr image as a texture, returns its index or -1 when
+    // the image cannot be read. aColor tells sRGB colors from linear data
+    // in 8 bit images. An image added twice is one texture.
+    int AddTexture(
+        const std::string &aFilename,
+        bool              aColor)
+    {
+        const std::string tiledName = GetTiledName(aFilename, aColor);
+
+        std::map<std::string, int>::const_iterator it = mTextureIndices.find(tiledName);
+        if(it != mTextureIndices.end())
+            return it->second;
+
+        // converts the image when the tiled file is missing or older
+        struct stat imageInfo, tiledInfo;
+        if(stat(aFilename.c_str(), &imageInfo) != 0)
+        {
+            printf("Could not open texture %s\n", aFilename.c_str());
+            return -1;
+        }
+
+        Texture texture;
+        texture.mFilename = aFilename;
+        texture.mKept     = false;
+
+        const bool upToDate = stat(tiledName.c_str(), &tiledInfo) == 0 &&
+            tiledInfo.st_mtime >= imageInfo.st_mtime && OpenTiled(tiledName, texture);
+
+        if(!upToDate)
+        {
+            const double convertStart = omp_get_wtime();
+            const int textureIdx = (int)mTextures.size();
+
+            ConvertResult result = Convert(aFilename, aColor, tiledName, textureIdx, texture);
+            if(result == kConverted && !OpenTiled(tiledName, texture))
+                result = kWriteFailed;
+
+            if(result == kWriteFailed)
+            {
+                printf("Could not write the tiled texture %s, keeping its tiles in the texture cache\n",
+                    tiledName.c_str());
+                result = Convert(aFilename, aColor, std::string(), textureIdx, texture);
+            }
+
+            if(result != kConverted)
+                return -1;
+
+            printf("Texture:   %s, %d x %d texels, %d levels, %.1f MB tiled in %.2f s%s\n",
+                aFilename.c_str(), texture.mHeader.mWidth, texture.mHeader.mHeight,
+                texture.mHeader.mLevelCount, texture.mFileSize / (1024.f * 1024.f),
+                omp_get_wtime() - convertStart, texture.mKept ? ", kept in the cache" : "");
+        }
+
+        mTextureIndices[tiledName] = (int)mTextures.size();
+        mTextures.push_back(texture);
+        return (int)mTextures.size() - 1;
+    }
+
+    // Filtered value at aUV, which wraps around, v runs up the image. aWidth
+    // is the footprint of the lookup in texture space. 0 reads the finest
+    // level bilinearly, wider footprints blend the two levels whose texels
+    // are closest to their size.
+    Vec3f Lookup(
+        int          aTexture,
+        const Vec2f &aUV,
+        float        aWidth) const
+    {
+        const Texture &texture = mTextures[aTexture];
+        const int levelCount = texture.mHeader.mLevelCount;
+
+        float level = 0.f;
+        if(aWidth > 0.f)
+        {
+            const float size = float(std::max(texture.mHeader.mWidth, texture.mHeader.mHeight));
+            level = std::min(float(levelCount - 1), std::max(0.f, std::log2(aWidth * size)));
+        }
+
+        const int   fine  = int(level);
+        const float blend = level - fine;
+
+        Vec3f result = Bilinear(aTexture, fine, aUV);
+        if(blend > 0.f && fine + 1 < levelCount)
+            result = result * (1.f - blend) + Bilinear(aTexture, fine + 1, aUV) * blend;
+        return result;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Statistics
+
+    int GetTextureCount() const
+    {
+        return (int)mTextures.size();
+    }
+
+    // Bytes of all tiled files, and of the textures kept in the cache instead
+    size_t GetFileSize() const
+    {
+        size_t size = 0;
+        for(size_t i=0; i<mTextures.size(); i++)
+            size += size_t(mTextures[i].mFileSize);
+        return size;
+    }
+
+    // Tiles looked up and read from the files, the rest were in memory
+    void GetTileCounts(
+        unsigned long long &oRequests,
+        unsigned long long &oLoads,
+        unsigned long long &oEvictions) const
+    {
+        oRequests = oLoads = oEvictions = 0;
+        for(int i=0; i<kShardCount; i++)
+        {
+            oRequests  += mShards[i].mRequests;
+            oLoads     += mShards[i].mLoads;
+            oEvictions += mShards[i].mEvictions;
+        }
+    }
+
+    // Most bytes of tiles in memory at once
+    size_t GetPeakMemory() const
+    {
+        return mPeakBytes;
+    }
+
+private:
+
+#if defined(_WIN32)
+    typedef HANDLE FileHandle;
+#else
+    typedef int FileHandle;
+#endif
+
+    struct FileHeader
+    {
+        char mMagic[4]; //!< PG3T
+        int  mVersion;
+        int  mWidth;
+        int  mHeight;
+        int  mFormat;
+        int  mLevelCount;
+        int  mTileSize;
+        int  mReserved;
+    };
+
+    struct Level
+    {
+        int mWidth;
+        int mHeight;
+        int mTilesX;
+        int mFirstTile; //!< Index of the first tile in the file
+    };
+
+    struct Texture
+    {
+        std::string        mFilename;  //!< Of the image
+        FileHeader         mHeader;
+        std::vector<Level> mLevels;
+        int                mTexelSize;
+        size_t             mTileBytes;
+        long long          mFileSize;
+        FileHandle         mFile;      //!< Unused when mKept
+        bool               mKept;      //!< Tiles kept in the cache, there is no file
+    };
+
+    struct Tile
+    {
+        unsigned long long mKey;
+        Tile               *mPrev;  //!< More recently used
+        Tile               *mNext;  //!< Less recently used
+        int                mPins;
+        bool               mKept;   //!< Of a texture without file, in no list and never evicted
+        unsigned char      *mData;
+    };
+
+    struct Shard
+    {
+        omp_lock_t                                    mLock;
+        std::unordered_map<unsigned long long, Tile*> mTiles;
+        Tile                                          *mHead; //!< Most recently used
+        Tile                                          *mTail;
+        size_t                                        mBytes;
+        unsigned long long                            mRequests;
+        unsigned long long                            mLoads;
+        unsigned long long                            mEvictions;
+    };
+
+    //////////////////////////////////////////////////////////////////////////
+    // Tiled files
+
+    static void CloseFile(FileHandle aFile)
+    {
+#if defined(_WIN32)
+        CloseHandle(aFile);
+#else
+        close(aFile);
+#endif
+    }
+
+    // Positioned read, safe from several threads at once
+    static bool ReadAt(
+        FileHandle aFile,
+        void       *aData,
+        size_t     aSize,
+        long long  aOffset)
+    {
+#if defined(_WIN32)
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = DWORD(aOffset);
+        overlapped.OffsetHigh = DWORD(aOffset >> 32);
+
+        DWORD read = 0;
+        return ReadFile(aFile, aData, DWORD(aSize), &read, &overlapped) && read == aSize;
+#else
+        return pread(aFile, aData, aSize, off_t(aOffset)) == ssize_t(aSize);
+#endif
+    }
+
+    static int GetTexelSize(int aFormat)
+    {
+        return aFormat == kFormatFloat ? 3 * sizeof(float) : 3;
+    }
+
+    // Level sizes and tile positions of a header
+    static void SetupLevels(Texture &aoTexture)
+    {
+        const FileHeader &header = aoTexture.mHeader;
+
+        aoTexture.mLevels.clear();
+        aoTexture.mTexelSize = GetTexelSize(header.mFormat);
+        aoTexture.mTileBytes = size_t(kTileSize) * kTileSize * aoTexture.mTexelSize;
+
+        int width = header.mWidth, height = header.mHeight, tiles = 0;
+        for(int i=0; i<header.mLevelCount; i++)
+        {
+            Level level;
+            level.mWidth     = width;
+            level.mHeight    = height;
+            level.mTilesX    = (width + kTileSize - 1) / kTileSize;
+            level.mFirstTile = tiles;
+            aoTexture.mLevels.push_back(level);
+
+            tiles += level.mTilesX * ((height + kTileSize - 1) / kTileSize);
+            width  = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+    }
+
+    static int GetLevelCount(int aWidth, int aHeight)
+    {
+        int levels = 1;
+        for(; aWidth > 1 || aHeight > 1; levels++)
+        {
+            aWidth  = std::max(1, aWidth / 2);
+            aHeight = std::max(1, aHeight / 2);
+        }
+        return levels;
+    }
+
+    // Opens a tiled file, false when it is not one of this version or
+    // its size does not match the header
+    static bool OpenTiled(
+        const std::string &aFilename,
+        Texture           &aoTexture)
+    {
+#if defined(_WIN32)
+        const FileHandle file = CreateFileA(aFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        const long long fileSize = GetFileSizeEx(file, &size) ? size.QuadPart : -1;
+#else
+        const FileHandle file = open(aFilename.c_str(), O_RDONLY);
+        if(file < 0)
+            return false;
+
+        struct stat info;
+        const long long fileSize = fstat(file, &info) == 0 ? (long long)info.st_size : -1;
+#endif
+
+        FileHeader &header = aoTexture.mHeader;
+        bool valid = ReadAt(file, &header, sizeof(header), 0) &&
+            memcmp(header.mMagic, "PG3T", 4) == 0 && header.mVersion == kVersion &&
+            header.mTileSize == kTileSize && header.mWidth > 0 && header.mHeight > 0 &&
+            header.mFormat >= kFormatSRGB8 && header.mFormat <= kFormatFloat &&
+            header.mLevelCount == GetLevelCount(header.mWidth, header.mHeight);
+
+        if(valid)
+        {
+            SetupLevels(aoTexture);
+
+            const Level &last = aoTexture.mLevels.back();
+            const long long tiles = last.mFirstTile + 1;
+            valid = fileSize == (long long)sizeof(FileHeader) + tiles * (long long)aoTexture.mTileBytes;
+        }
+
+        if(!valid)
+        {
+            CloseFile(file);
+            return false;
+        }
+
+        aoTexture.mFile     = file;
+        aoTexture.mFileSize = fileSize;
+        return true;
+    }
+
+    // Name of the tiled file of an image in the cache directory, the hash
+    // of the path tells images of the same name apart
+    std::string GetTiledName(
+        const std::string &aImage,
+        bool              aColor) const
+    {
+        unsigned long long hash = 14695981039346656037ULL; // FNV-1a
+        for(size_t i=0; i<aImage.size(); i++)
+        {
+            hash ^= (unsigned char)aImage[i];
+            hash *= 1099511628211ULL;
+        }
+
+        const size_t slash = aImage.find_last_of("/\\");
+        const std::string name = slash == std::string::npos ? aImage : aImage.substr(slash + 1);
+
+        char hashText[24];
+        sprintf(hashText, ".%016llx", hash);
+
+        return mCacheDirectory + "/" + name + hashText + (aColor ? ".pg3t" : ".data.pg3t");
+    }
+
+    enum ConvertResult
+    {
+        kConverted,
+        kWriteFailed,   //!< The tiled file could not be written
+        kFailed         //!< Told why, the texture is left out
+    };
+
+    // Tiles an image one level at a time and streams the tiles to the file
+    // aTiled, creating the cache directory first. With an empty aTiled the
+    // tiles are kept in the cache as those of texture aTexture instead,
+    // when they fit in the part of the memory limit not kept yet.
+    ConvertResult Convert(
+        const std::string &aImage,
+        bool              aColor,
+        const std::string &aTiled,
+        int               aTexture,
+        Texture           &aoTexture)
+    {
+        const size_t dot = aImage.find_last_of('.');
+        const std::string extension = dot == std::string::npos ? std::string() : aImage.substr(dot);
+
+        Texture texture;
+        FileHeader &header = texture.mHeader;
+
+        // the levels are filtered in linear space
+        std::vector<Vec3f> texels;
+        {
+            Framebuffer image;
+            if(extension == ".hdr" && image.LoadHDR(aImage.c_str()))
+                header.mFormat = kFormatFloat;
+            else if(extension == ".bmp" && image.LoadBMP(aImage.c_str()))
+                header.mFormat = aColor ? kFormatSRGB8 : kFormatLinear8;
+            else
+            {
+                printf("Could not load texture %s, only .bmp and .hdr images are supported\n", aImage.c_str());
+                return kFailed;
+            }
+
+            memcpy(header.mMagic, "PG3T", 4);
+            header.mVersion    = kVersion;
+            header.mWidth      = image.GetResX();
+            header.mHeight     = image.GetResY();
+            header.mLevelCount = GetLevelCount(header.mWidth, header.mHeight);
+            header.mTileSize   = kTileSize;
+            header.mReserved   = 0;
+
+            texels.resize(size_t(header.mWidth) * header.mHeight);
+            for(int y=0; y<header.mHeight; y++)
+            {
+                for(int x=0; x<header.mWidth; x++)
+                {
+                    Vec3f &texel = texels[x + size_t(y) * header.mWidth];
+                    texel = image.GetColor(x, y);
+                    if(header.mFormat == kFormatSRGB8)
+                    {
+                        for(int c=0; c<3; c++)
+                            texel.Get(c) = SRGBToLinear(texel.Get(c));
+                    }
+                }
+            }
+        }
+        SetupLevels(texture);
+
+        const size_t tilesBytes = size_t(texture.mLevels.back().mFirstTile + 1) * texture.mTileBytes;
+        FILE *file = NULL;
+
+        if(!aTiled.empty())
+        {
+#if defined(_WIN32)
+            _mkdir(mCacheDirectory.c_str());
+#else
+            mkdir(mCacheDirectory.c_str(), 0755);
+#endif
+            file = fopen(aTiled.c_str(), "wb");
+            if(!file)
+                return kWriteFailed;
+        }
+        else if(mKeptBytes + tilesBytes > mMemoryLimit)
+        {
+            printf("Could not keep the %.1f MB of tiles of texture %s in the %.1f MB of the texture cache "
+                "left, it is left out\n", tilesBytes / (1024.f * 1024.f), aImage.c_str(),
+                (mMemoryLimit - mKeptBytes) / (1024.f * 1024.f));
+            return kFailed;
+        }
+
+        bool written = !file || fwrite(&header, sizeof(header), 1, file) == 1;
+
+        std::vector<unsigned char> tile(texture.mTileBytes);
+        for(int l=0; l<header.mLevelCount && written; l++)
+        {
+            const Level &level = texture.mLevels[l];
+            const int tilesY = (level.mHeight + kTileSize - 1) / kTileSize;
+
+            for(int ty=0; ty<tilesY && written; ty++)
+            {
+                for(int tx=0; tx<level.mTilesX && written; tx++)
+                {
+                    // texels past the edge of the level are never read
+                    memset(&tile[0], 0, tile.size());
+                    for(int y=ty * kTileSize; y<std::min(level.mHeight, (ty + 1) * kTileSize); y++)
+                    {
+                        for(int x=tx * kTileSize; x<std::min(level.mWidth, (tx + 1) * kTileSize); x++)
+                        {
+                            unsigned char *texel = &tile[((y % kTileSize) * kTileSize + x % kTileSize) *
+                                texture.mTexelSize];
+                            EncodeTexel(texels[x + size_t(y) * level.mWidth], header.mFormat, texel);
+                        }
+                    }
+
+                    if(file)
+                        written = fwrite(&tile[0], tile.size(), 1, file) == 1;
+                    else
+                        KeepTile(aTexture, level.mFirstTile + ty * level.mTilesX + tx, tile);
+                }
+            }
+
+            if(l + 1 < header.mLevelCount)
+                texels = Downsample(texels, level, texture.mLevels[l + 1]);
+        }
+
+        if(file)
+        {
+            written = fclose(file) == 0 && written;
+            if(!written)
+            {
+                remove(aTiled.c_str());
+                return kWriteFailed;
+            }
+            return kConverted;
+        }
+
+        mKeptBytes += tilesBytes;
+
+        aoTexture.mHeader   = header;
+        aoTexture.mKept     = true;
+        aoTexture.mFileSize = (long long)(sizeof(FileHeader) + tilesBytes);
+        SetupLevels(aoTexture);
+        return kConverted;
+    }
+
+    // Box filter, each texel of the smaller level averages the texels of
+    // the larger one its area covers
+    static std::vector<Vec3f> Downsample(
+        const std::vector<Vec3f> &aTexels,
+        const Level              &aLevel,
+        const Level              &aNext)
+    {
+        std::vector<Vec3f> result(size_t(aNext.mWidth) * aNext.mHeight);
+
+#pragma omp parallel for
+        for(int y=0; y<aNext.mHeight; y++)
+        {
+            const int y0 = y * aLevel.mHeight / aNext.mHeight;
+            const int y1 = std::max(y0 + 1, (y + 1) * aLevel.mHeight / aNext.mHeight);
+
+            for(int x=0; x<aNext.mWidth; x++)
+            {
+                const int x0 = x * aLevel.mWidth / aNext.mWidth;
+                const int x1 = std::max(x0 + 1, (x + 1) * aLevel.mWidth / aNext.mWidth);
+
+                Vec3f sum(0.f);
+                for(int sy=y0; sy<y1; sy++)
+                    for(int sx=x0; sx<x1; sx++)
+                        sum += aTexels[sx + size_t(sy) * aLevel.mWidth];
+
+                result[x + size_t(y) * aNext.mWidth] = sum / Vec3f(float((x1 - x0) * (y1 - y0)));
+            }
+        }
+
+        return result;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Texels
+
+    static float SRGBToLinear(float aValue)
+    {
+        return aValue <= 0.04045f ? aValue / 12.92f : std::pow((aValue + 0.055f) / 1.055f, 2.4f);
+    }
+
+    static float LinearToSRGB(float aValue)
+    {
+        return aValue <= 0.0031308f ? aValue * 12.92f : 1.055f * std::pow(aValue, 1.f / 2.4f) - 0.055f;
+    }
+
+    static void EncodeTexel(
+        const Vec3f   &aValue,
+        int           aFormat,
+        unsigned char *oTexel)
+    {
+        if(aFormat == kFormatFloat)
+        {
+            memcpy(oTexel, &aValue.x, 3 * sizeof(float));
+            return;
+        }
+
+        for(int c=0; c<3; c++)
+        {
+            float value = std::min(1.f, std::max(0.f, aValue.Get(c)));
+            if(aFormat == kFormatSRGB8)
+                value = LinearToSRGB(value);
+            oTexel[c] = (unsigned char)(value * 255.f + 0.5f);
+        }
+    }
+
+    static Vec3f DecodeTexel(
+        const unsigned char *aTexel,
+        int                 aFormat)
+    {
+        struct Table
+        {
+            Table()
+            {
+                for(int i=0; i<256; i++)
+                {
+                    mSRGB[i]   = SRGBToLinear(i / 255.f);
+                    mLinear[i] = i / 255.f;
+                }
+            }
+
+            float mSRGB[256];
+            float mLinear[256];
+        };
+        static const Table table;
+
+        if(aFormat == kFormatFloat)
+        {
+            Vec3f value;
+            memcpy(&value.x, aTexel, 3 * sizeof(float));
+            return value;
+        }
+
+        const float *decode = aFormat == kFormatSRGB8 ? table.mSRGB : table.mLinear;
+        return Vec3f(decode[aTexel[0]], decode[aTexel[1]], decode[aTexel[2]]);
+    }
+
+    Vec3f Bilinear(
+        int          aTexture,
+        int          aLevel,
+        const Vec2f &aUV) const
+    {
+        const Texture &texture = mTextures[aTexture];
+        const Level   &level   = texture.mLevels[aLevel];
+
+        // wraps into [0, 1), texel centers are at half texels
+        float u = aUV.x - std::floor(aUV.x);
+        float v = aUV.y - std::floor(aUV.y);
+        if(!(u >= 0.f && u < 1.f)) u = 0.f;
+        if(!(v >= 0.f && v < 1.f)) v = 0.f;
+
+        const float x = u * level.mWidth - 0.5f;
+        const float y = (1.f - v) * level.mHeight - 0.5f;
+        const float fx = std::floor(x), fy = std::floor(y);
+        const float dx = x - fx, dy = y - fy;
+
+        const int x0 = Wrap(int(fx), level.mWidth),  x1 = Wrap(x0 + 1, level.mWidth);
+        const int y0 = Wrap(int(fy), level.mHeight), y1 = Wrap(y0 + 1, level.mHeight);
+
+        const int xs[4] = { x0, x1, x0, x1 };
+        const int ys[4] = { y0, y0, y1, y1 };
+        const float weights[4] = { (1.f - dx) * (1.f - dy), dx * (1.f - dy), (1.f - dx) * dy, dx * dy };
+
+        // the four texels are mostly in one tile, it is pinned once
+        Tile *tile = NULL;
+        int tileIndex = -1;
+        Vec3f result(0.f);
+
+        for(int i=0; i<4; i++)
+        {
+            const int index = level.mFirstTile + (ys[i] / kTileSize) * level.mTilesX + xs[i] / kTileSize;
+            if(index != tileIndex)
+            {
+                if(tile)
+                    Unpin(tile);
+                tile = Pin(aTexture, index);
+                tileIndex = index;
+            }
+
+            const int offset = ((ys[i] % kTileSize) * kTileSize + xs[i] % kTileSize) * texture.mTexelSize;
+            result += DecodeTexel(tile->mData + offset, texture.mHeader.mFormat) * weights[i];
+        }
+
+        Unpin(tile);
+        return result;
+    }
+
+    static int Wrap(int aIndex, int aSize)
+    {
+        return aIndex < 0 ? aIndex + aSize : (aIndex >= aSize ? aIndex - aSize : aIndex);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Cache
+
+    static unsigned int GetShard(unsigned long long aKey)
+    {
+        aKey ^= aKey >> 33;
+        aKey *= 0xff51afd7ed558ccdULL;
+        aKey ^= aKey >> 33;
+        return (unsigned int)(aKey & (kShardCount - 1));
+    }
+
+    // The tile in memory, read from the file first when it is not. It stays
+    // until unpinned.
+    Tile* Pin(
+        int aTexture,
+        int aTileIndex) const
+    {
+        const unsigned long long key = ((unsigned long long)aTexture << 40) | (unsigned long long)aTileIndex;
+        Shard &shard = mShards[GetShard(key)];
+
+        omp_set_lock(&shard.mLock);
+        shard.mRequests++;
+
+        Tile *tile;
+        std::unordered_map<unsigned long long, Tile*>::const_iterator it = shard.mTiles.find(key);
+        if(it != shard.mTiles.end())
+        {
+            tile = it->second;
+            if(!tile->mKept)
+                Unlink(shard, tile);
+        }
+        else
+        {
+            const Texture &texture = mTextures[aTexture];
+
+            tile = new Tile;
+            tile->mKey  = key;
+            tile->mPins = 0;
+            tile->mKept = false;
+            tile->mData = new unsigned char[texture.mTileBytes];
+
+            if(!ReadAt(texture.mFile, tile->mData, texture.mTileBytes,
+                (long long)sizeof(FileHeader) + (long long)aTileIndex * (long long)texture.mTileBytes))
+            {
+                memset(tile->mData, 0, texture.mTileBytes);
+            }
+
+            shard.mTiles[key] = tile;
+            shard.mBytes += texture.mTileBytes;
+            shard.mLoads++;
+            AddResident((long long)texture.mTileBytes);
+
+            Evict(shard, mMemoryLimit / kShardCount);
+        }
+
+        // most recently used
+        if(!tile->mKept)
+        {
+            tile->mPrev = NULL;
+            tile->mNext = shard.mHead;
+            if(shard.mHead)
+                shard.mHead->mPrev = tile;
+            shard.mHead = tile;
+            if(!shard.mTail)
+                shard.mTail = tile;
+        }
+
+#pragma omp atomic
+        tile->mPins++;
+
+        omp_unset_lock(&shard.mLock);
+        return tile;
+    }
+
+    // Adds a tile of a texture without file, it stays until the cache is
+    // destroyed. Only called while the textures are added.
+    void KeepTile(
+        int                              aTexture,
+        int                              aTileIndex,
+        const std::vector<unsigned char> &aData)
+    {
+        const unsigned long long key = ((unsigned long long)aTexture << 40) | (unsigned long long)aTileIndex;
+        Shard &shard = mShards[GetShard(key)];
+
+        Tile *tile = new Tile;
+        tile->mKey  = key;
+        tile->mPrev = tile->mNext = NULL;
+        tile->mPins = 0;
+        tile->mKept = true;
+        tile->mData = new unsigned char[aData.size()];
+        memcpy(tile->mData, &aData[0], aData.size());
+
+        shard.mTiles[key] = tile;
+        shard.mBytes += aData.size();
+        AddResident((long long)aData.size());
+    }
+
+    static void Unpin(Tile *aTile)
+    {
+#pragma omp atomic
+        aTile->mPins--;
+    }
+
+    static void Unlink(
+        Shard &aoShard,
+        Tile  *aTile)
+    {
+        (aTile->mPrev ? aTile->mPrev->mNext : aoShard.mHead) = aTile->mNext;
+        (aTile->mNext ? aTile->mNext->mPrev : aoShard.mTail) = aTile->mPrev;
+    }
+
+    // Drops the least recently used tiles nobody reads until the shard
+    // fits its share. Pins only change under the lock, so an unpinned tile
+    // found here stays unpinned.
+    void Evict(
+        Shard  &aoShard,
+        size_t aLimit) const
+    {
+        for(Tile *tile = aoShard.mTail; tile && aoShard.mBytes > aLimit; )
+        {
+            Tile *prev = tile->mPrev;
+
+            int pins;
+#pragma omp atomic read
+            pins = tile->mPins;
+
+            if(pins == 0)
+            {
+                const size_t bytes = mTextures[int(tile->mKey >> 40)].mTileBytes;
+
+                Unlink(aoShard, tile);
+                aoShard.mTiles.erase(tile->mKey);
+                aoShard.mBytes -= bytes;
+                aoShard.mEvictions++;
+                AddResident(-(long long)bytes);
+
+                delete[] tile->mData;
+                delete tile;
+            }
+
+            tile = prev;
+        }
+    }
+
+    void AddResident(long long aBytes) const
+    {
+        long long resident;
+#pragma omp atomic capture
+        resident = mResidentBytes += aBytes;
+
+        if(resident > (long long)mPeakBytes)
+        {
+#pragma omp critical(TextureCachePeak)
+            mPeakBytes = std::max(mPeakBytes, size_t(resident));
+        }
+    }
+
+private:
+
+    std::vector<Texture>       mTextures;
+    std::map<std::string, int> mTextureIndices; //!< By tiled file name
+    std::string                mCacheDirectory;
+    size_t                     mMemoryLimit;
+    size_t                     mKeptBytes;      //!< Of the tiles of the textures without file
+
+    mutable Shard              mShards[kShardCount];
+    mutable long long          mResidentBytes;
+    mutable size_t             mPeakBytes;
+};
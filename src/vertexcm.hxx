@@ -0,0 +1,779 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "renderer.hxx"
+#include "lightsampler.hxx"
+#include "hashgrid.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Vertex connection and merging
+//
+// Each iteration traces one light subpath and one camera subpath per pixel
+// and combines them with all connection strategies: light subpath vertices
+// are connected to the camera (light tracing, splatted to the framebuffer),
+// camera subpath vertices to a sampled light point (next event estimation),
+// to the light subpath vertices of their pixel, and emitters hit by the
+// camera subpath are gathered directly. In the kVcm mode, the camera
+// vertices are also merged with the light vertices of all pixels within a
+// radius that shrinks with the iteration, like in photon mapping. The
+// strategies are weighted with the balance heuristic, evaluated recursively
+// along the subpaths from the partial quantities dVCM, dVC and dVM (see
+// Georgiev et al. 2012, "Implementing Vertex Connection and Merging").
+
+class VertexCM : public AbstractRenderer
+{
+public:
+
+    enum AlgorithmType
+    {
+        kBpt, // bidirectional path tracing, connections only
+        kVcm  // connections and merging
+    };
+
+    // Light subpaths draw their sample dimensions from here on,
+    // far beyond the dimensions used by the camera subpath of the pixel
+    static const uint kLightPathDimension = 1 << 10;
+
+    // State of a subpath that is kept between bounces
+    struct SubPathState
+    {
+        Vec3f mOrigin;             // origin of the next ray
+        Vec3f mDirection;          // direction of the next ray
+        Vec3f mThroughput;         // path throughput
+        uint  mPathLength;         // number of path segments, including the next one
+        bool  mIsFiniteLight;      // light subpath started on a finite light
+        SamplerState mSampler;     // next sample dimensions of the subpath
+
+        float dVCM; // MIS quantity used for vertex connection and merging
+        float dVC;  // MIS quantity used for vertex connection
+        float dVM;  // MIS quantity used for vertex merging
+    };
+
+    // Stored light subpath vertex
+    struct PathVertex
+    {
+        Vec3f mHitpoint;   // position of the vertex
+        Vec3f mThroughput; // path throughput, including emission
+        uint  mPathLength; // number of segments between the light and the vertex
+        Frame mFrame;      // shading frame
+        Vec3f mWol;        // local direction towards the previous vertex
+        int   mMatID;
+        Vec2f mUV;         // texture coordinates of the material
+
+        float dVCM;
+        float dVC;
+        float dVM;
+
+        const Vec3f& GetPosition() const { return mHitpoint; }
+    };
+
+    VertexCM(
+        const Scene           &aScene,
+        const AbstractSampler &aSampler,
+        AlgorithmType         aAlgorithm,
+        float                 aRadiusFactor = 0.003f,
+        float                 aRadiusAlpha = 0.75f) :
+        AbstractRenderer(aScene, aSampler),
+        mUseVM(aAlgorithm == kVcm),
+        mLightPicker(aScene.mLights, aScene.mSceneSphere)
+    {
+        mBaseRadius  = aRadiusFactor * aScene.mSceneSphere.mSceneRadius;
+        mRadiusAlpha = aRadiusAlpha;
+    }
+
+    virtual void RunIteration(int aIteration)
+    {
+        const int resX = int(mScene.mCamera.mResolution.x);
+        const int resY = int(mScene.mCamera.mResolution.y);
+        const int pathCount = resX * resY;
+
+        // one light subpath is traced per pixel
+        mLightSubPathCount = float(pathCount);
+
+        // merging radius of this iteration, r_i = r_0 / i^((1 - alpha) / 2)
+        const float radius = std::max(1e-7f,
+            mBaseRadius / std::pow(float(aIteration + 1), 0.5f * (1.f - mRadiusAlpha)));
+        mMergeRadiusSqr = Sqr(radius);
+
+        // ratio of the merging and connection pdfs of a vertex, without the
+        // pdfs of the light subpath reaching it
+        const float etaVCM = PI_F * mMergeRadiusSqr * mLightSubPathCount;
+        mMisVmWeightFactor = mUseVM ? etaVCM : 0.f;
+        mMisVcWeightFactor = mUseVM ? 1.f / etaVCM : 0.f;
+        mVmNormalization   = 1.f / etaVCM;
+
+        mLightVertices.clear();
+        mPathEnds.resize(pathCount);
+
+        //////////////////////////////////////////////////////////////////////////
+        // Trace the light subpaths and connect their vertices to the camera
+        for(int pathIdx = 0; pathIdx < pathCount; pathIdx++)
+        {
+            SubPathState lightState;
+            mSampler.StartPixelSample(pathIdx % resX, pathIdx / resX, uint(aIteration), lightState.mSampler);
+            lightState.mSampler.mDimension = kLightPathDimension;
+
+            if(GenerateLightSample(lightState))
+                TraceLightSubPath(lightState);
+
+            mPathEnds[pathIdx] = (int)mLightVertices.size();
+        }
+
+        // merging uses the light vertices of all pixels
+        if(mUseVM)
+        {
+            mGrid.Reserve(pathCount);
+            mGrid.Build(mLightVertices, radius);
+        }
+
+        //////////////////////////////////////////////////////////////////////////
+        // Trace the camera subpaths and combine them with the light subpaths
+        for(int pathIdx = 0; pathIdx < pathCount; pathIdx++)
+        {
+            SubPathState cameraState;
+            const Vec2f screenSample = GenerateCameraSample(pathIdx, aIteration, cameraState);
+
+            const int lightBegin = pathIdx > 0 ? mPathEnds[pathIdx - 1] : 0;
+            const int lightEnd   = mPathEnds[pathIdx];
+
+            Vec3f direct;
+            const Vec3f color = TraceCameraSubPath(cameraState, screenSample, lightBegin, lightEnd, direct);
+            AddSample(screenSample, color, direct);
+        }
+
+        mIterations++;
+    }
+
+private:
+
+    //////////////////////////////////////////////////////////////////////////
+    // Subpaths
+
+    void TraceLightSubPath(SubPathState &aoLightState)
+    {
+        for(;;)
+        {
+            Isect isect;
+            Vec3f hitPoint;
+            if(!IntersectNext(aoLightState, isect, hitPoint))
+                break;
+
+            Frame frame;
+            frame.SetFromZ(isect.normal);
+            const Vec3f wol = frame.ToLocal(-aoLightState.mDirection);
+            const Material mat = mScene.GetMaterial(isect.matID, isect.uv);
+
+            // emitters do not reflect, surfaces are lit from the front only
+            if(isect.lightID >= 0 || IsBlack(mat) || wol.z <= 0)
+                break;
+
+            // infinite lights use solid angle pdfs, the first segment
+            // of their subpaths carries no distance
+            if(aoLightState.mPathLength > 1 || aoLightState.mIsFiniteLight)
+                aoLightState.dVCM *= Sqr(isect.dist);
+
+            aoLightState.dVCM /= wol.z;
+            aoLightState.dVC  /= wol.z;
+            aoLightState.dVM  /= wol.z;
+
+            PathVertex vertex;
+            vertex.mHitpoint   = hitPoint;
+            vertex.mThroughput = aoLightState.mThroughput;
+            vertex.mPathLength = aoLightState.mPathLength;
+            vertex.mFrame      = frame;
+            vertex.mWol        = wol;
+            vertex.mMatID      = isect.matID;
+            vertex.mUV         = isect.uv;
+            vertex.dVCM        = aoLightState.dVCM;
+            vertex.dVC         = aoLightState.dVC;
+            vertex.dVM         = aoLightState.dVM;
+            mLightVertices.push_back(vertex);
+
+            if(aoLightState.mPathLength + 1 >= mMinPathLength)
+                ConnectToCamera(vertex);
+
+            // the next vertex could not be connected to the camera anymore
+            if(aoLightState.mPathLength + 2 > mMaxPathLength)
+                break;
+
+            if(!SampleScattering(mat, frame, wol, hitPoint, aoLightState))
+                break;
+
+            aoLightState.mPathLength++;
+        }
+    }
+
+    Vec3f TraceCameraSubPath(
+        SubPathState &aoCameraState,
+        const Vec2f  &aScreenSample,
+        int          aLightBegin,
+        int          aLightEnd,
+        Vec3f        &oDirect)
+    {
+        Vec3f color(0);
+        oDirect = Vec3f(0);
+
+        for(;;)
+        {
+            Isect isect;
+            Vec3f hitPoint;
+            const bool hit = IntersectNext(aoCameraState, isect, hitPoint);
+
+            if(aoCameraState.mPathLength == 1)
+                AddFirstHit(aScreenSample, Ray(aoCameraState.mOrigin, aoCameraState.mDirection, 0), isect, hit);
+
+            if(!hit)
+            {
+                // the background is a light of its own
+                if(mScene.GetBackground() && aoCameraState.mPathLength >= mMinPathLength)
+                {
+                    const Vec3f contrib = AddTechnique(kTechEmission, aoCameraState.mThroughput *
+                        GetLightRadiance(mScene.GetBackgroundID(), 0, aoCameraState, Vec3f(0)));
+
+                    color += contrib;
+                    if(aoCameraState.mPathLength <= 2)
+                        oDirect += contrib;
+                }
+                break;
+            }
+
+            Frame frame;
+            frame.SetFromZ(isect.normal);
+            const Vec3f wol = frame.ToLocal(-aoCameraState.mDirection);
+
+            aoCameraState.dVCM *= Sqr(isect.dist);
+            aoCameraState.dVCM /= std::abs(wol.z);
+            aoCameraState.dVC  /= std::abs(wol.z);
+            aoCameraState.dVM  /= std::abs(wol.z);
+
+            if(isect.lightID >= 0)
+            {
+                if(aoCameraState.mPathLength >= mMinPathLength)
+                {
+                    const Vec3f contrib = AddTechnique(kTechEmission, aoCameraState.mThroughput *
+                        GetLightRadiance(isect.lightID, isect.primID, aoCameraState, hitPoint));
+
+                    color += contrib;
+                    if(aoCameraState.mPathLength <= 2)
+                        oDirect += contrib;
+                }
+                break;
+            }
+
+            const Material mat = mScene.GetMaterial(isect.matID, isect.uv);
+            if(IsBlack(mat) || wol.z <= 0)
+                break;
+
+            if(aoCameraState.mPathLength >= mMaxPathLength)
+                break;
+
+            // connection to a light point
+            if(aoCameraState.mPathLength + 1 >= mMinPathLength)
+            {
+                const Vec3f contrib = AddTechnique(kTechDirect, aoCameraState.mThroughput *
+                    DirectIllumination(mat, frame, wol, hitPoint, aoCameraState));
+
+                color += contrib;
+                if(aoCameraState.mPathLength == 1)
+                    oDirect += contrib;
+            }
+
+            // connections to the light subpath vertices
+            for(int i = aLightBegin; i < aLightEnd; i++)
+            {
+                const PathVertex &lightVertex = mLightVertices[i];
+
+                if(lightVertex.mPathLength + 1 + aoCameraState.mPathLength < mMinPathLength)
+                    continue;
+
+                // the light vertices are ordered by path length
+                if(lightVertex.mPathLength + 1 + aoCameraState.mPathLength > mMaxPathLength)
+                    break;
+
+                color += AddTechnique(kTechConnection, aoCameraState.mThroughput * lightVertex.mThroughput *
+                    ConnectVertices(lightVertex, mat, frame, wol, hitPoint, aoCameraState));
+            }
+
+            // merging with the light vertices of all pixels
+            if(mUseVM)
+            {
+                RangeQuery query(*this, mat, frame, wol, aoCameraState);
+                mGrid.Process(mLightVertices, hitPoint, query);
+
+                color += AddTechnique(kTechMerging,
+                    aoCameraState.mThroughput * mVmNormalization * query.mContrib);
+                oDirect += aoCameraState.mThroughput * mVmNormalization * query.mDirectContrib;
+            }
+
+            if(!SampleScattering(mat, frame, wol, hitPoint, aoCameraState))
+                break;
+
+            aoCameraState.mPathLength++;
+        }
+
+        return color;
+    }
+
+    // Traces the next segment of the subpath
+    bool IntersectNext(
+        const SubPathState &aState,
+        Isect              &oIsect,
+        Vec3f              &oHitPoint)
+    {
+        Ray ray;
+        ray.org  = aState.mOrigin + aState.mDirection * EPS_RAY;
+        ray.dir  = aState.mDirection;
+        ray.tmin = 0;
+
+        oIsect.dist = 1e36f;
+
+        const unsigned long long stepsBefore = g_TraversalSteps;
+        const bool hit = mScene.Intersect(ray, oIsect);
+        mTraversalSteps += g_TraversalSteps - stepsBefore;
+        mRayCount++;
+
+        if(!hit)
+            return false;
+
+        oHitPoint = ray.org + ray.dir * oIsect.dist;
+        oIsect.dist += EPS_RAY;
+        return true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Subpath starts
+
+    // Emits the light subpath from a light picked by its power
+    bool GenerateLightSample(SubPathState &oLightState)
+    {
+        float lightPickProb = 0;
+        const int lightID = mLightPicker.SampleLight(mSampler.Get1D(oLightState.mSampler), lightPickProb);
+        const Vec2f rndDir = mSampler.Get2D(oLightState.mSampler);
+        const Vec3f rndPos = mSampler.Get3D(oLightState.mSampler);
+
+        if(lightID < 0 || lightPickProb == 0)
+            return false;
+
+        const AbstractLight *light = mScene.GetLightPtr(lightID);
+
+        float emissionPdfW = 0, directPdfA = 0, cosLight = 0;
+        const Vec3f energy = light->emit(mScene.mSceneSphere, rndDir, rndPos,
+            oLightState.mOrigin, oLightState.mDirection,
+            emissionPdfW, directPdfA, cosLight);
+
+        if(energy.Max() <= 0 || emissionPdfW <= 0)
+            return false;
+
+        emissionPdfW *= lightPickProb;
+        directPdfA   *= lightPickProb;
+
+        oLightState.mThroughput    = energy / emissionPdfW;
+        oLightState.mPathLength    = 1;
+        oLightState.mIsFiniteLight = !light->IsInfinite();
+
+        oLightState.dVCM = directPdfA / emissionPdfW;
+
+        // delta lights cannot be hit, the path cannot end on them
+        if(!light->IsDelta())
+        {
+            const float usedCosLight = light->IsInfinite() ? 1.f : cosLight;
+            oLightState.dVC = usedCosLight / emissionPdfW;
+        }
+        else
+            oLightState.dVC = 0.f;
+
+        oLightState.dVM = oLightState.dVC * mMisVcWeightFactor;
+
+        return true;
+    }
+
+    // Generates the camera ray of the pixel, returns its raster position
+    Vec2f GenerateCameraSample(
+        int          aPixID,
+        int          aIteration,
+        SubPathState &oCameraState)
+    {
+        const Camera &camera = mScene.mCamera;
+        const int resX = int(camera.mResolution.x);
+        const int x = aPixID % resX;
+        const int y = aPixID / resX;
+
+        mSampler.StartPixelSample(x, y, uint(aIteration), oCameraState.mSampler);
+        const Vec2f sample = Vec2f(float(x), float(y)) + mSampler.Get2D(oCameraState.mSampler);
+        const Ray ray = camera.GenerateRay(sample);
+
+        // pdf of the ray direction, the image plane is sampled uniformly
+        const float cosAtCamera = Dot(camera.mForward, ray.dir);
+        const float imagePointToCameraDist = camera.mImagePlaneDist / cosAtCamera;
+        const float cameraPdfW = Sqr(imagePointToCameraDist) / cosAtCamera;
+
+        oCameraState.mOrigin     = ray.org;
+        oCameraState.mDirection  = ray.dir;
+        oCameraState.mThroughput = Vec3f(1);
+        oCameraState.mPathLength = 1;
+
+        oCameraState.dVCM = mLightSubPathCount / cameraPdfW;
+        oCameraState.dVC  = 0;
+        oCameraState.dVM  = 0;
+
+        return sample;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Connection strategies
+
+    // Radiance of the light hit by the camera subpath, weighted against
+    // generating the light point by the other strategies.
+    // aHitPoint is unused for the background.
+    Vec3f GetLightRadiance(
+        int                aLightID,
+        int                aPrimID,
+        const SubPathState &aCameraState,
+        const Vec3f        &aHitPoint)
+    {
+        float directPdfA, emissionPdfW;
+        const Vec3f radiance = mScene.GetLightPtr(aLightID)->getEmittedRadiance(
+            mScene.mSceneSphere, aCameraState.mDirection, aHitPoint, aPrimID,
+            directPdfA, emissionPdfW);
+
+        if(radiance.Max() <= 0)
+            return Vec3f(0);
+
+        // camera rays cannot be generated by the other strategies
+        if(aCameraState.mPathLength == 1)
+            return radiance;
+
+        const float lightPickProb = mLightPicker.LightPdf(aLightID);
+        directPdfA   *= lightPickProb;
+        emissionPdfW *= lightPickProb;
+
+        const float wCamera = directPdfA * aCameraState.dVCM + emissionPdfW * aCameraState.dVC;
+        const float misWeight = 1.f / (1.f + wCamera);
+
+        return misWeight * radiance;
+    }
+
+    // Connects the camera vertex to a sampled light point
+    Vec3f DirectIllumination(
+        const Material     &aMat,
+        const Frame        &aFrame,
+        const Vec3f        &aWol,
+        const Vec3f        &aHitPoint,
+        SubPathState       &aoCameraState)
+    {
+        float lightPickProb;
+        const int lightID = mLightPicker.SampleLight(mSampler.Get1D(aoCameraState.mSampler), lightPickProb);
+        const Vec3f rnd = mSampler.Get3D(aoCameraState.mSampler);
+
+        if(lightID < 0 || lightPickProb == 0)
+            return Vec3f(0);
+
+        const AbstractLight *light = mScene.GetLightPtr(lightID);
+
+        Vec3f dirToLight;
+        float distance = 0, directPdfW = 0, emissionPdfW = 0, cosAtLight = 0;
+        const Vec3f radiance = light->illuminate(mScene.mSceneSphere, aHitPoint, rnd,
+            dirToLight, distance, directPdfW, emissionPdfW, cosAtLight);
+
+        if(radiance.Max() <= 0 || directPdfW <= 0)
+            return Vec3f(0);
+
+        float cosToLight = 0, bsdfDirPdfW = 0, bsdfRevPdfW = 0;
+        const Vec3f bsdfFactor = EvaluateBsdf(aMat, aFrame, aWol, dirToLight,
+            cosToLight, bsdfDirPdfW, bsdfRevPdfW);
+
+        if(bsdfFactor.Max() <= 0)
+            return Vec3f(0);
+
+        // delta lights cannot be hit by scattered rays
+        if(light->IsDelta())
+            bsdfDirPdfW = 0.f;
+
+        // the light picking probability cancels out in wCamera
+        const float wLight  = bsdfDirPdfW / (lightPickProb * directPdfW);
+        const float wCamera = emissionPdfW * cosToLight / (directPdfW * cosAtLight) *
+            (mMisVmWeightFactor + aoCameraState.dVCM + aoCameraState.dVC * bsdfRevPdfW);
+        const float misWeight = 1.f / (wLight + 1.f + wCamera);
+
+        const Vec3f contrib = (misWeight * cosToLight / (lightPickProb * directPdfW)) *
+            (radiance * bsdfFactor);
+
+        if(contrib.Max() <= 0 || mScene.Occluded(aHitPoint, dirToLight, distance))
+            return Vec3f(0);
+
+        return contrib;
+    }
+
+    // Connects a camera vertex to a light vertex,
+    // the throughputs of both subpaths are not included
+    Vec3f ConnectVertices(
+        const PathVertex   &aLightVertex,
+        const Material     &aCameraMat,
+        const Frame        &aCameraFrame,
+        const Vec3f        &aCameraWol,
+        const Vec3f        &aCameraHitPoint,
+        const SubPathState &aCameraState)
+    {
+        Vec3f direction = aLightVertex.mHitpoint - aCameraHitPoint;
+        const float dist2 = direction.LenSqr();
+        const float distance = std::sqrt(dist2);
+        direction /= distance;
+
+        float cosCamera = 0, cameraBsdfDirPdfW = 0, cameraBsdfRevPdfW = 0;
+        const Vec3f cameraBsdfFactor = EvaluateBsdf(aCameraMat, aCameraFrame, aCameraWol,
+            direction, cosCamera, cameraBsdfDirPdfW, cameraBsdfRevPdfW);
+
+        if(cameraBsdfFactor.Max() <= 0)
+            return Vec3f(0);
+
+        float cosLight = 0, lightBsdfDirPdfW = 0, lightBsdfRevPdfW = 0;
+        const Vec3f lightBsdfFactor = EvaluateBsdf(mScene.GetMaterial(aLightVertex.mMatID, aLightVertex.mUV),
+            aLightVertex.mFrame, aLightVertex.mWol, -direction,
+            cosLight, lightBsdfDirPdfW, lightBsdfRevPdfW);
+
+        if(lightBsdfFactor.Max() <= 0)
+            return Vec3f(0);
+
+        const float geometryTerm = cosLight * cosCamera / dist2;
+        if(geometryTerm <= 0)
+            return Vec3f(0);
+
+        // pdfs of generating the connected vertices by extending the subpaths
+        const float cameraBsdfDirPdfA = PdfWtoA(cameraBsdfDirPdfW, distance, cosLight);
+        const float lightBsdfDirPdfA  = PdfWtoA(lightBsdfDirPdfW,  distance, cosCamera);
+
+        const float wLight  = cameraBsdfDirPdfA *
+            (mMisVmWeightFactor + aLightVertex.dVCM + aLightVertex.dVC * lightBsdfRevPdfW);
+        const float wCamera = lightBsdfDirPdfA *
+            (mMisVmWeightFactor + aCameraState.dVCM + aCameraState.dVC * cameraBsdfRevPdfW);
+        const float misWeight = 1.f / (wLight + 1.f + wCamera);
+
+        const Vec3f contrib = (misWeight * geometryTerm) * cameraBsdfFactor * lightBsdfFactor;
+
+        if(contrib.Max() <= 0 || mScene.Occluded(aCameraHitPoint, direction, distance))
+            return Vec3f(0);
+
+        return contrib;
+    }
+
+    // Connects a light vertex to the camera and splats the contribution
+    // to the pixel it projects to
+    void ConnectToCamera(const PathVertex &aLightVertex)
+    {
+        const Camera &camera = mScene.mCamera;
+        Vec3f directionToCamera = camera.mPosition - aLightVertex.mHitpoint;
+
+        // behind the camera
+        if(Dot(camera.mForward, -directionToCamera) <= 0)
+            return;
+
+        const Vec2f imagePos = camera.WorldToRaster(aLightVertex.mHitpoint);
+        if(!camera.CheckRaster(imagePos))
+            return;
+
+        const float distEye2 = directionToCamera.LenSqr();
+        const float distance = std::sqrt(distEye2);
+        directionToCamera /= distance;
+
+        float cosToCamera = 0, bsdfDirPdfW = 0, bsdfRevPdfW = 0;
+        const Vec3f bsdfFactor = EvaluateBsdf(mScene.GetMaterial(aLightVertex.mMatID, aLightVertex.mUV),
+            aLightVertex.mFrame, aLightVertex.mWol, directionToCamera,
+            cosToCamera, bsdfDirPdfW, bsdfRevPdfW);
+
+        if(bsdfFactor.Max() <= 0)
+            return;
+
+        // area pdf of the camera generating the vertex
+        const float cosAtCamera = Dot(camera.mForward, -directionToCamera);
+        const float imagePointToCameraDist = camera.mImagePlaneDist / cosAtCamera;
+        const float imageToSolidAngleFactor = Sqr(imagePointToCameraDist) / cosAtCamera;
+        const float imageToSurfaceFactor = imageToSolidAngleFactor * cosToCamera / distEye2;
+        const float cameraPdfA = imageToSurfaceFactor;
+
+        const float wLight = (cameraPdfA / mLightSubPathCount) *
+            (mMisVmWeightFactor + aLightVertex.dVCM + aLightVertex.dVC * bsdfRevPdfW);
+        const float misWeight = 1.f / (wLight + 1.f);
+
+        // the light subpaths of all pixels contribute to the image
+        const Vec3f contrib = (misWeight * imageToSurfaceFactor / mLightSubPathCount) *
+            aLightVertex.mThroughput * bsdfFactor;
+
+        if(contrib.Max() <= 0 || mScene.Occluded(aLightVertex.mHitpoint, directionToCamera, distance))
+            return;
+
+        AddSplat(imagePos, AddTechnique(kTechLightTrace, contrib), aLightVertex.mPathLength == 1);
+    }
+
+    // Merges a camera vertex with the light vertices around it,
+    // the throughput of the camera subpath is not included
+    struct RangeQuery
+    {
+        RangeQuery(
+            const VertexCM     &aRenderer,
+            const Material     &aCameraMat,
+            const Frame        &aCameraFrame,
+            const Vec3f        &aCameraWol,
+            const SubPathState &aCameraState) :
+            mRenderer(aRenderer),
+            mCameraMat(aCameraMat),
+            mCameraFrame(aCameraFrame),
+            mCameraWol(aCameraWol),
+            mCameraState(aCameraState),
+            mContrib(0),
+            mDirectContrib(0)
+        {}
+
+        void Process(const PathVertex &aLightVertex)
+        {
+            const uint pathLength = aLightVertex.mPathLength + mCameraState.mPathLength;
+            if(pathLength < mRenderer.mMinPathLength || pathLength > mRenderer.mMaxPathLength)
+                return;
+
+            // the light vertex takes the place of the camera vertex
+            const Vec3f lightDirection = aLightVertex.mFrame.ToWorld(aLightVertex.mWol);
+
+            float cosCamera = 0, cameraBsdfDirPdfW = 0, cameraBsdfRevPdfW = 0;
+            const Vec3f cameraBsdfFactor = EvaluateBsdf(mCameraMat, mCameraFrame, mCameraWol,
+                lightDirection, cosCamera, cameraBsdfDirPdfW, cameraBsdfRevPdfW);
+
+            if(cameraBsdfFactor.Max() <= 0)
+                return;
+
+            // the reverse direction continues the light subpath
+            cameraBsdfRevPdfW *= ContinuationProb(
+                mRenderer.mScene.GetMaterial(aLightVertex.mMatID, aLightVertex.mUV)) /
+                ContinuationProb(mCameraMat);
+
+            const float wLight  = aLightVertex.dVCM * mRenderer.mMisVcWeightFactor +
+                aLightVertex.dVM * cameraBsdfDirPdfW;
+            const float wCamera = mCameraState.dVCM * mRenderer.mMisVcWeightFactor +
+                mCameraState.dVM * cameraBsdfRevPdfW;
+            const float misWeight = 1.f / (wLight + 1.f + wCamera);
+
+            const Vec3f contrib = misWeight * cameraBsdfFactor * aLightVertex.mThroughput;
+
+            mContrib += contrib;
+            if(pathLength <= 2)
+                mDirectContrib += contrib;
+        }
+
+        const VertexCM     &mRenderer;
+        const Material     &mCameraMat;
+        const Frame        &mCameraFrame;
+        Vec3f              mCameraWol;
+        const SubPathState &mCameraState;
+        Vec3f              mContrib;
+        Vec3f              mDirectContrib; //!< part of mContrib of paths with two segments
+    };
+
+    // Records the contribution of a technique for the statistics
+    const Vec3f& AddTechnique(Technique aTechnique, const Vec3f &aContrib)
+    {
+        mTechniqueContrib[aTechnique] += Luminance(aContrib);
+        return aContrib;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // BRDF
+
+    static bool IsBlack(const Material &aMat)
+    {
+        return aMat.mDiffuseReflectance.Max() <= 0 && aMat.mPhongReflectance.Max() <= 0;
+    }
+
+    // Probability of continuing a subpath at a vertex with the material
+    static float ContinuationProb(const Material &aMat)
+    {
+        return std::min(1.f, std::max(aMat.mDiffuseReflectance.Max(), aMat.mPhongReflectance.Max()));
+    }
+
+    // Evaluates the BRDF for the direction aWig (world space) and the local
+    // direction aWol towards the previous vertex. oDirPdfW is the pdf of
+    // sampling aWig, oRevPdfW the pdf of sampling the reverse direction,
+    // both include the russian roulette of SampleScattering.
+    static Vec3f EvaluateBsdf(
+        const Material &aMat,
+        const Frame    &aFrame,
+        const Vec3f    &aWol,
+        const Vec3f    &aWig,
+        float          &oCosWig,
+        float          &oDirPdfW,
+        float          &oRevPdfW)
+    {
+        oCosWig = Dot(aFrame.Normal(), aWig);
+        if(oCosWig <= EPS_COSINE || aWol.z <= EPS_COSINE)
+            return Vec3f(0);
+
+        const Vec3f wog = aFrame.ToWorld(aWol);
+        const float contProb = ContinuationProb(aMat);
+        oDirPdfW = aMat.evalBrdfPdf(wog, aWig, aFrame.Normal()) * contProb;
+        oRevPdfW = aMat.evalBrdfPdf(aWig, wog, aFrame.Normal()) * contProb;
+
+        return aMat.evalBrdf(aFrame.ToLocal(aWig), aWol);
+    }
+
+    // Samples the direction of the next segment and updates the
+    // throughput and the MIS quantities, returns false to end the subpath
+    bool SampleScattering(
+        const Material &aMat,
+        const Frame    &aFrame,
+        const Vec3f    &aWol,
+        const Vec3f    &aHitPoint,
+        SubPathState   &aoState)
+    {
+        // pick a BRDF component by its reflectance, like the path tracer
+        float pd = aMat.getMaxElementInVector(aMat.mDiffuseReflectance);
+        float ps = aMat.getMaxElementInVector(aMat.mPhongReflectance);
+        pd /= (pd + ps);
+
+        Vec2f rnd = mSampler.Get2D(aoState.mSampler);
+        const float rndComponent = mSampler.Get1D(aoState.mSampler);
+        const float rndRoulette  = mSampler.Get1D(aoState.mSampler);
+
+        Vec3f wig;
+        if(rndComponent <= pd)
+            wig = aFrame.ToWorld(aMat.sampleDiffuse(rnd.x, rnd.y));
+        else
+            wig = aMat.sampleGlossy(aFrame.ToWorld(aWol), aFrame.Normal(), rnd.x, rnd.y);
+
+        float cosThetaOut = 0, bsdfDirPdfW = 0, bsdfRevPdfW = 0;
+        const Vec3f bsdfFactor = EvaluateBsdf(aMat, aFrame, aWol, wig,
+            cosThetaOut, bsdfDirPdfW, bsdfRevPdfW);
+
+        if(bsdfFactor.Max() <= 0 || bsdfDirPdfW <= 0)
+            return false;
+
+        // russian roulette
+        if(rndRoulette > ContinuationProb(aMat))
+            return false;
+
+        aoState.dVC  = (cosThetaOut / bsdfDirPdfW) *
+            (aoState.dVC * bsdfRevPdfW + aoState.dVCM + mMisVmWeightFactor);
+        aoState.dVM  = (cosThetaOut / bsdfDirPdfW) *
+            (aoState.dVM * bsdfRevPdfW + aoState.dVCM * mMisVcWeightFactor + 1.f);
+        aoState.dVCM = 1.f / bsdfDirPdfW;
+
+        aoState.mOrigin      = aHitPoint;
+        aoState.mDirection   = wig;
+        aoState.mThroughput *= bsdfFactor * (cosThetaOut / bsdfDirPdfW);
+
+        return true;
+    }
+
+private:
+
+    bool                    mUseVM;             //!< Merging is enabled
+    PowerLightSampler       mLightPicker;       //!< Picks the lights of both subpaths
+    float                   mLightSubPathCount; //!< Light subpaths traced per iteration
+    std::vector<PathVertex> mLightVertices;     //!< Vertices of all light subpaths
+    std::vector<int>        mPathEnds;          //!< End index of each light subpath in mLightVertices
+    HashGrid                mGrid;              //!< Range search over mLightVertices
+
+    float mBaseRadius;        //!< Merging radius of the first iteration
+    float mRadiusAlpha;       //!< Rate of the radius reduction
+    float mMergeRadiusSqr;    //!< Squared merging radius of the current iteration
+    float mMisVmWeightFactor; //!< Weight of merging relative to connection
+    float mMisVcWeightFactor; //!< Weight of connection relative to merging
+    float mVmNormalization;   //!< Density estimation kernel of the merges
+};
@@ -0,0 +1,97 @@
+#include <cstdio>
+#include "config.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Back-facing mesh light test
+//
+// Renders backfacing_light.scene with the algorithms that trace paths. The
+// light covers the middle of the image and shows its back to the camera,
+// so those pixels have to be black, while the wall it lights around it
+// must not be.
+
+// Mean luminance of the pixels whose x and y lie in [aMin, aMax) times the
+// resolution
+float MeanLuminance(
+    const Framebuffer &aImage,
+    float             aMin,
+    float             aMax)
+{
+    double sum = 0;
+    int    count = 0;
+
+    for (int y = int(aMin * aImage.GetResY()); y < int(aMax * aImage.GetResY()); y++)
+    {
+        for (int x = int(aMin * aImage.GetResX()); x < int(aMax * aImage.GetResX()); x++)
+        {
+            sum += Luminance(aImage.GetColor(x, y));
+            count++;
+        }
+    }
+
+    return count > 0 ? float(sum / count) : 0.f;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <backfacing_light.scene>\n", argv[0]);
+        return 1;
+    }
+
+    SceneDescription description;
+    if (!description.Load(argv[1]))
+        return 1;
+
+    Scene scene;
+    if (!scene.LoadDescription(description, Vec2i(32, 32)))
+    {
+        printf("Could not load %s\n", argv[1]);
+        return 1;
+    }
+
+    RandomSampler sampler(1234);
+
+    Config config = Config();
+    config.mScene         = &scene;
+    config.mSampler       = &sampler;
+    config.mRayReordering = false;
+    config.mGuiding       = NULL;
+
+    const Config::Algorithm algorithms[] =
+    {
+        Config::kDirectIllum,
+        Config::kPathTracing,
+        Config::kBidirPathTracing,
+        Config::kVertexCM
+    };
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+    {
+        config.mAlgorithm = algorithms[i];
+
+        AbstractRenderer *renderer = CreateRenderer(config);
+        renderer->mMaxPathLength = 10;
+
+        for (int iteration = 0; iteration < 4; iteration++)
+            renderer->RunIteration(iteration);
+
+        Framebuffer image;
+        renderer->GetFramebuffer(image);
+        delete renderer;
+
+        // the light spans the middle 40% of the image, the wall its edges
+        const float light = MeanLuminance(image, 0.4f, 0.6f);
+        const float wall  = MeanLuminance(image, 0.f, 0.1f);
+        const bool  passed = light == 0.f && wall > 0.f;
+
+        printf("%-30s back of the light %.5f, wall %.5f %s\n",
+            Config::GetName(config.mAlgorithm), light, wall, passed ? "ok" : "FAILED");
+
+        if (!passed)
+            failures++;
+    }
+
+    return failures > 0 ? 1 : 0;
+}